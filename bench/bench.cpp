@@ -0,0 +1,155 @@
+#include "bench.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+
+#include "file_descriptor.h"
+
+namespace bench
+{
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+runner::runner(options opts)
+    : opts(std::move(opts))
+{}
+
+bool runner::is_enabled(std::string const& name) const
+{
+    return opts.filter.empty() || name.find(opts.filter) != std::string::npos;
+}
+
+void runner::run(std::string const& group, std::string const& name,
+                 uint64_t bytes_per_iteration, uint64_t items_per_iteration,
+                 std::function<void()> const& body,
+                 std::function<void()> const& setup)
+{
+    if (!is_enabled(group + "/" + name))
+        return;
+
+    std::cerr << group << "/" << name << "... " << std::flush;
+
+    result res;
+    res.group = group;
+    res.name = name;
+    res.bytes_per_iteration = bytes_per_iteration;
+    res.items_per_iteration = items_per_iteration;
+    res.min_ns = UINT64_MAX;
+
+    while (res.iterations < opts.max_iterations
+        && (res.total_ns < opts.min_time_ns || res.iterations == 0))
+    {
+        if (setup)
+            setup();
+
+        uint64_t start = now_ns();
+        body();
+        uint64_t elapsed = now_ns() - start;
+
+        res.total_ns += elapsed;
+        res.min_ns = std::min(res.min_ns, elapsed);
+        ++res.iterations;
+    }
+
+    std::cerr << res.total_ns / res.iterations << " ns/iter\n";
+    results.push_back(std::move(res));
+}
+
+void runner::skip(std::string const& group, std::string const& name, std::string const& reason)
+{
+    if (!is_enabled(group + "/" + name))
+        return;
+
+    std::cerr << group << "/" << name << ": skipped, " << reason << '\n';
+
+    result res;
+    res.group = group;
+    res.name = name;
+    res.skipped = true;
+    res.skip_reason = reason;
+    results.push_back(std::move(res));
+}
+
+void runner::write_json(std::ostream& os) const
+{
+    os << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i != results.size(); ++i)
+    {
+        result const& r = results[i];
+        os << (i == 0 ? "\n" : ",\n");
+        os << "    {\"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\"";
+        if (r.skipped)
+        {
+            os << ", \"skipped\": true, \"reason\": \"" << r.skip_reason << "\"}";
+            continue;
+        }
+
+        double mean_ns = static_cast<double>(r.total_ns) / static_cast<double>(r.iterations);
+        os << ", \"iterations\": " << r.iterations
+           << ", \"mean_ns\": " << static_cast<uint64_t>(mean_ns)
+           << ", \"min_ns\": " << r.min_ns;
+        if (r.bytes_per_iteration != 0)
+            os << ", \"bytes\": " << r.bytes_per_iteration
+               << ", \"bytes_per_second\": " << static_cast<uint64_t>(static_cast<double>(r.bytes_per_iteration) * 1e9 / mean_ns);
+        if (r.items_per_iteration != 0)
+            os << ", \"items\": " << r.items_per_iteration
+               << ", \"items_per_second\": " << static_cast<uint64_t>(static_cast<double>(r.items_per_iteration) * 1e9 / mean_ns);
+        os << "}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+temp_dir::temp_dir()
+{
+    char const* tmp = getenv("TMPDIR");
+    std::string tmpl = std::string(tmp ? tmp : "/tmp") + "/source-store-bench.XXXXXX";
+    if (!mkdtemp(&tmpl[0]))
+        throw std::runtime_error("mkdtemp failed: " + tmpl);
+
+    dir = tmpl;
+}
+
+temp_dir::~temp_dir()
+{
+    try
+    {
+        remove_recursively(dir);
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "failed to remove " << dir << ": " << e.what() << '\n';
+    }
+}
+
+std::string const& temp_dir::path() const
+{
+    return dir;
+}
+
+void remove_recursively(std::string const& path)
+{
+    {
+        directory_stream dir(file_descriptor::open(path, file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+        while (directory_stream::dirent const* ent = dir.next())
+        {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+
+            std::string child = path + "/" + ent->d_name;
+            if (ent->d_type == DT_DIR)
+                remove_recursively(child);
+            else
+                unlink(child);
+        }
+    }
+
+    unlink(path, unlink_flags::directory);
+}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+struct result
+{
+    std::string name;
+    std::string group;
+
+    // size of the input processed by a single iteration, 0 if not meaningful
+    uint64_t bytes_per_iteration = 0;
+    uint64_t items_per_iteration = 0;
+
+    uint64_t iterations = 0;
+    uint64_t total_ns = 0;
+    uint64_t min_ns = 0;
+
+    bool skipped = false;
+    std::string skip_reason;
+};
+
+struct options
+{
+    // every benchmark is repeated until it ran at least this long
+    uint64_t min_time_ns = 200 * 1000 * 1000;
+    uint64_t max_iterations = 1000000;
+    std::string filter;
+};
+
+class runner
+{
+public:
+    explicit runner(options opts);
+
+    bool is_enabled(std::string const& name) const;
+
+    // runs body repeatedly, setup is executed before each iteration and
+    // is not included in the measured time
+    void run(std::string const& group, std::string const& name,
+             uint64_t bytes_per_iteration, uint64_t items_per_iteration,
+             std::function<void()> const& body,
+             std::function<void()> const& setup = {});
+
+    void skip(std::string const& group, std::string const& name, std::string const& reason);
+
+    void write_json(std::ostream& os) const;
+
+private:
+    options opts;
+    std::vector<result> results;
+};
+
+uint64_t now_ns();
+
+// temporary directory removed recursively on destruction
+struct temp_dir
+{
+    temp_dir();
+    temp_dir(temp_dir const&) = delete;
+    temp_dir& operator=(temp_dir const&) = delete;
+    ~temp_dir();
+
+    std::string const& path() const;
+
+private:
+    std::string dir;
+};
+
+void remove_recursively(std::string const& path);
+
+// prevents the compiler from optimizing away computations whose result is unused
+template <typename T>
+void do_not_optimize(T const& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+void register_micro_benchmarks(runner& r);
+void register_macro_benchmarks(runner& r);
+}
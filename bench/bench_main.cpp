@@ -0,0 +1,64 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "bench.h"
+#include "command_line.h"
+
+// Usage: source-store-bench [--filter=<substring>] [--min-time-ms=N] [--output=<file>]
+//                           [--micro-only|--macro-only]
+//
+// Results are written as JSON to stdout (or --output), progress goes to stderr.
+int main(int argc, char* argv[])
+{
+    try
+    {
+        bench::options opts;
+        std::string output;
+        bool micro = true;
+        bool macro = true;
+
+        for (int i = 1; i != argc; ++i)
+        {
+            char const* value;
+            if (match_option(argv[i], "filter", value))
+                opts.filter = value;
+            else if (match_option(argv[i], "min-time-ms", value))
+                opts.min_time_ns = parse_count("min-time-ms", value) * 1000 * 1000;
+            else if (match_option(argv[i], "output", value))
+                output = value;
+            else if (match_flag(argv[i], "micro-only"))
+                macro = false;
+            else if (match_flag(argv[i], "macro-only"))
+                micro = false;
+            else
+            {
+                std::cerr << "unknown option: " << argv[i] << '\n';
+                return 1;
+            }
+        }
+
+        bench::runner runner(opts);
+        if (micro)
+            bench::register_micro_benchmarks(runner);
+        if (macro)
+            bench::register_macro_benchmarks(runner);
+
+        if (output.empty())
+            runner.write_json(std::cout);
+        else
+        {
+            std::ofstream out(output);
+            runner.write_json(out);
+            if (!out)
+                throw std::runtime_error("failed to write " + output);
+        }
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "error: " << e.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
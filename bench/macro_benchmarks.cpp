@@ -0,0 +1,206 @@
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "bench.h"
+#include "file_descriptor.h"
+#include "repository.h"
+
+void add_source_file_command(size_t argc, char* argv[]);
+void md5sum_command(size_t argc, char* argv[]);
+void list_source_files(size_t argc, char* argv[]);
+
+namespace bench
+{
+namespace
+{
+    // commands print to stdout, we don't want that in the benchmark output
+    struct silence_stdout
+    {
+        silence_stdout()
+            : saved(file_descriptor::attach(::dup(STDOUT_FILENO)))
+        {
+            std::cout.flush();
+            file_descriptor null = file_descriptor::open("/dev/null", file_flags::write_only | file_flags::close_on_exec);
+            dup(null.get_fd(), STDOUT_FILENO, dup_flags::none);
+        }
+
+        ~silence_stdout()
+        {
+            std::cout.flush();
+            dup(saved.get_fd(), STDOUT_FILENO, dup_flags::none);
+        }
+
+    private:
+        file_descriptor saved;
+    };
+
+    struct source_tree
+    {
+        std::vector<std::string> files;
+        uint64_t total_bytes = 0;
+    };
+
+    std::string synthetic_source(std::mt19937_64& rng, size_t index, size_t size)
+    {
+        static char const* const words[] = {"int", "return", "if", "else", "for", "while", "struct",
+                                            "static", "const", "void", "char", "size_t", "value",
+                                            "result", "buffer", "length", "index", "count"};
+
+        std::string text = "// synthetic source file " + std::to_string(index) + "\n";
+        while (text.size() < size)
+        {
+            size_t line_words = 3 + rng() % 8;
+            for (size_t i = 0; i != line_words; ++i)
+            {
+                text += words[rng() % (sizeof words / sizeof words[0])];
+                text += ' ';
+            }
+            text += ";\n";
+        }
+
+        return text;
+    }
+
+    // file sizes follow a rough approximation of a real source tree:
+    // mostly a few kilobytes with a long tail of large files
+    source_tree generate_source_tree(std::string const& root, size_t dir_count, size_t files_per_dir)
+    {
+        std::mt19937_64 rng(42);
+        source_tree tree;
+
+        for (size_t d = 0; d != dir_count; ++d)
+        {
+            std::string dir = root + "/dir" + std::to_string(d);
+            mkdir(dir);
+
+            for (size_t f = 0; f != files_per_dir; ++f)
+            {
+                size_t size = (rng() % 16 == 0) ? 64 * 1024 + rng() % (256 * 1024) : 512 + rng() % (8 * 1024);
+                std::string text = synthetic_source(rng, d * files_per_dir + f, size);
+
+                std::string path = dir + "/file" + std::to_string(f) + ".cpp";
+                write_whole_file(path, std::vector<char>(text.begin(), text.end()));
+
+                tree.files.push_back(path);
+                tree.total_bytes += text.size();
+            }
+        }
+
+        return tree;
+    }
+
+    std::vector<char*> make_argv(std::vector<std::string>& args)
+    {
+        std::vector<char*> result;
+        for (std::string& arg : args)
+            result.push_back(&arg[0]);
+        return result;
+    }
+
+    void ingest_benchmarks(runner& r)
+    {
+        if (!r.is_enabled("ingest/") && !r.is_enabled("md5sum/"))
+            return;
+
+        temp_dir dir;
+        mkdir(dir.path() + "/tree");
+        source_tree tree = generate_source_tree(dir.path() + "/tree", 20, 100);
+
+        std::vector<std::string> args = tree.files;
+        std::vector<char*> argv = make_argv(args);
+
+        // commands locate the repository through XDG_CACHE_HOME
+        std::string cache_home = dir.path() + "/cache";
+        mkdir(cache_home);
+        setenv("XDG_CACHE_HOME", cache_home.c_str(), 1);
+        std::string repository_root = default_repository_root();
+
+        r.run("ingest", "add_source_file/new_objects", tree.total_bytes, tree.files.size(), [&]
+        {
+            add_source_file_command(argv.size(), argv.data());
+        }, [&]
+        {
+            if (file_descriptor::open_if_exists(repository_root, file_flags::path | file_flags::close_on_exec))
+                remove_recursively(repository_root);
+            init_new_repository(repository_root);
+        });
+
+        // everything is stored already, this measures the deduplication path
+        r.run("ingest", "add_source_file/existing_objects", tree.total_bytes, tree.files.size(), [&]
+        {
+            add_source_file_command(argv.size(), argv.data());
+        });
+
+        r.run("md5sum", "md5sum_command", tree.total_bytes, tree.files.size(), [&]
+        {
+            silence_stdout silence;
+            md5sum_command(argv.size(), argv.data());
+        });
+
+        r.run("io", "read_whole_file", tree.total_bytes, tree.files.size(), [&]
+        {
+            for (std::string const& filename : tree.files)
+                do_not_optimize(read_whole_file(filename).size());
+        });
+    }
+
+    void list_source_files_benchmarks(runner& r)
+    {
+        if (!r.is_enabled("list_source_files/"))
+            return;
+
+        temp_dir dir;
+        char const* cc = getenv("CC");
+        std::string compiler = cc ? cc : "cc";
+
+        // a binary with many compilation units, each referencing a few headers
+        constexpr size_t UNIT_COUNT = 200;
+        constexpr size_t HEADER_COUNT = 50;
+
+        for (size_t h = 0; h != HEADER_COUNT; ++h)
+        {
+            std::string text = "static inline int header" + std::to_string(h) + "(int x) { return x * " + std::to_string(h + 1) + "; }\n";
+            write_whole_file(dir.path() + "/header" + std::to_string(h) + ".h", std::vector<char>(text.begin(), text.end()));
+        }
+
+        std::string command = compiler + " -g -gdwarf-5 -O0 -o " + dir.path() + "/binary";
+        for (size_t u = 0; u != UNIT_COUNT; ++u)
+        {
+            std::string text;
+            for (size_t h = u % HEADER_COUNT; h < HEADER_COUNT; h += 7)
+                text += "#include \"header" + std::to_string(h) + ".h\"\n";
+            text += u == 0 ? "int main() { return 0; }\n" : "int unit" + std::to_string(u) + "(int x) { return x; }\n";
+
+            std::string path = dir.path() + "/unit" + std::to_string(u) + ".c";
+            write_whole_file(path, std::vector<char>(text.begin(), text.end()));
+            command += " " + path;
+        }
+        command += " 2>/dev/null";
+
+        if (system(command.c_str()) != 0)
+        {
+            r.skip("list_source_files", "dwarf5_binary", "can not build test binary with " + compiler);
+            return;
+        }
+
+        std::vector<std::string> args = {dir.path() + "/binary"};
+        std::vector<char*> argv = make_argv(args);
+
+        r.run("list_source_files", "dwarf5_binary/" + std::to_string(UNIT_COUNT) + "_units", 0, UNIT_COUNT, [&]
+        {
+            silence_stdout silence;
+            list_source_files(argv.size(), argv.data());
+        });
+    }
+}
+
+void register_macro_benchmarks(runner& r)
+{
+    ingest_benchmarks(r);
+    list_source_files_benchmarks(r);
+}
+}
@@ -0,0 +1,133 @@
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "file_descriptor.h"
+#include "md5.h"
+#include "md5_accumulator.h"
+
+namespace bench
+{
+namespace
+{
+    std::vector<char> random_bytes(size_t size)
+    {
+        std::mt19937_64 rng(size);
+        std::vector<char> result(size);
+        for (char& c : result)
+            c = static_cast<char>(rng());
+        return result;
+    }
+
+    void md5_benchmarks(runner& r)
+    {
+        for (size_t size : {size_t(64), size_t(1024), size_t(64 * 1024), size_t(1024 * 1024), size_t(16 * 1024 * 1024)})
+        {
+            std::vector<char> data = random_bytes(size);
+
+            r.run("md5", "md5_hash/" + std::to_string(size), size, 1, [&]
+            {
+                do_not_optimize(md5_hash(data.data(), data.size()));
+            });
+
+            // same input fed in 4 KiB pieces, as the streaming ingest path does
+            r.run("md5", "md5_accumulator/" + std::to_string(size), size, 1, [&]
+            {
+                md5_accumulator acc;
+                for (size_t off = 0; off < data.size(); off += 4096)
+                    acc.accumulate(data.data() + off, std::min(size_t(4096), data.size() - off));
+                do_not_optimize(acc.finish());
+            });
+        }
+    }
+
+    void hex_benchmarks(runner& r)
+    {
+        constexpr size_t COUNT = 10000;
+
+        std::vector<md5> hashes(COUNT);
+        for (size_t i = 0; i != COUNT; ++i)
+            hashes[i] = md5_hash(reinterpret_cast<char const*>(&i), sizeof i);
+
+        r.run("hex", "ostream", 0, COUNT, [&]
+        {
+            std::ostringstream ss;
+            for (md5 const& hash : hashes)
+                ss << hash;
+            do_not_optimize(ss.str().size());
+        });
+
+        r.run("hex", "md5_to_hex", 0, COUNT, [&]
+        {
+            char buf[MD5_HEX_LENGTH];
+            for (md5 const& hash : hashes)
+            {
+                md5_to_hex(hash, buf);
+                do_not_optimize(buf);
+            }
+        });
+
+        std::vector<std::string> strings;
+        for (md5 const& hash : hashes)
+        {
+            char buf[MD5_HEX_LENGTH];
+            md5_to_hex(hash, buf);
+            strings.emplace_back(buf, MD5_HEX_LENGTH);
+        }
+
+        r.run("hex", "md5_from_hex", 0, COUNT, [&]
+        {
+            md5 hash;
+            for (std::string const& s : strings)
+            {
+                md5_from_hex(s.data(), s.size(), hash);
+                do_not_optimize(hash);
+            }
+        });
+    }
+
+    void directory_benchmarks(runner& r)
+    {
+        if (!r.is_enabled("directory/"))
+            return;
+
+        constexpr size_t COUNT = 20000;
+
+        temp_dir dir;
+        for (size_t i = 0; i != COUNT; ++i)
+        {
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(md5_hash(reinterpret_cast<char const*>(&i), sizeof i), name);
+            file_descriptor::open({dir.path() + "/" + name}, file_flags::write_only | file_flags::create | file_flags::close_on_exec);
+        }
+
+        r.run("directory", "directory_stream/" + std::to_string(COUNT), 0, COUNT, [&]
+        {
+            directory_stream stream(file_descriptor::open(dir.path(), file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+            size_t n = 0;
+            while (stream.next())
+                ++n;
+            do_not_optimize(n);
+        });
+
+        r.run("directory", "sorted_directory_stream/" + std::to_string(COUNT), 0, COUNT, [&]
+        {
+            sorted_directory_stream stream(file_descriptor::open(dir.path(), file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+            size_t n = 0;
+            while (stream.next())
+                ++n;
+            do_not_optimize(n);
+        });
+    }
+}
+
+void register_micro_benchmarks(runner& r)
+{
+    md5_benchmarks(r);
+    hex_benchmarks(r);
+    directory_benchmarks(r);
+}
+}
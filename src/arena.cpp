@@ -0,0 +1,26 @@
+#include "arena.h"
+#include <cstring>
+
+arena::arena(size_t initial_size)
+    : first_block(new char[initial_size])
+    , memory(first_block.get(), initial_size)
+{}
+
+std::pmr::memory_resource* arena::resource()
+{
+    return &memory;
+}
+
+std::string_view arena::copy(std::string_view s)
+{
+    char* result = static_cast<char*>(memory.allocate(s.size() + 1, 1));
+    memcpy(result, s.data(), s.size());
+    result[s.size()] = '\0';
+    return std::string_view(result, s.size());
+}
+
+void arena::reset()
+{
+    // later blocks go back to the heap, allocation restarts at the first
+    memory.release();
+}
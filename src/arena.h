@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+
+// Bump allocator for data that lives exactly as long as one unit of work,
+// e.g. the file names of a binary's line tables. Allocating is a pointer
+// increment and nothing is freed individually; reset() keeps the first
+// block for the next unit. Containers use it through resource().
+struct arena
+{
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+    explicit arena(size_t initial_size = DEFAULT_BLOCK_SIZE);
+
+    arena(arena const&) = delete;
+    arena& operator=(arena const&) = delete;
+
+    std::pmr::memory_resource* resource();
+
+    // NUL-terminated copy of s that lives until reset()
+    std::string_view copy(std::string_view s);
+
+    void reset();
+
+private:
+    std::unique_ptr<char[]> first_block;
+    std::pmr::monotonic_buffer_resource memory;
+};
@@ -0,0 +1,230 @@
+#include "buffer_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // enough for the buffers one thread holds at once (a directory
+    // listing and a file read, say)
+    constexpr size_t MAX_POOLED_PER_THREAD = 4;
+
+    // the rest is kept process-wide up to this much, then goes back
+    constexpr size_t MAX_SHARED_BYTES = 64 * 1024 * 1024;
+
+    // O_DIRECT wants the logical block size, a page covers every device
+    constexpr size_t MIN_ALIGNMENT = 4096;
+
+    size_t round_up(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // capacity is rounded up to what is actually allocated
+    char* allocate(size_t& capacity)
+    {
+        if (capacity < pooled_buffer::HUGE_PAGE_SIZE)
+        {
+            capacity = round_up(std::max(capacity, size_t(1)), MIN_ALIGNMENT);
+            void* p = aligned_alloc(MIN_ALIGNMENT, capacity);
+            if (!p)
+                throw std::bad_alloc();
+            return static_cast<char*>(p);
+        }
+
+        capacity = round_up(capacity, pooled_buffer::HUGE_PAGE_SIZE);
+
+        // reserved huge pages, most systems have none
+        void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+            return static_cast<char*>(p);
+
+        // transparent huge pages need an aligned range: map one huge page
+        // more and trim both ends
+        size_t length = capacity + pooled_buffer::HUGE_PAGE_SIZE;
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+
+        uintptr_t start = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = round_up(start, pooled_buffer::HUGE_PAGE_SIZE);
+        if (aligned != start)
+            munmap(p, aligned - start);
+        if (size_t tail = start + length - (aligned + capacity))
+            munmap(reinterpret_cast<void*>(aligned + capacity), tail);
+
+        // only a hint, fails if THP is disabled
+        madvise(reinterpret_cast<void*>(aligned), capacity, MADV_HUGEPAGE);
+        return reinterpret_cast<char*>(aligned);
+    }
+
+    void deallocate(char* buf, size_t capacity)
+    {
+        if (capacity < pooled_buffer::HUGE_PAGE_SIZE)
+            free(buf);
+        else
+            munmap(buf, capacity);
+    }
+
+    struct free_buffer
+    {
+        char* buf;
+        size_t capacity;
+    };
+
+    // most recently released last
+    bool take_from(std::vector<free_buffer>& list, size_t size, free_buffer& result)
+    {
+        for (auto i = list.rbegin(); i != list.rend(); ++i)
+        {
+            if (i->capacity < size)
+                continue;
+
+            result = *i;
+            list.erase(std::next(i).base());
+            return true;
+        }
+
+        return false;
+    }
+
+    struct shared_free_list
+    {
+        std::mutex mutex;
+        std::vector<free_buffer> buffers;
+        size_t total_bytes = 0;
+
+        ~shared_free_list()
+        {
+            for (free_buffer const& b : buffers)
+                deallocate(b.buf, b.capacity);
+        }
+
+        bool take(size_t size, free_buffer& result)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!take_from(buffers, size, result))
+                return false;
+
+            total_bytes -= result.capacity;
+            return true;
+        }
+
+        void give(free_buffer b) noexcept
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (total_bytes + b.capacity <= MAX_SHARED_BYTES)
+                {
+                    try
+                    {
+                        buffers.push_back(b);
+                        total_bytes += b.capacity;
+                        return;
+                    }
+                    catch (...)
+                    {}
+                }
+            }
+
+            deallocate(b.buf, b.capacity);
+        }
+    };
+
+    shared_free_list& shared_buffers()
+    {
+        static shared_free_list list;
+        return list;
+    }
+
+    struct thread_free_list
+    {
+        std::vector<free_buffer> buffers;
+
+        // the thread is exiting, another one can use them
+        ~thread_free_list()
+        {
+            for (free_buffer const& b : buffers)
+                shared_buffers().give(b);
+        }
+    };
+
+    thread_local thread_free_list free_buffers;
+}
+
+pooled_buffer::pooled_buffer()
+    : buf(nullptr)
+    , capacity(0)
+{}
+
+pooled_buffer::pooled_buffer(size_t size)
+    : buf(nullptr)
+    , capacity(0)
+{
+    free_buffer b;
+    if (take_from(free_buffers.buffers, size, b) || shared_buffers().take(size, b))
+    {
+        buf = b.buf;
+        capacity = b.capacity;
+        return;
+    }
+
+    capacity = size;
+    buf = allocate(capacity);
+}
+
+pooled_buffer::pooled_buffer(pooled_buffer&& other) noexcept
+    : buf(std::exchange(other.buf, nullptr))
+    , capacity(std::exchange(other.capacity, 0))
+{}
+
+pooled_buffer& pooled_buffer::operator=(pooled_buffer&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        release();
+        buf = std::exchange(rhs.buf, nullptr);
+        capacity = std::exchange(rhs.capacity, 0);
+    }
+    return *this;
+}
+
+pooled_buffer::~pooled_buffer()
+{
+    release();
+}
+
+void pooled_buffer::release() noexcept
+{
+    if (!buf)
+        return;
+
+    free_buffer b = {std::exchange(buf, nullptr), std::exchange(capacity, 0)};
+    if (free_buffers.buffers.size() < MAX_POOLED_PER_THREAD)
+    {
+        try
+        {
+            free_buffers.buffers.push_back(b);
+            return;
+        }
+        catch (...)
+        {}
+    }
+
+    shared_buffers().give(b);
+}
+
+char* pooled_buffer::data() const
+{
+    return buf;
+}
+
+size_t pooled_buffer::size() const
+{
+    return capacity;
+}
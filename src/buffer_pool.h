@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+
+// I/O buffer borrowed from a pool. Released buffers stay with the thread
+// that released them and are handed out again by the next acquire there,
+// so steady-state per-file work doesn't go through malloc (which would
+// mmap and munmap blocks this large on every file). What doesn't fit, and
+// the buffers of exiting threads, go to a small process-wide list, so the
+// worker threads each command starts reuse them too.
+//
+// Buffers are page aligned, as O_DIRECT requires. Those of HUGE_PAGE_SIZE
+// and more are aligned to it and backed by huge pages where the kernel
+// has them (reserved ones, else transparent), so streaming over one takes
+// a TLB entry per 2 MiB instead of one per 4 KiB page.
+struct pooled_buffer
+{
+    static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    pooled_buffer();
+    explicit pooled_buffer(size_t size);
+
+    pooled_buffer(pooled_buffer&&) noexcept;
+    pooled_buffer& operator=(pooled_buffer&&) noexcept;
+
+    ~pooled_buffer();
+
+    char* data() const;
+
+    // at least the size asked for, rounded up to the alignment
+    size_t size() const;
+
+private:
+    void release() noexcept;
+
+private:
+    char* buf;
+    size_t capacity;
+};
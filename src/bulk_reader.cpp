@@ -0,0 +1,116 @@
+#include "bulk_reader.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+namespace
+{
+    // physical offset of the first extent of the file, 0 if unknown
+    uint64_t first_extent_offset(int fd)
+    {
+        alignas(fiemap) char buf[sizeof(fiemap) + sizeof(fiemap_extent)] = {};
+        fiemap* request = reinterpret_cast<fiemap*>(buf);
+
+        request->fm_start = 0;
+        request->fm_length = FIEMAP_MAX_OFFSET;
+        request->fm_extent_count = 1;
+
+        // fails with EOPNOTSUPP/ENOTTY on NFS, tmpfs, etc.
+        // in that case ordering falls back to inode numbers
+        if (ioctl(fd, FS_IOC_FIEMAP, request) != 0 || request->fm_mapped_extents == 0)
+            return 0;
+
+        return request->fm_extents[0].fe_physical;
+    }
+
+    // every file of a batch is open at once
+    size_t limit_batch_size(size_t batch_size, size_t reserved_descriptors)
+    {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+            return batch_size;
+
+        size_t available = limit.rlim_cur > reserved_descriptors ? limit.rlim_cur - reserved_descriptors : 0;
+        return std::max(std::min(batch_size, available), size_t(1));
+    }
+}
+
+bulk_reader::bulk_reader(std::vector<char const*> filenames, size_t readahead_window, size_t batch_size, bool direct, size_t reserved_descriptors)
+    : filenames(std::move(filenames))
+    , readahead_window(readahead_window)
+    , batch_size(limit_batch_size(batch_size, reserved_descriptors))
+    , direct(direct)
+    , next_to_load(0)
+    , current(0)
+    , advised(0)
+{}
+
+bool bulk_reader::next(entry& result)
+{
+    if (current == batch.size())
+    {
+        if (next_to_load == filenames.size())
+            return false;
+
+        load_batch();
+    }
+
+    pending& p = batch[current];
+    ++current;
+
+    if (!direct)
+    {
+        advise_up_to(std::min(current + readahead_window, batch.size()));
+
+        // the current file is read sequentially from start to end
+        posix_fadvise(p.fd.get_fd(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    result.index = p.index;
+    result.filename = filenames[p.index];
+    result.fd = std::move(p.fd);
+    return true;
+}
+
+void bulk_reader::load_batch()
+{
+    batch.clear();
+    current = 0;
+    advised = 0;
+
+    size_t end = std::min(next_to_load + batch_size, filenames.size());
+    batch.reserve(end - next_to_load);
+    for (; next_to_load != end; ++next_to_load)
+    {
+        pending p;
+        p.index = next_to_load;
+        file_flags flags = file_flags::read_only | file_flags::close_on_exec;
+        p.fd = direct ? file_descriptor::open_direct_if_supported(filenames[next_to_load], flags) : file_descriptor::open(filenames[next_to_load], flags);
+
+        struct stat64 st = p.fd.stat();
+        p.device = st.st_dev;
+        p.inode = st.st_ino;
+        p.physical = S_ISREG(st.st_mode) ? first_extent_offset(p.fd.get_fd()) : 0;
+
+        batch.push_back(std::move(p));
+    }
+
+    std::sort(batch.begin(), batch.end(), [](pending const& a, pending const& b)
+    {
+        if (a.device != b.device)
+            return a.device < b.device;
+        if (a.physical != b.physical)
+            return a.physical < b.physical;
+        return a.inode < b.inode;
+    });
+}
+
+void bulk_reader::advise_up_to(size_t end)
+{
+    // errors are ignored: this is only a hint and it fails for pipes
+    for (; advised < end; ++advised)
+        posix_fadvise(batch[advised].fd.get_fd(), 0, 0, POSIX_FADV_WILLNEED);
+}
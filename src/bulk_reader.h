@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "file_descriptor.h"
+
+// Opens a list of files in the order they are laid out on disk and asks
+// the kernel to prefetch the next few of them while the current one is
+// being processed. On cold caches (spinning disks, NFS) this hides most
+// of the seek latency of reading many small files one by one.
+//
+// Files are processed in batches: each batch is opened up front, sorted
+// by physical offset of the first extent (FIEMAP) or by inode number on
+// filesystems that don't report extents, and then handed out in order.
+// A batch is kept below the RLIMIT_NOFILE soft limit, less the
+// descriptors reserved for the rest of the process (the files handed out
+// of the previous batch, the repository, ...).
+//
+// With direct, files are opened with O_DIRECT where supported and
+// nothing is prefetched: a bulk ingest of cold files then neither waits
+// for nor evicts anything in the page cache.
+struct bulk_reader
+{
+    static constexpr size_t DEFAULT_READAHEAD_WINDOW = 16;
+    static constexpr size_t DEFAULT_BATCH_SIZE = 1024;
+    static constexpr size_t DEFAULT_RESERVED_DESCRIPTORS = 64;
+
+    struct entry
+    {
+        // index of the file in the list passed to the constructor
+        size_t index;
+        char const* filename;
+        file_descriptor fd;
+    };
+
+    bulk_reader(std::vector<char const*> filenames,
+                size_t readahead_window = DEFAULT_READAHEAD_WINDOW,
+                size_t batch_size = DEFAULT_BATCH_SIZE,
+                bool direct = false,
+                size_t reserved_descriptors = DEFAULT_RESERVED_DESCRIPTORS);
+
+    // returns false when all files have been handed out
+    bool next(entry& result);
+
+private:
+    struct pending
+    {
+        size_t index;
+        uint64_t device;
+        uint64_t physical;
+        uint64_t inode;
+        file_descriptor fd;
+    };
+
+    void load_batch();
+    void advise_up_to(size_t end);
+
+private:
+    std::vector<char const*> filenames;
+    size_t readahead_window;
+    size_t batch_size;
+    bool direct;
+
+    size_t next_to_load;
+    std::vector<pending> batch;
+    size_t current;
+    size_t advised;
+};
@@ -0,0 +1,58 @@
+#include "command_line.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+bool match_option(char const* arg, char const* name, char const*& value)
+{
+    if (arg[0] != '-' || arg[1] != '-')
+        return false;
+
+    size_t name_len = strlen(name);
+    if (strncmp(arg + 2, name, name_len) != 0 || arg[2 + name_len] != '=')
+        return false;
+
+    value = arg + 2 + name_len + 1;
+    return true;
+}
+
+bool match_flag(char const* arg, char const* name)
+{
+    return arg[0] == '-' && arg[1] == '-' && !strcmp(arg + 2, name);
+}
+
+size_t parse_count(char const* option, char const* value)
+{
+    char* end;
+    errno = 0;
+    unsigned long long result = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-')
+        throw std::runtime_error(std::string("invalid value for --") + option + ": " + value);
+
+    return static_cast<size_t>(result);
+}
+
+uint64_t parse_size(char const* option, char const* value)
+{
+    char* end;
+    errno = 0;
+    unsigned long long result = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || value[0] == '-')
+        throw std::runtime_error(std::string("invalid value for --") + option + ": " + value);
+
+    unsigned shift = 0;
+    switch (*end)
+    {
+    case 'K': shift = 10; ++end; break;
+    case 'M': shift = 20; ++end; break;
+    case 'G': shift = 30; ++end; break;
+    case 'T': shift = 40; ++end; break;
+    }
+
+    if (*end != '\0' || (shift != 0 && result > (UINT64_MAX >> shift)))
+        throw std::runtime_error(std::string("invalid value for --") + option + ": " + value);
+
+    return static_cast<uint64_t>(result) << shift;
+}
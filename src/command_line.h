@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// returns true if arg is "--<name>=<value>", value points into arg then
+bool match_option(char const* arg, char const* name, char const*& value);
+
+// returns true if arg is exactly "--<name>"
+bool match_flag(char const* arg, char const* name);
+
+size_t parse_count(char const* option, char const* value);
+
+// a byte count with an optional K, M, G or T (binary) suffix
+uint64_t parse_size(char const* option, char const* value);
@@ -0,0 +1,216 @@
+#include "delta.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    constexpr size_t BLOCK_SIZE = 16;
+    constexpr size_t MAX_LITERAL_SIZE = 127;
+    constexpr unsigned char COPY_OP = 0x80;
+
+    // polynomial rolling hash of a block, P_TOP is HASH_PRIME to the
+    // power of BLOCK_SIZE - 1
+    constexpr uint32_t HASH_PRIME = 0x01000193;
+
+    constexpr uint32_t pow_prime(size_t n)
+    {
+        uint32_t result = 1;
+        for (size_t i = 0; i != n; ++i)
+            result *= HASH_PRIME;
+        return result;
+    }
+
+    constexpr uint32_t P_TOP = pow_prime(BLOCK_SIZE - 1);
+
+    uint32_t block_hash(unsigned char const* p)
+    {
+        uint32_t h = 0;
+        for (size_t i = 0; i != BLOCK_SIZE; ++i)
+            h = h * HASH_PRIME + p[i];
+        return h;
+    }
+
+    uint32_t mix(uint32_t h)
+    {
+        h ^= h >> 15;
+        h *= 0x2c1b3c6d;
+        h ^= h >> 12;
+        return h;
+    }
+
+    void write_varint(std::vector<char>& out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    uint64_t read_varint(unsigned char const*& p, unsigned char const* end)
+    {
+        uint64_t result = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (p == end)
+                throw std::runtime_error("damaged delta");
+
+            unsigned char byte = *p++;
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return result;
+        }
+        throw std::runtime_error("damaged delta");
+    }
+
+    void write_literal(std::vector<char>& out, unsigned char const* data, size_t size)
+    {
+        while (size != 0)
+        {
+            size_t n = std::min(size, MAX_LITERAL_SIZE);
+            out.push_back(static_cast<char>(n));
+            out.insert(out.end(), data, data + n);
+            data += n;
+            size -= n;
+        }
+    }
+
+    void write_copy(std::vector<char>& out, size_t offset, size_t size)
+    {
+        out.push_back(static_cast<char>(COPY_OP));
+        write_varint(out, offset);
+        write_varint(out, size);
+    }
+
+    // open addressing without probing: a colliding block replaces the
+    // previous one, which only costs a missed match
+    struct block_index
+    {
+        block_index(unsigned char const* base, size_t base_size)
+        {
+            size_t block_count = base_size / BLOCK_SIZE;
+            size_t capacity = 16;
+            while (capacity < block_count * 2)
+                capacity *= 2;
+
+            mask = capacity - 1;
+            slots.assign(capacity, 0);
+
+            // earlier blocks win, copies from the start of a file are
+            // likelier to extend
+            for (size_t i = block_count; i-- != 0;)
+                slots[mix(block_hash(base + i * BLOCK_SIZE)) & mask] = static_cast<uint32_t>(i + 1);
+        }
+
+        // offset of a block with this hash plus one, or 0
+        size_t find(uint32_t hash) const
+        {
+            uint32_t slot = slots[mix(hash) & mask];
+            return slot == 0 ? 0 : (slot - 1) * BLOCK_SIZE + 1;
+        }
+
+    private:
+        std::vector<uint32_t> slots;
+        size_t mask;
+    };
+}
+
+std::vector<char> create_delta(char const* base_chars, size_t base_size, char const* target_chars, size_t target_size)
+{
+    if (base_size > UINT32_MAX * BLOCK_SIZE)
+        throw std::runtime_error("delta base is too large");
+
+    auto base = reinterpret_cast<unsigned char const*>(base_chars);
+    auto target = reinterpret_cast<unsigned char const*>(target_chars);
+
+    std::vector<char> result;
+    result.reserve(target_size / 8 + 32);
+    write_varint(result, base_size);
+    write_varint(result, target_size);
+
+    size_t literal_start = 0;
+    if (base_size >= BLOCK_SIZE && target_size >= BLOCK_SIZE)
+    {
+        block_index index(base, base_size);
+
+        size_t i = 0;
+        uint32_t h = block_hash(target);
+        while (i + BLOCK_SIZE <= target_size)
+        {
+            size_t found = index.find(h);
+            if (found != 0 && memcmp(base + found - 1, target + i, BLOCK_SIZE) == 0)
+            {
+                size_t base_offset = found - 1;
+
+                // the match may start inside the pending literal
+                while (i > literal_start && base_offset > 0 && base[base_offset - 1] == target[i - 1])
+                {
+                    --i;
+                    --base_offset;
+                }
+
+                size_t size = BLOCK_SIZE;
+                while (base_offset + size < base_size && i + size < target_size && base[base_offset + size] == target[i + size])
+                    ++size;
+
+                write_literal(result, target + literal_start, i - literal_start);
+                write_copy(result, base_offset, size);
+
+                i += size;
+                literal_start = i;
+                if (i + BLOCK_SIZE <= target_size)
+                    h = block_hash(target + i);
+                continue;
+            }
+
+            if (i + BLOCK_SIZE < target_size)
+                h = (h - target[i] * P_TOP) * HASH_PRIME + target[i + BLOCK_SIZE];
+            ++i;
+        }
+    }
+
+    write_literal(result, target + literal_start, target_size - literal_start);
+    return result;
+}
+
+std::vector<char> apply_delta(char const* base, size_t base_size, char const* delta, size_t delta_size)
+{
+    auto p = reinterpret_cast<unsigned char const*>(delta);
+    auto end = p + delta_size;
+
+    if (read_varint(p, end) != base_size)
+        throw std::runtime_error("delta was made against another base");
+
+    uint64_t target_size = read_varint(p, end);
+    // a damaged size must not turn into a huge allocation
+    std::vector<char> result;
+    result.reserve(std::min<uint64_t>(target_size, base_size + delta_size * 64));
+
+    while (p != end)
+    {
+        unsigned char op = *p++;
+        if (op & COPY_OP)
+        {
+            uint64_t offset = read_varint(p, end);
+            uint64_t size = read_varint(p, end);
+            if (offset > base_size || size > base_size - offset || size > target_size - result.size())
+                throw std::runtime_error("damaged delta");
+            result.insert(result.end(), base + offset, base + offset + size);
+        }
+        else
+        {
+            if (op == 0 || op > static_cast<size_t>(end - p) || op > target_size - result.size())
+                throw std::runtime_error("damaged delta");
+            result.insert(result.end(), p, p + op);
+            p += op;
+        }
+    }
+
+    if (result.size() != target_size)
+        throw std::runtime_error("damaged delta");
+
+    return result;
+}
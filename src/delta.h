@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Binary deltas between two versions of a file, in the spirit of xdelta:
+// the target is described as a sequence of copies from the base and
+// literal inserts. Matches are found through a hash of every 16-byte
+// block of the base, so unchanged runs cost a few bytes regardless of
+// their length.
+//
+// Format: varint base size, varint target size, then operations. A byte
+// with the high bit set is a copy followed by varint offset and length,
+// otherwise the byte is the length (1-127) of the literal that follows.
+std::vector<char> create_delta(char const* base, size_t base_size, char const* target, size_t target_size);
+
+// throws if the delta is damaged or was made against another base
+std::vector<char> apply_delta(char const* base, size_t base_size, char const* delta, size_t delta_size);
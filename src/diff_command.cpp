@@ -0,0 +1,95 @@
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "md5.h"
+#include "repository.h"
+#include "tree_object.h"
+
+namespace
+{
+    bool same_hash(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }
+
+    std::string join(std::string const& prefix, std::string const& name)
+    {
+        return prefix.empty() ? name : prefix + '/' + name;
+    }
+
+    // every file under an added or deleted entry
+    void list_entry(repository& repo, tree_entry const& entry, std::string const& path, char status, std::ostream& out)
+    {
+        if (entry.mode != tree_entry_mode::directory)
+        {
+            out << status << ' ' << path << '\n';
+            return;
+        }
+
+        for (tree_entry const& child : load_tree(repo, entry.hash))
+            list_entry(repo, child, join(path, child.name), status, out);
+    }
+
+    // equal subtrees have equal names, so only differing ones are loaded
+    void diff_trees(repository& repo, md5 const& from, md5 const& to, std::string const& prefix, std::ostream& out)
+    {
+        if (same_hash(from, to))
+            return;
+
+        std::vector<tree_entry> a = load_tree(repo, from);
+        std::vector<tree_entry> b = load_tree(repo, to);
+
+        size_t i = 0, j = 0;
+        while (i != a.size() || j != b.size())
+        {
+            int cmp = i == a.size() ? 1 : j == b.size() ? -1 : a[i].name.compare(b[j].name);
+            if (cmp < 0)
+            {
+                list_entry(repo, a[i], join(prefix, a[i].name), 'D', out);
+                ++i;
+                continue;
+            }
+            if (cmp > 0)
+            {
+                list_entry(repo, b[j], join(prefix, b[j].name), 'A', out);
+                ++j;
+                continue;
+            }
+
+            tree_entry const& x = a[i++];
+            tree_entry const& y = b[j++];
+            std::string path = join(prefix, x.name);
+
+            bool x_dir = x.mode == tree_entry_mode::directory;
+            bool y_dir = y.mode == tree_entry_mode::directory;
+            if (x_dir && y_dir)
+                diff_trees(repo, x.hash, y.hash, path, out);
+            else if (x_dir || y_dir)
+            {
+                list_entry(repo, x, path, 'D', out);
+                list_entry(repo, y, path, 'A', out);
+            }
+            else if (x.mode != y.mode || !same_hash(x.hash, y.hash))
+                out << 'M' << ' ' << path << '\n';
+        }
+    }
+}
+
+// diff <tree> <tree>
+//
+// lists files added (A), deleted (D) and modified (M) between two
+// snapshots, one per line. Trees can be given by abbreviated names
+void diff_command(size_t argc, char* argv[])
+{
+    if (argc != 2)
+        throw std::runtime_error("two tree names expected");
+
+    repository repo(default_repository_root());
+    md5 from = resolve_object_name(repo, argv[0]);
+    md5 to = resolve_object_name(repo, argv[1]);
+
+    diff_trees(repo, from, to, "", std::cout);
+}
@@ -1,14 +1,47 @@
 #include "dwarf_md5.h"
 
 #include <fcntl.h>
-#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unistd.h>
 
+#include "command_line.h"
 #include "dwarf_debug.h"
 #include "file_descriptor.h"
+#include "output_writer.h"
+#include "source_file_cache.h"
+#include "stats.h"
 
 namespace
 {
-void process_cu_die(dwarf::debug& dbg, Dwarf_Die cu_die, std::vector<std::pair<std::string, md5>>& result)
+md5 read_file_entry(Dwarf_Line_Context line_context, Dwarf_Signed index, char const*& name)
+{
+    Dwarf_Unsigned dirindex = 0;
+    Dwarf_Unsigned modtime = 0;
+    Dwarf_Unsigned flength = 0;
+    Dwarf_Form_Data16 *md5data = 0;
+
+    dwarf::check_for_error("dwarf_srclines_files_data_b(...) failed", __func__
+         , dwarf_srclines_files_data_b(line_context, index
+         , &name, &dirindex, &modtime, &flength
+         , &md5data, nullptr));
+
+    if (md5data == nullptr)
+    {
+        DWARF_THROW_ERROR("md5 value not found");
+    }
+
+    md5 hash{};
+    std::copy(md5data->fd_data, md5data->fd_data + 16, hash.data);
+    stats::add(stats::counter::source_files_found);
+    return hash;
+}
+
+// appends the files and the line table of the unit, with file numbers
+// translated to indices in result; names are copied to the arena
+void process_cu_die(dwarf::debug& dbg, Dwarf_Die cu_die, arena& names, std::vector<std::pair<std::string_view, md5>>& result, std::vector<dwarf::line_row>& rows)
 {
     Dwarf_Unsigned lineversion = 0;
     Dwarf_Signed linecount = 0;
@@ -26,7 +59,6 @@ void process_cu_die(dwarf::debug& dbg, Dwarf_Die cu_die, std::vector<std::pair<s
             , dwarf_srclines_from_linecontext(line_context
             , &linebuf, &linecount, nullptr));
 
-    const char* name = 0;
     Dwarf_Signed baseindex = 0;
     Dwarf_Signed file_count = 0;
     Dwarf_Signed endindex = 0;
@@ -35,33 +67,53 @@ void process_cu_die(dwarf::debug& dbg, Dwarf_Die cu_die, std::vector<std::pair<s
             , dwarf_srclines_files_indexes(line_context
             , &baseindex, &file_count, &endindex, nullptr));
 
-    for (int i = baseindex; i < endindex; ++i)
+    size_t first_file = result.size();
+    for (Dwarf_Signed i = baseindex; i < endindex; ++i)
     {
-        Dwarf_Unsigned dirindex = 0;
-        Dwarf_Unsigned modtime = 0;
-        Dwarf_Unsigned flength = 0;
-        Dwarf_Form_Data16 *md5data = 0;
+        char const* name = nullptr;
+        md5 hash = read_file_entry(line_context, i, name);
+        result.emplace_back(names.copy(name), hash);
+    }
 
-        dwarf::check_for_error("dwarf_srclines_files_data_b(...) failed", __func__
-             , dwarf_srclines_files_data_b(line_context, i
-             , &name, &dirindex, &modtime, &flength
-             , &md5data, nullptr));
+    for (Dwarf_Signed i = 0; i < linecount; ++i)
+    {
+        Dwarf_Addr address = 0;
+        Dwarf_Unsigned lineno = 0;
+        Dwarf_Unsigned fileno = 0;
+        Dwarf_Bool end_sequence = 0;
 
-        if (md5data == nullptr)
+        dwarf::check_for_error("dwarf_lineaddr(...) failed", __func__
+                , dwarf_lineaddr(linebuf[i], &address, nullptr));
+        dwarf::check_for_error("dwarf_lineendsequence(...) failed", __func__
+                , dwarf_lineendsequence(linebuf[i], &end_sequence, nullptr));
+
+        dwarf::line_row row{};
+        row.address = address;
+        row.end_sequence = end_sequence != 0;
+        if (!row.end_sequence)
         {
-            DWARF_THROW_ERROR("md5 value not found");
-        }
+            dwarf::check_for_error("dwarf_lineno(...) failed", __func__
+                    , dwarf_lineno(linebuf[i], &lineno, nullptr));
+            dwarf::check_for_error("dwarf_line_srcfileno(...) failed", __func__
+                    , dwarf_line_srcfileno(linebuf[i], &fileno, nullptr));
 
-        md5 hash{};
-        std::copy(md5data->fd_data, md5data->fd_data + 16, hash.data);
+            if (static_cast<Dwarf_Signed>(fileno) < baseindex || static_cast<Dwarf_Signed>(fileno) >= endindex)
+            {
+                DWARF_THROW_ERROR("line refers to a file out of range");
+            }
 
-        result.emplace_back(name, hash);
+            row.file = static_cast<uint32_t>(first_file + (fileno - baseindex));
+            row.line = static_cast<uint32_t>(lineno);
+        }
+
+        rows.push_back(row);
     }
+
+    dwarf_srclines_dealloc_b(line_context);
 }
 
-std::vector<std::pair<std::string, md5>> read_cu_list(dwarf::debug& dbg)
+void read_cu_list(dwarf::debug& dbg, dwarf::line_table& result)
 {
-    std::vector<std::pair<std::string, md5>> result;
     Dwarf_Bool is_info = 1;
     dwarf::cu_header cu;
 
@@ -72,11 +124,12 @@ std::vector<std::pair<std::string, md5>> read_cu_list(dwarf::debug& dbg)
 
         if (dbg.next_cu_header(is_info, &cu, nullptr) == DW_DLV_NO_ENTRY)
         {
-            return result;
+            return;
         }
 
         dbg.sibling_of(no_die, &cu_die, is_info, nullptr);
-        process_cu_die(dbg, cu_die, result);
+        process_cu_die(dbg, cu_die, *result.names, result.files, result.rows);
+        stats::add(stats::counter::cus_parsed);
         dbg.dealloc(cu_die, DW_DLA_DIE);
     }
 }
@@ -84,28 +137,164 @@ std::vector<std::pair<std::string, md5>> read_cu_list(dwarf::debug& dbg)
 
 namespace dwarf
 {
+source_file_reader::source_file_reader(char const *filename)
+    : fd(file_descriptor::open(file_location(filename), file_flags::read_only))
+{
+    stats::scoped_timer timer(stats::phase::dwarf);
+    dbg = debug(fd.get_fd());
+}
+
+source_file_reader::~source_file_reader()
+{
+    release_unit();
+}
+
+void source_file_reader::release_unit() noexcept
+{
+    if (line_context != nullptr)
+    {
+        dwarf_srclines_dealloc_b(line_context);
+        line_context = nullptr;
+    }
+    if (cu_die != nullptr)
+    {
+        dbg.dealloc(cu_die, DW_DLA_DIE);
+        cu_die = nullptr;
+    }
+}
+
+bool source_file_reader::next_unit()
+{
+    release_unit();
+
+    stats::scoped_timer timer(stats::phase::dwarf);
+    Dwarf_Bool is_info = 1;
+    cu_header cu;
+
+    if (dbg.next_cu_header(is_info, &cu, nullptr) == DW_DLV_NO_ENTRY)
+    {
+        return false;
+    }
+
+    Dwarf_Die no_die = 0;
+    dbg.sibling_of(no_die, &cu_die, is_info, nullptr);
+    stats::add(stats::counter::cus_parsed);
+
+    Dwarf_Unsigned lineversion = 0;
+    Dwarf_Small table_count = 0;
+    check_for_error("dwarf_srclines_b(...) failed", __func__
+            , dwarf_srclines_b(cu_die, &lineversion
+            , &table_count, &line_context
+            , nullptr));
+
+    Dwarf_Signed file_count = 0;
+    check_for_error("dwarf_srclines_files_indexes(...) failed", __func__
+            , dwarf_srclines_files_indexes(line_context
+            , &index, &file_count, &end_index, nullptr));
+
+    return true;
+}
+
+bool source_file_reader::next(source_file& result)
+{
+    while (index >= end_index)
+    {
+        if (done || !next_unit())
+        {
+            done = true;
+            return false;
+        }
+    }
+
+    stats::scoped_timer timer(stats::phase::dwarf);
+    result.hash = read_file_entry(line_context, index++, result.name);
+    return true;
+}
+
 std::vector<std::pair<std::string, md5>> get_source_files(char const *filename)
+{
+    std::vector<std::pair<std::string, md5>> result;
+
+    source_file_reader reader(filename);
+    for (source_file file; reader.next(file);)
+        result.emplace_back(file.name, file.hash);
+
+    return result;
+}
+
+line_table get_line_table(char const *filename)
 {
     file_descriptor fd = file_descriptor::open(file_location(filename), file_flags::read_only);
 
+    stats::scoped_timer timer(stats::phase::dwarf);
     dwarf::debug dbg(fd.get_fd());
 
-    return read_cu_list(dbg);
+    line_table result;
+    result.names = std::make_unique<arena>();
+    read_cu_list(dbg, result);
+    return result;
 }
 }
 
+// list_source_files [--no-cache] [--format=text|tsv|ndjson|binary] <binary>...
+//
+// results are cached in the default repository by the build id of the
+// binary, --no-cache always parses the DWARF; see output_writer.h for the
+// formats
 void list_source_files(size_t argc, char* argv[])
 {
+    bool use_cache = true;
+    output_format format = output_format::text;
+    for (; argc != 0 && **argv == '-'; --argc, ++argv)
+    {
+        char const* value;
+        if (match_flag(*argv, "no-cache"))
+            use_cache = false;
+        else if (match_option(*argv, "format", value))
+            format = parse_output_format(value);
+        else
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+    }
+
     if (argc == 0)
         throw std::runtime_error("filename expected");
 
-    for (size_t i = 0; i != argc; ++i)
+    std::unique_ptr<source_file_cache> cache;
+    if (use_cache)
+        cache = source_file_cache::open_default_if_exists();
+
+    output_writer out(STDOUT_FILENO, format);
+    auto print = [&](std::string_view path, md5 const& hash)
     {
-        auto v = dwarf::get_source_files(argv[i]);
+        if (format != output_format::text)
+        {
+            out.write_entry(path, hash);
+            return;
+        }
 
-        for (auto const& p : v)
+        out.put('\'');
+        out.write(path);
+        out.write("', md5 value: ");
+        out.write_hex(hash);
+        out.put('\n');
+    };
+
+    for (size_t i = 0; i != argc; ++i)
+    {
+        if (cache)
         {
-            std::cout << "'" << p.first << "', md5 value: " << p.second << std::endl;
+            source_file_list files = cache->get(argv[i]);
+            for (size_t j = 0; j != files.size(); ++j)
+                print(files.path(j), files.hash(j));
+            continue;
         }
+
+        // printed as the units are parsed rather than after the whole
+        // binary; the writer flushes whenever its buffer fills
+        dwarf::source_file_reader reader(argv[i]);
+        for (dwarf::source_file file; reader.next(file);)
+            print(file.name, file.hash);
     }
-}
\ No newline at end of file
+
+    out.flush();
+}
@@ -1,14 +1,78 @@
 #ifndef SOURCE_STORE_DWARF_MD5_H
 #define SOURCE_STORE_DWARF_MD5_H
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "arena.h"
+#include "dwarf_debug.h"
+#include "file_descriptor.h"
 #include "md5.h"
 
 namespace dwarf
 {
+struct line_row
+{
+    uint64_t address;
+    uint32_t file;
+    uint32_t line;
+    bool end_sequence;
+};
+
+// rows of every line program in the order libdwarf reports them, file is
+// an index in files; file names live in names
+struct line_table
+{
+    std::unique_ptr<arena> names;
+    std::vector<std::pair<std::string_view, md5>> files;
+    std::vector<line_row> rows;
+};
+
+struct source_file
+{
+    // owned by libdwarf, valid until the next call to next()
+    char const* name;
+    md5 hash;
+};
+
+// Walks the file tables of the line programs one compilation unit at a
+// time: the first files are available before the rest of the binary is
+// parsed, the caller can stop at any point and only the current unit is
+// kept in memory.
+class source_file_reader
+{
+public:
+    explicit source_file_reader(char const *filename);
+
+    source_file_reader(source_file_reader const&) = delete;
+
+    source_file_reader& operator=(source_file_reader const&) = delete;
+
+    ~source_file_reader();
+
+    // false once every unit has been read
+    bool next(source_file& result);
+
+private:
+    bool next_unit();
+
+    void release_unit() noexcept;
+
+private:
+    file_descriptor fd;
+    debug dbg;
+    Dwarf_Die cu_die = nullptr;
+    Dwarf_Line_Context line_context = nullptr;
+    Dwarf_Signed index = 0;
+    Dwarf_Signed end_index = 0;
+    bool done = false;
+};
+
 std::vector<std::pair<std::string, md5>> get_source_files(char const *filename);
+line_table get_line_table(char const *filename);
 }
 
 #endif //SOURCE_STORE_DWARF_MD5_H
@@ -0,0 +1,124 @@
+#include "elf_build_id.h"
+#include <cstring>
+#include <elf.h>
+
+namespace
+{
+    // notes are 4-byte aligned in practice, whatever the ELF class
+    size_t align4(size_t value)
+    {
+        return (value + 3) & ~size_t(3);
+    }
+
+    bool find_build_id(unsigned char const* notes, size_t size, std::vector<uint8_t>& result)
+    {
+        size_t pos = 0;
+        while (size - pos >= 12)
+        {
+            uint32_t name_size, desc_size, type;
+            memcpy(&name_size, notes + pos, 4);
+            memcpy(&desc_size, notes + pos + 4, 4);
+            memcpy(&type, notes + pos + 8, 4);
+            pos += 12;
+
+            size_t name_end = pos + align4(name_size);
+            if (name_end < pos || name_end > size)
+                return false;
+            size_t desc_end = name_end + align4(desc_size);
+            if (desc_end < name_end || desc_end > size)
+                return false;
+
+            if (type == NT_GNU_BUILD_ID && name_size == 4 && memcmp(notes + pos, "GNU", 4) == 0 && desc_size != 0)
+            {
+                result.assign(notes + name_end, notes + name_end + desc_size);
+                return true;
+            }
+
+            pos = desc_end;
+        }
+
+        return false;
+    }
+
+    template <typename Ehdr, typename Phdr, typename Shdr>
+    std::vector<uint8_t> read_build_id(unsigned char const* data, size_t size)
+    {
+        std::vector<uint8_t> result;
+        if (size < sizeof(Ehdr))
+            return result;
+
+        Ehdr ehdr;
+        memcpy(&ehdr, data, sizeof ehdr);
+
+        auto note_in_file = [&](uint64_t offset, uint64_t note_size)
+        {
+            return offset <= size && note_size <= size - offset
+                && find_build_id(data + offset, static_cast<size_t>(note_size), result);
+        };
+
+        // PT_NOTE segments are at the start of the file, this usually
+        // touches a single page
+        if (ehdr.e_phentsize == sizeof(Phdr) && ehdr.e_phoff <= size && ehdr.e_phnum <= (size - ehdr.e_phoff) / sizeof(Phdr))
+        {
+            for (size_t i = 0; i != ehdr.e_phnum; ++i)
+            {
+                Phdr phdr;
+                memcpy(&phdr, data + ehdr.e_phoff + i * sizeof(Phdr), sizeof phdr);
+                if (phdr.p_type == PT_NOTE && note_in_file(phdr.p_offset, phdr.p_filesz))
+                    return result;
+            }
+        }
+
+        // separate debug files and relocatable objects have no segments
+        if (ehdr.e_shentsize == sizeof(Shdr) && ehdr.e_shoff <= size && ehdr.e_shnum <= (size - ehdr.e_shoff) / sizeof(Shdr))
+        {
+            for (size_t i = 0; i != ehdr.e_shnum; ++i)
+            {
+                Shdr shdr;
+                memcpy(&shdr, data + ehdr.e_shoff + i * sizeof(Shdr), sizeof shdr);
+                if (shdr.sh_type == SHT_NOTE && note_in_file(shdr.sh_offset, shdr.sh_size))
+                    return result;
+            }
+        }
+
+        result.clear();
+        return result;
+    }
+}
+
+std::vector<uint8_t> read_build_id(file_descriptor const& fd)
+{
+    size_t size = static_cast<size_t>(fd.stat().st_size);
+    if (size < EI_NIDENT)
+        return {};
+
+    // only the headers and the notes are paged in
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read, map_flags::private_);
+    unsigned char const* data = static_cast<unsigned char const*>(mapping.data());
+
+    if (memcmp(data, ELFMAG, SELFMAG) != 0 || data[EI_DATA] != ELFDATA2LSB)
+        return {};
+
+    if (data[EI_CLASS] == ELFCLASS64)
+        return read_build_id<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr>(data, size);
+    if (data[EI_CLASS] == ELFCLASS32)
+        return read_build_id<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr>(data, size);
+
+    return {};
+}
+
+std::string build_id_to_hex(std::vector<uint8_t> const& id)
+{
+    static char const hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+    std::string result;
+    result.reserve(2 * id.size());
+    for (uint8_t byte : id)
+    {
+        result += hex[byte / 16];
+        result += hex[byte % 16];
+    }
+
+    return result;
+}
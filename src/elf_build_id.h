@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.h"
+
+// Reads the NT_GNU_BUILD_ID note of an ELF file straight from its program
+// (or, failing that, section) headers, without touching the debug info.
+// Returns an empty vector if the file is not a little-endian ELF or has
+// no build id.
+std::vector<uint8_t> read_build_id(file_descriptor const& fd);
+
+std::string build_id_to_hex(std::vector<uint8_t> const& id);
@@ -1,5 +1,7 @@
 #include "file_descriptor.h"
+#include "stats.h"
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <limits>
 #include <sstream>
@@ -8,6 +10,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/file.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <algorithm>
 #include <iostream>
@@ -61,12 +68,13 @@ namespace
         out << " (" << err << ", " << err_msg << ")";
     }
 
-    void throw_error [[noreturn]] (int err, char const* action)
-    {
-        std::stringstream ss;
-        print_error(ss, err, action);
-        throw std::runtime_error(ss.str());
-    }
+}
+
+void throw_error(int err, char const* action)
+{
+    std::stringstream ss;
+    print_error(ss, err, action);
+    throw std::runtime_error(ss.str());
 }
 
 file_flags operator|(file_flags a, file_flags b)
@@ -214,6 +222,9 @@ int file_descriptor::release()
 
 nonblock_result file_descriptor::read_nonblock(void *data, size_t size)
 {
+    stats::scoped_timer timer(stats::phase::read);
+    stats::add(stats::counter::syscalls);
+
     ssize_t bytes_read = ::read(file, data, size);
     if (bytes_read < 0)
     {
@@ -225,6 +236,8 @@ nonblock_result file_descriptor::read_nonblock(void *data, size_t size)
         throw_error(err, "read");
     }
 
+    stats::add(stats::counter::bytes_read, static_cast<uint64_t>(bytes_read));
+
     return nonblock_result(bytes_read);
 }
 
@@ -232,6 +245,9 @@ size_t file_descriptor::read_some(void* data, size_t size)
 {
     assert(!is_nonblock());
 
+    stats::scoped_timer timer(stats::phase::read);
+    stats::add(stats::counter::syscalls);
+
     ssize_t bytes_read = ::read(file, data, size);
     if (bytes_read < 0)
     {
@@ -239,6 +255,8 @@ size_t file_descriptor::read_some(void* data, size_t size)
         throw_error(errno, "read");
     }
 
+    stats::add(stats::counter::bytes_read, static_cast<uint64_t>(bytes_read));
+
     return static_cast<size_t>(bytes_read);
 }
 
@@ -253,8 +271,32 @@ void file_descriptor::read(void* data, size_t size)
     }
 }
 
+nonblock_result file_descriptor::write_nonblock(void const* data, size_t size)
+{
+    stats::scoped_timer timer(stats::phase::write);
+    stats::add(stats::counter::syscalls);
+
+    ssize_t bytes_written = ::write(file, data, size);
+    if (bytes_written < 0)
+    {
+        assert(bytes_written == -1);
+        int err = errno;
+        if (err == EAGAIN || err == EWOULDBLOCK)
+            return nonblock_result(-1);
+
+        throw_error(err, "write");
+    }
+
+    stats::add(stats::counter::bytes_written, static_cast<uint64_t>(bytes_written));
+
+    return nonblock_result(bytes_written);
+}
+
 size_t file_descriptor::write_some(void const* data, size_t size)
 {
+    stats::scoped_timer timer(stats::phase::write);
+    stats::add(stats::counter::syscalls);
+
     ssize_t bytes_written = ::write(file, data, size);
     if (bytes_written < 0)
     {
@@ -262,6 +304,8 @@ size_t file_descriptor::write_some(void const* data, size_t size)
         throw_error(errno, "write");
     }
 
+    stats::add(stats::counter::bytes_written, static_cast<uint64_t>(bytes_written));
+
     return static_cast<size_t>(bytes_written);
 }
 
@@ -295,6 +339,58 @@ int64_t file_descriptor::tell() const
     return const_cast<file_descriptor&>(*this).seek(0, seek_origin::current_position);
 }
 
+void file_descriptor::truncate(int64_t size)
+{
+    int r = ::ftruncate64(file, size);
+    if (r < 0)
+    {
+        assert(r == -1);
+        throw_error(errno, "ftruncate");
+    }
+}
+
+void file_descriptor::lock_exclusive()
+{
+    for (;;)
+    {
+        int r = ::flock(file, LOCK_EX);
+        if (r == 0)
+            return;
+
+        assert(r == -1);
+        int err = errno;
+        if (err != EINTR)
+            throw_error(err, "flock");
+    }
+}
+
+bool file_descriptor::try_lock_exclusive()
+{
+    for (;;)
+    {
+        int r = ::flock(file, LOCK_EX | LOCK_NB);
+        if (r == 0)
+            return true;
+
+        assert(r == -1);
+        int err = errno;
+        if (err == EWOULDBLOCK)
+            return false;
+        if (err != EINTR)
+            throw_error(err, "flock");
+    }
+}
+
+void file_descriptor::unlock()
+{
+    int r = ::flock(file, LOCK_UN);
+    if (r < 0)
+    {
+        assert(r == -1);
+        throw_error(errno, "flock");
+    }
+}
+
 void file_descriptor::set_close_on_exec(bool value)
 {
     int r1 = fcntl(file, F_GETFD);
@@ -351,8 +447,23 @@ bool file_descriptor::is_nonblock() const
     return r1 & O_NONBLOCK;
 }
 
+bool file_descriptor::is_direct() const
+{
+    int r1 = fcntl(file, F_GETFL);
+    if (r1 < 0)
+    {
+        assert(r1 == -1);
+        throw_error(errno, "fcntl(F_GETFL)");
+    }
+
+    return r1 & O_DIRECT;
+}
+
 struct stat64 file_descriptor::stat() const
 {
+    stats::scoped_timer timer(stats::phase::stat);
+    stats::add(stats::counter::syscalls);
+
     struct stat64 result;
 
     int r = ::fstat64(file, &result);
@@ -369,30 +480,75 @@ file_descriptor file_descriptor::attach(int fd) noexcept
     return result;
 }
 
-file_descriptor file_descriptor::open(file_location location, file_flags flags, file_mode mode)
+file_descriptor file_descriptor::try_open(file_location location, file_flags flags, std::error_code& ec, file_mode mode) noexcept
 {
+    stats::scoped_timer timer(stats::phase::open);
+    stats::add(stats::counter::syscalls);
+
     file_descriptor fd;
 
     fd.file = ::openat(location.basedir, location.filename, static_cast<int>(flags), static_cast<int>(mode));
 
     if (fd.file == INVALID_VALUE)
-        throw_error(errno, "open");
+    {
+        ec.assign(errno, std::system_category());
+        return fd;
+    }
+
+    ec.clear();
+    stats::add(stats::counter::files_opened);
+    return fd;
+}
+
+file_descriptor file_descriptor::open(file_location location, file_flags flags, file_mode mode)
+{
+    std::error_code ec;
+    file_descriptor fd = try_open(location, flags, ec, mode);
+    if (ec)
+        throw_error(ec.value(), "open");
 
     return fd;
 }
 
 file_descriptor file_descriptor::open_if_exists(file_location location, file_flags flags, file_mode mode)
 {
+    std::error_code ec;
+    file_descriptor fd = try_open(location, flags, ec, mode);
+    if (ec && ec.value() != ENOENT)
+        throw_error(ec.value(), "open");
+
+    return fd;
+}
+
+file_descriptor file_descriptor::open_direct_if_supported(file_location location, file_flags flags)
+{
+    std::error_code ec;
+    file_descriptor fd = try_open(location, flags | file_flags::direct, ec);
+    if (fd)
+        return fd;
+
+    // EINVAL: no O_DIRECT here; anything else fails again with a message
+    return open(location, flags);
+}
+
+file_descriptor file_descriptor::open_unnamed(file_location directory, file_flags flags, file_mode mode)
+{
+    stats::scoped_timer timer(stats::phase::open);
+    stats::add(stats::counter::syscalls);
+
     file_descriptor fd;
 
-    fd.file = ::openat(location.basedir, location.filename, static_cast<int>(flags), static_cast<int>(mode));
+    fd.file = ::openat(directory.basedir, directory.filename, static_cast<int>(flags | file_flags::temporary), static_cast<int>(mode));
 
     if (fd.file == INVALID_VALUE)
     {
         int err = errno;
-        if (err != ENOENT)
+        // EISDIR is returned by kernels that predate O_TMPFILE
+        if (err != EOPNOTSUPP && err != EISDIR)
             throw_error(err, "open");
     }
+    else
+        stats::add(stats::counter::files_opened);
 
     return fd;
 }
@@ -402,14 +558,14 @@ directory_stream::directory_stream()
 
 directory_stream::directory_stream(file_descriptor fd)
     : fd(std::move(fd))
-    , buf(new char[BUF_SIZE])
-    , current(buf.get())
-    , end(buf.get())
+    , buf(BUF_SIZE)
+    , current(buf.data())
+    , end(buf.data())
 {}
 
 directory_stream::directory_stream(directory_stream&& other) noexcept
-    : fd(std::move(fd))
-    , buf(std::move(buf))
+    : fd(std::move(other.fd))
+    , buf(std::move(other.buf))
     , current(other.current)
     , end(other.end)
 {
@@ -421,8 +577,8 @@ directory_stream& directory_stream::operator=(directory_stream&& other) noexcept
 {
     if (this != &other)
     {
-        fd = std::move(fd);
-        buf = std::move(buf);
+        fd = std::move(other.fd);
+        buf = std::move(other.buf);
         current = other.current;
         end = other.end;
 
@@ -438,20 +594,21 @@ directory_stream::~directory_stream()
 
 directory_stream::operator bool() const
 {
-    return buf != nullptr;
+    return buf.data() != nullptr;
 }
 
 void directory_stream::close()
 {
     fd.close();
-    buf.reset();
+    buf = pooled_buffer();
 }
 
 directory_stream::dirent const* directory_stream::next()
 {
     if (current == end)
     {
-        ssize_t r = syscall(SYS_getdents64, fd.get_fd(), buf.get(), BUF_SIZE);
+        stats::add(stats::counter::syscalls);
+        ssize_t r = syscall(SYS_getdents64, fd.get_fd(), buf.data(), BUF_SIZE);
         if (r < 0)
         {
             int err = errno;
@@ -463,8 +620,8 @@ directory_stream::dirent const* directory_stream::next()
         if (r == 0)
             return nullptr;
 
-        current = buf.get();
-        end = buf.get() + r;
+        current = buf.data();
+        end = buf.data() + r;
     }
 
     assert(current < end);
@@ -479,6 +636,14 @@ int directory_stream::get_fd() const
     return fd.get_fd();
 }
 
+file_descriptor directory_stream::release_fd()
+{
+    buf = pooled_buffer();
+    current = nullptr;
+    end = nullptr;
+    return std::move(fd);
+}
+
 sorted_directory_stream::sorted_directory_stream()
 {}
 
@@ -489,6 +654,7 @@ sorted_directory_stream::sorted_directory_stream(file_descriptor fd)
     for (;;)
     {
         std::unique_ptr<char[]> buf(new char[BUF_SIZE]);
+        stats::add(stats::counter::syscalls);
         ssize_t r = syscall(SYS_getdents64, this->fd.get_fd(), buf.get(), BUF_SIZE);
         if (r < 0)
         {
@@ -573,31 +739,37 @@ int sorted_directory_stream::get_fd() const
     return fd.get_fd();
 }
 
-void mkdir(file_location location, file_mode mode)
+bool try_mkdir(file_location location, std::error_code& ec, file_mode mode) noexcept
 {
     int r = ::mkdirat(location.basedir, location.filename, static_cast<mode_t>(mode));
     if (r < 0)
     {
-        int err = errno;
         assert(r == -1);
-        throw_error(err, "mkdirat");
+        ec.assign(errno, std::system_category());
+        return false;
     }
+
+    ec.clear();
+    return true;
+}
+
+void mkdir(file_location location, file_mode mode)
+{
+    std::error_code ec;
+    if (!try_mkdir(location, ec, mode))
+        throw_error(ec.value(), "mkdirat");
 }
 
 bool mkdir_if_not_exists(file_location location, file_mode mode)
 {
-    int r = ::mkdirat(location.basedir, location.filename, static_cast<mode_t>(mode));
-    if (r < 0)
-    {
-        int err = errno;
-        if (err == EEXIST)
-            return false;
+    std::error_code ec;
+    if (try_mkdir(location, ec, mode))
+        return true;
 
-        assert(r == -1);
-        throw_error(err, "mkdirat");
-    }
+    if (ec.value() != EEXIST)
+        throw_error(ec.value(), "mkdirat");
 
-    return true;
+    return false;
 }
 
 void chmod(file_location location, file_mode mode)
@@ -611,17 +783,47 @@ void chmod(file_location location, file_mode mode)
     }
 }
 
-struct stat64 stat(file_location location, stat_flags flags)
+bool try_stat(file_location location, stat_flags flags, struct stat64& result, std::error_code& ec) noexcept
 {
-    struct stat64 result;
+    stats::scoped_timer timer(stats::phase::stat);
+    stats::add(stats::counter::syscalls);
 
     int r = fstatat64(location.basedir, location.filename, &result, static_cast<int>(flags));
     if (r != 0)
-        throw_error(errno, "fstatat64");
+    {
+        ec.assign(errno, std::system_category());
+        return false;
+    }
+
+    ec.clear();
+    return true;
+}
+
+struct stat64 stat(file_location location, stat_flags flags)
+{
+    struct stat64 result;
+
+    std::error_code ec;
+    if (!try_stat(location, flags, result, ec))
+        throw_error(ec.value(), "fstatat64");
 
     return result;
 }
 
+bool file_exists(file_location location)
+{
+    struct stat64 st;
+
+    std::error_code ec;
+    if (try_stat(location, stat_flags::none, st, ec))
+        return true;
+
+    if (ec.value() != ENOENT)
+        throw_error(ec.value(), "fstatat64");
+
+    return false;
+}
+
 pipe_flags operator|(pipe_flags a, pipe_flags b)
 {
     return static_cast<pipe_flags>(static_cast<int>(a) | static_cast<int>(b));
@@ -701,6 +903,9 @@ void change_directory(std::string const& path)
 
 void unlink(file_location location, unlink_flags flags)
 {
+    stats::scoped_timer timer(stats::phase::link);
+    stats::add(stats::counter::syscalls);
+
     int r = unlinkat(location.basedir, location.filename, static_cast<int>(flags));
     if (r < 0)
     {
@@ -711,17 +916,280 @@ void unlink(file_location location, unlink_flags flags)
     assert(r == 0);
 }
 
-std::vector<char> read_whole_file(file_location location)
+bool unlink_if_exists(file_location location, unlink_flags flags)
+{
+    stats::scoped_timer timer(stats::phase::link);
+    stats::add(stats::counter::syscalls);
+
+    int r = unlinkat(location.basedir, location.filename, static_cast<int>(flags));
+    if (r < 0)
+    {
+        int err = errno;
+        if (err == ENOENT)
+            return false;
+
+        throw_error(err, "unlink");
+    }
+
+    return true;
+}
+
+void rename(file_location from, file_location to)
+{
+    stats::scoped_timer timer(stats::phase::link);
+    stats::add(stats::counter::syscalls);
+
+    int r = ::renameat(from.basedir, from.filename, to.basedir, to.filename);
+    if (r < 0)
+    {
+        assert(r == -1);
+        throw_error(errno, "renameat");
+    }
+}
+
+std::string read_symlink(file_location location)
+{
+    stats::add(stats::counter::syscalls);
+
+    std::string result(256, '\0');
+    for (;;)
+    {
+        ssize_t r = ::readlinkat(location.basedir, location.filename, &result[0], result.size());
+        if (r < 0)
+            throw_error(errno, "readlinkat");
+
+        // a full buffer may mean the target was truncated
+        if (static_cast<size_t>(r) < result.size())
+        {
+            result.resize(static_cast<size_t>(r));
+            return result;
+        }
+        result.resize(result.size() * 2);
+    }
+}
+
+bool try_link(file_location from, file_location to, std::error_code& ec, link_flags flags) noexcept
+{
+    stats::scoped_timer timer(stats::phase::link);
+    stats::add(stats::counter::syscalls);
+
+    int r = ::linkat(from.basedir, from.filename, to.basedir, to.filename, static_cast<int>(flags));
+    if (r < 0)
+    {
+        assert(r == -1);
+        ec.assign(errno, std::system_category());
+        return false;
+    }
+
+    ec.clear();
+    return true;
+}
+
+bool link_if_not_exists(file_location from, file_location to, link_flags flags)
+{
+    std::error_code ec;
+    if (try_link(from, to, ec, flags))
+        return true;
+
+    if (ec.value() != EEXIST)
+        throw_error(ec.value(), "linkat");
+
+    return false;
+}
+
+bool link_unnamed_if_not_exists(file_descriptor const& fd, file_location to)
+{
+    // linkat(fd, "", ..., AT_EMPTY_PATH) requires CAP_DAC_READ_SEARCH,
+    // going through /proc works for unprivileged users
+    char path[64];
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd.get_fd());
+    return link_if_not_exists(path, to, link_flags::symlink_follow);
+}
+
+file_descriptor accept_if_pending(file_descriptor const& listener)
+{
+    stats::add(stats::counter::syscalls);
+
+    for (;;)
+    {
+        int r = ::accept4(listener.get_fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (r >= 0)
+            return file_descriptor::attach(r);
+
+        int err = errno;
+        if (err == EINTR || err == ECONNABORTED)
+            continue;
+        if (err == EAGAIN || err == EWOULDBLOCK)
+            return file_descriptor();
+
+        throw_error(err, "accept4");
+    }
+}
+
+bool clone_file_if_supported(file_descriptor const& from, file_descriptor const& to)
+{
+    stats::scoped_timer timer(stats::phase::write);
+    stats::add(stats::counter::syscalls);
+
+    int r = ::ioctl(to.get_fd(), FICLONE, from.get_fd());
+    if (r < 0)
+    {
+        int err = errno;
+        // EXDEV: different filesystems, EINVAL/EOPNOTSUPP/ENOTTY: no reflinks
+        if (err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOTTY)
+            return false;
+
+        assert(r == -1);
+        throw_error(err, "ioctl(FICLONE)");
+    }
+
+    return true;
+}
+
+void copy_file_contents(file_descriptor const& from, file_descriptor const& to, uint64_t size)
+{
+    stats::scoped_timer timer(stats::phase::write);
+
+    bool use_sendfile = false;
+    while (size != 0)
+    {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, 1u << 30));
+
+        stats::add(stats::counter::syscalls);
+        ssize_t r = use_sendfile
+            ? ::sendfile(to.get_fd(), from.get_fd(), nullptr, chunk)
+            : ::copy_file_range(from.get_fd(), nullptr, to.get_fd(), nullptr, chunk, 0);
+        if (r < 0)
+        {
+            int err = errno;
+            if (err == EINTR)
+                continue;
+
+            // old kernels can't copy_file_range across filesystems
+            if (!use_sendfile && (err == EXDEV || err == ENOSYS || err == EINVAL || err == EOPNOTSUPP))
+            {
+                use_sendfile = true;
+                continue;
+            }
+
+            assert(r == -1);
+            throw_error(err, use_sendfile ? "sendfile" : "copy_file_range");
+        }
+
+        if (r == 0)
+            throw std::runtime_error("unexpected end of file while copying");
+
+        stats::add(stats::counter::bytes_written, static_cast<uint64_t>(r));
+        size -= static_cast<uint64_t>(r);
+    }
+}
+
+map_flags operator|(map_flags a, map_flags b)
+{
+    return static_cast<map_flags>(static_cast<int>(a) | static_cast<int>(b));
+}
+
+map_flags& operator|=(map_flags& a, map_flags b)
+{
+    a = a | b;
+    return a;
+}
+
+memory_mapping::memory_mapping()
+    : start(nullptr)
+    , length(0)
+{}
+
+memory_mapping::memory_mapping(memory_mapping&& other) noexcept
+    : start(other.start)
+    , length(other.length)
+{
+    other.start = nullptr;
+    other.length = 0;
+}
+
+memory_mapping& memory_mapping::operator=(memory_mapping&& rhs) noexcept
+{
+    if (this != &rhs)
+    {
+        unmap();
+        start = rhs.start;
+        length = rhs.length;
+        rhs.start = nullptr;
+        rhs.length = 0;
+    }
+
+    return *this;
+}
+
+memory_mapping::~memory_mapping()
+{
+    unmap();
+}
+
+memory_mapping::operator bool() const
+{
+    return start != nullptr;
+}
+
+void memory_mapping::unmap()
+{
+    if (start != nullptr)
+    {
+        int r = ::munmap(start, length);
+        if (r != 0)
+        {
+            print_error(std::cerr, errno, "munmap");
+            std::cerr << std::endl;
+            std::abort();
+        }
+        start = nullptr;
+        length = 0;
+    }
+}
+
+void* memory_mapping::data() const
+{
+    return start;
+}
+
+size_t memory_mapping::size() const
+{
+    return length;
+}
+
+memory_mapping memory_mapping::map(file_descriptor const& fd, size_t size, map_protection prot, map_flags flags, int64_t offset)
+{
+    void* p = ::mmap64(nullptr, size, static_cast<int>(prot), static_cast<int>(flags), fd.get_fd(), offset);
+    if (p == MAP_FAILED)
+        throw_error(errno, "mmap");
+
+    memory_mapping result;
+    result.start = p;
+    result.length = size;
+    return result;
+}
+
+std::vector<char> read_whole_file(file_descriptor& fd)
 {
     std::vector<char> buf;
 
-    file_descriptor fd = file_descriptor::open(location, file_flags::read_only | file_flags::close_on_exec);
     auto size = fd.stat().st_size;
-    if (size >= buf.max_size())
+    if (static_cast<uint64_t>(size) >= buf.max_size())
         throw std::runtime_error("file is too large");
 
     buf.resize(static_cast<size_t>(size));
-    size_t bytes_read = fd.read_some(buf.data(), buf.size());
+
+    // read() may return less than requested even for regular files
+    // (signals, network filesystems), so loop until the buffer is full
+    size_t bytes_read = 0;
+    while (bytes_read != buf.size())
+    {
+        size_t n = fd.read_some(buf.data() + bytes_read, buf.size() - bytes_read);
+        if (n == 0)
+            break;
+        bytes_read += n;
+    }
 
     // shrink vector if file was truncated after we stat'ed it and before we read it
     // these two lines are redundant in 99.9% of cases and are very cheap
@@ -731,27 +1199,19 @@ std::vector<char> read_whole_file(file_location location)
     return buf;
 }
 
-std::unique_ptr<std::vector<char> > read_whole_file_if_exists(file_location location)
+std::vector<char> read_whole_file(file_location location)
 {
-    std::vector<char> buf;
+    file_descriptor fd = file_descriptor::open(location, file_flags::read_only | file_flags::close_on_exec);
+    return read_whole_file(fd);
+}
 
+std::unique_ptr<std::vector<char> > read_whole_file_if_exists(file_location location)
+{
     file_descriptor fd = file_descriptor::open_if_exists(location, file_flags::read_only | file_flags::close_on_exec);
     if (!fd)
         return nullptr;
 
-    auto size = fd.stat().st_size;
-    if (size >= buf.max_size())
-        throw std::runtime_error("file is too large");
-
-    buf.resize(static_cast<size_t>(size));
-    size_t bytes_read = fd.read_some(buf.data(), buf.size());
-
-    // shrink vector if file was truncated after we stat'ed it and before we read it
-    // these two lines are redundant in 99.9% of cases and are very cheap
-    buf.resize(bytes_read);
-    buf.shrink_to_fit();
-
-    return std::unique_ptr<std::vector<char>>(new std::vector<char>(std::move(buf)));
+    return std::unique_ptr<std::vector<char>>(new std::vector<char>(read_whole_file(fd)));
 }
 
 void write_whole_file(file_location location, std::vector<char> const& data)
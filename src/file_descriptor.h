@@ -3,17 +3,25 @@
 #include <cstdint>
 #include <cstdlib>
 #include <string>
+#include <system_error>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <vector>
 #include <memory>
 
+#include "buffer_pool.h"
+
 struct file_descriptor;
 struct directory_stream;
 enum class unlink_flags : int;
+enum class link_flags : int;
+
+// throws runtime_error("<action> failed, error: <name> (<err>, <message>)")
+[[noreturn]] void throw_error(int err, char const* action);
 
 enum class file_flags : int
 {
@@ -25,6 +33,7 @@ enum class file_flags : int
     async         = O_ASYNC,
     close_on_exec = O_CLOEXEC,
     create        = O_CREAT,
+    direct        = O_DIRECT,
     directory     = O_DIRECTORY,
     dsync         = O_DSYNC,
     excl          = O_EXCL,
@@ -102,11 +111,14 @@ private:
     char const* filename;
 
     friend struct file_descriptor;
-    friend void mkdir(file_location location, file_mode mode);
-    friend bool mkdir_if_not_exists(file_location location, file_mode mode);
+    friend bool try_mkdir(file_location location, std::error_code& ec, file_mode mode) noexcept;
     friend void chmod(file_location location, file_mode mode);
-    friend struct stat64 stat(file_location location, stat_flags flags);
+    friend bool try_stat(file_location location, stat_flags flags, struct stat64& result, std::error_code& ec) noexcept;
     friend void unlink(file_location location, unlink_flags flags);
+    friend bool unlink_if_exists(file_location location, unlink_flags flags);
+    friend void rename(file_location from, file_location to);
+    friend std::string read_symlink(file_location location);
+    friend bool try_link(file_location from, file_location to, std::error_code& ec, link_flags flags) noexcept;
 };
 
 struct nonblock_result
@@ -142,16 +154,28 @@ struct file_descriptor
     size_t read_some(void* data, size_t size);
     void read(void* data, size_t size);
 
+    nonblock_result write_nonblock(void const* data, size_t size);
     size_t write_some(void const* data, size_t size);
     void write(void const* data, size_t size);
 
     int64_t seek(int64_t offset, seek_origin whence = seek_origin::file_start);
     int64_t tell() const;
 
+    void truncate(int64_t size);
+
+    // advisory whole-file lock (flock), shared by descriptors duplicated
+    // from this one but not by other opens of the same file
+    void lock_exclusive();
+    void unlock();
+
+    // returns false instead of waiting if another open holds the lock
+    bool try_lock_exclusive();
+
     void set_close_on_exec(bool value);
     void set_nonblock(bool value);
     
     bool is_nonblock() const;
+    bool is_direct() const;
 
     struct stat64 stat() const;
 
@@ -159,6 +183,19 @@ struct file_descriptor
     static file_descriptor open(file_location location, file_flags flags, file_mode mode = file_mode::file_default);
     static file_descriptor open_if_exists(file_location location, file_flags flags, file_mode mode = file_mode::file_default);
 
+    // returns an invalid descriptor and sets ec instead of throwing, for
+    // callers that expect failures on the hot path
+    static file_descriptor try_open(file_location location, file_flags flags, std::error_code& ec, file_mode mode = file_mode::file_default) noexcept;
+
+    // opens with O_DIRECT, bypassing the page cache, or without it on
+    // filesystems that don't support it (tmpfs, some FUSE). Reads then
+    // need page aligned buffers, offsets and sizes
+    static file_descriptor open_direct_if_supported(file_location location, file_flags flags);
+
+    // opens an unnamed file in the given directory (O_TMPFILE), returns an
+    // invalid descriptor if the filesystem doesn't support unnamed files
+    static file_descriptor open_unnamed(file_location directory, file_flags flags, file_mode mode = file_mode::file_default);
+
 private:
     int file;
     static constexpr int const INVALID_VALUE = -1;
@@ -188,11 +225,14 @@ struct directory_stream
     dirent const* next();
     int get_fd() const;
 
+    // stops iteration and hands out the directory descriptor
+    file_descriptor release_fd();
+
 private:
     static constexpr size_t BUF_SIZE = 32 * 1024;
 
     file_descriptor fd;
-    std::unique_ptr<char[]> buf;
+    pooled_buffer buf;
     void* current;
     void* end;
 
@@ -228,10 +268,22 @@ private:
 void mkdir(file_location, file_mode mode = file_mode::directory_default);
 bool mkdir_if_not_exists(file_location, file_mode mode = file_mode::directory_default);
 
+// sets ec instead of throwing, returns false on failure
+bool try_mkdir(file_location, std::error_code& ec, file_mode mode = file_mode::directory_default) noexcept;
+
 void chmod(file_location, file_mode mode = file_mode::directory_default);
 
 struct stat64 stat(file_location location, stat_flags flags);
 
+// sets ec instead of throwing, returns false on failure
+bool try_stat(file_location location, stat_flags flags, struct stat64& result, std::error_code& ec) noexcept;
+
+// one fstatat, no descriptor is opened
+bool file_exists(file_location location);
+
+// target of a symbolic link
+std::string read_symlink(file_location location);
+
 struct pipe_fds
 {
     file_descriptor read_end;
@@ -273,6 +325,79 @@ enum class unlink_flags : int
 
 void unlink(file_location location, unlink_flags flags = unlink_flags::none);
 
+// returns false if there was nothing to remove
+bool unlink_if_exists(file_location location, unlink_flags flags = unlink_flags::none);
+
+void rename(file_location from, file_location to);
+
+enum class link_flags : int
+{
+    none           = 0,
+
+    empty_path     = AT_EMPTY_PATH,
+    symlink_follow = AT_SYMLINK_FOLLOW,
+};
+
+// returns false if the target already exists
+bool link_if_not_exists(file_location from, file_location to, link_flags flags = link_flags::none);
+
+// sets ec instead of throwing, returns false on failure
+bool try_link(file_location from, file_location to, std::error_code& ec, link_flags flags = link_flags::none) noexcept;
+
+// gives a name to a file opened with file_descriptor::open_unnamed
+bool link_unnamed_if_not_exists(file_descriptor const& fd, file_location to);
+
+// accepts a connection on a non-blocking listening socket, returns an
+// invalid descriptor if none is pending; the result is non-blocking too
+file_descriptor accept_if_pending(file_descriptor const& listener);
+
+// shares the extents of from with to (FICLONE), returns false if the
+// filesystem can't do that for these files
+bool clone_file_if_supported(file_descriptor const& from, file_descriptor const& to);
+
+// copies size bytes from the current positions inside the kernel, with
+// copy_file_range or sendfile where the former is not available
+void copy_file_contents(file_descriptor const& from, file_descriptor const& to, uint64_t size);
+
+enum class map_protection : int
+{
+    none       = PROT_NONE,
+    read       = PROT_READ,
+    write      = PROT_WRITE,
+    read_write = PROT_READ | PROT_WRITE,
+};
+
+enum class map_flags : int
+{
+    shared_     = MAP_SHARED,
+    private_    = MAP_PRIVATE,
+    populate    = MAP_POPULATE,
+};
+
+map_flags operator|(map_flags a, map_flags b);
+map_flags& operator|=(map_flags& a, map_flags b);
+
+struct memory_mapping
+{
+    memory_mapping();
+    memory_mapping(memory_mapping&&) noexcept;
+    memory_mapping& operator=(memory_mapping&&) noexcept;
+    ~memory_mapping();
+
+    explicit operator bool() const;
+
+    void unmap();
+    void* data() const;
+    size_t size() const;
+
+    static memory_mapping map(file_descriptor const& fd, size_t size, map_protection prot, map_flags flags, int64_t offset = 0);
+
+private:
+    void* start;
+    size_t length;
+};
+
 std::vector<char> read_whole_file(file_location location);
+std::vector<char> read_whole_file(file_descriptor& fd);
 std::unique_ptr<std::vector<char>> read_whole_file_if_exists(file_location location);
 void write_whole_file(file_location location, std::vector<char> const& data);
@@ -0,0 +1,19 @@
+#include <cstddef>
+#include <stdexcept>
+
+#include "repository.h"
+
+void gc_command(size_t argc, char* argv[])
+{
+    (void)argv;
+
+    if (argc != 0)
+        throw std::runtime_error("gc takes no arguments");
+
+    repository repo(default_repository_root());
+    repo.rebuild_filter();
+    repo.rebuild_index();
+    repo.upload_missing_to_shared_tier();
+    repo.flush_shared_tier();
+    repo.enforce_capacity();
+}
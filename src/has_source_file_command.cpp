@@ -0,0 +1,25 @@
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <iostream>
+
+#include "md5.h"
+#include "repository.h"
+
+void has_source_file_command(size_t argc, char* argv[])
+{
+    if (argc == 0)
+        throw std::runtime_error("md5 value expected");
+
+    repository repo(default_repository_root());
+    for (size_t i = 0; i != argc; ++i)
+    {
+        md5 hash;
+        if (!md5_from_hex(argv[i], strlen(argv[i]), hash))
+            throw std::runtime_error(std::string("invalid md5 value: ") + argv[i]);
+
+        std::cout << hash << (repo.has_object(hash) ? " present" : " missing") << '\n';
+    }
+
+    repo.flush_shared_tier();
+}
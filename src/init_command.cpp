@@ -1,10 +1,49 @@
 #include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
 #include <string>
 
+#include "command_line.h"
 #include "repository.h"
 
+// init [--hash=md5|sha256] [--capacity=SIZE] [--low-water=PERCENT]
+//      [--shared=REPOSITORY [--shared-writes=through|back]] [path]
 void init_command(size_t argc, char* argv[])
 {
+    repository_config config;
+
+    for (; argc != 0 && **argv == '-'; --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "hash", value))
+            config.hash = parse_object_hash(value);
+        else if (match_option(*argv, "capacity", value))
+            config.capacity = parse_size("capacity", value);
+        else if (match_option(*argv, "low-water", value))
+        {
+            size_t percent = parse_count("low-water", value);
+            if (percent == 0 || percent > 100)
+                throw std::runtime_error("--low-water must be between 1 and 100");
+            config.low_water = static_cast<unsigned>(percent);
+        }
+        else if (match_option(*argv, "shared", value))
+            config.shared = value;
+        else if (match_option(*argv, "shared-writes", value))
+            config.shared_writes = parse_write_policy(value);
+        else
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+    }
+
+    // the shared tier is looked up from every working directory
+    if (!config.shared.empty())
+    {
+        std::unique_ptr<char, void (*)(void*)> path(realpath(config.shared.c_str(), nullptr), free);
+        if (!path)
+            throw std::runtime_error("shared repository does not exist: " + config.shared);
+        config.shared = path.get();
+    }
+
     std::string repository_root;
     if (argc != 0)
     {
@@ -15,5 +54,5 @@ void init_command(size_t argc, char* argv[])
     else
         repository_root = default_repository_root();
 
-    init_new_repository(repository_root);
+    init_new_repository(repository_root, config);
 }
@@ -0,0 +1,187 @@
+#include "input_files.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "bulk_reader.h"
+#include "command_line.h"
+#include "parallel.h"
+#include "tree_walker.h"
+
+namespace
+{
+    constexpr size_t DESCRIPTORS_PER_WORKER = 4;
+
+    std::vector<std::string> read_names0(file_descriptor& input)
+    {
+        std::vector<std::string> result;
+        std::string current;
+        char buf[64 * 1024];
+        for (;;)
+        {
+            size_t bytes_read = input.read_some(buf, sizeof buf);
+            if (bytes_read == 0)
+                break;
+
+            for (char const* p = buf, *end = buf + bytes_read; p != end;)
+            {
+                char const* zero = std::find(p, end, '\0');
+                current.append(p, zero);
+                if (zero == end)
+                    break;
+
+                if (!current.empty())
+                    result.push_back(std::move(current));
+                current.clear();
+                p = zero + 1;
+            }
+        }
+
+        if (!current.empty())
+            result.push_back(std::move(current));
+
+        return result;
+    }
+
+    std::vector<std::string> read_names0(char const* filename)
+    {
+        if (strcmp(filename, "-") != 0)
+        {
+            file_descriptor fd = file_descriptor::open(filename, file_flags::read_only | file_flags::close_on_exec);
+            return read_names0(fd);
+        }
+
+        // stdin is not ours to close
+        file_descriptor fd = file_descriptor::attach(STDIN_FILENO);
+        try
+        {
+            std::vector<std::string> result = read_names0(fd);
+            fd.release();
+            return result;
+        }
+        catch (...)
+        {
+            fd.release();
+            throw;
+        }
+    }
+}
+
+input_files::input_files(size_t argc, char* argv[])
+    : recursive(false)
+    , jobs(std::max(std::thread::hardware_concurrency(), 1u))
+    , readahead_window(bulk_reader::DEFAULT_READAHEAD_WINDOW)
+    , direct(false)
+{
+    char const* files0_from = nullptr;
+
+    for (; argc != 0; --argc, ++argv)
+    {
+        char const* value;
+        if (match_flag(*argv, "recursive"))
+            recursive = true;
+        else if (match_option(*argv, "files0-from", value))
+            files0_from = value;
+        else if (match_option(*argv, "jobs", value))
+            jobs = std::max(parse_count("jobs", value), size_t(1));
+        else if (match_option(*argv, "readahead", value))
+            readahead_window = parse_count("readahead", value);
+        else if (match_flag(*argv, "direct"))
+            direct = true;
+        else if (match_flag(*argv, ""))
+        {
+            --argc;
+            ++argv;
+            break;
+        }
+        else if (**argv == '-' && (*argv)[1] == '-')
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+        else
+            break;
+    }
+
+    if (files0_from)
+    {
+        if (argc != 0)
+            throw std::runtime_error("file names can not be combined with --files0-from");
+
+        names = read_names0(files0_from);
+    }
+    else
+        names.assign(argv, argv + argc);
+
+    if (names.empty())
+        throw std::runtime_error("filename expected");
+}
+
+bool input_files::is_recursive() const
+{
+    return recursive;
+}
+
+size_t input_files::size() const
+{
+    return names.size();
+}
+
+char const* input_files::name(size_t index) const
+{
+    return names[index].c_str();
+}
+
+void input_files::for_each(callback const& fn) const
+{
+    if (recursive)
+        for_each_recursive(fn);
+    else
+        for_each_listed(fn);
+}
+
+void input_files::for_each_listed(callback const& fn) const
+{
+    std::vector<char const*> filenames;
+    filenames.reserve(names.size());
+    for (std::string const& name : names)
+        filenames.push_back(name.c_str());
+
+    // each worker holds a file of the previous batch and whatever the
+    // callback opens (an object being written, say)
+    size_t workers = std::min(jobs, names.size());
+    size_t reserved = bulk_reader::DEFAULT_RESERVED_DESCRIPTORS + workers * DESCRIPTORS_PER_WORKER;
+    bulk_reader reader(std::move(filenames), readahead_window, bulk_reader::DEFAULT_BATCH_SIZE, direct, reserved);
+    std::mutex reader_mutex;
+
+    run_parallel(workers, [&](std::atomic<bool> const& stop)
+    {
+        while (!stop)
+        {
+            bulk_reader::entry file;
+            {
+                std::lock_guard<std::mutex> lock(reader_mutex);
+                if (!reader.next(file))
+                    return;
+            }
+
+            fn(file.index, file.filename, file.fd);
+        }
+    });
+}
+
+void input_files::for_each_recursive(callback const& fn) const
+{
+    tree_walker walker(jobs);
+    walker.walk(names, [&](int dir_fd, char const* name, std::string const& path)
+    {
+        // entries found by the walk are never followed if they are links,
+        // roots given by the user are
+        file_flags flags = file_flags::read_only | file_flags::close_on_exec;
+        if (dir_fd != AT_FDCWD)
+            flags |= file_flags::nofollow;
+
+        file_descriptor fd = direct ? file_descriptor::open_direct_if_supported({dir_fd, name}, flags) : file_descriptor::open({dir_fd, name}, flags);
+        fn(NO_INDEX, path.c_str(), fd);
+    });
+}
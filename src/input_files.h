@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.h"
+
+// Input handling shared by the commands that read source files:
+//
+//   --recursive         arguments are directories, ingest every regular file under them
+//   --files0-from=F     read NUL-separated file names from F ("-" for stdin)
+//   --jobs=N            number of worker threads (default: number of CPUs)
+//   --readahead=N       number of files prefetched ahead of the current one
+//   --direct            read with O_DIRECT, for cold bulk ingest that shouldn't
+//                       fill the page cache; nothing is prefetched then
+//
+// Explicit file lists are read in disk order through bulk_reader, directory
+// trees are walked in parallel with tree_walker. Either way files are
+// processed by several threads, so the callback must be thread-safe.
+struct input_files
+{
+    static constexpr size_t NO_INDEX = SIZE_MAX;
+
+    // consumes the options and the file names from argv
+    input_files(size_t argc, char* argv[]);
+
+    bool is_recursive() const;
+
+    // explicit inputs: file names, or the roots in recursive mode
+    size_t size() const;
+    char const* name(size_t index) const;
+
+    // index is the position in the explicit inputs, NO_INDEX for files
+    // found while walking directories
+    using callback = std::function<void(size_t index, char const* path, file_descriptor& fd)>;
+    void for_each(callback const& fn) const;
+
+private:
+    void for_each_listed(callback const& fn) const;
+    void for_each_recursive(callback const& fn) const;
+
+private:
+    bool recursive;
+    size_t jobs;
+    size_t readahead_window;
+    bool direct;
+    std::vector<std::string> names;
+};
@@ -0,0 +1,335 @@
+#include "io_context.h"
+#include <cerrno>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "parallel.h"
+
+namespace
+{
+    constexpr size_t MAX_EVENTS = 64;
+}
+
+// Owns itself once started: runs the task, reports how it ended and
+// destroys its frame on completion.
+struct io_context::detached
+{
+    struct promise_type
+    {
+        detached get_return_object() noexcept
+        {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {}
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+io_context::detached io_context::run_detached(io_context& ctx, task<void> t)
+{
+    std::exception_ptr error;
+    try
+    {
+        co_await t;
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+
+    ctx.task_finished(error);
+}
+
+io_context::io_context()
+    : sleeping(0)
+    , outstanding(0)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        throw_error(errno, "epoll_create1");
+    epoll = file_descriptor::attach(epfd);
+
+    int efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (efd < 0)
+        throw_error(errno, "eventfd");
+    wakeup = file_descriptor::attach(efd);
+
+    // level-triggered: stays readable until drained, so every sleeping
+    // thread notices it
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll.get_fd(), EPOLL_CTL_ADD, wakeup.get_fd(), &ev) < 0)
+        throw_error(errno, "epoll_ctl");
+}
+
+io_context::~io_context()
+{
+    // tasks that never ran are destroyed together with their frames
+    for (std::coroutine_handle<> h : ready)
+        h.destroy();
+}
+
+void io_context::spawn(task<void> t)
+{
+    ++outstanding;
+    post(run_detached(*this, std::move(t)).handle);
+}
+
+void io_context::run(size_t thread_count)
+{
+    run_parallel(thread_count, [this](std::atomic<bool> const&)
+    {
+        worker();
+    });
+
+    std::exception_ptr e;
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        e = std::exchange(error, nullptr);
+    }
+    if (e)
+        std::rethrow_exception(e);
+}
+
+io_context::schedule_awaiter io_context::schedule()
+{
+    return {*this};
+}
+
+io_context::fd_awaiter io_context::readable(int fd)
+{
+    return {*this, fd, EPOLLIN, nullptr};
+}
+
+io_context::fd_awaiter io_context::writable(int fd)
+{
+    return {*this, fd, EPOLLOUT, nullptr};
+}
+
+void io_context::schedule_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    ctx.post(h);
+}
+
+void io_context::fd_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+    handle = h;
+
+    // one-shot: the descriptor is disarmed once the event is delivered,
+    // so exactly one thread resumes the coroutine
+    epoll_event ev{};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = this;
+
+    // the event can fire and resume the coroutine on another thread as
+    // soon as epoll_ctl succeeds, this must not be touched after it
+    int epfd = ctx.epoll.get_fd();
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+        return;
+    if (errno != ENOENT)
+        throw_error(errno, "epoll_ctl");
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw_error(errno, "epoll_ctl");
+}
+
+void io_context::post(std::coroutine_handle<> h)
+{
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex);
+        ready.push_back(h);
+    }
+
+    if (sleeping.load() != 0)
+        wake();
+}
+
+std::coroutine_handle<> io_context::pop()
+{
+    std::lock_guard<std::mutex> lock(ready_mutex);
+    if (ready.empty())
+        return nullptr;
+
+    std::coroutine_handle<> h = ready.front();
+    ready.pop_front();
+    return h;
+}
+
+void io_context::wake()
+{
+    uint64_t one = 1;
+    // EAGAIN means the counter is saturated, threads are woken anyway
+    (void)::write(wakeup.get_fd(), &one, sizeof one);
+}
+
+void io_context::worker()
+{
+    epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        if (std::coroutine_handle<> h = pop())
+        {
+            h.resume();
+            continue;
+        }
+
+        if (outstanding.load() == 0)
+            return;
+
+        // re-check after announcing ourselves, post() either sees the
+        // counter or we see its handle
+        ++sleeping;
+        if (std::coroutine_handle<> h = pop())
+        {
+            --sleeping;
+            h.resume();
+            continue;
+        }
+        if (outstanding.load() == 0)
+        {
+            --sleeping;
+            return;
+        }
+
+        int n = epoll_wait(epoll.get_fd(), events, MAX_EVENTS, -1);
+        --sleeping;
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw_error(errno, "epoll_wait");
+        }
+
+        bool posted = false;
+        for (int i = 0; i != n; ++i)
+        {
+            if (events[i].data.ptr == nullptr)
+            {
+                // leave the wakeup signalled on shutdown, so that it
+                // reaches every thread
+                if (outstanding.load() != 0)
+                {
+                    uint64_t value;
+                    (void)::read(wakeup.get_fd(), &value, sizeof value);
+                }
+                continue;
+            }
+
+            fd_awaiter* awaiter = static_cast<fd_awaiter*>(events[i].data.ptr);
+            std::lock_guard<std::mutex> lock(ready_mutex);
+            ready.push_back(awaiter->handle);
+            posted = true;
+        }
+
+        // this thread takes the first one, others can help with the rest
+        if (posted && n > 1 && sleeping.load() != 0)
+            wake();
+    }
+}
+
+void io_context::task_finished(std::exception_ptr e)
+{
+    if (e)
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+            error = e;
+    }
+
+    if (--outstanding == 0)
+        wake();
+}
+
+task<size_t> async_read_some(io_context& ctx, file_descriptor& fd, void* data, size_t size)
+{
+    for (;;)
+    {
+        nonblock_result r = fd.read_nonblock(data, size);
+        if (!r.is_wouldblock())
+            co_return r.bytes();
+
+        co_await ctx.readable(fd.get_fd());
+    }
+}
+
+task<void> async_read(io_context& ctx, file_descriptor& fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size != 0)
+    {
+        size_t bytes_read = co_await async_read_some(ctx, fd, p, size);
+        if (bytes_read == 0)
+            throw std::runtime_error("unexpected end of stream");
+
+        p += bytes_read;
+        size -= bytes_read;
+    }
+}
+
+task<size_t> async_write_some(io_context& ctx, file_descriptor& fd, void const* data, size_t size)
+{
+    for (;;)
+    {
+        nonblock_result r = fd.write_nonblock(data, size);
+        if (!r.is_wouldblock())
+            co_return r.bytes();
+
+        co_await ctx.writable(fd.get_fd());
+    }
+}
+
+task<void> async_write(io_context& ctx, file_descriptor& fd, void const* data, size_t size)
+{
+    char const* p = static_cast<char const*>(data);
+    while (size != 0)
+    {
+        size_t bytes_written = co_await async_write_some(ctx, fd, p, size);
+        p += bytes_written;
+        size -= bytes_written;
+    }
+}
+
+task<file_descriptor> async_accept(io_context& ctx, file_descriptor& listener)
+{
+    for (;;)
+    {
+        file_descriptor fd = accept_if_pending(listener);
+        if (fd)
+            co_return fd;
+
+        co_await ctx.readable(listener.get_fd());
+    }
+}
+
+task<file_descriptor> async_open(io_context& ctx, std::string path, file_flags flags, file_mode mode)
+{
+    co_await ctx.schedule();
+    co_return file_descriptor::open(path, flags, mode);
+}
+
+task<file_descriptor> async_open(io_context& ctx, int basedir, std::string path, file_flags flags, file_mode mode)
+{
+    co_await ctx.schedule();
+    co_return file_descriptor::open({basedir, path}, flags, mode);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+
+#include "file_descriptor.h"
+#include "task.h"
+
+// Executor and epoll reactor for coroutines.
+//
+// spawn() starts tasks, run() executes them on a few threads until all of
+// them finish. A task suspended on a descriptor (readable(), writable(),
+// the async_* functions below) doesn't occupy a thread, so a handful of
+// threads can drive thousands of concurrent operations.
+//
+// Only one coroutine can wait on a given descriptor at a time.
+struct io_context
+{
+    io_context();
+    ~io_context();
+
+    io_context(io_context const&) = delete;
+    io_context& operator=(io_context const&) = delete;
+
+    // can be called from any thread, also from inside running tasks
+    void spawn(task<void> t);
+
+    // runs on thread_count threads (including the calling one) until all
+    // spawned tasks finish, then rethrows the first exception one of them
+    // exited with
+    void run(size_t thread_count = 1);
+
+    struct schedule_awaiter
+    {
+        io_context& ctx;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h);
+
+        void await_resume() const noexcept
+        {}
+    };
+
+    struct fd_awaiter
+    {
+        io_context& ctx;
+        int fd;
+        uint32_t events;
+        std::coroutine_handle<> handle;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h);
+
+        void await_resume() const noexcept
+        {}
+    };
+
+    // continues on one of the executor threads, used to move blocking
+    // work (e.g. regular file I/O, which epoll can't wait for) off the
+    // current one
+    schedule_awaiter schedule();
+
+    fd_awaiter readable(int fd);
+    fd_awaiter writable(int fd);
+
+private:
+    void post(std::coroutine_handle<> h);
+    std::coroutine_handle<> pop();
+    void wake();
+    void worker();
+    void task_finished(std::exception_ptr error);
+
+    struct detached;
+    static detached run_detached(io_context& ctx, task<void> t);
+
+private:
+    file_descriptor epoll;
+    file_descriptor wakeup;
+
+    std::mutex ready_mutex;
+    std::deque<std::coroutine_handle<>> ready;
+
+    // threads blocked in epoll_wait, post() only signals wakeup if any
+    std::atomic<size_t> sleeping;
+    std::atomic<size_t> outstanding;
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+};
+
+// descriptors passed to these must be in non-blocking mode
+
+task<size_t> async_read_some(io_context& ctx, file_descriptor& fd, void* data, size_t size);
+
+// throws if the stream ends before size bytes are read
+task<void> async_read(io_context& ctx, file_descriptor& fd, void* data, size_t size);
+
+task<size_t> async_write_some(io_context& ctx, file_descriptor& fd, void const* data, size_t size);
+task<void> async_write(io_context& ctx, file_descriptor& fd, void const* data, size_t size);
+
+task<file_descriptor> async_accept(io_context& ctx, file_descriptor& listener);
+
+// open can block on slow filesystems, it runs on an executor thread.
+// The task owns its copy of the path, basedir must outlive it.
+task<file_descriptor> async_open(io_context& ctx, std::string path, file_flags flags, file_mode mode = file_mode::file_default);
+task<file_descriptor> async_open(io_context& ctx, int basedir, std::string path, file_flags flags, file_mode mode = file_mode::file_default);
@@ -0,0 +1,420 @@
+#include "line_index.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    char const INDEX_MAGIC[8] = {'S', 'S', 'L', 'I', 'N', 'E', 'S', '1'};
+
+    constexpr size_t BLOCK_SIZE = 64;
+
+    // block: first file, first line, row count, then the rest of the rows
+    // as varint deltas (address, zigzag file, zigzag line). The address of
+    // the first row is the block key.
+    constexpr size_t BLOCK_HEADER_SIZE = 9;
+    constexpr size_t MAX_ROWS_PER_BLOCK = 255;
+    constexpr size_t MAX_ROW_SIZE = 20;
+
+    // marks the end of a sequence: addresses from there on up to the next
+    // row are not covered by any line program
+    constexpr uint32_t NO_FILE = UINT32_MAX;
+
+    constexpr size_t HEADER_SIZE = 64;
+    constexpr size_t FILE_ENTRY_SIZE = 24;
+
+    struct row
+    {
+        uint64_t address;
+        uint32_t file;
+        uint32_t line;
+    };
+
+    size_t round_up(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // header, block keys (padded to a cache line), blocks, file entries,
+    // paths
+    struct layout
+    {
+        size_t keys_offset;
+        size_t blocks_offset;
+        size_t files_offset;
+        size_t paths_offset;
+        size_t total_size;
+    };
+
+    layout compute_layout(uint64_t block_count, uint64_t file_count, uint64_t paths_size)
+    {
+        layout result;
+        result.keys_offset = HEADER_SIZE;
+        result.blocks_offset = result.keys_offset + round_up(block_count * sizeof(uint64_t), BLOCK_SIZE);
+        result.files_offset = result.blocks_offset + block_count * BLOCK_SIZE;
+        result.paths_offset = result.files_offset + file_count * FILE_ENTRY_SIZE;
+        result.total_size = result.paths_offset + paths_size;
+        return result;
+    }
+
+    uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    size_t write_varint(unsigned char* out, uint64_t value)
+    {
+        size_t size = 0;
+        while (value >= 0x80)
+        {
+            out[size++] = static_cast<unsigned char>(value | 0x80);
+            value >>= 7;
+        }
+        out[size++] = static_cast<unsigned char>(value);
+        return size;
+    }
+
+    // stops at end, a damaged block decodes to garbage but not out of
+    // bounds
+    uint64_t read_varint(unsigned char const*& p, unsigned char const* end)
+    {
+        uint64_t result = 0;
+        for (unsigned shift = 0; p != end && shift < 64; shift += 7)
+        {
+            unsigned char byte = *p++;
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return result;
+    }
+
+    size_t encode_delta(unsigned char* out, row const& prev, row const& current)
+    {
+        size_t size = write_varint(out, current.address - prev.address);
+        size += write_varint(out + size, zigzag(static_cast<int64_t>(current.file) - static_cast<int64_t>(prev.file)));
+        size += write_varint(out + size, zigzag(static_cast<int64_t>(current.line) - static_cast<int64_t>(prev.line)));
+        return size;
+    }
+
+    // Turns the line programs into one sorted list of ranges. Sequences
+    // starting at address 0 belong to code the linker discarded, sequences
+    // overlapping an earlier one are dropped, repeated addresses keep the
+    // last row and rows not changing the location are merged into the
+    // range before them.
+    std::vector<row> flatten(std::vector<dwarf::line_row> const& rows)
+    {
+        struct sequence
+        {
+            size_t first;
+            size_t last;
+        };
+
+        std::vector<sequence> sequences;
+        for (size_t i = 0, first = 0; i != rows.size(); ++i)
+        {
+            if (!rows[i].end_sequence)
+                continue;
+            if (i != first && rows[first].address != 0 && rows[first].address < rows[i].address)
+                sequences.push_back({first, i});
+            first = i + 1;
+        }
+
+        std::stable_sort(sequences.begin(), sequences.end(), [&](sequence const& a, sequence const& b)
+        {
+            return rows[a.first].address < rows[b.first].address;
+        });
+
+        std::vector<row> result;
+        for (sequence const& seq : sequences)
+        {
+            if (!result.empty())
+            {
+                if (result.back().address > rows[seq.first].address)
+                    continue;
+                if (result.back().address == rows[seq.first].address)
+                    result.pop_back();
+            }
+
+            for (size_t i = seq.first; i != seq.last; ++i)
+            {
+                row current = {rows[i].address, rows[i].file, rows[i].line};
+                if (!result.empty() && result.back().address == current.address)
+                    result.back() = current;
+                else if (result.empty() || result.back().file != current.file || result.back().line != current.line)
+                    result.push_back(current);
+            }
+            result.push_back({rows[seq.last].address, NO_FILE, 0});
+        }
+
+        return result;
+    }
+}
+
+struct line_index::header
+{
+    char magic[8];
+    uint64_t row_count;
+    uint64_t block_count;
+    uint64_t file_count;
+    uint64_t paths_size;
+    uint64_t reserved[3];
+};
+
+struct line_index::file_entry
+{
+    uint32_t path_offset;
+    uint32_t path_size;
+    uint8_t hash[16];
+};
+
+line_index::line_index()
+    : data(nullptr)
+{}
+
+line_index::line_index(line_index&& other) noexcept
+    : mapping(std::move(other.mapping))
+    , owned(std::move(other.owned))
+    , data(other.data)
+{
+    other.data = nullptr;
+}
+
+line_index& line_index::operator=(line_index&& rhs) noexcept
+{
+    mapping = std::move(rhs.mapping);
+    owned = std::move(rhs.owned);
+    data = rhs.data;
+    rhs.data = nullptr;
+    return *this;
+}
+
+line_index::~line_index()
+{}
+
+line_index::operator bool() const
+{
+    return data != nullptr;
+}
+
+line_index::header const* line_index::get_header() const
+{
+    return reinterpret_cast<header const*>(data);
+}
+
+uint64_t const* line_index::keys() const
+{
+    return reinterpret_cast<uint64_t const*>(data + HEADER_SIZE);
+}
+
+unsigned char const* line_index::blocks() const
+{
+    header const* hdr = get_header();
+    return reinterpret_cast<unsigned char const*>(data + compute_layout(hdr->block_count, hdr->file_count, hdr->paths_size).blocks_offset);
+}
+
+line_index::file_entry const* line_index::files() const
+{
+    header const* hdr = get_header();
+    return reinterpret_cast<file_entry const*>(data + compute_layout(hdr->block_count, hdr->file_count, hdr->paths_size).files_offset);
+}
+
+char const* line_index::paths() const
+{
+    header const* hdr = get_header();
+    return data + compute_layout(hdr->block_count, hdr->file_count, hdr->paths_size).paths_offset;
+}
+
+size_t line_index::row_count() const
+{
+    return data ? get_header()->row_count : 0;
+}
+
+char const* line_index::serialized_data() const
+{
+    return data;
+}
+
+size_t line_index::serialized_size() const
+{
+    if (!data)
+        return 0;
+
+    header const* hdr = get_header();
+    return compute_layout(hdr->block_count, hdr->file_count, hdr->paths_size).total_size;
+}
+
+bool line_index::lookup(uint64_t address, location& result) const
+{
+    if (!data)
+        return false;
+
+    header const* hdr = get_header();
+    uint64_t const* first = keys();
+    if (hdr->block_count == 0 || address < first[0])
+        return false;
+
+    // the number of iterations depends only on the block count and the
+    // comparison compiles to a conditional move, so mispredictions don't
+    // grow with the size of the table
+    uint64_t const* base = first;
+    for (size_t n = hdr->block_count; n > 1;)
+    {
+        size_t half = n / 2;
+        base = base[half] <= address ? base + half : base;
+        n -= half;
+    }
+
+    unsigned char const* block = blocks() + (base - first) * BLOCK_SIZE;
+    unsigned char const* end = block + BLOCK_SIZE;
+
+    row current;
+    current.address = *base;
+    memcpy(&current.file, block, sizeof current.file);
+    memcpy(&current.line, block + 4, sizeof current.line);
+    size_t count = block[8];
+
+    unsigned char const* p = block + BLOCK_HEADER_SIZE;
+    for (size_t i = 1; i < count; ++i)
+    {
+        uint64_t address_delta = read_varint(p, end);
+        if (current.address + address_delta > address)
+            break;
+
+        current.address += address_delta;
+        current.file = static_cast<uint32_t>(current.file + unzigzag(read_varint(p, end)));
+        current.line = static_cast<uint32_t>(current.line + unzigzag(read_varint(p, end)));
+    }
+
+    if (current.file >= hdr->file_count)
+        return false;
+
+    file_entry const& file = files()[current.file];
+    memcpy(result.hash.data, file.hash, sizeof result.hash.data);
+    result.path = std::string_view(paths() + file.path_offset, file.path_size);
+    result.line = current.line;
+    return true;
+}
+
+line_index line_index::build(dwarf::line_table const& table)
+{
+    static_assert(sizeof(header) == HEADER_SIZE, "header size is part of the format");
+    static_assert(sizeof(file_entry) == FILE_ENTRY_SIZE, "entry size is part of the format");
+
+    std::vector<row> rows = flatten(table.rows);
+
+    std::vector<uint64_t> block_keys;
+    std::vector<unsigned char> block_data;
+    for (size_t i = 0; i != rows.size();)
+    {
+        unsigned char block[BLOCK_SIZE] = {};
+        memcpy(block, &rows[i].file, sizeof rows[i].file);
+        memcpy(block + 4, &rows[i].line, sizeof rows[i].line);
+        block_keys.push_back(rows[i].address);
+
+        size_t pos = BLOCK_HEADER_SIZE;
+        size_t count = 1;
+        for (++i; i != rows.size() && count != MAX_ROWS_PER_BLOCK; ++i, ++count)
+        {
+            unsigned char encoded[MAX_ROW_SIZE * 2];
+            size_t size = encode_delta(encoded, rows[i - 1], rows[i]);
+            if (pos + size > BLOCK_SIZE)
+                break;
+            memcpy(block + pos, encoded, size);
+            pos += size;
+        }
+        block[8] = static_cast<unsigned char>(count);
+
+        block_data.insert(block_data.end(), block, block + BLOCK_SIZE);
+    }
+
+    size_t paths_size = 0;
+    for (auto const& file : table.files)
+        paths_size += file.first.size();
+    if (table.files.size() >= NO_FILE || paths_size > UINT32_MAX)
+        throw std::runtime_error("too many source files");
+
+    layout l = compute_layout(block_keys.size(), table.files.size(), paths_size);
+
+    line_index result;
+    result.owned.resize(round_up(l.total_size, sizeof(cache_line)) / sizeof(cache_line));
+    char* out = reinterpret_cast<char*>(result.owned.data());
+
+    header* hdr = reinterpret_cast<header*>(out);
+    memcpy(hdr->magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+    hdr->row_count = rows.size();
+    hdr->block_count = block_keys.size();
+    hdr->file_count = table.files.size();
+    hdr->paths_size = paths_size;
+
+    if (!block_keys.empty())
+    {
+        memcpy(out + l.keys_offset, block_keys.data(), block_keys.size() * sizeof(uint64_t));
+        memcpy(out + l.blocks_offset, block_data.data(), block_data.size());
+    }
+
+    file_entry* entries = reinterpret_cast<file_entry*>(out + l.files_offset);
+    uint32_t offset = 0;
+    for (size_t i = 0; i != table.files.size(); ++i)
+    {
+        std::string_view path = table.files[i].first;
+        entries[i].path_offset = offset;
+        entries[i].path_size = static_cast<uint32_t>(path.size());
+        memcpy(entries[i].hash, table.files[i].second.data, sizeof entries[i].hash);
+        memcpy(out + l.paths_offset + offset, path.data(), path.size());
+        offset += entries[i].path_size;
+    }
+
+    result.data = out;
+    return result;
+}
+
+bool line_index::is_valid(char const* data, size_t size)
+{
+    if (size < sizeof(header))
+        return false;
+
+    header const* hdr = reinterpret_cast<header const*>(data);
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof INDEX_MAGIC) != 0)
+        return false;
+    if (hdr->block_count > size / BLOCK_SIZE || hdr->file_count > size / FILE_ENTRY_SIZE || hdr->paths_size > size)
+        return false;
+
+    layout l = compute_layout(hdr->block_count, hdr->file_count, hdr->paths_size);
+    if (size != l.total_size)
+        return false;
+
+    uint64_t const* block_keys = reinterpret_cast<uint64_t const*>(data + l.keys_offset);
+    for (size_t i = 1; i < hdr->block_count; ++i)
+        if (block_keys[i - 1] >= block_keys[i])
+            return false;
+
+    file_entry const* entries = reinterpret_cast<file_entry const*>(data + l.files_offset);
+    for (size_t i = 0; i != hdr->file_count; ++i)
+        if (entries[i].path_offset > hdr->paths_size || entries[i].path_size > hdr->paths_size - entries[i].path_offset)
+            return false;
+
+    return true;
+}
+
+line_index line_index::map(file_descriptor const& fd)
+{
+    line_index result;
+
+    size_t size = static_cast<size_t>(fd.stat().st_size);
+    if (size < sizeof(header))
+        return result;
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read, map_flags::private_);
+    if (!is_valid(static_cast<char const*>(mapping.data()), size))
+        return result;
+
+    result.mapping = std::move(mapping);
+    result.data = static_cast<char const*>(result.mapping.data());
+    return result;
+}
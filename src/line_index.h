@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "dwarf_md5.h"
+#include "file_descriptor.h"
+#include "md5.h"
+
+// Sorted address ranges of a binary's line programs, each mapping to a
+// (source file, line) pair. Rows are delta-encoded into 64-byte blocks;
+// a separate array of the first address of every block is searched
+// first, so a lookup touches a few lines of the key array and exactly
+// one block.
+struct line_index
+{
+    struct location
+    {
+        md5 hash;
+        std::string_view path;
+        uint32_t line;
+    };
+
+    line_index();
+    line_index(line_index&&) noexcept;
+    line_index& operator=(line_index&&) noexcept;
+    ~line_index();
+
+    static line_index build(dwarf::line_table const& table);
+
+    // returns an empty index (operator bool is false) if the file is not
+    // a valid index
+    static line_index map(file_descriptor const& fd);
+
+    // false if no line program covers the address
+    bool lookup(uint64_t address, location& result) const;
+
+    size_t row_count() const;
+
+    char const* serialized_data() const;
+    size_t serialized_size() const;
+
+    explicit operator bool() const;
+
+private:
+    struct header;
+    struct file_entry;
+
+    struct alignas(64) cache_line
+    {
+        unsigned char bytes[64];
+    };
+
+    static bool is_valid(char const* data, size_t size);
+
+    header const* get_header() const;
+    uint64_t const* keys() const;
+    unsigned char const* blocks() const;
+    file_entry const* files() const;
+    char const* paths() const;
+
+private:
+    memory_mapping mapping;
+    std::vector<cache_line> owned;
+    char const* data;
+};
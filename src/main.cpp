@@ -1,17 +1,69 @@
 #include <cstring>
 #include <iostream>
 
+#include "command_line.h"
+#include "stats.h"
+
 void add_source_file_command(size_t argc, char* argv[]);
 void init_command(size_t argc, char* argv[]);
 void md5sum_command(size_t argc, char* argv[]);
 void list_source_files(size_t argc, char* argv[]);
+void has_source_file_command(size_t argc, char* argv[]);
+void gc_command(size_t argc, char* argv[]);
+void send_command(size_t argc, char* argv[]);
+void receive_command(size_t argc, char* argv[]);
+void materialize_command(size_t argc, char* argv[]);
+void symbolize_command(size_t argc, char* argv[]);
+void snapshot_command(size_t argc, char* argv[]);
+void diff_command(size_t argc, char* argv[]);
+void repack_command(size_t argc, char* argv[]);
+void resolve_command(size_t argc, char* argv[]);
+void watch_command(size_t argc, char* argv[]);
+
+namespace
+{
+    enum class stats_format
+    {
+        none,
+        text,
+        json,
+    };
+
+    void print_stats(stats_format format, uint64_t start_ns)
+    {
+        uint64_t wall_ns = stats::detail::now_ns() - start_ns;
+        if (format == stats_format::text)
+            stats::print_summary(std::cerr, wall_ns);
+        else if (format == stats_format::json)
+            stats::print_json(std::cerr, wall_ns);
+    }
+}
 
 int main(int argc, char* argv[])
 {
+    uint64_t start_ns = stats::detail::now_ns();
+    stats_format stats_report = stats_format::none;
+
     try
     {
         --argc;
         ++argv;
+
+        for (; argc != 0 && **argv == '-'; --argc, ++argv)
+        {
+            char const* value;
+            if (match_flag(*argv, "stats"))
+                stats_report = stats_format::text;
+            else if (match_option(*argv, "stats", value) && !strcmp(value, "text"))
+                stats_report = stats_format::text;
+            else if (match_option(*argv, "stats", value) && !strcmp(value, "json"))
+                stats_report = stats_format::json;
+            else
+            {
+                std::cerr << "unknown option: " << *argv << '\n';
+                return 1;
+            }
+        }
     
         if (argc == 0)
         {
@@ -43,6 +95,72 @@ int main(int argc, char* argv[])
             ++argv;
             list_source_files(argc, argv);
         }
+        else if (!strcmp(*argv, "has_source_file"))
+        {
+            --argc;
+            ++argv;
+            has_source_file_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "gc"))
+        {
+            --argc;
+            ++argv;
+            gc_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "send"))
+        {
+            --argc;
+            ++argv;
+            send_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "receive"))
+        {
+            --argc;
+            ++argv;
+            receive_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "materialize"))
+        {
+            --argc;
+            ++argv;
+            materialize_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "symbolize"))
+        {
+            --argc;
+            ++argv;
+            symbolize_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "snapshot"))
+        {
+            --argc;
+            ++argv;
+            snapshot_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "diff"))
+        {
+            --argc;
+            ++argv;
+            diff_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "repack"))
+        {
+            --argc;
+            ++argv;
+            repack_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "resolve"))
+        {
+            --argc;
+            ++argv;
+            resolve_command(argc, argv);
+        }
+        else if (!strcmp(*argv, "watch"))
+        {
+            --argc;
+            ++argv;
+            watch_command(argc, argv);
+        }
         else
         {
             std::cerr << "unknown subcommand\n";
@@ -51,8 +169,10 @@ int main(int argc, char* argv[])
     catch (std::exception const& e)
     {
         std::cerr << "error: " << e.what() << '\n';
+        print_stats(stats_report, start_ns);
         return 1;
     }
-    
+
+    print_stats(stats_report, start_ns);
     return 0;
 }
@@ -0,0 +1,168 @@
+#include "manifest_cache.h"
+#include <cstring>
+#include <sched.h>
+
+namespace
+{
+    char const CACHE_MAGIC[8] = {'S', 'S', 'M', 'C', 'A', 'C', 'H', '1'};
+
+    // sparse, a manifest after gc takes a few hundred bytes
+    constexpr size_t CACHE_SIZE = 256 * 1024;
+
+    // stored instead of the size of a manifest that doesn't fit
+    constexpr uint64_t TOO_LARGE = UINT64_MAX;
+
+    // a writer holds the sequence odd for a memcpy of the manifest,
+    // this many yields mean it died
+    constexpr size_t MAX_READ_ATTEMPTS = 1000;
+
+    uint64_t load_word(uint64_t const& word)
+    {
+        return __atomic_load_n(&word, __ATOMIC_ACQUIRE);
+    }
+
+    void store_word(uint64_t& word, uint64_t value)
+    {
+        __atomic_store_n(&word, value, __ATOMIC_RELEASE);
+    }
+}
+
+struct manifest_cache::header
+{
+    char magic[8];
+    // odd while a writer changes the fields below
+    uint64_t sequence;
+    uint64_t generation;
+    uint64_t size;
+    uint64_t reserved[4];
+};
+
+manifest_cache::manifest_cache()
+{}
+
+manifest_cache::manifest_cache(manifest_cache&& other) noexcept
+    : fd(std::move(other.fd))
+    , mapping(std::move(other.mapping))
+{}
+
+manifest_cache& manifest_cache::operator=(manifest_cache&& rhs) noexcept
+{
+    fd = std::move(rhs.fd);
+    mapping = std::move(rhs.mapping);
+    return *this;
+}
+
+manifest_cache::~manifest_cache()
+{}
+
+manifest_cache::operator bool() const
+{
+    return static_cast<bool>(mapping);
+}
+
+manifest_cache::header* manifest_cache::get_header() const
+{
+    return static_cast<header*>(mapping.data());
+}
+
+char* manifest_cache::text() const
+{
+    return reinterpret_cast<char*>(get_header() + 1);
+}
+
+uint64_t manifest_cache::generation() const
+{
+    // a file nobody stored to yet is all zeros
+    header const* hdr = get_header();
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof CACHE_MAGIC) != 0)
+        return 0;
+
+    return load_word(hdr->generation);
+}
+
+bool manifest_cache::load(repository_manifest& result) const
+{
+    header const* hdr = get_header();
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof CACHE_MAGIC) != 0)
+        return false;
+
+    std::vector<char> copy;
+    for (size_t attempt = 0; attempt != MAX_READ_ATTEMPTS; ++attempt)
+    {
+        uint64_t sequence = load_word(hdr->sequence);
+        if (sequence % 2 != 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        uint64_t generation = __atomic_load_n(&hdr->generation, __ATOMIC_RELAXED);
+        uint64_t size = __atomic_load_n(&hdr->size, __ATOMIC_RELAXED);
+        if (size <= CACHE_SIZE - sizeof(header))
+            copy.assign(text(), text() + size);
+
+        // the copy is meaningful only if no writer started meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+        if (generation == 0 || size > CACHE_SIZE - sizeof(header))
+            return false;
+
+        result = repository_manifest::parse(generation, copy.data(), copy.size());
+        return true;
+    }
+
+    return false;
+}
+
+void manifest_cache::store(repository_manifest const& manifest)
+{
+    std::vector<char> data = manifest.serialize();
+
+    fd.lock_exclusive();
+
+    header* hdr = get_header();
+    bool initialized = memcmp(hdr->magic, CACHE_MAGIC, sizeof CACHE_MAGIC) == 0;
+    if (!initialized || load_word(hdr->generation) < manifest.generation)
+    {
+        // odd already if the previous writer died midway
+        uint64_t sequence = load_word(hdr->sequence) | 1;
+        store_word(hdr->sequence, sequence);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        bool fits = data.size() <= CACHE_SIZE - sizeof(header);
+        if (fits)
+            memcpy(text(), data.data(), data.size());
+        __atomic_store_n(&hdr->size, fits ? data.size() : TOO_LARGE, __ATOMIC_RELAXED);
+        __atomic_store_n(&hdr->generation, manifest.generation, __ATOMIC_RELAXED);
+        if (!initialized)
+            memcpy(hdr->magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+
+        store_word(hdr->sequence, sequence + 1);
+    }
+
+    fd.unlock();
+}
+
+manifest_cache manifest_cache::open(file_location location)
+{
+    manifest_cache result;
+
+    std::error_code ec;
+    file_descriptor fd = file_descriptor::try_open(location, file_flags::read_write | file_flags::create | file_flags::close_on_exec, ec);
+    if (!fd)
+        return result;
+
+    // concurrent openers all extend it to the same size; anything else
+    // isn't ours and is left alone
+    uint64_t size = static_cast<uint64_t>(fd.stat().st_size);
+    if (size == 0)
+        fd.truncate(CACHE_SIZE);
+    else if (size != CACHE_SIZE)
+        return result;
+
+    result.mapping = memory_mapping::map(fd, CACHE_SIZE, map_protection::read_write, map_flags::shared_);
+    result.fd = std::move(fd);
+    return result;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+#include "file_descriptor.h"
+#include "repository_manifest.h"
+
+// Copy of the newest repository manifest in a small file mapped shared
+// by every process, so a process gets the current packs and index files
+// from memory instead of listing and reading manifests/, and tells that
+// its copy is stale by comparing one counter instead of a stat.
+//
+// Writers replace the copy under a seqlock: the sequence number is odd
+// while they write, readers copy without locking and retry if it
+// changed meanwhile. Writers serialize on flock, they are rare (repack,
+// gc, a journal turning into a segment). A writer that dies midway
+// leaves the sequence odd; readers give up after a while and read
+// manifests/, the next writer repairs it.
+//
+// The copy lags manifests/ between publication and store(), so a writer
+// has to store() before removing anything the new manifest replaces.
+struct manifest_cache
+{
+    manifest_cache();
+    manifest_cache(manifest_cache&&) noexcept;
+    manifest_cache& operator=(manifest_cache&&) noexcept;
+    ~manifest_cache();
+
+    explicit operator bool() const;
+
+    // generation of the cached manifest, 0 if there is none
+    uint64_t generation() const;
+
+    // false if there is nothing cached, the manifest is too large to
+    // be cached or a writer doesn't finish
+    bool load(repository_manifest& result) const;
+
+    // replaces the copy unless it is already as new
+    void store(repository_manifest const& manifest);
+
+    // an invalid cache if the file can't be created or opened for
+    // writing (a read-only repository); callers go to manifests/ then
+    static manifest_cache open(file_location location);
+
+private:
+    struct header;
+
+    header* get_header() const;
+    char* text() const;
+
+private:
+    file_descriptor fd;
+    memory_mapping mapping;
+};
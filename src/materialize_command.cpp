@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "command_line.h"
+#include "dwarf_md5.h"
+#include "file_descriptor.h"
+#include "md5.h"
+#include "parallel.h"
+#include "repository.h"
+#include "source_file_cache.h"
+
+namespace
+{
+    struct source_entry
+    {
+        std::string path;
+        md5 hash;
+    };
+
+    // Makes path relative to the output directory: absolute paths lose the
+    // leading slash, "." and empty components are dropped and ".." never
+    // goes above the output directory.
+    std::string normalize_path(std::string const& path)
+    {
+        std::vector<std::string> components;
+        size_t pos = 0;
+        while (pos <= path.size())
+        {
+            size_t slash = path.find('/', pos);
+            if (slash == std::string::npos)
+                slash = path.size();
+
+            std::string component = path.substr(pos, slash - pos);
+            pos = slash + 1;
+
+            if (component.empty() || component == ".")
+                continue;
+            if (component == "..")
+            {
+                if (!components.empty())
+                    components.pop_back();
+                continue;
+            }
+
+            components.push_back(std::move(component));
+        }
+
+        std::string result;
+        for (std::string const& component : components)
+        {
+            if (!result.empty())
+                result += '/';
+            result += component;
+        }
+
+        return result;
+    }
+
+    // manifests are md5sum output, "<md5> <path>" per line as this
+    // tool's md5sum prints it; coreutils' "<md5>  <path>" and
+    // "<md5> *<path>" are accepted too, so a path can't start with a
+    // space or '*'
+    void read_manifest(char const* filename, std::vector<source_entry>& result)
+    {
+        std::vector<char> data = read_whole_file(file_location(filename));
+        std::string text(data.begin(), data.end());
+
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            size_t eol = text.find('\n', pos);
+            if (eol == std::string::npos)
+                eol = text.size();
+
+            std::string line = text.substr(pos, eol - pos);
+            pos = eol + 1;
+
+            if (line.empty())
+                continue;
+
+            source_entry entry;
+            size_t path_start = MD5_HEX_LENGTH + 1;
+            if (line.size() > path_start && (line[path_start] == ' ' || line[path_start] == '*'))
+                ++path_start;
+
+            if (line.size() <= path_start || !md5_from_hex(line.data(), MD5_HEX_LENGTH, entry.hash)
+                || line[MD5_HEX_LENGTH] != ' ')
+                throw std::runtime_error(std::string("malformed manifest line in ") + filename + ": " + line);
+
+            entry.path = line.substr(path_start);
+            result.push_back(std::move(entry));
+        }
+    }
+
+    // creates every directory the entries need, serially and once, so the
+    // parallel phase only creates files
+    void create_parent_directories(int root_fd, std::vector<source_entry> const& entries)
+    {
+        std::set<std::string> created;
+        for (source_entry const& entry : entries)
+        {
+            for (size_t slash = entry.path.find('/'); slash != std::string::npos; slash = entry.path.find('/', slash + 1))
+            {
+                std::string dir = entry.path.substr(0, slash);
+                if (created.insert(dir).second)
+                    mkdir_if_not_exists({root_fd, dir});
+            }
+        }
+    }
+
+    enum class materialize_method
+    {
+        clone,
+        hardlink,
+        copy,
+    };
+
+    struct materializer
+    {
+        materializer(repository& repo, int root_fd, bool hardlink)
+            : repo(repo)
+            , root_fd(root_fd)
+            , hardlink(hardlink)
+            , clone_supported(true)
+        {}
+
+        // returns false if the object is not in the repository
+        bool materialize(source_entry const& entry, materialize_method& method)
+        {
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(entry.hash, name);
+
+            // only loose local objects can be linked, packed ones and
+            // those of the shared tier are copied
+            if (hardlink && link_loose_object(name, entry.path))
+            {
+                repo.touch_object(entry.hash);
+                method = materialize_method::hardlink;
+                return true;
+            }
+
+            file_descriptor source = repo.open_object(entry.hash);
+            if (!source)
+                return false;
+
+            file_descriptor target = file_descriptor::open({root_fd, entry.path}, file_flags::write_only | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+
+            // reflinks share extents copy-on-write: no data is copied and
+            // editing the result doesn't touch the repository
+            if (clone_supported.load(std::memory_order_relaxed))
+            {
+                if (clone_file_if_supported(source, target))
+                {
+                    method = materialize_method::clone;
+                    return true;
+                }
+                clone_supported.store(false, std::memory_order_relaxed);
+            }
+
+            copy_file_contents(source, target, static_cast<uint64_t>(source.stat().st_size));
+            method = materialize_method::copy;
+            return true;
+        }
+
+    private:
+        // false if the object has no file of its own
+        bool link_loose_object(char const* name, std::string const& path)
+        {
+            file_location object(repo.get_md5_dir_fd(), name);
+            file_location target(root_fd, path);
+
+            std::error_code ec;
+            if (try_link(object, target, ec))
+                return true;
+
+            if (ec.value() == EEXIST)
+            {
+                unlink(target);
+                if (try_link(object, target, ec))
+                    return true;
+            }
+
+            if (ec.value() == ENOENT)
+                return false;
+
+            throw_error(ec.value(), "linkat");
+        }
+
+    private:
+        repository& repo;
+        int root_fd;
+        bool hardlink;
+        std::atomic<bool> clone_supported;
+    };
+}
+
+// materialize [--jobs=N] [--hardlink] [--manifest=F]... <output-dir> [binary...]
+//
+// lays out the sources of the binaries (found through their DWARF5 line
+// tables) and of the manifests under output-dir. Files are reflinked from
+// the repository where the filesystem allows and copied inside the kernel
+// otherwise. --hardlink links objects instead, the result must not be
+// edited then.
+void materialize_command(size_t argc, char* argv[])
+{
+    size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    bool hardlink = false;
+    std::vector<char const*> manifests;
+
+    for (; argc != 0; --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "jobs", value))
+            jobs = std::max(parse_count("jobs", value), size_t(1));
+        else if (match_flag(*argv, "hardlink"))
+            hardlink = true;
+        else if (match_option(*argv, "manifest", value))
+            manifests.push_back(value);
+        else if (match_flag(*argv, ""))
+        {
+            --argc;
+            ++argv;
+            break;
+        }
+        else if (**argv == '-' && (*argv)[1] == '-')
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+        else
+            break;
+    }
+
+    if (argc == 0)
+        throw std::runtime_error("output directory expected");
+
+    char const* output_dir = *argv;
+    --argc;
+    ++argv;
+
+    if (argc == 0 && manifests.empty())
+        throw std::runtime_error("binary or --manifest expected");
+
+    std::vector<source_entry> entries;
+    for (char const* manifest : manifests)
+        read_manifest(manifest, entries);
+    if (argc != 0)
+    {
+        std::unique_ptr<source_file_cache> cache = source_file_cache::open_default_if_exists();
+        for (size_t i = 0; i != argc; ++i)
+        {
+            if (cache)
+            {
+                source_file_list files = cache->get(argv[i]);
+                for (size_t j = 0; j != files.size(); ++j)
+                    entries.push_back({std::string(files.path(j)), files.hash(j)});
+            }
+            else
+            {
+                dwarf::source_file_reader reader(argv[i]);
+                for (dwarf::source_file file; reader.next(file);)
+                    entries.push_back({file.name, file.hash});
+            }
+        }
+    }
+
+    for (source_entry& entry : entries)
+        entry.path = normalize_path(entry.path);
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [](source_entry const& entry)
+    {
+        return entry.path.empty();
+    }), entries.end());
+
+    // headers are listed by every unit that includes them
+    std::stable_sort(entries.begin(), entries.end(), [](source_entry const& a, source_entry const& b)
+    {
+        return a.path < b.path;
+    });
+    auto last = std::unique(entries.begin(), entries.end(), [](source_entry const& a, source_entry const& b)
+    {
+        if (a.path != b.path)
+            return false;
+        if (memcmp(a.hash.data, b.hash.data, sizeof a.hash.data) != 0)
+            std::cerr << "warning: " << a.path << " has different contents in the inputs, using " << a.hash << '\n';
+        return true;
+    });
+    entries.erase(last, entries.end());
+
+    repository repo(default_repository_root());
+
+    mkdir_if_not_exists(output_dir);
+    file_descriptor root = file_descriptor::open(output_dir, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+    create_parent_directories(root.get_fd(), entries);
+
+    materializer m(repo, root.get_fd(), hardlink);
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> counts[3] = {};
+    std::atomic<size_t> missing{0};
+    std::mutex output_mutex;
+
+    run_parallel(std::min(jobs, entries.size()), [&](std::atomic<bool> const& stop)
+    {
+        while (!stop)
+        {
+            size_t index = next++;
+            if (index >= entries.size())
+                return;
+
+            materialize_method method;
+            if (m.materialize(entries[index], method))
+                ++counts[static_cast<size_t>(method)];
+            else
+            {
+                ++missing;
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << entries[index].hash << " missing, needed for " << entries[index].path << '\n';
+            }
+        }
+    });
+
+    std::cout << entries.size() - missing << " files materialized ("
+              << counts[static_cast<size_t>(materialize_method::clone)] << " cloned, "
+              << counts[static_cast<size_t>(materialize_method::hardlink)] << " linked, "
+              << counts[static_cast<size_t>(materialize_method::copy)] << " copied)\n";
+
+    repo.flush_shared_tier();
+
+    if (missing != 0)
+        throw std::runtime_error(std::to_string(missing.load()) + " source files are missing from the repository");
+}
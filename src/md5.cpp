@@ -41,21 +41,98 @@
 
 #include "md5.h"
 #include "md5_accumulator.h"
+#include "stats.h"
 #include <cstring>
 #include <ostream>
 
 std::ostream& operator<<(std::ostream& os, md5 const& hash)
+{
+    char buf[32];
+    md5_to_hex(hash, buf);
+    return os.write(buf, sizeof buf);
+}
+
+void md5_to_hex(md5 const& hash, char* out)
 {
     static char const hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
                                  '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
 
     for (size_t i = 0; i != 16; ++i)
     {
-        os.put(hex[hash.data[i] / 16]);
-        os.put(hex[hash.data[i] % 16]);
+        *out++ = hex[hash.data[i] / 16];
+        *out++ = hex[hash.data[i] % 16];
     }
+}
 
-    return os;
+namespace
+{
+    int hex_digit_value(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+}
+
+bool md5_from_hex(char const* str, size_t len, md5& hash)
+{
+    if (len != MD5_HEX_LENGTH)
+        return false;
+
+    for (size_t i = 0; i != 16; ++i)
+    {
+        int hi = hex_digit_value(str[2 * i]);
+        int lo = hex_digit_value(str[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+
+        hash.data[i] = static_cast<uint8_t>(hi * 16 + lo);
+    }
+
+    return true;
+}
+
+bool md5_prefix_from_hex(char const* str, size_t len, md5& low, md5& high)
+{
+    if (len == 0 || len > MD5_HEX_LENGTH)
+        return false;
+
+    memset(low.data, 0x00, sizeof low.data);
+    memset(high.data, 0xff, sizeof high.data);
+    for (size_t i = 0; i != len; ++i)
+    {
+        int digit = hex_digit_value(str[i]);
+        if (digit < 0)
+            return false;
+
+        if (i % 2 == 0)
+        {
+            low.data[i / 2] = static_cast<uint8_t>(digit << 4);
+            high.data[i / 2] = static_cast<uint8_t>(digit << 4 | 0x0f);
+        }
+        else
+        {
+            low.data[i / 2] |= static_cast<uint8_t>(digit);
+            high.data[i / 2] = static_cast<uint8_t>((high.data[i / 2] & 0xf0) | digit);
+        }
+    }
+
+    return true;
+}
+
+size_t md5_common_hex_prefix(md5 const& a, md5 const& b)
+{
+    for (size_t i = 0; i != sizeof a.data; ++i)
+    {
+        uint8_t diff = a.data[i] ^ b.data[i];
+        if (diff != 0)
+            return 2 * i + (diff >> 4 ? 0 : 1);
+    }
+    return MD5_HEX_LENGTH;
 }
 
 #define BLOCK_LEN 64  // In bytes
@@ -65,15 +142,29 @@ extern "C" void md5_compress(md5* state, char const* block);
 
 void md5_accumulate(char const* message, size_t len, md5& hash)
 {
-#define LENGTH_SIZE 8  // In bytes
+    stats::scoped_timer timer(stats::phase::hash);
+    stats::add(stats::counter::bytes_hashed, len);
 
-    size_t off;
-    for (off = 0; len - off >= BLOCK_LEN; off += BLOCK_LEN)
-        md5_compress(&hash, message + off);
+    size_t block_count = len / BLOCK_LEN;
+    md5_compress_blocks(message, block_count, hash);
+    md5_finish(message + block_count * BLOCK_LEN, len % BLOCK_LEN, len, hash);
+}
+
+void md5_compress_blocks(char const* blocks, size_t block_count, md5& hash)
+{
+    for (size_t i = 0; i != block_count; ++i)
+        md5_compress(&hash, blocks + i * BLOCK_LEN);
+}
+
+void md5_finish(char const* tail, size_t tail_len, uint64_t total_len, md5& hash)
+{
+#define LENGTH_SIZE 8  // In bytes
 
     char block[BLOCK_LEN] = {};
-    size_t rem = len - off;
-    memcpy(block, message + off, rem);
+    size_t rem = tail_len;
+    // the tail of empty data may be null
+    if (rem != 0)
+        memcpy(block, tail, rem);
 
     block[rem] = (char)0x80;
     rem++;
@@ -83,10 +174,10 @@ void md5_accumulate(char const* message, size_t len, md5& hash)
         memset(block, 0, sizeof(block));
     }
 
-    block[BLOCK_LEN - LENGTH_SIZE] = static_cast<char>((len & 0x1FU) << 3);
-    len >>= 5;
-    for (int i = 1; i < LENGTH_SIZE; i++, len >>= 8)
-        block[BLOCK_LEN - LENGTH_SIZE + i] = static_cast<char>(len & 0xFFU);
+    block[BLOCK_LEN - LENGTH_SIZE] = static_cast<char>((total_len & 0x1FU) << 3);
+    total_len >>= 5;
+    for (int i = 1; i < LENGTH_SIZE; i++, total_len >>= 8)
+        block[BLOCK_LEN - LENGTH_SIZE + i] = static_cast<char>(total_len & 0xFFU);
     md5_compress(&hash, block);
 }
 
@@ -18,8 +18,26 @@ struct md5
     };
 };
 
+constexpr size_t MD5_HEX_LENGTH = 32;
+
 std::ostream& operator<<(std::ostream& os, md5 const& hash);
 
+// writes exactly MD5_HEX_LENGTH characters, no null terminator
+void md5_to_hex(md5 const& hash, char* out);
+bool md5_from_hex(char const* str, size_t len, md5& hash);
+
+// an abbreviated name of 1 to MD5_HEX_LENGTH hex digits, as the range of
+// hashes [low, high] it matches
+bool md5_prefix_from_hex(char const* str, size_t len, md5& low, md5& high);
+
+// number of leading hex digits a and b have in common
+size_t md5_common_hex_prefix(md5 const& a, md5 const& b);
+
 void md5_accumulate(char const* message, size_t len, md5& hash);
 
+// building blocks for incremental hashing, see md5_accumulator
+constexpr size_t MD5_BLOCK_SIZE = 64;
+void md5_compress_blocks(char const* blocks, size_t block_count, md5& hash);
+void md5_finish(char const* tail, size_t tail_len, uint64_t total_len, md5& hash);
+
 md5 md5_hash(char const* message, size_t len);
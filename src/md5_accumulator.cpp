@@ -1,4 +1,8 @@
 #include "md5_accumulator.h"
+#include <algorithm>
+#include <cstring>
+
+#include "stats.h"
 
 md5_accumulator::md5_accumulator() noexcept
 {
@@ -7,7 +11,38 @@ md5_accumulator::md5_accumulator() noexcept
 
 void md5_accumulator::accumulate(const char *message, size_t len) noexcept
 {
-    md5_accumulate(message, len, get_hash());
+    stats::scoped_timer timer(stats::phase::hash);
+    stats::add(stats::counter::bytes_hashed, len);
+
+    total_len += len;
+
+    if (tail_len != 0)
+    {
+        size_t n = std::min(len, MD5_BLOCK_SIZE - tail_len);
+        memcpy(tail + tail_len, message, n);
+        tail_len += n;
+        message += n;
+        len -= n;
+
+        if (tail_len != MD5_BLOCK_SIZE)
+            return;
+
+        md5_compress_blocks(tail, 1, hash);
+        tail_len = 0;
+    }
+
+    size_t block_count = len / MD5_BLOCK_SIZE;
+    md5_compress_blocks(message, block_count, hash);
+
+    tail_len = len % MD5_BLOCK_SIZE;
+    memcpy(tail, message + block_count * MD5_BLOCK_SIZE, tail_len);
+}
+
+md5 md5_accumulator::finish() noexcept
+{
+    stats::scoped_timer timer(stats::phase::hash);
+    md5_finish(tail, tail_len, total_len, hash);
+    return hash;
 }
 
 md5& md5_accumulator::get_hash() noexcept
@@ -26,4 +61,6 @@ void md5_accumulator::reset() noexcept
     hash.b = UINT32_C(0xEFCDAB89);
     hash.c = UINT32_C(0x98BADCFE);
     hash.d = UINT32_C(0x10325476);
+    total_len = 0;
+    tail_len = 0;
 }
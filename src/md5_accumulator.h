@@ -2,16 +2,24 @@
 #define SOURCE_STORE_MD5_ACCUMULATOR_H
 
 #include <cstddef>
+#include <cstdint>
 #include "md5.h"
 
+// incremental md5: accumulate() can be called any number of times with
+// arbitrary chunks, finish() applies the padding and returns the result
 class md5_accumulator
 {
     md5 hash{};
+    uint64_t total_len = 0;
+    size_t tail_len = 0;
+    char tail[MD5_BLOCK_SIZE];
 
 public:
     md5_accumulator() noexcept;
 
     void accumulate(char const* message, size_t len) noexcept;
+
+    md5 finish() noexcept;
     
     md5& get_hash() noexcept;
     
@@ -1,21 +1,98 @@
 #include <cstddef>
-#include <stdexcept>
-#include <iostream>
+#include <mutex>
+#include <unistd.h>
+#include <vector>
 
-#include "file_descriptor.h"
+#include "buffer_pool.h"
+#include "command_line.h"
+#include "input_files.h"
 #include "md5.h"
+#include "md5_accumulator.h"
+#include "output_writer.h"
 
-void md5sum_command(size_t argc, char* argv[])
+namespace
 {
-    if (argc == 0)
-        throw std::runtime_error("filename expected");
+    constexpr size_t CHUNK_SIZE = 256 * 1024;
+
+    // O_DIRECT reads go to the device synchronously, without readahead,
+    // so they have to be large; the data doesn't pass through the cache
+    // either, so a chunk that fits in L2 gains nothing
+    constexpr size_t DIRECT_CHUNK_SIZE = pooled_buffer::HUGE_PAGE_SIZE;
+
+    md5 hash_file(file_descriptor& fd, char* buf, size_t chunk_size)
+    {
+        md5_accumulator acc;
+        for (;;)
+        {
+            size_t bytes_read = fd.read_some(buf, chunk_size);
+            if (bytes_read == 0)
+                break;
+
+            acc.accumulate(buf, bytes_read);
+        }
 
-    for (size_t i = 0; i != argc; ++i)
+        return acc.finish();
+    }
+
+    void print(output_writer& out, md5 const& hash, char const* path)
     {
-        char const* filename = argv[i];
+        if (out.format() != output_format::text)
+        {
+            out.write_entry(path, hash);
+            return;
+        }
+
+        out.write_hex(hash);
+        out.put(' ');
+        out.write(path);
+        out.put('\n');
+    }
+}
 
-        std::vector<char> text = read_whole_file(filename);
-        md5 hash = md5_hash(text.data(), text.size());
-        std::cout << hash << ' ' << filename << '\n';
+// md5sum [--format=text|tsv|ndjson|binary] <input options> <file>...
+//
+// see input_files.h for the input options and output_writer.h for the
+// formats
+void md5sum_command(size_t argc, char* argv[])
+{
+    // taken out before input_files sees the rest of the options
+    output_format format = output_format::text;
+    std::vector<char*> args;
+    for (; argc != 0 && **argv == '-' && !match_flag(*argv, ""); --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "format", value))
+            format = parse_output_format(value);
+        else
+            args.push_back(*argv);
     }
+    args.insert(args.end(), argv, argv + argc);
+
+    input_files inputs(args.size(), args.data());
+    output_writer out(STDOUT_FILENO, format);
+
+    // listed files are read in disk order, but reported in the order
+    // they were given, files found by --recursive are reported as found
+    std::vector<md5> hashes(inputs.is_recursive() ? 0 : inputs.size());
+    std::mutex output_mutex;
+
+    inputs.for_each([&](size_t index, char const* path, file_descriptor& fd)
+    {
+        size_t chunk_size = fd.is_direct() ? DIRECT_CHUNK_SIZE : CHUNK_SIZE;
+        pooled_buffer buf(chunk_size);
+        md5 hash = hash_file(fd, buf.data(), chunk_size);
+
+        if (index != input_files::NO_INDEX)
+            hashes[index] = hash;
+        else
+        {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            print(out, hash, path);
+        }
+    });
+
+    for (size_t i = 0; i != hashes.size(); ++i)
+        print(out, hashes[i], inputs.name(i));
+
+    out.flush();
 }
@@ -0,0 +1,331 @@
+#include "object_clock.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    char const CLOCK_MAGIC[8] = {'S', 'S', 'C', 'L', 'O', 'C', 'K', '1'};
+
+    constexpr uint64_t MIN_SLOTS = 4096;
+
+    // low 56 bits of a slot word are the object size
+    constexpr uint64_t SIZE_MASK = (UINT64_C(1) << 56) - 1;
+    constexpr uint64_t OCCUPIED = UINT64_C(1) << 56;
+    constexpr uint64_t TOMBSTONE = UINT64_C(1) << 57;
+    constexpr uint64_t REFERENCED = UINT64_C(1) << 58;
+    constexpr uint64_t PINNED = UINT64_C(1) << 59;
+
+    // slot: word, md5, and sha256 if the repository names objects by it
+    constexpr size_t WORD_SIZE = 8;
+    constexpr size_t MD5_SIZE = 16;
+    constexpr size_t SHA256_SIZE = 32;
+
+    uint64_t slot_index(md5 const& hash, uint64_t slot_count)
+    {
+        return (static_cast<uint64_t>(hash.c) | (static_cast<uint64_t>(hash.d) << 32)) & (slot_count - 1);
+    }
+
+    uint64_t load_word(unsigned char const* slot)
+    {
+        return __atomic_load_n(reinterpret_cast<uint64_t const*>(slot), __ATOMIC_ACQUIRE);
+    }
+
+    void store_word(unsigned char* slot, uint64_t value)
+    {
+        __atomic_store_n(reinterpret_cast<uint64_t*>(slot), value, __ATOMIC_RELEASE);
+    }
+
+    uint64_t round_up_pow2(uint64_t value)
+    {
+        uint64_t result = MIN_SLOTS;
+        while (result < value)
+            result *= 2;
+        return result;
+    }
+}
+
+struct object_clock::header
+{
+    char magic[8];
+    uint64_t slot_count;
+    uint64_t slot_size;
+    uint64_t hand;
+    uint64_t total_bytes;
+    uint64_t object_count;
+    uint64_t tombstone_count;
+    uint64_t reserved[1];
+};
+
+object_clock::object_clock()
+    : inode(0)
+{}
+
+object_clock::object_clock(object_clock&& other) noexcept
+    : fd(std::move(other.fd))
+    , mapping(std::move(other.mapping))
+    , inode(other.inode)
+{
+    other.inode = 0;
+}
+
+object_clock& object_clock::operator=(object_clock&& rhs) noexcept
+{
+    fd = std::move(rhs.fd);
+    mapping = std::move(rhs.mapping);
+    inode = rhs.inode;
+    rhs.inode = 0;
+    return *this;
+}
+
+object_clock::~object_clock()
+{}
+
+object_clock::operator bool() const
+{
+    return static_cast<bool>(mapping);
+}
+
+object_clock::header* object_clock::get_header() const
+{
+    return static_cast<header*>(mapping.data());
+}
+
+unsigned char* object_clock::slot(uint64_t index) const
+{
+    header* hdr = get_header();
+    return reinterpret_cast<unsigned char*>(hdr + 1) + index * hdr->slot_size;
+}
+
+uint64_t object_clock::find(md5 const& hash) const
+{
+    header const* hdr = get_header();
+    uint64_t mask = hdr->slot_count - 1;
+
+    // table is never full, an empty slot ends every probe sequence
+    for (uint64_t i = slot_index(hash, hdr->slot_count);; i = (i + 1) & mask)
+    {
+        unsigned char const* s = slot(i);
+        uint64_t word = load_word(s);
+        if (!(word & (OCCUPIED | TOMBSTONE)))
+            return UINT64_MAX;
+        if ((word & OCCUPIED) && memcmp(s + WORD_SIZE, hash.data, MD5_SIZE) == 0)
+            return i;
+    }
+}
+
+void object_clock::touch(md5 const& hash)
+{
+    uint64_t index = find(hash);
+    if (index == UINT64_MAX)
+        return;
+
+    // most lookups hit hot objects, skip the write if the bit is set
+    unsigned char* s = slot(index);
+    if (!(load_word(s) & REFERENCED))
+        __atomic_fetch_or(reinterpret_cast<uint64_t*>(s), REFERENCED, __ATOMIC_RELAXED);
+}
+
+bool object_clock::insert(md5 const& hash, sha256 const& strong, uint64_t size, bool pinned)
+{
+    uint64_t existing = find(hash);
+    if (existing != UINT64_MAX)
+    {
+        if (pinned)
+            __atomic_fetch_or(reinterpret_cast<uint64_t*>(slot(existing)), PINNED, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    header* hdr = get_header();
+    uint64_t mask = hdr->slot_count - 1;
+    uint64_t i = slot_index(hash, hdr->slot_count);
+    while (load_word(slot(i)) & OCCUPIED)
+        i = (i + 1) & mask;
+
+    unsigned char* s = slot(i);
+    if (load_word(s) & TOMBSTONE)
+        --hdr->tombstone_count;
+
+    memcpy(s + WORD_SIZE, hash.data, MD5_SIZE);
+    if (hdr->slot_size >= WORD_SIZE + MD5_SIZE + SHA256_SIZE)
+        memcpy(s + WORD_SIZE + MD5_SIZE, strong.data, SHA256_SIZE);
+
+    // new objects start referenced, they survive one pass of the hand
+    store_word(s, std::min(size, SIZE_MASK) | OCCUPIED | REFERENCED | (pinned ? PINNED : 0));
+
+    hdr->total_bytes += size;
+    ++hdr->object_count;
+    return true;
+}
+
+void object_clock::unpin(md5 const& hash)
+{
+    uint64_t index = find(hash);
+    if (index == UINT64_MAX)
+        return;
+
+    // touch() may set the referenced bit concurrently
+    __atomic_fetch_and(reinterpret_cast<uint64_t*>(slot(index)), ~PINNED, __ATOMIC_RELAXED);
+}
+
+bool object_clock::is_full() const
+{
+    header const* hdr = get_header();
+    return (hdr->object_count + hdr->tombstone_count + 1) * 10 > hdr->slot_count * 7;
+}
+
+uint64_t object_clock::total_bytes() const
+{
+    return get_header()->total_bytes;
+}
+
+uint64_t object_clock::object_count() const
+{
+    return get_header()->object_count;
+}
+
+void object_clock::evict(uint64_t target, remove_callback const& remove)
+{
+    header* hdr = get_header();
+    bool strong_keys = hdr->slot_size >= WORD_SIZE + MD5_SIZE + SHA256_SIZE;
+
+    for (uint64_t steps = 0; hdr->total_bytes > target && steps != 2 * hdr->slot_count; ++steps)
+    {
+        unsigned char* s = slot(hdr->hand);
+        hdr->hand = (hdr->hand + 1) & (hdr->slot_count - 1);
+
+        uint64_t word = load_word(s);
+        if (!(word & OCCUPIED) || (word & PINNED))
+            continue;
+
+        if (word & REFERENCED)
+        {
+            __atomic_fetch_and(reinterpret_cast<uint64_t*>(s), ~REFERENCED, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        md5 hash;
+        memcpy(hash.data, s + WORD_SIZE, MD5_SIZE);
+        sha256 strong = {};
+        if (strong_keys)
+            memcpy(strong.data, s + WORD_SIZE + MD5_SIZE, SHA256_SIZE);
+
+        // the entry goes first: if removing the files fails midway, the
+        // object is no longer accounted for rather than evicted twice
+        store_word(s, TOMBSTONE);
+        hdr->total_bytes -= std::min(hdr->total_bytes, word & SIZE_MASK);
+        --hdr->object_count;
+        ++hdr->tombstone_count;
+
+        remove(hash, strong);
+    }
+}
+
+void object_clock::lock()
+{
+    fd.lock_exclusive();
+}
+
+void object_clock::unlock()
+{
+    fd.unlock();
+}
+
+bool object_clock::is_stale(file_location location) const
+{
+    // any failure counts as stale, reopening reports the actual error
+    struct stat64 st;
+    std::error_code ec;
+    if (!try_stat(location, stat_flags::none, st, ec))
+        return true;
+
+    return st.st_ino != inode;
+}
+
+object_clock object_clock::open_if_exists(file_location location)
+{
+    object_clock result;
+
+    file_descriptor fd = file_descriptor::open_if_exists(location, file_flags::read_write | file_flags::close_on_exec);
+    if (!fd)
+        return result;
+
+    struct stat64 st = fd.stat();
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(header))
+        throw std::runtime_error("object clock is corrupted: file is too small");
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read_write, map_flags::shared_);
+    header const* hdr = static_cast<header const*>(mapping.data());
+    if (memcmp(hdr->magic, CLOCK_MAGIC, sizeof CLOCK_MAGIC) != 0)
+        throw std::runtime_error("object clock is corrupted: bad magic");
+    if (hdr->slot_count < MIN_SLOTS || (hdr->slot_count & (hdr->slot_count - 1)) != 0
+        || (hdr->slot_size != WORD_SIZE + MD5_SIZE && hdr->slot_size != WORD_SIZE + MD5_SIZE + SHA256_SIZE)
+        || size != sizeof(header) + hdr->slot_count * hdr->slot_size)
+        throw std::runtime_error("object clock is corrupted: size mismatch");
+
+    result.fd = std::move(fd);
+    result.mapping = std::move(mapping);
+    result.inode = st.st_ino;
+    return result;
+}
+
+void object_clock::create(file_location location, bool strong_keys)
+{
+    create_locked(location, strong_keys, MIN_SLOTS);
+}
+
+object_clock object_clock::create_locked(file_location location, bool strong_keys, uint64_t slot_count)
+{
+    static_assert(sizeof(header) == 64, "slots must be cache line aligned");
+
+    uint64_t slot_size = WORD_SIZE + MD5_SIZE + (strong_keys ? SHA256_SIZE : 0);
+    size_t size = sizeof(header) + slot_count * slot_size;
+
+    object_clock result;
+    result.fd = file_descriptor::open(location, file_flags::read_write | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+    result.fd.lock_exclusive();
+
+    // sparse: untouched parts of the table take no disk space
+    result.fd.truncate(static_cast<int64_t>(size));
+    result.mapping = memory_mapping::map(result.fd, size, map_protection::read_write, map_flags::shared_);
+    result.inode = result.fd.stat().st_ino;
+
+    header* hdr = result.get_header();
+    hdr->slot_count = slot_count;
+    hdr->slot_size = slot_size;
+    memcpy(hdr->magic, CLOCK_MAGIC, sizeof CLOCK_MAGIC);
+
+    return result;
+}
+
+object_clock object_clock::rebuild(file_location location) const
+{
+    header const* hdr = get_header();
+    bool strong_keys = hdr->slot_size >= WORD_SIZE + MD5_SIZE + SHA256_SIZE;
+
+    object_clock result = create_locked(location, strong_keys, round_up_pow2(2 * (hdr->object_count + 1)));
+    header* new_hdr = result.get_header();
+    uint64_t mask = new_hdr->slot_count - 1;
+
+    for (uint64_t i = 0; i != hdr->slot_count; ++i)
+    {
+        unsigned char const* s = slot(i);
+        uint64_t word = load_word(s);
+        if (!(word & OCCUPIED))
+            continue;
+
+        md5 hash;
+        memcpy(hash.data, s + WORD_SIZE, MD5_SIZE);
+
+        uint64_t j = slot_index(hash, new_hdr->slot_count);
+        while (load_word(result.slot(j)) & OCCUPIED)
+            j = (j + 1) & mask;
+
+        memcpy(result.slot(j), s, hdr->slot_size);
+        new_hdr->total_bytes += word & SIZE_MASK;
+        ++new_hdr->object_count;
+    }
+
+    return result;
+}
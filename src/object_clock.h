@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+
+#include "file_descriptor.h"
+#include "md5.h"
+#include "sha256.h"
+
+// Recency table for size-bounded repositories, persisted next to the
+// objects and mapped shared. An open-addressing hash table keyed by md5
+// holds the size and a "referenced" bit of every object; eviction is
+// CLOCK: the hand sweeps the table, clearing set bits and evicting
+// objects whose bit is already clear. Total size is kept in the header,
+// so neither lookups nor eviction ever scan the store.
+//
+// Objects not yet copied to a shared tier are pinned: the hand skips
+// them until unpin(), so a repository may stay over its capacity while
+// write-backs are pending rather than lose the only copy.
+//
+// touch() is lock-free. Everything else requires lock() and a check
+// that the table was not replaced by a rebuild (is_stale).
+struct object_clock
+{
+    object_clock();
+    object_clock(object_clock&&) noexcept;
+    object_clock& operator=(object_clock&&) noexcept;
+    ~object_clock();
+
+    explicit operator bool() const;
+
+    // sets the referenced bit, a no-op if the object is not in the table
+    void touch(md5 const& hash);
+
+    // false if the object is already in the table, it is pinned anyway
+    // if pinned is set
+    bool insert(md5 const& hash, sha256 const& strong, uint64_t size, bool pinned);
+
+    // makes the object evictable, a no-op if it is not in the table
+    void unpin(md5 const& hash);
+
+    // true if the next insert could push the load factor too high, the
+    // table has to be rebuilt first
+    bool is_full() const;
+
+    uint64_t total_bytes() const;
+    uint64_t object_count() const;
+
+    // strong is meaningful only if the table was created with strong keys
+    using remove_callback = std::function<void(md5 const& hash, sha256 const& strong)>;
+
+    // evicts objects until total_bytes() <= target, the hand moves at
+    // most two rounds so the cost is bounded even if everything is hot
+    // or pinned
+    void evict(uint64_t target, remove_callback const& remove);
+
+    void lock();
+    void unlock();
+
+    bool is_stale(file_location location) const;
+
+    static object_clock open_if_exists(file_location location);
+
+    static void create(file_location location, bool strong_keys);
+
+    // writes a copy of the live entries with room to grow to location and
+    // returns it locked; the caller renames it into place
+    object_clock rebuild(file_location location) const;
+
+private:
+    struct header;
+
+    static object_clock create_locked(file_location location, bool strong_keys, uint64_t slot_count);
+
+    header* get_header() const;
+    unsigned char* slot(uint64_t index) const;
+    uint64_t find(md5 const& hash) const;
+
+private:
+    file_descriptor fd;
+    memory_mapping mapping;
+    ino64_t inode;
+};
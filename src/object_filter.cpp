@@ -0,0 +1,176 @@
+#include "object_filter.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    char const FILTER_MAGIC[8] = {'S', 'S', 'F', 'I', 'L', 'T', 'R', '1'};
+
+    // 16 bits per key keeps the false positive rate of a 512-bit block
+    // with 8 probes well below 1%
+    constexpr size_t BITS_PER_KEY = 16;
+    constexpr size_t BITS_PER_BLOCK = 512;
+    constexpr size_t PROBES = 8;
+
+    // filter is sized for this many keys at least, so that a fresh
+    // repository does not degrade immediately as objects are added
+    constexpr size_t MIN_CAPACITY = 64 * 1024;
+}
+
+struct object_filter::header
+{
+    char magic[8];
+    uint64_t block_count;
+    uint64_t key_count;
+    uint64_t reserved[5];
+};
+
+struct object_filter::block
+{
+    uint64_t words[BITS_PER_BLOCK / 64];
+};
+
+namespace
+{
+    template <typename Block>
+    Block* block_for(Block* blocks, uint64_t block_count, md5 const& hash)
+    {
+        // md5 is uniformly distributed already, so no extra hashing is needed:
+        // word a selects the block, words b, c and d select bits inside it
+        return blocks + ((static_cast<uint64_t>(hash.a) * block_count) >> 32);
+    }
+
+    unsigned __int128 probe_bits(md5 const& hash)
+    {
+        return static_cast<unsigned __int128>(hash.b)
+             | (static_cast<unsigned __int128>(hash.c) << 32)
+             | (static_cast<unsigned __int128>(hash.d) << 64);
+    }
+}
+
+object_filter::object_filter()
+    : inode(0)
+{}
+
+object_filter::object_filter(object_filter&& other) noexcept
+    : mapping(std::move(other.mapping))
+    , inode(other.inode)
+{
+    other.inode = 0;
+}
+
+object_filter& object_filter::operator=(object_filter&& rhs) noexcept
+{
+    mapping = std::move(rhs.mapping);
+    inode = rhs.inode;
+    rhs.inode = 0;
+    return *this;
+}
+
+object_filter::~object_filter()
+{}
+
+object_filter::operator bool() const
+{
+    return static_cast<bool>(mapping);
+}
+
+bool object_filter::may_contain(md5 const& hash) const
+{
+    header const* hdr = static_cast<header const*>(mapping.data());
+    block const* blk = block_for(reinterpret_cast<block const*>(hdr + 1), hdr->block_count, hash);
+
+    unsigned __int128 bits = probe_bits(hash);
+    uint64_t missing = 0;
+    for (size_t i = 0; i != PROBES; ++i, bits >>= 9)
+    {
+        unsigned bit = static_cast<unsigned>(bits) & (BITS_PER_BLOCK - 1);
+        uint64_t word = __atomic_load_n(&blk->words[bit / 64], __ATOMIC_RELAXED);
+        missing |= ~word & (UINT64_C(1) << (bit % 64));
+    }
+
+    return missing == 0;
+}
+
+void object_filter::insert(md5 const& hash)
+{
+    header* hdr = static_cast<header*>(mapping.data());
+    block* blk = block_for(reinterpret_cast<block*>(hdr + 1), hdr->block_count, hash);
+
+    unsigned __int128 bits = probe_bits(hash);
+    for (size_t i = 0; i != PROBES; ++i, bits >>= 9)
+    {
+        unsigned bit = static_cast<unsigned>(bits) & (BITS_PER_BLOCK - 1);
+        __atomic_fetch_or(&blk->words[bit / 64], UINT64_C(1) << (bit % 64), __ATOMIC_RELAXED);
+    }
+
+    __atomic_fetch_add(&hdr->key_count, 1, __ATOMIC_RELAXED);
+}
+
+bool object_filter::is_stale(file_location location) const
+{
+    // any failure counts as stale, reopening reports the actual error
+    struct stat64 st;
+    std::error_code ec;
+    if (!try_stat(location, stat_flags::none, st, ec))
+        return true;
+
+    return st.st_ino != inode;
+}
+
+object_filter object_filter::open_if_exists(file_location location)
+{
+    object_filter result;
+
+    file_descriptor fd = file_descriptor::open_if_exists(location, file_flags::read_write | file_flags::close_on_exec);
+    if (!fd)
+        return result;
+
+    struct stat64 st = fd.stat();
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < sizeof(header))
+        throw std::runtime_error("object filter is corrupted: file is too small");
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read_write, map_flags::shared_);
+    header const* hdr = static_cast<header const*>(mapping.data());
+    if (memcmp(hdr->magic, FILTER_MAGIC, sizeof FILTER_MAGIC) != 0)
+        throw std::runtime_error("object filter is corrupted: bad magic");
+    if (hdr->block_count == 0 || hdr->block_count > UINT32_MAX || size != sizeof(header) + hdr->block_count * sizeof(block))
+        throw std::runtime_error("object filter is corrupted: size mismatch");
+
+    result.mapping = std::move(mapping);
+    result.inode = st.st_ino;
+    return result;
+}
+
+void object_filter::create(file_location location, std::vector<md5> const& hashes)
+{
+    static_assert(sizeof(header) == 64, "blocks must be cache line aligned");
+    static_assert(sizeof(block) == 64, "block must fill exactly one cache line");
+
+    size_t capacity = std::max(2 * hashes.size(), MIN_CAPACITY);
+    size_t block_count = (capacity * BITS_PER_KEY + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    if (block_count > UINT32_MAX)
+        throw std::runtime_error("too many objects for object filter");
+
+    std::vector<char> data(sizeof(header) + block_count * sizeof(block));
+    header* hdr = reinterpret_cast<header*>(data.data());
+    memcpy(hdr->magic, FILTER_MAGIC, sizeof FILTER_MAGIC);
+    hdr->block_count = block_count;
+    hdr->key_count = hashes.size();
+
+    block* blocks = reinterpret_cast<block*>(hdr + 1);
+    for (md5 const& hash : hashes)
+    {
+        block* blk = block_for(blocks, block_count, hash);
+        unsigned __int128 bits = probe_bits(hash);
+        for (size_t i = 0; i != PROBES; ++i, bits >>= 9)
+        {
+            unsigned bit = static_cast<unsigned>(bits) & (BITS_PER_BLOCK - 1);
+            blk->words[bit / 64] |= UINT64_C(1) << (bit % 64);
+        }
+    }
+
+    write_whole_file(location, data);
+}
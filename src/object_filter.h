@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+
+#include "file_descriptor.h"
+#include "md5.h"
+
+// Blocked Bloom filter over object hashes, persisted in the repository
+// and mapped shared so that concurrent writers see each other's inserts.
+// Every key lives in a single 64-byte block, so a negative lookup costs
+// one cache line and no system calls.
+struct object_filter
+{
+    object_filter();
+    object_filter(object_filter&&) noexcept;
+    object_filter& operator=(object_filter&&) noexcept;
+    ~object_filter();
+
+    explicit operator bool() const;
+
+    bool may_contain(md5 const& hash) const;
+    void insert(md5 const& hash);
+
+    // true if the file at location is no longer the one we have mapped
+    // (the filter was rebuilt and replaced concurrently)
+    bool is_stale(file_location location) const;
+
+    static object_filter open_if_exists(file_location location);
+
+    // writes a new filter sized for hashes and some future growth,
+    // the caller is expected to rename it into place
+    static void create(file_location location, std::vector<md5> const& hashes);
+
+private:
+    struct header;
+    struct block;
+
+    memory_mapping mapping;
+    ino64_t inode;
+};
@@ -0,0 +1,131 @@
+#include "object_index.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+    char const INDEX_MAGIC[8] = {'S', 'S', 'O', 'I', 'D', 'X', '0', '1'};
+
+    bool key_less(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    }
+}
+
+struct object_index::header
+{
+    char magic[8];
+    uint64_t key_count;
+    // fanout[b] is the number of keys whose first byte is at most b
+    uint32_t fanout[256];
+};
+
+object_index::object_index()
+{}
+
+object_index::object_index(object_index&& other) noexcept
+    : mapping(std::move(other.mapping))
+{}
+
+object_index& object_index::operator=(object_index&& rhs) noexcept
+{
+    mapping = std::move(rhs.mapping);
+    return *this;
+}
+
+object_index::~object_index()
+{}
+
+object_index::operator bool() const
+{
+    return static_cast<bool>(mapping);
+}
+
+object_index::header const* object_index::get_header() const
+{
+    return static_cast<header const*>(mapping.data());
+}
+
+md5 const* object_index::keys() const
+{
+    return reinterpret_cast<md5 const*>(get_header() + 1);
+}
+
+size_t object_index::size() const
+{
+    return mapping ? get_header()->key_count : 0;
+}
+
+md5 const& object_index::key(size_t index) const
+{
+    return keys()[index];
+}
+
+void object_index::find_range(md5 const& low, md5 const& high, size_t& begin, size_t& end) const
+{
+    if (!mapping)
+    {
+        begin = end = 0;
+        return;
+    }
+
+    header const* hdr = get_header();
+    size_t first = low.data[0] == 0 ? 0 : hdr->fanout[low.data[0] - 1];
+    size_t last = hdr->fanout[high.data[0]];
+
+    md5 const* k = keys();
+    begin = std::lower_bound(k + first, k + last, low, key_less) - k;
+    end = std::upper_bound(k + begin, k + last, high, key_less) - k;
+}
+
+object_index object_index::open_if_exists(file_location location)
+{
+    object_index result;
+
+    file_descriptor fd = file_descriptor::open_if_exists(location, file_flags::read_only | file_flags::close_on_exec);
+    if (!fd)
+        return result;
+
+    size_t size = static_cast<size_t>(fd.stat().st_size);
+    if (size < sizeof(header))
+        return result;
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read, map_flags::private_);
+    header const* hdr = static_cast<header const*>(mapping.data());
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof INDEX_MAGIC) != 0)
+        return result;
+    if (size != sizeof(header) + hdr->key_count * sizeof(md5) || hdr->fanout[255] != hdr->key_count)
+        return result;
+    for (size_t i = 1; i != 256; ++i)
+        if (hdr->fanout[i] < hdr->fanout[i - 1])
+            return result;
+
+    result.mapping = std::move(mapping);
+    return result;
+}
+
+void object_index::create(file_location location, std::vector<md5> keys)
+{
+    std::sort(keys.begin(), keys.end(), key_less);
+    keys.erase(std::unique(keys.begin(), keys.end(), [](md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }), keys.end());
+
+    if (keys.size() > UINT32_MAX)
+        throw std::runtime_error("too many objects for object index");
+
+    std::vector<char> data(sizeof(header) + keys.size() * sizeof(md5));
+    header* hdr = reinterpret_cast<header*>(data.data());
+    memcpy(hdr->magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+    hdr->key_count = keys.size();
+
+    for (md5 const& key : keys)
+        ++hdr->fanout[key.data[0]];
+    for (size_t i = 1; i != 256; ++i)
+        hdr->fanout[i] += hdr->fanout[i - 1];
+
+    memcpy(hdr + 1, keys.data(), keys.size() * sizeof(md5));
+    write_whole_file(location, data);
+}
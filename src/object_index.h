@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "file_descriptor.h"
+#include "md5.h"
+
+// Sorted names of all objects, for resolving abbreviated names without
+// listing objects/. A 256-entry fanout table over the first byte narrows
+// a lookup to 1/256 of the keys before the binary search, so with 10M
+// objects a lookup touches a few dozen cache lines.
+//
+// Built by gc from a full listing; objects stored since then are in the
+// journals of the processes that stored them, which are turned into
+// smaller indexes of the same format (segments) once they are long.
+struct object_index
+{
+    object_index();
+    object_index(object_index&&) noexcept;
+    object_index& operator=(object_index&&) noexcept;
+    ~object_index();
+
+    explicit operator bool() const;
+
+    size_t size() const;
+    md5 const& key(size_t index) const;
+
+    // keys in [low, high] are at [begin, end)
+    void find_range(md5 const& low, md5 const& high, size_t& begin, size_t& end) const;
+
+    // returns an empty index if the file is missing or damaged
+    static object_index open_if_exists(file_location location);
+
+    // the caller is expected to rename it into place
+    static void create(file_location location, std::vector<md5> keys);
+
+private:
+    struct header;
+
+    header const* get_header() const;
+    md5 const* keys() const;
+
+private:
+    memory_mapping mapping;
+};
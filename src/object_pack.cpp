@@ -0,0 +1,402 @@
+#include "object_pack.h"
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <zlib.h>
+
+#include "delta.h"
+#include "stats.h"
+
+namespace
+{
+    char const PACK_MAGIC[8] = {'S', 'S', 'P', 'A', 'C', 'K', '0', '1'};
+
+    constexpr uint32_t NO_BASE = UINT32_MAX;
+
+    // a longer chain means a damaged pack, not a deep one
+    constexpr size_t MAX_CHAIN_LENGTH = 256;
+
+    // reconstructed bases kept per pack
+    constexpr size_t BASE_CACHE_SIZE = 32 * 1024 * 1024;
+
+    // smaller objects gain nothing from a delta, larger ones are too
+    // expensive to diff
+    constexpr size_t MIN_DELTA_SIZE = 64;
+    constexpr size_t MAX_DELTA_SIZE = 64 * 1024 * 1024;
+
+    // deflate expands at most 1032:1, a payload claiming more than that
+    // is a damaged entry and must not decide an allocation
+    constexpr uint64_t MAX_INFLATE_RATIO = 1032;
+    constexpr uint64_t MAX_INFLATE_OVERHEAD = 64;
+
+    std::vector<char> compress(std::vector<char> const& data)
+    {
+        uLongf size = compressBound(data.size());
+        std::vector<char> result(size);
+        if (compress2(reinterpret_cast<Bytef*>(result.data()), &size, reinterpret_cast<Bytef const*>(data.data()), data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw std::runtime_error("compress2 failed");
+        result.resize(size);
+        return result;
+    }
+
+    std::vector<char> decompress(char const* data, size_t size, size_t expected_size)
+    {
+        std::vector<char> result(expected_size);
+        uLongf result_size = expected_size;
+        if (uncompress(reinterpret_cast<Bytef*>(result.data()), &result_size, reinterpret_cast<Bytef const*>(data), size) != Z_OK || result_size != expected_size)
+            throw std::runtime_error("damaged pack entry");
+        return result;
+    }
+
+    bool is_similar_size(size_t a, size_t b)
+    {
+        return std::max(a, b) - std::min(a, b) <= std::max(a, b) / 2;
+    }
+}
+
+struct object_pack::header
+{
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t entries_offset;
+};
+
+struct object_pack::entry
+{
+    uint8_t hash[16];
+    uint64_t offset;
+    // of the object
+    uint64_t size;
+    // of the compressed data
+    uint64_t stored_size;
+    // of the data after decompression: the object or the delta
+    uint64_t payload_size;
+    uint32_t base;
+    uint32_t reserved;
+};
+
+// least recently used first
+struct object_pack::base_cache
+{
+    using value = std::shared_ptr<std::vector<char> const>;
+
+    value find(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto i = positions.find(index);
+        if (i == positions.end())
+            return nullptr;
+
+        order.splice(order.end(), order, i->second);
+        return i->second->second;
+    }
+
+    void insert(size_t index, value const& v)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (positions.count(index) || v->size() > BASE_CACHE_SIZE)
+            return;
+
+        positions[index] = order.insert(order.end(), {index, v});
+        total_size += v->size();
+
+        while (total_size > BASE_CACHE_SIZE)
+        {
+            total_size -= order.front().second->size();
+            positions.erase(order.front().first);
+            order.pop_front();
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::list<std::pair<size_t, value>> order;
+    std::unordered_map<size_t, std::list<std::pair<size_t, value>>::iterator> positions;
+    size_t total_size = 0;
+};
+
+object_pack::object_pack()
+    : data(nullptr)
+{}
+
+object_pack::object_pack(object_pack&& other) noexcept
+    : mapping(std::move(other.mapping))
+    , data(other.data)
+    , cache(std::move(other.cache))
+{
+    other.data = nullptr;
+}
+
+object_pack& object_pack::operator=(object_pack&& rhs) noexcept
+{
+    mapping = std::move(rhs.mapping);
+    data = rhs.data;
+    cache = std::move(rhs.cache);
+    rhs.data = nullptr;
+    return *this;
+}
+
+object_pack::~object_pack()
+{}
+
+object_pack::operator bool() const
+{
+    return data != nullptr;
+}
+
+object_pack::entry const* object_pack::entries() const
+{
+    header const* hdr = reinterpret_cast<header const*>(data);
+    return reinterpret_cast<entry const*>(data + hdr->entries_offset);
+}
+
+size_t object_pack::size() const
+{
+    return data ? reinterpret_cast<header const*>(data)->entry_count : 0;
+}
+
+md5 object_pack::hash(size_t index) const
+{
+    md5 result;
+    memcpy(result.data, entries()[index].hash, sizeof result.data);
+    return result;
+}
+
+uint64_t object_pack::object_size(size_t index) const
+{
+    return entries()[index].size;
+}
+
+bool object_pack::find(md5 const& hash, size_t& index) const
+{
+    entry const* first = entries();
+    entry const* last = first + size();
+    entry const* i = std::lower_bound(first, last, hash, [](entry const& e, md5 const& h)
+    {
+        return memcmp(e.hash, h.data, sizeof e.hash) < 0;
+    });
+
+    if (i == last || memcmp(i->hash, hash.data, sizeof i->hash) != 0)
+        return false;
+
+    index = static_cast<size_t>(i - first);
+    return true;
+}
+
+void object_pack::find_range(md5 const& low, md5 const& high, size_t& begin, size_t& end) const
+{
+    entry const* first = entries();
+    entry const* last = first + size();
+    begin = std::lower_bound(first, last, low, [](entry const& e, md5 const& h)
+    {
+        return memcmp(e.hash, h.data, sizeof e.hash) < 0;
+    }) - first;
+    end = std::upper_bound(first + begin, last, high, [](md5 const& h, entry const& e)
+    {
+        return memcmp(h.data, e.hash, sizeof e.hash) < 0;
+    }) - first;
+}
+
+std::vector<char> object_pack::read(size_t index) const
+{
+    return reconstruct(index, 0);
+}
+
+std::vector<char> object_pack::reconstruct(size_t index, size_t depth) const
+{
+    if (depth > MAX_CHAIN_LENGTH)
+        throw std::runtime_error("damaged pack: delta chain is too long");
+
+    entry const& e = entries()[index];
+    std::vector<char> payload = decompress(data + e.offset, e.stored_size, e.payload_size);
+    if (e.base == NO_BASE)
+    {
+        if (payload.size() != e.size)
+            throw std::runtime_error("damaged pack entry");
+        return payload;
+    }
+
+    std::shared_ptr<std::vector<char> const> base = read_base(e.base, depth + 1);
+    std::vector<char> result = apply_delta(base->data(), base->size(), payload.data(), payload.size());
+    if (result.size() != e.size)
+        throw std::runtime_error("damaged pack entry");
+    return result;
+}
+
+std::shared_ptr<std::vector<char> const> object_pack::read_base(size_t index, size_t depth) const
+{
+    if (auto cached = cache->find(index))
+        return cached;
+
+    auto result = std::make_shared<std::vector<char> const>(reconstruct(index, depth));
+    cache->insert(index, result);
+    return result;
+}
+
+bool object_pack::is_valid(char const* data, size_t size)
+{
+    if (size < sizeof(header))
+        return false;
+
+    header const* hdr = reinterpret_cast<header const*>(data);
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof PACK_MAGIC) != 0)
+        return false;
+    if (hdr->entries_offset < sizeof(header) || hdr->entries_offset % alignof(entry) != 0 || hdr->entries_offset > size)
+        return false;
+    if (size - hdr->entries_offset != uint64_t(hdr->entry_count) * sizeof(entry))
+        return false;
+
+    entry const* e = reinterpret_cast<entry const*>(data + hdr->entries_offset);
+    for (size_t i = 0; i != hdr->entry_count; ++i)
+    {
+        if (e[i].offset < sizeof(header) || e[i].offset > hdr->entries_offset || e[i].stored_size > hdr->entries_offset - e[i].offset)
+            return false;
+        if (e[i].base != NO_BASE && (e[i].base >= hdr->entry_count || e[i].base == i))
+            return false;
+
+        // the payload is the object itself, or a delta write_pack kept
+        // only because it is smaller than the object
+        if (e[i].base == NO_BASE ? e[i].payload_size != e[i].size : e[i].payload_size >= e[i].size)
+            return false;
+        if (e[i].payload_size > e[i].stored_size * MAX_INFLATE_RATIO + MAX_INFLATE_OVERHEAD)
+            return false;
+        if (i != 0 && memcmp(e[i - 1].hash, e[i].hash, sizeof e[i].hash) >= 0)
+            return false;
+    }
+
+    return true;
+}
+
+object_pack object_pack::map(file_descriptor const& fd)
+{
+    object_pack result;
+
+    size_t size = static_cast<size_t>(fd.stat().st_size);
+    if (size < sizeof(header))
+        return result;
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read, map_flags::private_);
+    if (!is_valid(static_cast<char const*>(mapping.data()), size))
+        return result;
+
+    result.mapping = std::move(mapping);
+    result.data = static_cast<char const*>(result.mapping.data());
+    result.cache = std::make_unique<base_cache>();
+    return result;
+}
+
+void write_pack(file_descriptor& out, std::vector<pack_input> objects, pack_options const& options, std::function<std::vector<char>(md5 const&)> const& load)
+{
+    using entry = object_pack::entry;
+    using header = object_pack::header;
+
+    std::sort(objects.begin(), objects.end(), [](pack_input const& a, pack_input const& b)
+    {
+        return memcmp(a.hash.data, b.hash.data, sizeof a.hash.data) < 0;
+    });
+    objects.erase(std::unique(objects.begin(), objects.end(), [](pack_input const& a, pack_input const& b)
+    {
+        return memcmp(a.hash.data, b.hash.data, sizeof a.hash.data) == 0;
+    }), objects.end());
+
+    if (objects.size() >= NO_BASE)
+        throw std::runtime_error("too many objects for one pack");
+
+    // versions of one file end up next to each other, largest first:
+    // deleting is cheaper to encode than inserting
+    std::vector<uint32_t> order(objects.size());
+    for (size_t i = 0; i != order.size(); ++i)
+        order[i] = static_cast<uint32_t>(i);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+    {
+        pack_input const& x = objects[a];
+        pack_input const& y = objects[b];
+        if (x.name.empty() != y.name.empty())
+            return y.name.empty();
+        if (x.name != y.name)
+            return x.name < y.name;
+        return x.size > y.size;
+    });
+
+    struct candidate
+    {
+        uint32_t index;
+        size_t depth;
+        std::vector<char> data;
+    };
+
+    std::vector<entry> entries(objects.size());
+    std::vector<candidate> window;
+    uint64_t offset = sizeof(header);
+
+    header hdr = {};
+    out.write(&hdr, sizeof hdr);
+
+    for (uint32_t index : order)
+    {
+        std::vector<char> data = load(objects[index].hash);
+
+        std::vector<char> best;
+        candidate const* best_base = nullptr;
+        if (data.size() >= MIN_DELTA_SIZE && data.size() <= MAX_DELTA_SIZE)
+        {
+            // most recent first, those are the likeliest relatives
+            for (size_t i = window.size(); i-- != 0;)
+            {
+                candidate const& c = window[i];
+                if (c.depth >= options.max_depth || !is_similar_size(c.data.size(), data.size()))
+                    continue;
+
+                std::vector<char> delta = create_delta(c.data.data(), c.data.size(), data.data(), data.size());
+                if (delta.size() < data.size() / 2 && (!best_base || delta.size() < best.size()))
+                {
+                    best = std::move(delta);
+                    best_base = &c;
+                }
+            }
+        }
+
+        std::vector<char> stored = compress(best_base ? best : data);
+        out.write(stored.data(), stored.size());
+
+        entry& e = entries[index];
+        memcpy(e.hash, objects[index].hash.data, sizeof e.hash);
+        e.offset = offset;
+        e.size = data.size();
+        e.stored_size = stored.size();
+        e.payload_size = best_base ? best.size() : data.size();
+        e.base = best_base ? best_base->index : NO_BASE;
+        offset += stored.size();
+
+        stats::add(stats::counter::objects_packed);
+        if (best_base)
+            stats::add(stats::counter::deltas_written);
+
+        size_t depth = best_base ? best_base->depth + 1 : 0;
+        if (options.window != 0 && data.size() <= MAX_DELTA_SIZE)
+        {
+            if (window.size() == options.window)
+                window.erase(window.begin());
+            window.push_back({index, depth, std::move(data)});
+        }
+    }
+
+    // entries are indexed by their position in md5 order, which is the
+    // order of objects
+    uint64_t padding = (alignof(entry) - offset % alignof(entry)) % alignof(entry);
+    char zeros[alignof(entry)] = {};
+    out.write(zeros, padding);
+    out.write(entries.data(), entries.size() * sizeof(entry));
+
+    memcpy(hdr.magic, PACK_MAGIC, sizeof PACK_MAGIC);
+    hdr.entry_count = static_cast<uint32_t>(entries.size());
+    hdr.entries_offset = offset + padding;
+    out.seek(0);
+    out.write(&hdr, sizeof hdr);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_descriptor.h"
+#include "md5.h"
+
+struct pack_options;
+struct pack_input;
+
+// Many objects in one immutable file, each compressed with zlib and, when
+// a similar object is in the same pack, stored as a delta against it (see
+// delta.h). Packs are written by repack; the repository looks objects up
+// in them after the loose ones.
+//
+// Layout: header, the data of every entry, then the entries sorted by
+// md5. An entry is either a whole object or a delta against another entry
+// of the same pack; delta chains are at most pack_options::max_depth long.
+struct object_pack
+{
+    object_pack();
+    object_pack(object_pack&&) noexcept;
+    object_pack& operator=(object_pack&&) noexcept;
+    ~object_pack();
+
+    // returns an empty pack (operator bool is false) if the file is not a
+    // valid pack
+    static object_pack map(file_descriptor const& fd);
+
+    size_t size() const;
+    md5 hash(size_t index) const;
+    uint64_t object_size(size_t index) const;
+
+    bool find(md5 const& hash, size_t& index) const;
+
+    // entries with hashes in [low, high] are at [begin, end)
+    void find_range(md5 const& low, md5 const& high, size_t& begin, size_t& end) const;
+
+    // reconstructs the object; bases met on the way are cached, so reading
+    // successive versions of a file decompresses each base only once.
+    // Throws if the entry is damaged
+    std::vector<char> read(size_t index) const;
+
+    explicit operator bool() const;
+
+private:
+    struct header;
+    struct entry;
+    struct base_cache;
+
+    static bool is_valid(char const* data, size_t size);
+
+    entry const* entries() const;
+    std::vector<char> reconstruct(size_t index, size_t depth) const;
+    std::shared_ptr<std::vector<char> const> read_base(size_t index, size_t depth) const;
+
+private:
+    memory_mapping mapping;
+    char const* data;
+    std::unique_ptr<base_cache> cache;
+
+    friend void write_pack(file_descriptor& out, std::vector<pack_input> objects, pack_options const& options, std::function<std::vector<char>(md5 const&)> const& load);
+};
+
+struct pack_options
+{
+    // how many preceding objects are tried as delta bases
+    size_t window = 10;
+    size_t max_depth = 16;
+};
+
+struct pack_input
+{
+    md5 hash;
+    uint64_t size;
+    // file name the object was last seen under, empty if unknown; objects
+    // with equal names are tried as bases for each other first
+    std::string name;
+};
+
+// writes a pack of the objects to out, load returns the contents of one
+void write_pack(file_descriptor& out, std::vector<pack_input> objects, pack_options const& options, std::function<std::vector<char>(md5 const&)> const& load);
@@ -0,0 +1,328 @@
+#include "output_writer.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#include "stats.h"
+
+namespace
+{
+    // a few thousand entries per write()
+    constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+    char const BINARY_MAGIC[8] = {'S', 'S', 'L', 'I', 'S', 'T', '0', '1'};
+
+    // the characters the format has to escape in a path, 0 if none
+    char escape_for(output_format format, unsigned char c)
+    {
+        switch (c)
+        {
+        case '\\':
+            return '\\';
+        case '\t':
+            return 't';
+        case '\n':
+            return 'n';
+        case '\r':
+            return 'r';
+        case '"':
+            return format == output_format::ndjson ? '"' : 0;
+        }
+
+        // \u00XX, only JSON can't have the other control characters
+        if (c < 0x20 && format == output_format::ndjson)
+            return 'u';
+
+        return 0;
+    }
+
+    // strict UTF-8: no overlong forms, surrogates or code points past
+    // U+10FFFF, which JSON parsers reject or mangle
+    bool is_utf8(std::string_view str)
+    {
+        for (size_t i = 0; i != str.size();)
+        {
+            unsigned char c = static_cast<unsigned char>(str[i]);
+            if (c < 0x80)
+            {
+                ++i;
+                continue;
+            }
+
+            size_t length;
+            unsigned char min = 0x80;
+            unsigned char max = 0xbf;
+            if (c >= 0xc2 && c <= 0xdf)
+                length = 2;
+            else if (c >= 0xe0 && c <= 0xef)
+            {
+                length = 3;
+                if (c == 0xe0)
+                    min = 0xa0;
+                else if (c == 0xed)
+                    max = 0x9f;
+            }
+            else if (c >= 0xf0 && c <= 0xf4)
+            {
+                length = 4;
+                if (c == 0xf0)
+                    min = 0x90;
+                else if (c == 0xf4)
+                    max = 0x8f;
+            }
+            else
+                return false;
+
+            if (str.size() - i < length)
+                return false;
+
+            // only the second byte has a narrower range
+            for (size_t j = 1; j != length; ++j)
+            {
+                unsigned char next = static_cast<unsigned char>(str[i + j]);
+                if (next < (j == 1 ? min : 0x80) || next > (j == 1 ? max : 0xbf))
+                    return false;
+            }
+
+            i += length;
+        }
+
+        return true;
+    }
+}
+
+output_format parse_output_format(char const* value)
+{
+    if (!strcmp(value, "text"))
+        return output_format::text;
+    if (!strcmp(value, "tsv"))
+        return output_format::tsv;
+    if (!strcmp(value, "ndjson"))
+        return output_format::ndjson;
+    if (!strcmp(value, "binary"))
+        return output_format::binary;
+
+    throw std::runtime_error(std::string("unknown output format: ") + value);
+}
+
+output_writer::output_writer(int fd, output_format format)
+    : fd(fd)
+    , fmt(format)
+    , buffer(BUFFER_SIZE)
+    , used(0)
+{
+    if (fmt == output_format::binary)
+        write(BINARY_MAGIC, sizeof BINARY_MAGIC);
+}
+
+output_writer::~output_writer()
+{
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {}
+}
+
+output_format output_writer::format() const
+{
+    return fmt;
+}
+
+char* output_writer::reserve(size_t size)
+{
+    assert(size <= buffer.size());
+
+    if (buffer.size() - used < size)
+        flush();
+
+    char* result = buffer.data() + used;
+    used += size;
+    return result;
+}
+
+void output_writer::write(char const* data, size_t size)
+{
+    if (size <= buffer.size() - used)
+    {
+        memcpy(buffer.data() + used, data, size);
+        used += size;
+        return;
+    }
+
+    if (size < buffer.size() / 2)
+    {
+        flush();
+        memcpy(buffer.data(), data, size);
+        used = size;
+        return;
+    }
+
+    iovec iov[2] = {{buffer.data(), used}, {const_cast<char*>(data), size}};
+    write_out(iov, 2);
+    used = 0;
+}
+
+void output_writer::write(std::string_view str)
+{
+    write(str.data(), str.size());
+}
+
+void output_writer::put(char c)
+{
+    *reserve(1) = c;
+}
+
+void output_writer::write_hex(md5 const& hash)
+{
+    md5_to_hex(hash, reserve(32));
+}
+
+void output_writer::write_escaped(std::string_view str)
+{
+    static char const hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+    // paths rarely need escaping, the runs between escapes are copied
+    // whole
+    size_t start = 0;
+    for (size_t i = 0; i != str.size(); ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        char escape = escape_for(fmt, c);
+        if (escape == 0)
+            continue;
+
+        write(str.data() + start, i - start);
+        start = i + 1;
+
+        if (escape == 'u')
+        {
+            char* out = reserve(6);
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c / 16];
+            out[5] = hex[c % 16];
+        }
+        else
+        {
+            char* out = reserve(2);
+            out[0] = '\\';
+            out[1] = escape;
+        }
+    }
+
+    write(str.data() + start, str.size() - start);
+}
+
+void output_writer::write_base64(std::string_view str)
+{
+    static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (size_t i = 0; i < str.size(); i += 3)
+    {
+        size_t count = std::min<size_t>(3, str.size() - i);
+        uint32_t group = 0;
+        for (size_t j = 0; j != count; ++j)
+            group |= static_cast<uint32_t>(static_cast<unsigned char>(str[i + j])) << (16 - 8 * j);
+
+        char* out = reserve(4);
+        for (size_t j = 0; j != 4; ++j)
+            out[j] = j <= count ? alphabet[(group >> (18 - 6 * j)) & 0x3f] : '=';
+    }
+}
+
+void output_writer::write_entry(std::string_view path, md5 const& hash)
+{
+    switch (fmt)
+    {
+    case output_format::text:
+        throw std::logic_error("write_entry called for text output");
+
+    case output_format::tsv:
+        write_hex(hash);
+        put('\t');
+        write_escaped(path);
+        put('\n');
+        break;
+
+    case output_format::ndjson:
+        if (is_utf8(path))
+        {
+            write("{\"path\":\"");
+            write_escaped(path);
+        }
+        else
+        {
+            write("{\"path_base64\":\"");
+            write_base64(path);
+        }
+        write("\",\"md5\":\"");
+        write_hex(hash);
+        write("\"}\n");
+        break;
+
+    case output_format::binary:
+    {
+        if (path.size() > UINT32_MAX)
+            throw std::runtime_error("path too long for binary output");
+
+        uint32_t length = static_cast<uint32_t>(path.size());
+        char* out = reserve(sizeof hash.data + 4);
+        memcpy(out, hash.data, sizeof hash.data);
+        for (size_t i = 0; i != 4; ++i)
+            out[sizeof hash.data + i] = static_cast<char>(length >> (8 * i));
+        write(path);
+        break;
+    }
+    }
+}
+
+void output_writer::flush()
+{
+    if (used == 0)
+        return;
+
+    iovec iov = {buffer.data(), used};
+    write_out(&iov, 1);
+    used = 0;
+}
+
+void output_writer::write_out(iovec* iov, int count)
+{
+    stats::scoped_timer timer(stats::phase::write);
+
+    // a pipe takes what fits, the rest is written by the next call
+    while (count != 0)
+    {
+        stats::add(stats::counter::syscalls);
+        ssize_t bytes_written = ::writev(fd, iov, count);
+        if (bytes_written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("write of output failed: ") + strerror(errno));
+        }
+
+        stats::add(stats::counter::bytes_written, static_cast<uint64_t>(bytes_written));
+
+        size_t left = static_cast<size_t>(bytes_written);
+        while (count != 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count != 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+}
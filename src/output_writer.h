@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+#include "md5.h"
+
+// --format= of the commands that list (path, md5) pairs:
+//
+//   text     the human-readable format of each command (default)
+//   tsv      "<md5>\t<path>\n", backslash, tab, CR and LF in paths are
+//            escaped as \\, \t, \r and \n
+//   ndjson   {"path":"...","md5":"..."} per line; a path that isn't
+//            valid UTF-8 can't be a JSON string, it is written as
+//            {"path_base64":"...","md5":"..."} instead, the exact bytes
+//            in standard base64 with padding
+//   binary   the magic "SSLIST01", then per entry the 16 bytes of the
+//            md5, the length of the path as a 32-bit little-endian
+//            integer and the path, not terminated
+enum class output_format
+{
+    text,
+    tsv,
+    ndjson,
+    binary,
+};
+
+output_format parse_output_format(char const* value);
+
+// Buffered writer for the large outputs of listing commands. Output is
+// collected in a pooled buffer and written in one write() per buffer
+// instead of going through iostreams a character at a time; data larger
+// than half the buffer is written together with the buffered part by
+// one writev() without being copied. Not thread-safe.
+struct output_writer
+{
+    output_writer(int fd, output_format format);
+    output_writer(output_writer const&) = delete;
+    output_writer& operator=(output_writer const&) = delete;
+
+    // flushes, but errors are lost then: call flush() at the end
+    ~output_writer();
+
+    output_format format() const;
+
+    void write(char const* data, size_t size);
+    void write(std::string_view str);
+    void put(char c);
+    void write_hex(md5 const& hash);
+
+    // one entry in the format given to the constructor, which mustn't be
+    // text: the text formats differ between commands, they print it with
+    // the functions above
+    void write_entry(std::string_view path, md5 const& hash);
+
+    void flush();
+
+private:
+    char* reserve(size_t size);
+    void write_escaped(std::string_view str);
+    void write_base64(std::string_view str);
+    void write_out(iovec* iov, int count);
+
+private:
+    int fd;
+    output_format fmt;
+    pooled_buffer buffer;
+    size_t used;
+};
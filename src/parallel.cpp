@@ -0,0 +1,46 @@
+#include "parallel.h"
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+void run_parallel(size_t thread_count, std::function<void(std::atomic<bool> const& stop)> const& body)
+{
+    std::atomic<bool> stop{false};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto guarded = [&]
+    {
+        try
+        {
+            body(stop);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            stop = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    try
+    {
+        for (size_t i = 1; i < thread_count; ++i)
+            threads.emplace_back(guarded);
+    }
+    catch (...)
+    {
+        // failed to start some threads, the remaining ones do the work
+    }
+
+    guarded();
+
+    for (std::thread& t : threads)
+        t.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+// runs body on thread_count threads (including the calling one), stop is
+// set once any of them throws; rethrows the first exception after all of
+// them finish
+void run_parallel(size_t thread_count, std::function<void(std::atomic<bool> const& stop)> const& body);
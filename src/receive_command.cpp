@@ -0,0 +1,39 @@
+#include <cstddef>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "file_descriptor.h"
+#include "repository.h"
+#include "sync.h"
+
+// receive
+// the other end of send: the protocol runs over stdin and stdout
+void receive_command(size_t argc, char* argv[])
+{
+    (void)argv;
+
+    if (argc != 0)
+        throw std::runtime_error("receive takes no arguments");
+
+    repository repo(default_repository_root());
+
+    // stdin and stdout are not ours to close
+    file_descriptor input = file_descriptor::attach(STDIN_FILENO);
+    file_descriptor output = file_descriptor::attach(STDOUT_FILENO);
+    try
+    {
+        sync_receive(repo, input, output);
+    }
+    catch (...)
+    {
+        input.release();
+        output.release();
+        throw;
+    }
+
+    input.release();
+    output.release();
+
+    repo.flush_shared_tier();
+    repo.enforce_capacity();
+}
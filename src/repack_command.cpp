@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "command_line.h"
+#include "object_pack.h"
+#include "repository.h"
+#include "tree_object.h"
+
+namespace
+{
+    bool hash_less(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    }
+
+    // a tree and the name of an entry in it
+    using tree_entry_ref = std::pair<md5, std::string>;
+    using tree_map = std::map<md5, tree_entry_ref, bool (*)(md5 const&, md5 const&)>;
+
+    // "a/b/" for the tree of a/b, empty for a snapshot root; trees are
+    // named under the first parent seen, shared subtrees are resolved once
+    std::string const& tree_path(md5 const& tree, tree_map const& parents, std::map<md5, std::string, bool (*)(md5 const&, md5 const&)>& paths)
+    {
+        auto known = paths.find(tree);
+        if (known != paths.end())
+            return known->second;
+
+        // up to a root or a tree with a known path; content addressing
+        // rules out cycles unless the store is damaged, the bound covers
+        // that
+        std::vector<md5> chain;
+        std::string prefix;
+        for (md5 current = tree;;)
+        {
+            auto p = parents.find(current);
+            if (p == parents.end() || chain.size() > parents.size())
+                break;
+
+            chain.push_back(current);
+            current = p->second.first;
+
+            auto k = paths.find(current);
+            if (k != paths.end())
+            {
+                prefix = k->second;
+                break;
+            }
+        }
+
+        for (size_t i = chain.size(); i-- != 0;)
+        {
+            prefix += parents.find(chain[i])->second.second + "/";
+            paths.emplace(chain[i], prefix);
+        }
+
+        return paths.emplace(tree, prefix).first->second;
+    }
+
+    // the path every file object was first seen under in a snapshot,
+    // relative to the snapshot root, sorted by hash. Full paths, so that
+    // same-named files in different directories (every CMakeLists.txt)
+    // aren't tried as bases for each other
+    std::vector<std::pair<md5, std::string>> collect_names(repository& repo)
+    {
+        tree_map parents(hash_less);
+        std::vector<std::pair<md5, tree_entry_ref>> files;
+
+        for (md5 const& hash : repo.list_objects())
+        {
+            file_descriptor fd = repo.open_object(hash);
+            if (!fd)
+                continue;
+
+            char magic[16];
+            size_t size = 0;
+            while (size != sizeof magic)
+            {
+                size_t n = fd.read_some(magic + size, sizeof magic - size);
+                if (n == 0)
+                    break;
+                size += n;
+            }
+            if (!looks_like_tree(magic, size))
+                continue;
+
+            fd.seek(0);
+            for (tree_entry const& entry : parse_tree(read_whole_file(fd)))
+            {
+                if (entry.mode == tree_entry_mode::directory)
+                    parents.emplace(entry.hash, tree_entry_ref(hash, entry.name));
+                else
+                    files.emplace_back(entry.hash, tree_entry_ref(hash, entry.name));
+            }
+        }
+
+        std::map<md5, std::string, bool (*)(md5 const&, md5 const&)> paths(hash_less);
+        std::vector<std::pair<md5, std::string>> result;
+        for (auto const& file : files)
+            result.emplace_back(file.first, tree_path(file.second.first, parents, paths) + file.second.second);
+
+        std::stable_sort(result.begin(), result.end(), [](auto const& a, auto const& b)
+        {
+            return hash_less(a.first, b.first);
+        });
+        return result;
+    }
+}
+
+// repack [--window=N] [--depth=N]
+//
+// moves all objects into a single pack, storing versions of the same file
+// as deltas against each other. Paths in snapshot trees decide which
+// objects are tried as bases; window is how many, depth bounds the delta
+// chains and so the cost of reading an object back.
+void repack_command(size_t argc, char* argv[])
+{
+    pack_options options;
+
+    for (; argc != 0; --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "window", value))
+            options.window = parse_count("window", value);
+        else if (match_option(*argv, "depth", value))
+            options.max_depth = parse_count("depth", value);
+        else
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+    }
+
+    repository repo(default_repository_root());
+    std::vector<std::pair<md5, std::string>> names = collect_names(repo);
+
+    repo.repack(options, [&](md5 const& hash) -> std::string
+    {
+        auto i = std::lower_bound(names.begin(), names.end(), hash, [](auto const& entry, md5 const& h)
+        {
+            return hash_less(entry.first, h);
+        });
+        if (i == names.end() || memcmp(i->first.data, hash.data, sizeof hash.data) != 0)
+            return std::string();
+        return i->second;
+    });
+}
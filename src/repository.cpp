@@ -1,6 +1,150 @@
 #include "repository.h"
 #include <cstdlib>
-#include "file_descriptor.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <time.h>
+#include <utility>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "md5_accumulator.h"
+#include "sha256.h"
+#include "stats.h"
+
+namespace
+{
+    char const FILTER_FILENAME[] = "objects.filter";
+    char const MD5_INDEX_DIRNAME[] = "md5";
+    char const CLOCK_FILENAME[] = "objects.clock";
+    char const PACKS_DIRNAME[] = "packs";
+    char const PACK_SUFFIX[] = ".pack";
+    char const MANIFESTS_DIRNAME[] = "manifests";
+    char const MANIFEST_CACHE_FILENAME[] = "objects.manifest";
+    char const INDEX_DIRNAME[] = "index";
+    char const INDEX_SUFFIX[] = ".idx";
+    char const JOURNAL_SUFFIX[] = ".journal";
+
+    // single files written by every process, replaced by index/
+    char const OLD_INDEX_FILENAME[] = "objects.index";
+    char const OLD_JOURNAL_FILENAME[] = "objects.journal";
+
+    // a journal this long is sorted into an index segment
+    constexpr size_t JOURNAL_SEAL_RECORDS = 64 * 1024;
+
+    // a reader that finds a file of its manifest removed loads a newer one
+    constexpr size_t MAX_MANIFEST_ATTEMPTS = 16;
+
+    constexpr size_t STREAM_CHUNK_SIZE = 256 * 1024;
+
+    // O_DIRECT reads have no readahead behind them, they have to be large
+    constexpr size_t DIRECT_CHUNK_SIZE = pooled_buffer::HUGE_PAGE_SIZE;
+    constexpr size_t HASH_PIECE_SIZE = 16 * 1024;
+
+    // write-backs are handed to the background thread in batches
+    constexpr size_t UPLOAD_BATCH_SIZE = 256;
+
+    std::string make_temporary_name()
+    {
+        static std::atomic<unsigned> counter;
+        return "tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    }
+
+    // see pack_set
+    constexpr int64_t RACY_WINDOW_NS = 1000000000;
+
+    int64_t to_ns(struct timespec const& ts)
+    {
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    std::string make_journal_name()
+    {
+        static std::atomic<unsigned> counter;
+        return std::to_string(getpid()) + "." + std::to_string(counter++) + JOURNAL_SUFFIX;
+    }
+
+    bool has_suffix(char const* name, char const* suffix)
+    {
+        size_t len = strlen(name);
+        size_t suffix_len = strlen(suffix);
+        return len > suffix_len && !strcmp(name + len - suffix_len, suffix);
+    }
+
+    // names in dir with the suffix, nothing if dir doesn't exist
+    std::vector<std::string> list_files(int root_fd, char const* dirname, char const* suffix)
+    {
+        std::vector<std::string> result;
+
+        file_descriptor fd = file_descriptor::open_if_exists({root_fd, dirname}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+        if (!fd)
+            return result;
+
+        directory_stream dir(std::move(fd));
+        while (directory_stream::dirent const* ent = dir.next())
+            if (has_suffix(ent->d_name, suffix))
+                result.push_back(ent->d_name);
+
+        return result;
+    }
+
+    bool contains(std::vector<std::string> const& names, std::string const& name)
+    {
+        return std::find(names.begin(), names.end(), name) != names.end();
+    }
+
+    bool md5_less(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    }
+
+    std::vector<md5> parse_journal(std::vector<char> const& data)
+    {
+        // a torn last record is ignored
+        std::vector<md5> result(data.size() / sizeof(md5));
+        memcpy(result.data(), data.data(), result.size() * sizeof(md5));
+        return result;
+    }
+
+    std::string hash_file_name(std::vector<md5> const& hashes, char const* suffix)
+    {
+        char hex[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(md5_hash(reinterpret_cast<char const*>(hashes.data()), hashes.size() * sizeof(md5)), hex);
+        return hex + std::string(suffix);
+    }
+
+    std::vector<md5> scan_objects(int objects_fd)
+    {
+        std::vector<md5> result;
+
+        directory_stream dir(file_descriptor::open(file_location(objects_fd, "."), file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+        while (directory_stream::dirent const* ent = dir.next())
+        {
+            md5 hash;
+            if (md5_from_hex(ent->d_name, strlen(ent->d_name), hash))
+                result.push_back(hash);
+        }
+
+        return result;
+    }
+}
+
+struct repository::pack_set
+{
+    std::vector<object_pack> packs;
+
+    // of the manifest listing the packs, compared with the cached one
+    uint64_t generation = 0;
+
+    // without a manifest cache: manifests/ when the newest manifest was
+    // loaded, every new generation changes the directory. Timestamps are
+    // coarse, a change in the same tick as the load is invisible, so a
+    // set loaded right after a change is never considered current
+    bool exists = false;
+    bool racy = false;
+    uint64_t inode = 0;
+    int64_t mtime_ns = 0;
+};
 
 can_not_detect_default_repository_root::can_not_detect_default_repository_root()
     : runtime_error("can not detect default repository root: XDG_CACHE_HOME and HOME environment variables are not set")
@@ -17,13 +161,39 @@ std::string default_repository_root()
     throw can_not_detect_default_repository_root();
 }
 
-void init_new_repository(std::string const& repository_root)
+md5 resolve_object_name(repository& repo, char const* name)
+{
+    // full names may refer to objects of the shared tier, they are not
+    // looked up here
+    md5 result;
+    if (md5_from_hex(name, strlen(name), result))
+        return result;
+
+    switch (repo.resolve_prefix(name, strlen(name), result))
+    {
+    case prefix_match::unique:
+        return result;
+    case prefix_match::ambiguous:
+        throw std::runtime_error(std::string("ambiguous object name: ") + name);
+    case prefix_match::none:
+        break;
+    }
+    throw std::runtime_error(std::string("no object named ") + name);
+}
+
+void init_new_repository(std::string const& repository_root, repository_config const& config)
 {
     mkdir(repository_root);
     try
     {
         file_descriptor root = file_descriptor::open(repository_root, file_flags::read_only | file_flags::close_on_exec | file_flags::directory);
         mkdir({root.get_fd(), "objects"});
+        if (config.hash != object_hash::md5)
+            mkdir({root.get_fd(), MD5_INDEX_DIRNAME});
+        object_filter::create({root.get_fd(), FILTER_FILENAME}, {});
+        if (config.capacity != 0)
+            object_clock::create({root.get_fd(), CLOCK_FILENAME}, config.hash != object_hash::md5);
+        config.save(root.get_fd());
     }
     catch (...)
     {
@@ -31,3 +201,1271 @@ void init_new_repository(std::string const& repository_root)
         throw;
     }
 }
+
+repository::repository(std::string const& root)
+    : root(file_descriptor::open(root, file_flags::read_only | file_flags::directory | file_flags::close_on_exec))
+    , config(repository_config::load(this->root.get_fd()))
+    , objects_dir(file_descriptor::open({this->root.get_fd(), "objects"}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec))
+    , filter(nullptr)
+    , clock(nullptr)
+    , packs(nullptr)
+    , journal_records(0)
+    , tier_busy(false)
+    , tier_stop(false)
+{
+    if (config.hash != object_hash::md5)
+        md5_index_dir = file_descriptor::open({this->root.get_fd(), MD5_INDEX_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    // repositories created before the filter was introduced don't have one
+    // until the next gc, all lookups go to the filesystem then
+    object_filter f = object_filter::open_if_exists({this->root.get_fd(), FILTER_FILENAME});
+    if (f)
+    {
+        filters.push_back(std::make_unique<object_filter>(std::move(f)));
+        filter = filters.back().get();
+    }
+
+    if (config.capacity != 0)
+    {
+        object_clock c = object_clock::open_if_exists({this->root.get_fd(), CLOCK_FILENAME});
+        if (!c)
+        {
+            // lost somehow: start a new one, objects already stored are
+            // not accounted for until they are added again
+            std::string tmp_name = std::string(CLOCK_FILENAME) + "." + make_temporary_name();
+            object_clock::create({this->root.get_fd(), tmp_name}, config.hash != object_hash::md5);
+            link_if_not_exists({this->root.get_fd(), tmp_name}, {this->root.get_fd(), CLOCK_FILENAME});
+            unlink({this->root.get_fd(), tmp_name});
+            c = object_clock::open_if_exists({this->root.get_fd(), CLOCK_FILENAME});
+        }
+
+        clocks.push_back(std::make_unique<object_clock>(std::move(c)));
+        clock = clocks.back().get();
+    }
+
+    // packs are mapped on first use, many commands never need them
+    cached_manifest = manifest_cache::open({this->root.get_fd(), MANIFEST_CACHE_FILENAME});
+
+    if (!config.shared.empty())
+        shared = std::make_unique<repository>(config.shared);
+}
+
+repository::~repository()
+{
+    // pending write-backs are dropped here; their objects stay pinned
+    // against eviction until upload_missing_to_shared_tier copies them
+    {
+        std::lock_guard<std::mutex> lock(tier_mutex);
+        tier_stop = true;
+    }
+    tier_cv.notify_all();
+
+    if (tier_worker.joinable())
+        tier_worker.join();
+}
+
+repository_config const& repository::get_config() const
+{
+    return config;
+}
+
+bool repository::has_object(md5 const& hash)
+{
+    if (has_local_object(hash))
+        return true;
+
+    if (!shared || !shared->has_object(hash))
+        return false;
+
+    enqueue_promotion(hash);
+    return true;
+}
+
+file_descriptor repository::open_object(md5 const& hash)
+{
+    file_descriptor fd = open_local_object(hash);
+    if (fd)
+    {
+        touch_object(hash);
+        return fd;
+    }
+
+    if (!shared)
+        return fd;
+
+    fd = shared->open_object(hash);
+    if (fd)
+        enqueue_promotion(hash);
+    return fd;
+}
+
+bool repository::has_local_object(md5 const& hash)
+{
+    object_filter const* f = filter.load(std::memory_order_acquire);
+    if (f && !f->may_contain(hash))
+        return false;
+
+    char name[MD5_HEX_LENGTH + 1] = {};
+    md5_to_hex(hash, name);
+    if (!file_exists({get_md5_dir_fd(), name}))
+    {
+        object_pack const* pack;
+        size_t index;
+        return find_packed(hash, pack, index);
+    }
+
+    touch_object(hash);
+    return true;
+}
+
+file_descriptor repository::open_local_object(md5 const& hash)
+{
+    char name[MD5_HEX_LENGTH + 1] = {};
+    md5_to_hex(hash, name);
+
+    file_descriptor fd = file_descriptor::open_if_exists({get_md5_dir_fd(), name}, file_flags::read_only | file_flags::close_on_exec);
+    if (fd)
+        return fd;
+
+    object_pack const* pack;
+    size_t index;
+    if (find_packed(hash, pack, index))
+        return open_packed_object(*pack, index);
+
+    return fd;
+}
+
+file_descriptor repository::open_packed_object(object_pack const& pack, size_t index)
+{
+    std::vector<char> data = pack.read(index);
+
+    // readers get a descriptor like for a loose object, the file is gone
+    // once they close it
+    file_descriptor fd = file_descriptor::open_unnamed({objects_dir.get_fd(), "."}, file_flags::read_write | file_flags::close_on_exec);
+    if (!fd)
+    {
+        std::string tmp_name = make_temporary_name();
+        fd = file_descriptor::open({objects_dir.get_fd(), tmp_name}, file_flags::read_write | file_flags::create | file_flags::excl | file_flags::close_on_exec);
+        unlink({objects_dir.get_fd(), tmp_name});
+    }
+
+    fd.write(data.data(), data.size());
+    fd.seek(0);
+    return fd;
+}
+
+uint64_t repository::local_object_size(md5 const& hash)
+{
+    char name[MD5_HEX_LENGTH + 1] = {};
+    md5_to_hex(hash, name);
+
+    struct stat64 st;
+    std::error_code ec;
+    if (try_stat({get_md5_dir_fd(), name}, stat_flags::none, st, ec))
+        return static_cast<uint64_t>(st.st_size);
+
+    object_pack const* pack;
+    size_t index;
+    if (find_packed(hash, pack, index))
+        return pack->object_size(index);
+
+    return 0;
+}
+
+void repository::add_object(md5 const& hash, std::vector<char> const& data)
+{
+    temporary_object tmp = create_temporary_object();
+    try
+    {
+        tmp.fd.write(data.data(), data.size());
+
+        sha256 strong = {};
+        if (config.hash == object_hash::sha256)
+            strong = sha256_hash(data.data(), data.size());
+
+        publish_object(tmp, hash, strong, data.size());
+    }
+    catch (...)
+    {
+        discard_temporary_object(tmp);
+        throw;
+    }
+
+    discard_temporary_object(tmp);
+}
+
+md5 repository::add_object(file_descriptor& source)
+{
+    size_t chunk_size = source.is_direct() ? DIRECT_CHUNK_SIZE : STREAM_CHUNK_SIZE;
+    return add_stream(chunk_size, [&](char* data, size_t size)
+    {
+        return source.read_some(data, size);
+    }, nullptr);
+}
+
+void repository::add_object(md5 const& hash, uint64_t size, read_callback const& read)
+{
+    uint64_t left = size;
+    add_stream(STREAM_CHUNK_SIZE, [&](char* data, size_t capacity)
+    {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(left, capacity));
+        if (n != 0)
+            read(data, n);
+        left -= n;
+        return n;
+    }, &hash);
+}
+
+md5 repository::add_stream(size_t chunk_size, std::function<size_t(char* data, size_t size)> const& read_some, md5 const* expected)
+{
+    temporary_object tmp = create_temporary_object();
+
+    md5 hash;
+    try
+    {
+        bool dual = config.hash == object_hash::sha256;
+
+        pooled_buffer buf(chunk_size);
+        uint64_t size = 0;
+        md5_accumulator md5_acc;
+        sha256_accumulator sha256_acc;
+        for (;;)
+        {
+            size_t bytes_read = read_some(buf.data(), chunk_size);
+            if (bytes_read == 0)
+                break;
+
+            if (dual)
+            {
+                // both hashes consume a piece while it is still in L1,
+                // so the second hash costs no extra memory traffic
+                for (size_t off = 0; off < bytes_read; off += HASH_PIECE_SIZE)
+                {
+                    size_t n = std::min(HASH_PIECE_SIZE, bytes_read - off);
+                    md5_acc.accumulate(buf.data() + off, n);
+                    sha256_acc.accumulate(buf.data() + off, n);
+                }
+            }
+            else
+                md5_acc.accumulate(buf.data(), bytes_read);
+
+            tmp.fd.write(buf.data(), bytes_read);
+            size += bytes_read;
+        }
+        hash = md5_acc.finish();
+        if (expected && memcmp(hash.data, expected->data, sizeof hash.data) != 0)
+            throw std::runtime_error("object data does not match its hash");
+
+        sha256 strong = {};
+        if (dual)
+            strong = sha256_acc.finish();
+
+        publish_object(tmp, hash, strong, size);
+    }
+    catch (...)
+    {
+        discard_temporary_object(tmp);
+        throw;
+    }
+
+    discard_temporary_object(tmp);
+    return hash;
+}
+
+repository::temporary_object repository::create_temporary_object()
+{
+    temporary_object result;
+
+    // when unnamed files are not supported, the object is written under
+    // a temporary name that is never a valid hash, so it is ignored by gc
+    result.fd = file_descriptor::open_unnamed({objects_dir.get_fd(), "."}, file_flags::write_only | file_flags::close_on_exec);
+    if (!result.fd)
+    {
+        result.name = make_temporary_name();
+        result.fd = file_descriptor::open({objects_dir.get_fd(), result.name}, file_flags::write_only | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+    }
+
+    return result;
+}
+
+void repository::discard_temporary_object(temporary_object& tmp)
+{
+    if (!tmp.name.empty())
+    {
+        unlink({objects_dir.get_fd(), tmp.name});
+        tmp.name.clear();
+    }
+    tmp.fd.close();
+}
+
+bool repository::link_temporary_object(temporary_object const& tmp, file_location target)
+{
+    if (tmp.name.empty())
+        return link_unnamed_if_not_exists(tmp.fd, target);
+
+    return link_if_not_exists({objects_dir.get_fd(), tmp.name}, target);
+}
+
+void repository::publish_object(temporary_object const& tmp, md5 const& hash, sha256 const& strong, uint64_t size)
+{
+    char md5_name[MD5_HEX_LENGTH + 1] = {};
+    md5_to_hex(hash, md5_name);
+
+    bool stored;
+    if (config.hash == object_hash::md5)
+        stored = !has_local_object(hash) && link_temporary_object(tmp, {objects_dir.get_fd(), md5_name});
+    else
+    {
+        char name[SHA256_HEX_LENGTH + 1] = {};
+        sha256_to_hex(strong, name);
+
+        // objects are deduplicated by the strong hash, two different
+        // contents with the same md5 are both stored
+        bool exists = file_exists({objects_dir.get_fd(), name});
+        stored = !exists && link_temporary_object(tmp, {objects_dir.get_fd(), name});
+
+        // on an md5 collision the alias keeps pointing to the first
+        // object, md5 lookups can't tell them apart anyway; the alias is
+        // also recreated if a previous writer died before making it
+        if (stored || !has_local_object(hash))
+            link_if_not_exists({objects_dir.get_fd(), name}, {md5_index_dir.get_fd(), md5_name});
+    }
+
+    if (stored)
+    {
+        stats::add(stats::counter::objects_written);
+
+        // object must be in the filter only after it is visible on disk
+        insert_into_filter(hash);
+        append_to_journal(hash);
+
+        // until it is in the shared tier this is the only copy
+        if (clock.load(std::memory_order_acquire))
+            record_object(hash, strong, size, shared != nullptr);
+
+        if (shared)
+        {
+            if (config.shared_writes == write_policy::through)
+                upload_object(hash);
+            else
+                enqueue_upload(hash);
+        }
+    }
+    else
+    {
+        stats::add(stats::counter::objects_deduplicated);
+        touch_object(hash);
+    }
+}
+
+void repository::rebuild_filter()
+{
+    std::string tmp_name = std::string(FILTER_FILENAME) + "." + make_temporary_name();
+    object_filter::create({root.get_fd(), tmp_name}, list_objects());
+    rename({root.get_fd(), tmp_name}, {root.get_fd(), FILTER_FILENAME});
+
+    // objects added after the scan above could have been inserted into the
+    // old filter only, writers check for replacement after inserting, so
+    // a second scan covers everything they could have missed
+    object_filter* f = reload_filter();
+    for (md5 const& hash : list_objects())
+        if (!f->may_contain(hash))
+            f->insert(hash);
+}
+
+std::vector<md5> repository::list_objects()
+{
+    std::vector<md5> result = scan_objects(get_md5_dir_fd());
+
+    pack_set* set = load_packs();
+    if (!is_current(*set))
+        set = reload_packs();
+
+    for (object_pack const& pack : set->packs)
+        for (size_t i = 0; i != pack.size(); ++i)
+            result.push_back(pack.hash(i));
+
+    return result;
+}
+
+prefix_match repository::resolve_prefix(char const* hex, size_t len, md5& result)
+{
+    md5 low, high;
+    if (len < MIN_ABBREVIATION_LENGTH || !md5_prefix_from_hex(hex, len, low, high))
+        return prefix_match::none;
+
+    std::vector<md5> candidates = find_candidates(low, high);
+    std::sort(candidates.begin(), candidates.end(), [](md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    });
+    candidates.erase(std::unique(candidates.begin(), candidates.end(), [](md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }), candidates.end());
+
+    // the index and the journal still name evicted objects
+    size_t found = 0;
+    for (md5 const& candidate : candidates)
+    {
+        if (!has_local_object(candidate))
+            continue;
+
+        if (++found == 2)
+            return prefix_match::ambiguous;
+        result = candidate;
+    }
+
+    return found == 0 ? prefix_match::none : prefix_match::unique;
+}
+
+size_t repository::abbreviation_length(md5 const& hash, size_t min_length)
+{
+    // everything sharing more than min_length digits is among these
+    md5 low, high;
+    char hex[MD5_HEX_LENGTH];
+    md5_to_hex(hash, hex);
+    md5_prefix_from_hex(hex, std::min(min_length, MD5_HEX_LENGTH), low, high);
+
+    // evicted objects don't make it longer, resolve_prefix skips them too
+    size_t result = std::min(min_length, MD5_HEX_LENGTH);
+    for (md5 const& other : find_candidates(low, high))
+    {
+        size_t common = md5_common_hex_prefix(hash, other);
+        if (common != MD5_HEX_LENGTH && common + 1 > result && has_local_object(other))
+            result = common + 1;
+    }
+
+    return result;
+}
+
+std::vector<md5> repository::find_candidates(md5 const& low, md5 const& high)
+{
+    std::vector<md5> result;
+    auto in_range = [&](md5 const& hash)
+    {
+        return memcmp(hash.data, low.data, sizeof hash.data) >= 0 && memcmp(hash.data, high.data, sizeof hash.data) <= 0;
+    };
+
+    // journals before the manifest: a full journal is removed only after
+    // the segment made of it is in a manifest
+    find_in_journals(low, high, result);
+
+    std::vector<object_index> indexes;
+    repository_manifest manifest = load_index_files(indexes);
+    for (object_index const& index : indexes)
+    {
+        size_t begin, end;
+        index.find_range(low, high, begin, end);
+        for (size_t i = begin; i != end; ++i)
+            result.push_back(index.key(i));
+    }
+
+    // without a full index only a listing finds older objects
+    if (manifest.index.empty())
+    {
+        for (md5 const& hash : scan_objects(get_md5_dir_fd()))
+            if (in_range(hash))
+                result.push_back(hash);
+    }
+
+    // packed objects are in the index too, unless it predates the repack
+    pack_set* set = load_packs();
+    if (!is_current(*set))
+        set = reload_packs();
+    for (object_pack const& pack : set->packs)
+    {
+        size_t begin, end;
+        pack.find_range(low, high, begin, end);
+        for (size_t i = begin; i != end; ++i)
+            result.push_back(pack.hash(i));
+    }
+
+    return result;
+}
+
+void repository::find_in_journals(md5 const& low, md5 const& high, std::vector<md5>& result)
+{
+    std::lock_guard<std::mutex> lock(journal_cache_mutex);
+
+    std::vector<std::string> names = list_files(root.get_fd(), INDEX_DIRNAME, JOURNAL_SUFFIX);
+    for (auto i = journal_cache.begin(); i != journal_cache.end();)
+    {
+        if (contains(names, i->first))
+            ++i;
+        else
+            i = journal_cache.erase(i);
+    }
+
+    for (std::string const& name : names)
+    {
+        std::string path = std::string(INDEX_DIRNAME) + "/" + name;
+        cached_journal& cached = journal_cache[name];
+
+        // journals only grow, a torn last record aside: unchanged ones
+        // cost a stat, grown ones a read of what was appended
+        struct stat64 st;
+        std::error_code ec;
+        if (!try_stat({root.get_fd(), path}, stat_flags::none, st, ec))
+            continue;
+
+        uint64_t size = static_cast<uint64_t>(st.st_size) / sizeof(md5) * sizeof(md5);
+        if (st.st_ino != cached.inode || size < cached.size)
+            cached = cached_journal{st.st_ino, 0, {}};
+
+        if (size > cached.size)
+        {
+            file_descriptor fd = file_descriptor::open_if_exists({root.get_fd(), path}, file_flags::read_only | file_flags::close_on_exec);
+            if (fd && fd.stat().st_ino == cached.inode)
+            {
+                std::vector<char> data(size - cached.size);
+                fd.seek(static_cast<int64_t>(cached.size));
+                size_t bytes_read = 0;
+                while (bytes_read != data.size())
+                {
+                    size_t n = fd.read_some(data.data() + bytes_read, data.size() - bytes_read);
+                    if (n == 0)
+                        break;
+                    bytes_read += n;
+                }
+                data.resize(bytes_read / sizeof(md5) * sizeof(md5));
+
+                std::vector<md5> added = parse_journal(data);
+                std::sort(added.begin(), added.end(), md5_less);
+                size_t old_count = cached.hashes.size();
+                cached.hashes.insert(cached.hashes.end(), added.begin(), added.end());
+                std::inplace_merge(cached.hashes.begin(), cached.hashes.begin() + old_count, cached.hashes.end(), md5_less);
+                cached.size += data.size();
+            }
+        }
+
+        auto begin = std::lower_bound(cached.hashes.begin(), cached.hashes.end(), low, md5_less);
+        auto end = std::upper_bound(begin, cached.hashes.end(), high, md5_less);
+        result.insert(result.end(), begin, end);
+    }
+}
+
+repository_manifest repository::load_index_files(std::vector<object_index>& result)
+{
+    for (size_t attempt = 0;; ++attempt)
+    {
+        result.clear();
+
+        repository_manifest manifest = load_manifest();
+        std::vector<std::string> names = manifest.segments;
+        if (!manifest.index.empty())
+            names.push_back(manifest.index);
+
+        bool complete = true;
+        for (std::string const& name : names)
+        {
+            object_index index = object_index::open_if_exists({root.get_fd(), std::string(INDEX_DIRNAME) + "/" + name});
+            if (!index)
+                complete = false;
+            else
+                result.push_back(std::move(index));
+        }
+
+        // a damaged file stays missing, it is replaced by the next gc
+        if (complete || attempt + 1 == MAX_MANIFEST_ATTEMPTS)
+            return manifest;
+    }
+}
+
+void repository::rebuild_index()
+{
+    mkdir_if_not_exists({root.get_fd(), INDEX_DIRNAME});
+    file_descriptor index_dir = file_descriptor::open({root.get_fd(), INDEX_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    // journals nobody holds belong to processes that are gone, their
+    // objects are in the listing below. Locking them first keeps other
+    // writers from continuing them until they are removed
+    std::vector<std::pair<std::string, file_descriptor>> abandoned;
+    for (std::string const& name : list_files(root.get_fd(), INDEX_DIRNAME, JOURNAL_SUFFIX))
+    {
+        file_descriptor fd = file_descriptor::open_if_exists({index_dir.get_fd(), name}, file_flags::read_only | file_flags::close_on_exec);
+        if (fd && fd.try_lock_exclusive())
+            abandoned.emplace_back(name, std::move(fd));
+    }
+
+    // so are the objects of every segment listed now
+    repository_manifest before = load_manifest();
+
+    std::vector<md5> hashes = list_objects();
+    std::string index_name = hash_file_name(hashes, INDEX_SUFFIX);
+    std::string tmp_name = make_temporary_name();
+    try
+    {
+        object_index::create({index_dir.get_fd(), tmp_name}, std::move(hashes));
+        rename({index_dir.get_fd(), tmp_name}, {index_dir.get_fd(), index_name});
+    }
+    catch (...)
+    {
+        unlink_if_exists({index_dir.get_fd(), tmp_name});
+        throw;
+    }
+
+    // segments published since the listing are kept
+    repository_manifest after = update_manifest([&](repository_manifest& m)
+    {
+        m.index = index_name;
+        m.segments.erase(std::remove_if(m.segments.begin(), m.segments.end(), [&](std::string const& name)
+        {
+            return contains(before.segments, name);
+        }), m.segments.end());
+    });
+
+    std::vector<std::string> replaced = before.segments;
+    if (!before.index.empty())
+        replaced.push_back(before.index);
+    for (std::string const& name : replaced)
+        if (name != after.index && !contains(after.segments, name))
+            unlink_if_exists({index_dir.get_fd(), name});
+
+    for (auto const& journal : abandoned)
+        unlink_if_exists({index_dir.get_fd(), journal.first});
+
+    unlink_if_exists({root.get_fd(), OLD_INDEX_FILENAME});
+    unlink_if_exists({root.get_fd(), OLD_JOURNAL_FILENAME});
+}
+
+void repository::repack(pack_options const& options, std::function<std::string(md5 const&)> const& name)
+{
+    if (config.hash != object_hash::md5 || config.capacity != 0)
+        throw std::runtime_error("only md5-named repositories without a capacity can be packed");
+
+    mkdir_if_not_exists({root.get_fd(), PACKS_DIRNAME});
+    file_descriptor packs_dir = file_descriptor::open({root.get_fd(), PACKS_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    // every object of these packs is in the listing below, so the new
+    // pack replaces them. A concurrent repack does the same, at worst
+    // both packs stay until the next repack
+    repository_manifest before = load_manifest();
+
+    // sizes order objects of the same name, and all of those without
+    // one, for the delta window
+    std::vector<pack_input> inputs;
+    for (md5 const& hash : list_objects())
+        inputs.push_back({hash, local_object_size(hash), name(hash)});
+
+    std::vector<md5> hashes;
+    hashes.reserve(inputs.size());
+    for (pack_input const& input : inputs)
+        hashes.push_back(input.hash);
+    std::sort(hashes.begin(), hashes.end(), [](md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    });
+    hashes.erase(std::unique(hashes.begin(), hashes.end(), [](md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }), hashes.end());
+
+    // named by its contents, repacking an unchanged repository replaces
+    // the pack with an identical one
+    std::string pack_name = hash_file_name(hashes, PACK_SUFFIX);
+
+    std::string tmp_name = make_temporary_name();
+    try
+    {
+        file_descriptor out = file_descriptor::open({packs_dir.get_fd(), tmp_name}, file_flags::read_write | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+        write_pack(out, std::move(inputs), options, [this](md5 const& hash)
+        {
+            file_descriptor fd = open_local_object(hash);
+            if (!fd)
+                throw std::runtime_error("object disappeared during repack");
+            return read_whole_file(fd);
+        });
+        rename({packs_dir.get_fd(), tmp_name}, {packs_dir.get_fd(), pack_name});
+    }
+    catch (...)
+    {
+        unlink_if_exists({packs_dir.get_fd(), tmp_name});
+        throw;
+    }
+
+    repository_manifest after = update_manifest([&](repository_manifest& m)
+    {
+        m.packs.erase(std::remove_if(m.packs.begin(), m.packs.end(), [&](std::string const& name)
+        {
+            return contains(before.packs, name);
+        }), m.packs.end());
+        if (!contains(m.packs, pack_name))
+            m.packs.push_back(pack_name);
+    });
+
+    // everything is in the new pack now; readers that have an old pack
+    // mapped keep using it, the others load the new manifest on a miss
+    for (std::string const& old : before.packs)
+        if (!contains(after.packs, old))
+            unlink_if_exists({packs_dir.get_fd(), old});
+
+    for (md5 const& hash : hashes)
+    {
+        char loose_name[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(hash, loose_name);
+        unlink_if_exists({objects_dir.get_fd(), loose_name});
+    }
+
+    reload_packs();
+}
+
+int repository::get_root_fd() const
+{
+    return root.get_fd();
+}
+
+int repository::get_objects_fd() const
+{
+    return objects_dir.get_fd();
+}
+
+int repository::get_md5_dir_fd() const
+{
+    return md5_index_dir ? md5_index_dir.get_fd() : objects_dir.get_fd();
+}
+
+void repository::insert_into_filter(md5 const& hash)
+{
+    object_filter* f = filter.load(std::memory_order_acquire);
+    if (!f)
+        return;
+
+    f->insert(hash);
+    if (f->is_stale({root.get_fd(), FILTER_FILENAME}))
+    {
+        f = reload_filter();
+        if (f)
+            f->insert(hash);
+    }
+}
+
+object_filter* repository::reload_filter()
+{
+    std::lock_guard<std::mutex> lock(filter_mutex);
+
+    object_filter* current = filter.load(std::memory_order_relaxed);
+    if (current && !current->is_stale({root.get_fd(), FILTER_FILENAME}))
+        return current;
+
+    object_filter f = object_filter::open_if_exists({root.get_fd(), FILTER_FILENAME});
+    if (!f)
+        return current;
+
+    filters.push_back(std::make_unique<object_filter>(std::move(f)));
+    filter.store(filters.back().get(), std::memory_order_release);
+    return filters.back().get();
+}
+
+void repository::append_to_journal(md5 const& hash)
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+
+    // only this process appends to it, writers never wait for each other
+    if (!journal)
+        open_journal();
+
+    journal.write(hash.data, sizeof hash.data);
+    if (++journal_records >= JOURNAL_SEAL_RECORDS)
+        seal_journal();
+}
+
+void repository::open_journal()
+{
+    mkdir_if_not_exists({root.get_fd(), INDEX_DIRNAME});
+    file_descriptor dir = file_descriptor::open({root.get_fd(), INDEX_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    // a journal is locked by the process appending to it; one nobody
+    // holds was left by a process that is gone and is continued, so
+    // there are never many more journals than concurrent writers
+    std::vector<std::string> names = list_files(root.get_fd(), INDEX_DIRNAME, JOURNAL_SUFFIX);
+    for (;;)
+    {
+        std::string name;
+        file_descriptor fd;
+        if (!names.empty())
+        {
+            name = std::move(names.back());
+            names.pop_back();
+            fd = file_descriptor::open_if_exists({dir.get_fd(), name}, file_flags::write_only | file_flags::append | file_flags::close_on_exec);
+        }
+        else
+        {
+            std::error_code ec;
+            name = make_journal_name();
+            fd = file_descriptor::try_open({dir.get_fd(), name}, file_flags::write_only | file_flags::append | file_flags::create | file_flags::excl | file_flags::close_on_exec, ec);
+            if (!fd && ec.value() != EEXIST)
+                throw std::runtime_error("can not create journal: " + ec.message());
+        }
+
+        if (!fd || !fd.try_lock_exclusive())
+            continue;
+
+        // gc may have removed it while holding the lock
+        struct stat64 st;
+        std::error_code ec;
+        struct stat64 own = fd.stat();
+        if (!try_stat({dir.get_fd(), name}, stat_flags::none, st, ec) || st.st_ino != own.st_ino)
+            continue;
+
+        // the last record of a writer that died while appending may be torn
+        uint64_t size = static_cast<uint64_t>(own.st_size);
+        if (size % sizeof(md5) != 0)
+            fd.truncate(size - size % sizeof(md5));
+
+        journal = std::move(fd);
+        journal_name = name;
+        journal_records = size / sizeof(md5);
+        return;
+    }
+}
+
+void repository::seal_journal()
+{
+    file_descriptor dir = file_descriptor::open({root.get_fd(), INDEX_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    std::vector<md5> hashes = parse_journal(read_whole_file({dir.get_fd(), journal_name}));
+    std::string segment_name = hash_file_name(hashes, INDEX_SUFFIX);
+    std::string tmp_name = make_temporary_name();
+    try
+    {
+        object_index::create({dir.get_fd(), tmp_name}, std::move(hashes));
+        rename({dir.get_fd(), tmp_name}, {dir.get_fd(), segment_name});
+    }
+    catch (...)
+    {
+        unlink_if_exists({dir.get_fd(), tmp_name});
+        throw;
+    }
+
+    update_manifest([&](repository_manifest& m)
+    {
+        if (!contains(m.segments, segment_name))
+            m.segments.push_back(segment_name);
+    });
+
+    // readers that list journals after this find the segment instead
+    unlink({dir.get_fd(), journal_name});
+    journal.close();
+    journal_records = 0;
+}
+
+repository_manifest repository::load_manifest()
+{
+    repository_manifest result;
+    if (cached_manifest && cached_manifest.load(result))
+        return result;
+
+    if (file_descriptor dir = file_descriptor::open_if_exists({root.get_fd(), MANIFESTS_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec))
+        result = repository_manifest::load_latest(dir.get_fd());
+
+    // the cache was created after the last update
+    if (cached_manifest && result.generation > cached_manifest.generation())
+        cached_manifest.store(result);
+
+    // packed before manifests were introduced
+    if (result.generation == 0)
+        result.packs = list_files(root.get_fd(), PACKS_DIRNAME, PACK_SUFFIX);
+
+    return result;
+}
+
+repository_manifest repository::update_manifest(std::function<void(repository_manifest&)> const& change)
+{
+    mkdir_if_not_exists({root.get_fd(), MANIFESTS_DIRNAME});
+    file_descriptor dir = file_descriptor::open({root.get_fd(), MANIFESTS_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    repository_manifest result = repository_manifest::update(dir.get_fd(), [&](repository_manifest& m)
+    {
+        if (m.generation == 0)
+            m.packs = list_files(root.get_fd(), PACKS_DIRNAME, PACK_SUFFIX);
+        change(m);
+    });
+
+    // before the caller removes what it replaced
+    if (cached_manifest)
+        cached_manifest.store(result);
+
+    return result;
+}
+
+bool repository::find_packed(md5 const& hash, object_pack const*& pack, size_t& index)
+{
+    pack_set* set = load_packs();
+    for (int attempt = 0; attempt != 2; ++attempt)
+    {
+        for (object_pack const& p : set->packs)
+            if (p.find(hash, index))
+            {
+                pack = &p;
+                return true;
+            }
+
+        // a repack may have moved the object from objects/ into a pack
+        // the set doesn't have yet
+        if (attempt != 0 || is_current(*set))
+            break;
+        set = reload_packs();
+    }
+
+    return false;
+}
+
+bool repository::is_current(pack_set const& set) const
+{
+    if (uint64_t generation = cached_manifest ? cached_manifest.generation() : 0)
+        return set.generation == generation;
+
+    struct stat64 st;
+    std::error_code ec;
+    if (!try_stat({root.get_fd(), MANIFESTS_DIRNAME}, stat_flags::none, st, ec))
+        return !set.exists;
+
+    return set.exists && !set.racy && set.inode == st.st_ino && set.mtime_ns == to_ns(st.st_mtim);
+}
+
+repository::pack_set* repository::load_packs()
+{
+    pack_set* set = packs.load(std::memory_order_acquire);
+    return set ? set : reload_packs();
+}
+
+repository::pack_set* repository::reload_packs()
+{
+    std::lock_guard<std::mutex> lock(pack_mutex);
+
+    pack_set* current = packs.load(std::memory_order_relaxed);
+    if (current && is_current(*current))
+        return current;
+
+    auto set = std::make_unique<pack_set>();
+
+    // stat before loading: a generation published in between makes the
+    // set look stale, never current
+    struct stat64 st;
+    std::error_code ec;
+    if (try_stat({root.get_fd(), MANIFESTS_DIRNAME}, stat_flags::none, st, ec))
+    {
+        set->exists = true;
+        set->inode = st.st_ino;
+        set->mtime_ns = to_ns(st.st_mtim);
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        set->racy = set->mtime_ns >= to_ns(now) - RACY_WINDOW_NS;
+    }
+
+    for (size_t attempt = 0;; ++attempt)
+    {
+        set->packs.clear();
+
+        repository_manifest manifest = load_manifest();
+        set->generation = manifest.generation;
+
+        bool complete = true;
+        for (std::string const& name : manifest.packs)
+        {
+            file_descriptor fd = file_descriptor::open_if_exists({root.get_fd(), std::string(PACKS_DIRNAME) + "/" + name}, file_flags::read_only | file_flags::close_on_exec);
+            object_pack pack = fd ? object_pack::map(fd) : object_pack();
+            if (pack)
+                set->packs.push_back(std::move(pack));
+            else
+                complete = false;
+        }
+
+        // removed by a repack that published a newer manifest since, or
+        // damaged and then skipped
+        if (complete || attempt + 1 == MAX_MANIFEST_ATTEMPTS)
+            break;
+    }
+
+    pack_sets.push_back(std::move(set));
+    packs.store(pack_sets.back().get(), std::memory_order_release);
+    return pack_sets.back().get();
+}
+
+void repository::touch_object(md5 const& hash)
+{
+    if (object_clock* c = clock.load(std::memory_order_acquire))
+        c->touch(hash);
+}
+
+void repository::enforce_capacity()
+{
+    if (!clock.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    object_clock* c = lock_clock();
+    try
+    {
+        if (c->total_bytes() > config.capacity)
+        {
+            uint64_t target = config.capacity / 100 * config.low_water;
+            c->evict(target, [this](md5 const& hash, sha256 const& strong)
+            {
+                remove_object(hash, strong);
+            });
+        }
+    }
+    catch (...)
+    {
+        c->unlock();
+        throw;
+    }
+    c->unlock();
+}
+
+object_clock* repository::lock_clock()
+{
+    // a rebuild replaces the file under the lock, whoever waited on the
+    // old one has to switch to the new one
+    object_clock* c = clock.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        c->lock();
+        if (!c->is_stale({root.get_fd(), CLOCK_FILENAME}))
+            return c;
+
+        c->unlock();
+        c = install_clock(object_clock::open_if_exists({root.get_fd(), CLOCK_FILENAME}));
+    }
+}
+
+object_clock* repository::grow_clock(object_clock* current)
+{
+    std::string tmp_name = std::string(CLOCK_FILENAME) + "." + make_temporary_name();
+
+    object_clock* result;
+    try
+    {
+        // the new table is locked before it becomes visible, and the old
+        // one stays locked until then
+        object_clock bigger = current->rebuild({root.get_fd(), tmp_name});
+        rename({root.get_fd(), tmp_name}, {root.get_fd(), CLOCK_FILENAME});
+        result = install_clock(std::move(bigger));
+    }
+    catch (...)
+    {
+        current->unlock();
+        throw;
+    }
+
+    current->unlock();
+    return result;
+}
+
+object_clock* repository::install_clock(object_clock c)
+{
+    if (!c)
+        throw std::runtime_error("object clock disappeared from the repository");
+
+    clocks.push_back(std::make_unique<object_clock>(std::move(c)));
+    clock.store(clocks.back().get(), std::memory_order_release);
+    return clocks.back().get();
+}
+
+void repository::record_object(md5 const& hash, sha256 const& strong, uint64_t size, bool pinned)
+{
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    object_clock* c = lock_clock();
+    if (c->is_full())
+        c = grow_clock(c);
+
+    try
+    {
+        c->insert(hash, strong, size, pinned);
+    }
+    catch (...)
+    {
+        c->unlock();
+        throw;
+    }
+    c->unlock();
+}
+
+void repository::unpin_object(md5 const& hash)
+{
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    object_clock* c = lock_clock();
+    try
+    {
+        c->unpin(hash);
+    }
+    catch (...)
+    {
+        c->unlock();
+        throw;
+    }
+    c->unlock();
+}
+
+void repository::remove_object(md5 const& hash, sha256 const& strong)
+{
+    char md5_name[MD5_HEX_LENGTH + 1] = {};
+    md5_to_hex(hash, md5_name);
+
+    if (config.hash == object_hash::md5)
+        unlink_if_exists({objects_dir.get_fd(), md5_name});
+    else
+    {
+        // the alias goes first, so lookups never find a dangling name
+        char name[SHA256_HEX_LENGTH + 1] = {};
+        sha256_to_hex(strong, name);
+        unlink_if_exists({md5_index_dir.get_fd(), md5_name});
+        unlink_if_exists({objects_dir.get_fd(), name});
+    }
+
+    stats::add(stats::counter::objects_evicted);
+}
+
+void repository::flush_shared_tier()
+{
+    if (!shared)
+        return;
+
+    std::vector<md5> pending;
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(tier_mutex);
+        tier_cv.wait(lock, [this]
+        {
+            return promotions.empty() && !tier_busy;
+        });
+
+        pending.swap(uploads);
+        error = std::exchange(tier_error, nullptr);
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+
+    for (md5 const& hash : pending)
+        upload_object(hash);
+
+    shared->flush_shared_tier();
+}
+
+void repository::upload_missing_to_shared_tier()
+{
+    if (!shared)
+        return;
+
+    for (md5 const& hash : list_objects())
+        upload_object(hash);
+}
+
+void repository::upload_object(md5 const& hash)
+{
+    if (!shared->has_object(hash))
+    {
+        // objects are pinned until they are uploaded, eviction doesn't
+        // remove them: if it is gone, so is the only copy
+        file_descriptor fd = open_local_object(hash);
+        if (!fd)
+        {
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(hash, name);
+            throw std::runtime_error(std::string("object to write back is missing from the local tier: ") + name);
+        }
+
+        shared->add_object(fd);
+        stats::add(stats::counter::objects_uploaded);
+    }
+
+    if (clock.load(std::memory_order_acquire))
+        unpin_object(hash);
+}
+
+void repository::promote_object(md5 const& hash)
+{
+    if (has_local_object(hash))
+        return;
+
+    file_descriptor fd = shared->open_object(hash);
+    if (!fd)
+        return;
+
+    // stored under the hash of what was actually read, a damaged shared
+    // object doesn't end up under a wrong name locally
+    add_object(fd);
+    stats::add(stats::counter::objects_promoted);
+}
+
+void repository::enqueue_promotion(md5 const& hash)
+{
+    {
+        std::lock_guard<std::mutex> lock(tier_mutex);
+        promotions.push_back(hash);
+        start_tier_worker();
+    }
+    tier_cv.notify_all();
+}
+
+void repository::enqueue_upload(md5 const& hash)
+{
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(tier_mutex);
+        uploads.push_back(hash);
+        full = uploads.size() >= UPLOAD_BATCH_SIZE;
+        if (full)
+            start_tier_worker();
+    }
+
+    if (full)
+        tier_cv.notify_all();
+}
+
+// requires tier_mutex
+void repository::start_tier_worker()
+{
+    if (!tier_worker.joinable())
+        tier_worker = std::thread([this]
+        {
+            tier_worker_loop();
+        });
+}
+
+void repository::tier_worker_loop()
+{
+    std::unique_lock<std::mutex> lock(tier_mutex);
+    for (;;)
+    {
+        tier_cv.wait(lock, [this]
+        {
+            return tier_stop || !promotions.empty() || uploads.size() >= UPLOAD_BATCH_SIZE;
+        });
+
+        if (tier_stop)
+            return;
+
+        std::vector<md5> batch_promotions;
+        std::vector<md5> batch_uploads;
+        batch_promotions.swap(promotions);
+        if (uploads.size() >= UPLOAD_BATCH_SIZE)
+            batch_uploads.swap(uploads);
+
+        tier_busy = true;
+        lock.unlock();
+
+        try
+        {
+            for (md5 const& hash : batch_promotions)
+                promote_object(hash);
+            for (md5 const& hash : batch_uploads)
+                upload_object(hash);
+        }
+        catch (...)
+        {
+            lock.lock();
+            if (!tier_error)
+                tier_error = std::current_exception();
+            lock.unlock();
+        }
+
+        lock.lock();
+        tier_busy = false;
+        tier_cv.notify_all();
+    }
+}
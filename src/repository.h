@@ -1,7 +1,27 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "file_descriptor.h"
+#include "manifest_cache.h"
+#include "md5.h"
+#include "object_clock.h"
+#include "object_filter.h"
+#include "object_index.h"
+#include "object_pack.h"
+#include "repository_config.h"
+#include "repository_manifest.h"
+#include "sha256.h"
 
 struct can_not_detect_default_repository_root : std::runtime_error
 {
@@ -10,4 +30,241 @@ struct can_not_detect_default_repository_root : std::runtime_error
 
 std::string default_repository_root();
 
-void init_new_repository(std::string const& path);
+void init_new_repository(std::string const& path, repository_config const& config = repository_config());
+
+// shorter abbreviated names are not resolved, they match too many objects
+constexpr size_t MIN_ABBREVIATION_LENGTH = 4;
+
+enum class prefix_match
+{
+    none,
+    unique,
+    ambiguous,
+};
+
+// All member functions except rebuild_filter can be called concurrently.
+// Any number of processes can write to one repository without waiting
+// for each other: objects are published by rename, each process appends
+// to a journal of its own, packs and index files are published through
+// repository_manifest.
+//
+// A repository can have a shared tier (another repository, typically on a
+// network filesystem) behind it: lookups that miss locally go there and
+// hits are copied into the local tier in the background, new objects are
+// copied to the shared tier according to the write policy.
+struct repository
+{
+    explicit repository(std::string const& root);
+    ~repository();
+
+    repository_config const& get_config() const;
+
+    // looks in the shared tier too
+    bool has_object(md5 const& hash);
+    bool has_local_object(md5 const& hash);
+
+    // opens an object for reading from whichever tier has it, returns an
+    // invalid descriptor if none does
+    file_descriptor open_object(md5 const& hash);
+
+    void add_object(md5 const& hash, std::vector<char> const& data);
+
+    // hashes and stores the contents of source in a single pass with
+    // constant memory, the object is discarded if it is already stored
+    md5 add_object(file_descriptor& source);
+
+    // stores size bytes that read delivers in pieces (filling all of the
+    // buffer it is given), for data from an untrusted source: throws
+    // without storing anything if they don't hash to hash
+    using read_callback = std::function<void(char* data, size_t size)>;
+    void add_object(md5 const& hash, uint64_t size, read_callback const& read);
+
+    // rescans objects/ and replaces the object filter
+    void rebuild_filter();
+
+    // marks an object as recently used in size-bounded repositories,
+    // has_object does it implicitly
+    void touch_object(md5 const& hash);
+
+    // evicts least recently used objects if the repository is over its
+    // capacity, meant to be called when a command is done adding objects
+    void enforce_capacity();
+
+    // waits for background promotions and copies every pending write-back
+    // to the shared tier; rethrows the first error of background work
+    void flush_shared_tier();
+
+    // copies to the shared tier every local object it lacks, this recovers
+    // write-backs lost when a command died before flushing; their objects
+    // are pinned against eviction until then
+    void upload_missing_to_shared_tier();
+
+    // moves every local object into one new pack and removes the loose
+    // copies and the packs it replaces. name returns the file name an
+    // object was seen under, or an empty string; it guides the choice of
+    // delta bases. Only for md5-named repositories without a capacity
+    void repack(pack_options const& options, std::function<std::string(md5 const&)> const& name);
+
+    // md5 of every stored object: loose ones in directory order, then
+    // packed ones
+    std::vector<md5> list_objects();
+
+    // the local object an abbreviated name (hex digits) refers to. Looks
+    // at the object index, its segments, the journals of objects stored
+    // since and the packs, objects/ is listed only if there is no index
+    // yet
+    prefix_match resolve_prefix(char const* hex, size_t len, md5& result);
+
+    // length of the shortest abbreviation of hash no other local object
+    // shares, at least min_length
+    size_t abbreviation_length(md5 const& hash, size_t min_length = MIN_ABBREVIATION_LENGTH);
+
+    // replaces the object index with one built from a full listing, which
+    // also replaces the segments and the journals of processes that are
+    // gone
+    void rebuild_index();
+
+    int get_root_fd() const;
+    int get_objects_fd() const;
+
+    // directory with objects named by md5: objects/ itself, or the
+    // md5/ alias index when objects are named by a stronger hash
+    int get_md5_dir_fd() const;
+
+private:
+    struct temporary_object
+    {
+        file_descriptor fd;
+        // empty if the file is unnamed (O_TMPFILE)
+        std::string name;
+    };
+
+    struct pack_set;
+
+    // read_some returns 0 at the end; expected is checked before the
+    // object is published if not null
+    md5 add_stream(size_t chunk_size, std::function<size_t(char* data, size_t size)> const& read_some, md5 const* expected);
+
+    temporary_object create_temporary_object();
+    void discard_temporary_object(temporary_object& tmp);
+    bool link_temporary_object(temporary_object const& tmp, file_location target);
+
+    // strong is ignored unless the repository uses sha256 names
+    void publish_object(temporary_object const& tmp, md5 const& hash, sha256 const& strong, uint64_t size);
+
+    // local tier only: a loose object, or a packed one reconstructed into
+    // an unnamed temporary file
+    file_descriptor open_local_object(md5 const& hash);
+    file_descriptor open_packed_object(object_pack const& pack, size_t index);
+
+    // 0 if the object is gone
+    uint64_t local_object_size(md5 const& hash);
+
+    bool find_packed(md5 const& hash, object_pack const*& pack, size_t& index);
+    bool is_current(pack_set const& set) const;
+    pack_set* load_packs();
+    pack_set* reload_packs();
+
+    void insert_into_filter(md5 const& hash);
+    object_filter* reload_filter();
+
+    void append_to_journal(md5 const& hash);
+
+    // the following require journal_mutex
+    void open_journal();
+    void seal_journal();
+
+    // packs and index files in use. In a repository packed before
+    // manifests existed that is whatever is in packs/, the first update
+    // adopts those
+    repository_manifest load_manifest();
+    repository_manifest update_manifest(std::function<void(repository_manifest&)> const& change);
+
+    // of the newest manifest, retrying if a newer one removed some
+    repository_manifest load_index_files(std::vector<object_index>& result);
+
+    // local objects named in [low, high], with duplicates and possibly
+    // evicted ones
+    std::vector<md5> find_candidates(md5 const& low, md5 const& high);
+
+    // the part of find_candidates in journals, through journal_cache
+    void find_in_journals(md5 const& low, md5 const& high, std::vector<md5>& result);
+
+    // the following require clock_mutex
+    object_clock* lock_clock();
+    object_clock* grow_clock(object_clock* current);
+    object_clock* install_clock(object_clock c);
+    // pinned objects aren't evicted until unpin_object
+    void record_object(md5 const& hash, sha256 const& strong, uint64_t size, bool pinned);
+    void unpin_object(md5 const& hash);
+    void remove_object(md5 const& hash, sha256 const& strong);
+
+    void upload_object(md5 const& hash);
+    void promote_object(md5 const& hash);
+    void enqueue_promotion(md5 const& hash);
+    void enqueue_upload(md5 const& hash);
+    void tier_worker_loop();
+    void start_tier_worker();
+
+private:
+    file_descriptor root;
+    repository_config config;
+    file_descriptor objects_dir;
+    file_descriptor md5_index_dir;
+
+    // replaced filters are kept mapped until the repository is destroyed,
+    // so that lookups can use the current one without locking
+    std::atomic<object_filter*> filter;
+    std::vector<std::unique_ptr<object_filter>> filters;
+    std::mutex filter_mutex;
+
+    // recency table, only for repositories with a capacity; kept alive
+    // after replacement like filters. clock_mutex serializes threads,
+    // the file lock serializes processes
+    std::atomic<object_clock*> clock;
+    std::vector<std::unique_ptr<object_clock>> clocks;
+    std::mutex clock_mutex;
+
+    // packs as of the last manifest load, null until the first use;
+    // replaced sets are kept like filters
+    std::atomic<pack_set*> packs;
+    std::vector<std::unique_ptr<pack_set>> pack_sets;
+    std::mutex pack_mutex;
+
+    // invalid if the repository isn't writable
+    manifest_cache cached_manifest;
+
+    // objects this process stored since the index was built, locked
+    // while open; sealed into an index segment once it is long enough
+    file_descriptor journal;
+    std::string journal_name;
+    uint64_t journal_records;
+    std::mutex journal_mutex;
+
+    // sorted contents of the journals of all processes as of their
+    // cached size, so lookups read only what was appended since
+    struct cached_journal
+    {
+        ino64_t inode = 0;
+        uint64_t size = 0;
+        std::vector<md5> hashes;
+    };
+    std::map<std::string, cached_journal> journal_cache;
+    std::mutex journal_cache_mutex;
+
+    std::unique_ptr<repository> shared;
+
+    // background promotions and write-backs
+    std::mutex tier_mutex;
+    std::condition_variable tier_cv;
+    std::vector<md5> promotions;
+    std::vector<md5> uploads;
+    bool tier_busy;
+    bool tier_stop;
+    std::exception_ptr tier_error;
+    std::thread tier_worker;
+};
+
+// a full or abbreviated object name; throws if an abbreviation names no
+// local object or more than one
+md5 resolve_object_name(repository& repo, char const* name);
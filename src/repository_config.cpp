@@ -0,0 +1,151 @@
+#include "repository_config.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "file_descriptor.h"
+
+namespace
+{
+    char const CONFIG_FILENAME[] = "config";
+
+    std::string trim(std::string const& str)
+    {
+        size_t begin = str.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+            return std::string();
+
+        size_t end = str.find_last_not_of(" \t");
+        return str.substr(begin, end - begin + 1);
+    }
+
+    uint64_t parse_number(std::string const& key, std::string const& value, uint64_t max)
+    {
+        char* end;
+        errno = 0;
+        unsigned long long result = strtoull(value.c_str(), &end, 10);
+        if (errno != 0 || value.empty() || value[0] == '-' || *end != '\0' || result > max)
+            throw std::runtime_error("invalid value in repository config: " + key + " = " + value);
+
+        return result;
+    }
+}
+
+char const* to_string(object_hash hash)
+{
+    switch (hash)
+    {
+    case object_hash::md5:
+        return "md5";
+    case object_hash::sha256:
+        return "sha256";
+    }
+
+    return "<unknown>";
+}
+
+object_hash parse_object_hash(char const* str)
+{
+    if (!strcmp(str, "md5"))
+        return object_hash::md5;
+    if (!strcmp(str, "sha256"))
+        return object_hash::sha256;
+
+    throw std::runtime_error(std::string("unknown object hash: ") + str);
+}
+
+char const* to_string(write_policy policy)
+{
+    switch (policy)
+    {
+    case write_policy::through:
+        return "through";
+    case write_policy::back:
+        return "back";
+    }
+
+    return "<unknown>";
+}
+
+write_policy parse_write_policy(char const* str)
+{
+    if (!strcmp(str, "through"))
+        return write_policy::through;
+    if (!strcmp(str, "back"))
+        return write_policy::back;
+
+    throw std::runtime_error(std::string("unknown write policy: ") + str);
+}
+
+repository_config repository_config::load(int root_fd)
+{
+    repository_config result;
+
+    std::unique_ptr<std::vector<char>> data = read_whole_file_if_exists({root_fd, CONFIG_FILENAME});
+    if (!data)
+        return result;
+
+    std::string text(data->begin(), data->end());
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = text.size();
+
+        std::string line = trim(text.substr(pos, eol - pos));
+        pos = eol + 1;
+
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error("malformed repository config line: " + line);
+
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+
+        // unknown keys are an error: they come from a newer version whose
+        // repository layout we may not understand
+        if (key == "hash")
+            result.hash = parse_object_hash(value.c_str());
+        else if (key == "capacity")
+            result.capacity = parse_number(key, value, UINT64_MAX);
+        else if (key == "low_water")
+            result.low_water = static_cast<unsigned>(parse_number(key, value, 100));
+        else if (key == "shared")
+            result.shared = value;
+        else if (key == "shared_writes")
+            result.shared_writes = parse_write_policy(value.c_str());
+        else
+            throw std::runtime_error("unknown repository config key: " + key);
+    }
+
+    return result;
+}
+
+void repository_config::save(int root_fd) const
+{
+    std::string text;
+    text += "hash = ";
+    text += to_string(hash);
+    text += '\n';
+
+    if (capacity != 0)
+    {
+        text += "capacity = " + std::to_string(capacity) + '\n';
+        text += "low_water = " + std::to_string(low_water) + '\n';
+    }
+
+    if (!shared.empty())
+    {
+        text += "shared = " + shared + '\n';
+        text += std::string("shared_writes = ") + to_string(shared_writes) + '\n';
+    }
+
+    write_whole_file({root_fd, CONFIG_FILENAME}, std::vector<char>(text.begin(), text.end()));
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+enum class object_hash
+{
+    // objects are named by md5 of their contents
+    md5,
+
+    // objects are named by sha256, md5/ holds hard links named by md5,
+    // which is what DWARF5 DW_LNCT_MD5 lookups use
+    sha256,
+};
+
+char const* to_string(object_hash hash);
+object_hash parse_object_hash(char const* str);
+
+enum class write_policy
+{
+    // objects are copied to the shared tier as they are added
+    through,
+
+    // objects are copied in batches in the background, whatever is
+    // left is copied at the end of the command or by gc
+    back,
+};
+
+char const* to_string(write_policy policy);
+write_policy parse_write_policy(char const* str);
+
+// Settings chosen at init time, stored as "key = value" lines in the
+// "config" file of the repository. A missing file means all defaults.
+struct repository_config
+{
+    object_hash hash = object_hash::md5;
+
+    // total size of objects in bytes, 0 for unlimited; once it is
+    // exceeded, least recently used objects are evicted down to
+    // low_water percent of it
+    uint64_t capacity = 0;
+    unsigned low_water = 90;
+
+    // root of another repository used as a larger, slower tier behind
+    // this one (e.g. on NFS), empty if there is none
+    std::string shared;
+    write_policy shared_writes = write_policy::through;
+
+    static repository_config load(int root_fd);
+    void save(int root_fd) const;
+};
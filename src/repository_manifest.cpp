@@ -0,0 +1,178 @@
+#include "repository_manifest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "file_descriptor.h"
+
+namespace
+{
+    // older generations are removed; a reader that picked one of them
+    // just before looks for the newest again
+    constexpr uint64_t KEEP_GENERATIONS = 16;
+
+    constexpr size_t GENERATION_NAME_LENGTH = 16;
+
+    // unlikely to happen, but a writer can't retry forever if the
+    // directory keeps changing under it
+    constexpr size_t MAX_LOAD_ATTEMPTS = 100;
+
+    std::string generation_name(uint64_t generation)
+    {
+        char buf[GENERATION_NAME_LENGTH + 1];
+        snprintf(buf, sizeof buf, "%016llx", static_cast<unsigned long long>(generation));
+        return buf;
+    }
+
+    bool parse_generation_name(char const* name, uint64_t& result)
+    {
+        if (strlen(name) != GENERATION_NAME_LENGTH)
+            return false;
+
+        result = 0;
+        for (size_t i = 0; i != GENERATION_NAME_LENGTH; ++i)
+        {
+            char c = name[i];
+            unsigned digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else
+                return false;
+            result = result << 4 | digit;
+        }
+
+        return result != 0;
+    }
+
+    // oldest first
+    std::vector<uint64_t> list_generations(int dir_fd)
+    {
+        std::vector<uint64_t> result;
+
+        directory_stream dir(file_descriptor::open({dir_fd, "."}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+        while (directory_stream::dirent const* ent = dir.next())
+        {
+            uint64_t generation;
+            if (parse_generation_name(ent->d_name, generation))
+                result.push_back(generation);
+        }
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    // newest generation and everything listed with it
+    repository_manifest load_latest_from(int dir_fd, std::vector<uint64_t>& generations)
+    {
+        for (size_t attempt = 0; attempt != MAX_LOAD_ATTEMPTS; ++attempt)
+        {
+            generations = list_generations(dir_fd);
+            if (generations.empty())
+                return repository_manifest();
+
+            // removed since the listing when newer ones were published
+            uint64_t latest = generations.back();
+            if (auto data = read_whole_file_if_exists({dir_fd, generation_name(latest)}))
+                return repository_manifest::parse(latest, data->data(), data->size());
+        }
+
+        throw std::runtime_error("repository manifest keeps changing");
+    }
+}
+
+repository_manifest repository_manifest::parse(uint64_t generation, char const* data, size_t size)
+{
+    repository_manifest result;
+    result.generation = generation;
+
+    std::string text(data, size);
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos)
+            eol = text.size();
+
+        std::string line = text.substr(pos, eol - pos);
+        pos = eol + 1;
+
+        size_t space = line.find(' ');
+        if (space == std::string::npos || space + 1 == line.size())
+            throw std::runtime_error("malformed repository manifest line: " + line);
+
+        std::string kind = line.substr(0, space);
+        std::string name = line.substr(space + 1);
+        if (kind == "index")
+            result.index = name;
+        else if (kind == "segment")
+            result.segments.push_back(name);
+        else if (kind == "pack")
+            result.packs.push_back(name);
+        else
+            throw std::runtime_error("unknown repository manifest entry: " + line);
+    }
+
+    return result;
+}
+
+std::vector<char> repository_manifest::serialize() const
+{
+    std::string text;
+    if (!index.empty())
+        text += "index " + index + '\n';
+    for (std::string const& name : segments)
+        text += "segment " + name + '\n';
+    for (std::string const& name : packs)
+        text += "pack " + name + '\n';
+    return std::vector<char>(text.begin(), text.end());
+}
+
+repository_manifest repository_manifest::load_latest(int dir_fd)
+{
+    std::vector<uint64_t> generations;
+    return load_latest_from(dir_fd, generations);
+}
+
+repository_manifest repository_manifest::update(int dir_fd, std::function<void(repository_manifest&)> const& change)
+{
+    static std::atomic<unsigned> counter;
+    std::string tmp_name = "tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+
+    try
+    {
+        for (size_t attempt = 0; attempt != MAX_LOAD_ATTEMPTS; ++attempt)
+        {
+            std::vector<uint64_t> generations;
+            repository_manifest result = load_latest_from(dir_fd, generations);
+            change(result);
+            ++result.generation;
+
+            // complete before it gets its name, readers never see a
+            // partial one
+            write_whole_file({dir_fd, tmp_name}, result.serialize());
+            if (!link_if_not_exists({dir_fd, tmp_name}, {dir_fd, generation_name(result.generation)}))
+                continue;
+
+            unlink({dir_fd, tmp_name});
+            for (uint64_t generation : generations)
+                if (generation + KEEP_GENERATIONS <= result.generation)
+                    unlink_if_exists({dir_fd, generation_name(generation)});
+
+            return result;
+        }
+    }
+    catch (...)
+    {
+        unlink_if_exists({dir_fd, tmp_name});
+        throw;
+    }
+
+    unlink_if_exists({dir_fd, tmp_name});
+    throw std::runtime_error("too many concurrent repository manifest updates");
+}
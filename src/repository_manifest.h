@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// The packs and object index files that make up a repository at one
+// point in time, stored as "kind name" lines. Every change publishes a
+// new generation as a new file in manifests/, so readers that load one
+// generation see a consistent set of files even while writers replace
+// them.
+//
+// Generations are claimed with link(), which fails if the name exists:
+// two writers that start from the same generation can't both publish
+// the next one, the loser retries on top of the winner's. No writer
+// waits for another.
+struct repository_manifest
+{
+    // 0 if nothing was published yet
+    uint64_t generation = 0;
+
+    // object index built by gc from a full listing, empty if there is
+    // none; segments cover objects stored since
+    std::string index;
+    std::vector<std::string> segments;
+
+    std::vector<std::string> packs;
+
+    // the contents of a generation file
+    std::vector<char> serialize() const;
+    static repository_manifest parse(uint64_t generation, char const* data, size_t size);
+
+    // the newest generation in dir, an empty manifest if there is none
+    static repository_manifest load_latest(int dir_fd);
+
+    // publishes the result of change applied to the newest generation,
+    // retrying until no other writer got in between; returns what was
+    // published. change can be called several times
+    static repository_manifest update(int dir_fd, std::function<void(repository_manifest&)> const& change);
+};
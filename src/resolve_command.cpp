@@ -0,0 +1,39 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "command_line.h"
+#include "repository.h"
+
+// resolve [--abbrev] <name>...
+//
+// prints the full name of every object given by an abbreviated name, or
+// with --abbrev the shortest abbreviation that is still unique
+void resolve_command(size_t argc, char* argv[])
+{
+    bool abbreviate = false;
+    if (argc != 0 && match_flag(*argv, "abbrev"))
+    {
+        abbreviate = true;
+        --argc;
+        ++argv;
+    }
+
+    if (argc == 0)
+        throw std::runtime_error("object name expected");
+
+    repository repo(default_repository_root());
+    for (size_t i = 0; i != argc; ++i)
+    {
+        md5 hash = resolve_object_name(repo, argv[i]);
+        if (!abbreviate)
+        {
+            std::cout << hash << '\n';
+            continue;
+        }
+
+        char hex[MD5_HEX_LENGTH];
+        md5_to_hex(hash, hex);
+        std::cout << std::string(hex, repo.abbreviation_length(hash)) << '\n';
+    }
+}
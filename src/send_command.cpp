@@ -0,0 +1,107 @@
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "file_descriptor.h"
+#include "repository.h"
+#include "sync.h"
+
+namespace
+{
+    // starts argv[0] with its stdin and stdout connected to the returned pipes
+    pid_t spawn(char* argv[], file_descriptor& to_child, file_descriptor& from_child)
+    {
+        pipe_fds child_input = make_pipe(pipe_flags::close_on_exec);
+        pipe_fds child_output = make_pipe(pipe_flags::close_on_exec);
+
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error(std::string("fork: ") + strerror(errno));
+
+        if (pid == 0)
+        {
+            try
+            {
+                dup(child_input.read_end.get_fd(), STDIN_FILENO, dup_flags::none);
+                dup(child_output.write_end.get_fd(), STDOUT_FILENO, dup_flags::none);
+                execvp(argv[0], argv);
+                std::cerr << "error: can not run " << argv[0] << ": " << strerror(errno) << '\n';
+            }
+            catch (std::exception const& e)
+            {
+                std::cerr << "error: " << e.what() << '\n';
+            }
+            _exit(127);
+        }
+
+        to_child = std::move(child_input.write_end);
+        from_child = std::move(child_output.read_end);
+        return pid;
+    }
+
+    int wait_for(pid_t pid)
+    {
+        int status;
+        while (waitpid(pid, &status, 0) < 0)
+        {
+            if (errno != EINTR)
+                throw std::runtime_error(std::string("waitpid: ") + strerror(errno));
+        }
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+}
+
+// send [--] <command> [args...]
+// runs the command, which is expected to be "source-store receive" on the
+// other side (e.g. through ssh), and sends it the objects it lacks
+void send_command(size_t argc, char* argv[])
+{
+    if (argc != 0 && !strcmp(*argv, "--"))
+    {
+        --argc;
+        ++argv;
+    }
+
+    if (argc == 0)
+        throw std::runtime_error("receiver command expected");
+
+    repository repo(default_repository_root());
+
+    // a dead receiver must turn into a write error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    file_descriptor to_child;
+    file_descriptor from_child;
+    pid_t pid = spawn(argv, to_child, from_child);
+
+    sync_summary summary;
+    try
+    {
+        summary = sync_send(repo, from_child, to_child);
+    }
+    catch (...)
+    {
+        to_child.close();
+        from_child.close();
+        wait_for(pid);
+        throw;
+    }
+
+    to_child.close();
+    from_child.close();
+
+    int status = wait_for(pid);
+    if (status != 0)
+        throw std::runtime_error("receiver exited with status " + std::to_string(status));
+
+    std::cout << summary.objects_sent << " of " << summary.objects_offered << " objects sent, "
+              << summary.pack_bytes << " bytes packed, "
+              << summary.rounds << " negotiation rounds\n";
+}
@@ -0,0 +1,271 @@
+#include "sha256.h"
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "stats.h"
+
+namespace
+{
+    alignas(16) uint32_t const K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    inline uint32_t rotr(uint32_t x, unsigned n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    inline uint32_t load_be32(unsigned char const* p)
+    {
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+    }
+
+    void compress_generic(uint32_t state[8], unsigned char const* blocks, size_t block_count)
+    {
+        for (; block_count != 0; --block_count, blocks += SHA256_BLOCK_SIZE)
+        {
+            uint32_t w[64];
+            for (size_t i = 0; i != 16; ++i)
+                w[i] = load_be32(blocks + 4 * i);
+            for (size_t i = 16; i != 64; ++i)
+            {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (size_t i = 0; i != 64; ++i)
+            {
+                uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+                uint32_t ch = (e & f) ^ (~e & g);
+                uint32_t t1 = h + s1 + ch + K[i] + w[i];
+                uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+                uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                uint32_t t2 = s0 + maj;
+
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+    }
+
+    __attribute__((target("sha,sse4.1")))
+    void compress_sha_ni(uint32_t state[8], unsigned char const* blocks, size_t block_count)
+    {
+        __m128i const BSWAP_MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+        // SHA-NI operates on the state split as ABEF and CDGH
+        __m128i tmp = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&state[0]));
+        __m128i state1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&state[4]));
+        tmp = _mm_shuffle_epi32(tmp, 0xB1);
+        state1 = _mm_shuffle_epi32(state1, 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        for (; block_count != 0; --block_count, blocks += SHA256_BLOCK_SIZE)
+        {
+            __m128i abef_save = state0;
+            __m128i cdgh_save = state1;
+
+            // message schedule for the last four groups of four rounds
+            __m128i w[4];
+            for (size_t i = 0; i != 16; ++i)
+            {
+                __m128i msg;
+                if (i < 4)
+                    msg = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(blocks + 16 * i)), BSWAP_MASK);
+                else
+                {
+                    // W[t] = W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2])
+                    msg = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                    msg = _mm_add_epi32(msg, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                    msg = _mm_sha256msg2_epu32(msg, w[(i + 3) % 4]);
+                }
+                w[i % 4] = msg;
+
+                __m128i k = _mm_add_epi32(msg, _mm_load_si128(reinterpret_cast<__m128i const*>(&K[4 * i])));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, k);
+                k = _mm_shuffle_epi32(k, 0x0E);
+                state0 = _mm_sha256rnds2_epu32(state0, state1, k);
+            }
+
+            state0 = _mm_add_epi32(state0, abef_save);
+            state1 = _mm_add_epi32(state1, cdgh_save);
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+        state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+    }
+
+    using compress_function = void (*)(uint32_t state[8], unsigned char const* blocks, size_t block_count);
+
+    compress_function select_compress()
+    {
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return compress_generic;
+        bool has_ssse3 = ecx & bit_SSSE3;
+        bool has_sse41 = ecx & bit_SSE4_1;
+
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            return compress_generic;
+        bool has_sha = ebx & bit_SHA;
+
+        return has_ssse3 && has_sse41 && has_sha ? compress_sha_ni : compress_generic;
+    }
+
+    compress_function const compress = select_compress();
+}
+
+std::ostream& operator<<(std::ostream& os, sha256 const& hash)
+{
+    char buf[SHA256_HEX_LENGTH];
+    sha256_to_hex(hash, buf);
+    return os.write(buf, sizeof buf);
+}
+
+void sha256_to_hex(sha256 const& hash, char* out)
+{
+    static char const hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7',
+                                 '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+    for (size_t i = 0; i != sizeof hash.data; ++i)
+    {
+        *out++ = hex[hash.data[i] / 16];
+        *out++ = hex[hash.data[i] % 16];
+    }
+}
+
+bool sha256_from_hex(char const* str, size_t len, sha256& hash)
+{
+    if (len != SHA256_HEX_LENGTH)
+        return false;
+
+    for (size_t i = 0; i != sizeof hash.data; ++i)
+    {
+        unsigned value = 0;
+        for (size_t j = 0; j != 2; ++j)
+        {
+            char c = str[2 * i + j];
+            value *= 16;
+            if (c >= '0' && c <= '9')
+                value += c - '0';
+            else if (c >= 'a' && c <= 'f')
+                value += c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                value += c - 'A' + 10;
+            else
+                return false;
+        }
+        hash.data[i] = static_cast<uint8_t>(value);
+    }
+
+    return true;
+}
+
+sha256_accumulator::sha256_accumulator() noexcept
+{
+    reset();
+}
+
+void sha256_accumulator::accumulate(char const* message, size_t len) noexcept
+{
+    stats::scoped_timer timer(stats::phase::hash);
+    stats::add(stats::counter::bytes_hashed, len);
+
+    unsigned char const* p = reinterpret_cast<unsigned char const*>(message);
+    total_len += len;
+
+    if (tail_len != 0)
+    {
+        size_t n = std::min(len, SHA256_BLOCK_SIZE - tail_len);
+        memcpy(tail + tail_len, p, n);
+        tail_len += n;
+        p += n;
+        len -= n;
+
+        if (tail_len != SHA256_BLOCK_SIZE)
+            return;
+
+        compress(state, tail, 1);
+        tail_len = 0;
+    }
+
+    size_t block_count = len / SHA256_BLOCK_SIZE;
+    compress(state, p, block_count);
+
+    tail_len = len % SHA256_BLOCK_SIZE;
+    memcpy(tail, p + block_count * SHA256_BLOCK_SIZE, tail_len);
+}
+
+sha256 sha256_accumulator::finish() noexcept
+{
+    stats::scoped_timer timer(stats::phase::hash);
+
+    unsigned char block[2 * SHA256_BLOCK_SIZE] = {};
+    memcpy(block, tail, tail_len);
+    block[tail_len] = 0x80;
+
+    size_t padded = tail_len + 1 + 8 <= SHA256_BLOCK_SIZE ? SHA256_BLOCK_SIZE : 2 * SHA256_BLOCK_SIZE;
+    uint64_t bits = total_len * 8;
+    for (size_t i = 0; i != 8; ++i)
+        block[padded - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+
+    compress(state, block, padded / SHA256_BLOCK_SIZE);
+
+    sha256 result;
+    for (size_t i = 0; i != 8; ++i)
+    {
+        result.data[4 * i + 0] = static_cast<uint8_t>(state[i] >> 24);
+        result.data[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+        result.data[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+        result.data[4 * i + 3] = static_cast<uint8_t>(state[i]);
+    }
+
+    return result;
+}
+
+void sha256_accumulator::reset() noexcept
+{
+    static uint32_t const INITIAL_STATE[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    std::copy(INITIAL_STATE, INITIAL_STATE + 8, state);
+    total_len = 0;
+    tail_len = 0;
+}
+
+sha256 sha256_hash(char const* message, size_t len)
+{
+    sha256_accumulator acc;
+    acc.accumulate(message, len);
+    return acc.finish();
+}
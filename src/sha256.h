@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iosfwd>
+
+struct sha256
+{
+    uint8_t data[32];
+};
+
+constexpr size_t SHA256_HEX_LENGTH = 64;
+constexpr size_t SHA256_BLOCK_SIZE = 64;
+
+std::ostream& operator<<(std::ostream& os, sha256 const& hash);
+
+// writes exactly SHA256_HEX_LENGTH characters, no null terminator
+void sha256_to_hex(sha256 const& hash, char* out);
+bool sha256_from_hex(char const* str, size_t len, sha256& hash);
+
+// incremental sha256, uses SHA-NI instructions when the CPU has them
+class sha256_accumulator
+{
+    uint32_t state[8];
+    uint64_t total_len = 0;
+    size_t tail_len = 0;
+    unsigned char tail[SHA256_BLOCK_SIZE];
+
+public:
+    sha256_accumulator() noexcept;
+
+    void accumulate(char const* message, size_t len) noexcept;
+
+    sha256 finish() noexcept;
+
+    void reset() noexcept;
+};
+
+sha256 sha256_hash(char const* message, size_t len);
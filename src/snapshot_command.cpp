@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "command_line.h"
+#include "file_descriptor.h"
+#include "md5.h"
+#include "parallel.h"
+#include "repository.h"
+#include "stat_cache.h"
+#include "stats.h"
+#include "tree_object.h"
+
+namespace
+{
+    char const STAT_CACHE_DIRNAME[] = "stat-cache";
+
+    // timestamps are only as fine as the filesystem keeps them: a file
+    // changed this soon before the snapshot started may change again
+    // without its stat data changing, so it is not cached
+    constexpr int64_t RACY_WINDOW_NS = 1000000000;
+
+    struct node
+    {
+        std::string name;
+        // relative to the snapshot root, empty for the root itself
+        std::string path;
+        tree_entry_mode mode;
+        struct stat64 st;
+        md5 hash;
+        // the hash differs from the cached one (or there was none)
+        bool changed;
+        size_t depth;
+        std::vector<std::unique_ptr<node>> children;
+    };
+
+    // false for the types trees don't record (devices, sockets, ...)
+    bool to_entry_mode(mode_t st_mode, tree_entry_mode& result)
+    {
+        if (S_ISREG(st_mode))
+            result = (st_mode & 0111) ? tree_entry_mode::executable : tree_entry_mode::file;
+        else if (S_ISLNK(st_mode))
+            result = tree_entry_mode::symlink;
+        else if (S_ISDIR(st_mode))
+            result = tree_entry_mode::directory;
+        else
+            return false;
+
+        return true;
+    }
+
+    int64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    int64_t to_ns(struct timespec const& ts)
+    {
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    // Three passes: a parallel walk that stats every entry and takes the
+    // hashes of unchanged files from the cache, parallel hashing of the
+    // rest, and tree building level by level from the deepest directories
+    // up. A directory whose stat data and children are all unchanged keeps
+    // its cached tree, so only changed paths and their ancestors are read
+    // or serialized.
+    struct snapshot_builder
+    {
+        snapshot_builder(repository& repo, int root_fd, stat_cache const& cache, size_t jobs)
+            : repo(repo)
+            , root_fd(root_fd)
+            , cache(cache)
+            , jobs(jobs)
+            , may_evict(repo.get_config().capacity != 0)
+        {}
+
+        md5 build()
+        {
+            root = std::make_unique<node>();
+            root->mode = tree_entry_mode::directory;
+            root->st = stat({root_fd, "."}, stat_flags::none);
+            root->depth = 0;
+
+            scan();
+            hash_files();
+            build_trees();
+
+            return root->hash;
+        }
+
+        // entries for the next run; racy ones are left out and hashed
+        // again next time
+        stat_cache make_cache(int64_t started_ns) const
+        {
+            stat_cache result;
+            add_to_cache(result, *root, started_ns - RACY_WINDOW_NS);
+            return result;
+        }
+
+    private:
+        void scan()
+        {
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::vector<node*> stack{root.get()};
+            size_t busy = 0;
+            bool failed = false;
+
+            run_parallel(jobs, [&](std::atomic<bool> const& stop)
+            {
+                for (;;)
+                {
+                    node* dir;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [&] { return failed || stop || !stack.empty() || busy == 0; });
+                        if (failed || stop || stack.empty())
+                            return;
+
+                        dir = stack.back();
+                        stack.pop_back();
+                        ++busy;
+                    }
+
+                    std::vector<node*> subdirs;
+                    try
+                    {
+                        scan_directory(*dir, subdirs);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        failed = true;
+                        --busy;
+                        cv.notify_all();
+                        throw;
+                    }
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --busy;
+                    stack.insert(stack.end(), subdirs.rbegin(), subdirs.rend());
+                    cv.notify_all();
+                }
+            });
+        }
+
+        void scan_directory(node& dir, std::vector<node*>& subdirs)
+        {
+            {
+                std::lock_guard<std::mutex> lock(list_mutex);
+                directories.push_back(&dir);
+            }
+
+            file_flags flags = file_flags::read_only | file_flags::directory | file_flags::close_on_exec;
+            if (!dir.path.empty())
+                flags |= file_flags::nofollow;
+            directory_stream ds(file_descriptor::open({root_fd, dir.path.empty() ? "." : dir.path.c_str()}, flags));
+
+            std::vector<node*> files;
+            while (directory_stream::dirent const* ent = ds.next())
+            {
+                char const* name = ent->d_name;
+                if (!strcmp(name, ".") || !strcmp(name, ".."))
+                    continue;
+
+                auto child = std::make_unique<node>();
+                child->st = stat({ds.get_fd(), name}, stat_flags::symlink_nofollow);
+                if (!to_entry_mode(child->st.st_mode, child->mode))
+                    continue;
+
+                child->name = name;
+                child->path = dir.path.empty() ? child->name : dir.path + '/' + child->name;
+                child->depth = dir.depth + 1;
+                child->changed = false;
+
+                if (child->mode == tree_entry_mode::directory)
+                    subdirs.push_back(child.get());
+                else if (!reuse_cached(*child))
+                {
+                    if (child->mode == tree_entry_mode::symlink)
+                        hash_symlink(ds.get_fd(), *child);
+                    else
+                        files.push_back(child.get());
+                }
+
+                dir.children.push_back(std::move(child));
+            }
+
+            std::sort(dir.children.begin(), dir.children.end(), [](std::unique_ptr<node> const& a, std::unique_ptr<node> const& b)
+            {
+                return a->name < b->name;
+            });
+
+            if (!files.empty())
+            {
+                std::lock_guard<std::mutex> lock(list_mutex);
+                pending_files.insert(pending_files.end(), files.begin(), files.end());
+            }
+        }
+
+        bool reuse_cached(node& n)
+        {
+            stat_cache::entry const* cached = cache.find(n.path);
+            if (!cached || !stat_cache::matches(*cached, n.st))
+                return false;
+
+            // evicted objects have to be stored again
+            if (may_evict && !repo.has_object(cached->hash))
+                return false;
+
+            n.hash = cached->hash;
+            stats::add(stats::counter::stat_cache_hits);
+            return true;
+        }
+
+        // the parent's entry changes with the mode too (chmod +x doesn't
+        // change the content, nor the parent's own stat data)
+        void set_hash(node& n, md5 const& hash)
+        {
+            stat_cache::entry const* cached = cache.find(n.path);
+            n.hash = hash;
+
+            tree_entry_mode cached_mode;
+            n.changed = !cached || memcmp(cached->hash.data, hash.data, sizeof hash.data) != 0
+                || !to_entry_mode(cached->mode, cached_mode) || cached_mode != n.mode;
+        }
+
+        // the blob of a symlink is its target, as in git
+        void hash_symlink(int dir_fd, node& n)
+        {
+            std::string target = read_symlink({dir_fd, n.name});
+            md5 hash = md5_hash(target.data(), target.size());
+            if (!repo.has_object(hash))
+                repo.add_object(hash, std::vector<char>(target.begin(), target.end()));
+            set_hash(n, hash);
+        }
+
+        void hash_files()
+        {
+            std::atomic<size_t> next{0};
+            run_parallel(std::min(jobs, std::max(pending_files.size(), size_t(1))), [&](std::atomic<bool> const& stop)
+            {
+                while (!stop)
+                {
+                    size_t index = next++;
+                    if (index >= pending_files.size())
+                        return;
+
+                    node& n = *pending_files[index];
+                    file_descriptor fd = file_descriptor::open({root_fd, n.path}, file_flags::read_only | file_flags::nofollow | file_flags::close_on_exec);
+                    set_hash(n, repo.add_object(fd));
+                }
+            });
+        }
+
+        void build_trees()
+        {
+            std::stable_sort(directories.begin(), directories.end(), [](node const* a, node const* b)
+            {
+                return a->depth > b->depth;
+            });
+
+            // directories of one level don't depend on each other
+            for (size_t first = 0; first != directories.size();)
+            {
+                size_t last = first;
+                while (last != directories.size() && directories[last]->depth == directories[first]->depth)
+                    ++last;
+
+                std::atomic<size_t> next{first};
+                run_parallel(std::min(jobs, last - first), [&](std::atomic<bool> const& stop)
+                {
+                    while (!stop)
+                    {
+                        size_t index = next++;
+                        if (index >= last)
+                            return;
+                        build_tree(*directories[index]);
+                    }
+                });
+
+                first = last;
+            }
+        }
+
+        void build_tree(node& dir)
+        {
+            bool children_changed = std::any_of(dir.children.begin(), dir.children.end(), [](std::unique_ptr<node> const& child)
+            {
+                return child->changed;
+            });
+
+            if (!children_changed && reuse_cached(dir))
+                return;
+
+            std::vector<tree_entry> entries;
+            entries.reserve(dir.children.size());
+            for (std::unique_ptr<node> const& child : dir.children)
+                entries.push_back({child->name, child->mode, child->hash});
+
+            set_hash(dir, store_tree(repo, entries));
+            stats::add(stats::counter::trees_written);
+        }
+
+        static void add_to_cache(stat_cache& result, node const& n, int64_t racy_after_ns)
+        {
+            if (to_ns(n.st.st_mtim) < racy_after_ns && to_ns(n.st.st_ctim) < racy_after_ns)
+                result.insert(n.path, stat_cache::make_entry(n.st, n.hash));
+
+            for (std::unique_ptr<node> const& child : n.children)
+                add_to_cache(result, *child, racy_after_ns);
+        }
+
+    private:
+        repository& repo;
+        int root_fd;
+        stat_cache const& cache;
+        size_t jobs;
+        bool may_evict;
+
+        std::unique_ptr<node> root;
+
+        std::mutex list_mutex;
+        std::vector<node*> directories;
+        std::vector<node*> pending_files;
+    };
+
+    std::string cache_name(std::string const& root_path)
+    {
+        char name[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(md5_hash(root_path.data(), root_path.size()), name);
+        return name;
+    }
+}
+
+// snapshot [--jobs=N] [--no-cache] <directory>
+//
+// stores every file under directory and the tree objects describing it,
+// prints the name of the root tree. Stat data from the previous snapshot
+// of the same directory is kept in the repository, files whose stat data
+// didn't change are not read again.
+void snapshot_command(size_t argc, char* argv[])
+{
+    size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    bool use_cache = true;
+
+    for (; argc != 0; --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "jobs", value))
+            jobs = std::max(parse_count("jobs", value), size_t(1));
+        else if (match_flag(*argv, "no-cache"))
+            use_cache = false;
+        else if (**argv == '-' && (*argv)[1] == '-')
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+        else
+            break;
+    }
+
+    if (argc != 1)
+        throw std::runtime_error("directory expected");
+
+    char resolved[PATH_MAX];
+    if (!realpath(*argv, resolved))
+        throw std::runtime_error(std::string("can not resolve ") + *argv + ": " + strerror(errno));
+    std::string root_path = resolved;
+
+    repository repo(default_repository_root());
+    file_descriptor root = file_descriptor::open(root_path, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+    mkdir_if_not_exists({repo.get_root_fd(), STAT_CACHE_DIRNAME});
+    file_descriptor cache_dir = file_descriptor::open({repo.get_root_fd(), STAT_CACHE_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+    std::string name = cache_name(root_path);
+
+    stat_cache cache;
+    if (use_cache)
+        cache = stat_cache::load({cache_dir.get_fd(), name});
+
+    int64_t started_ns = now_ns();
+    snapshot_builder builder(repo, root.get_fd(), cache, jobs);
+    md5 tree = builder.build();
+
+    builder.make_cache(started_ns).save(cache_dir.get_fd(), name);
+
+    std::cout << tree << '\n';
+
+    repo.flush_shared_tier();
+    repo.enforce_capacity();
+}
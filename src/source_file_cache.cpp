@@ -0,0 +1,289 @@
+#include "source_file_cache.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "dwarf_md5.h"
+#include "elf_build_id.h"
+#include "repository.h"
+#include "stats.h"
+
+namespace
+{
+    char const LIST_MAGIC[8] = {'S', 'S', 'D', 'W', 'A', 'R', 'F', '1'};
+    char const CACHE_DIRNAME[] = "dwarf-cache";
+
+    source_file_list extract_source_files(char const* filename)
+    {
+        // names are only needed until they are serialized
+        arena names;
+        std::vector<std::pair<std::string_view, md5>> files;
+
+        dwarf::source_file_reader reader(filename);
+        for (dwarf::source_file file; reader.next(file);)
+            files.emplace_back(names.copy(file.name), file.hash);
+
+        return source_file_list::from_files(files);
+    }
+}
+
+struct source_file_list::header
+{
+    char magic[8];
+    uint32_t entry_count;
+    uint32_t paths_size;
+};
+
+struct source_file_list::entry
+{
+    uint32_t path_offset;
+    uint32_t path_size;
+    uint8_t hash[16];
+};
+
+source_file_list::source_file_list()
+    : data(nullptr)
+{}
+
+source_file_list::source_file_list(source_file_list&& other) noexcept
+    : mapping(std::move(other.mapping))
+    , owned(std::move(other.owned))
+    , data(other.data)
+{
+    other.data = nullptr;
+}
+
+source_file_list& source_file_list::operator=(source_file_list&& rhs) noexcept
+{
+    mapping = std::move(rhs.mapping);
+    owned = std::move(rhs.owned);
+    data = rhs.data;
+    rhs.data = nullptr;
+    return *this;
+}
+
+source_file_list::~source_file_list()
+{}
+
+source_file_list::operator bool() const
+{
+    return data != nullptr;
+}
+
+source_file_list::header const* source_file_list::get_header() const
+{
+    return reinterpret_cast<header const*>(data);
+}
+
+size_t source_file_list::size() const
+{
+    return data ? get_header()->entry_count : 0;
+}
+
+std::string_view source_file_list::path(size_t index) const
+{
+    header const* hdr = get_header();
+    entry const* entries = reinterpret_cast<entry const*>(hdr + 1);
+    char const* paths = reinterpret_cast<char const*>(entries + hdr->entry_count);
+    return std::string_view(paths + entries[index].path_offset, entries[index].path_size);
+}
+
+md5 source_file_list::hash(size_t index) const
+{
+    entry const* entries = reinterpret_cast<entry const*>(get_header() + 1);
+    md5 result;
+    memcpy(result.data, entries[index].hash, sizeof result.data);
+    return result;
+}
+
+bool source_file_list::is_valid(char const* data, size_t size)
+{
+    if (size < sizeof(header))
+        return false;
+
+    header const* hdr = reinterpret_cast<header const*>(data);
+    if (memcmp(hdr->magic, LIST_MAGIC, sizeof LIST_MAGIC) != 0)
+        return false;
+    if (size != sizeof(header) + uint64_t(hdr->entry_count) * sizeof(entry) + hdr->paths_size)
+        return false;
+
+    entry const* entries = reinterpret_cast<entry const*>(hdr + 1);
+    for (size_t i = 0; i != hdr->entry_count; ++i)
+        if (entries[i].path_offset > hdr->paths_size || entries[i].path_size > hdr->paths_size - entries[i].path_offset)
+            return false;
+
+    return true;
+}
+
+source_file_list source_file_list::from_files(std::vector<std::pair<std::string_view, md5>> const& files)
+{
+    size_t paths_size = 0;
+    for (auto const& file : files)
+        paths_size += file.first.size();
+    if (files.size() > UINT32_MAX || paths_size > UINT32_MAX)
+        throw std::runtime_error("too many source files");
+
+    source_file_list result;
+    result.owned.resize(sizeof(header) + files.size() * sizeof(entry) + paths_size);
+
+    header* hdr = reinterpret_cast<header*>(result.owned.data());
+    memcpy(hdr->magic, LIST_MAGIC, sizeof LIST_MAGIC);
+    hdr->entry_count = static_cast<uint32_t>(files.size());
+    hdr->paths_size = static_cast<uint32_t>(paths_size);
+
+    entry* entries = reinterpret_cast<entry*>(hdr + 1);
+    char* paths = reinterpret_cast<char*>(entries + files.size());
+    uint32_t offset = 0;
+    for (size_t i = 0; i != files.size(); ++i)
+    {
+        entries[i].path_offset = offset;
+        entries[i].path_size = static_cast<uint32_t>(files[i].first.size());
+        memcpy(entries[i].hash, files[i].second.data, sizeof entries[i].hash);
+        memcpy(paths + offset, files[i].first.data(), files[i].first.size());
+        offset += entries[i].path_size;
+    }
+
+    result.data = result.owned.data();
+    return result;
+}
+
+source_file_list source_file_list::map(file_descriptor const& fd)
+{
+    source_file_list result;
+
+    size_t size = static_cast<size_t>(fd.stat().st_size);
+    if (size < sizeof(header))
+        return result;
+
+    memory_mapping mapping = memory_mapping::map(fd, size, map_protection::read, map_flags::private_);
+    if (!is_valid(static_cast<char const*>(mapping.data()), size))
+        return result;
+
+    result.mapping = std::move(mapping);
+    result.data = static_cast<char const*>(result.mapping.data());
+    return result;
+}
+
+source_file_cache::source_file_cache(int repository_root_fd)
+{
+    // the cache is only an optimization, commands that merely read the
+    // repository go on without it (read-only or shared repository, ...)
+    std::error_code ec;
+    try_mkdir({repository_root_fd, CACHE_DIRNAME}, ec);
+    cache_dir = file_descriptor::try_open({repository_root_fd, CACHE_DIRNAME}, file_flags::read_only | file_flags::directory | file_flags::close_on_exec, ec);
+}
+
+std::unique_ptr<source_file_cache> source_file_cache::open_default_if_exists()
+{
+    std::string root_path;
+    try
+    {
+        root_path = default_repository_root();
+    }
+    catch (can_not_detect_default_repository_root const&)
+    {
+        return nullptr;
+    }
+
+    file_descriptor root = file_descriptor::open_if_exists(root_path, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+    if (!root || !file_descriptor::open_if_exists({root.get_fd(), "objects"}, file_flags::path | file_flags::close_on_exec))
+        return nullptr;
+
+    return std::make_unique<source_file_cache>(root.get_fd());
+}
+
+file_descriptor source_file_cache::open_entry_if_exists(std::string const& name)
+{
+    if (!cache_dir)
+        return file_descriptor();
+
+    return file_descriptor::open_if_exists({cache_dir.get_fd(), name}, file_flags::read_only | file_flags::close_on_exec);
+}
+
+void source_file_cache::store_entry(std::string const& name, void const* data, size_t size)
+{
+    if (!cache_dir)
+        return;
+
+    // written under a temporary name and renamed, so readers only ever
+    // see complete entries
+    static std::atomic<unsigned> counter;
+    std::string tmp_name = "tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    try
+    {
+        {
+            file_descriptor fd = file_descriptor::open({cache_dir.get_fd(), tmp_name}, file_flags::write_only | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+            fd.write(data, size);
+        }
+        rename({cache_dir.get_fd(), tmp_name}, {cache_dir.get_fd(), name});
+    }
+    catch (std::exception const&)
+    {
+        // the caller has the result either way, a full disk or a cache
+        // that isn't writable must not fail the command
+        try
+        {
+            unlink_if_exists({cache_dir.get_fd(), tmp_name});
+        }
+        catch (std::exception const&)
+        {}
+    }
+}
+
+source_file_list source_file_cache::get(char const* filename)
+{
+    std::vector<uint8_t> build_id;
+    {
+        file_descriptor fd = file_descriptor::open(filename, file_flags::read_only | file_flags::close_on_exec);
+        build_id = read_build_id(fd);
+    }
+
+    if (build_id.empty())
+        return extract_source_files(filename);
+
+    std::string name = build_id_to_hex(build_id);
+    if (file_descriptor fd = open_entry_if_exists(name))
+    {
+        // a damaged entry is simply replaced below
+        source_file_list cached = source_file_list::map(fd);
+        if (cached)
+        {
+            stats::add(stats::counter::dwarf_cache_hits);
+            return cached;
+        }
+    }
+
+    stats::add(stats::counter::dwarf_cache_misses);
+    source_file_list result = extract_source_files(filename);
+    store_entry(name, result.owned.data(), result.owned.size());
+    return result;
+}
+
+line_index source_file_cache::get_line_index(char const* filename)
+{
+    std::vector<uint8_t> build_id;
+    {
+        file_descriptor fd = file_descriptor::open(filename, file_flags::read_only | file_flags::close_on_exec);
+        build_id = read_build_id(fd);
+    }
+
+    if (build_id.empty())
+        return line_index::build(dwarf::get_line_table(filename));
+
+    std::string name = build_id_to_hex(build_id) + ".lines";
+    if (file_descriptor fd = open_entry_if_exists(name))
+    {
+        line_index cached = line_index::map(fd);
+        if (cached)
+        {
+            stats::add(stats::counter::dwarf_cache_hits);
+            return cached;
+        }
+    }
+
+    stats::add(stats::counter::dwarf_cache_misses);
+    line_index result = line_index::build(dwarf::get_line_table(filename));
+    store_entry(name, result.serialized_data(), result.serialized_size());
+    return result;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "file_descriptor.h"
+#include "line_index.h"
+#include "md5.h"
+
+// (path, md5) pairs of a binary in a compact serialized form: a header,
+// an array of fixed-size entries and a blob of paths. Lists loaded from
+// the cache are used straight from the mapping.
+struct source_file_list
+{
+    source_file_list();
+    source_file_list(source_file_list&&) noexcept;
+    source_file_list& operator=(source_file_list&&) noexcept;
+    ~source_file_list();
+
+    size_t size() const;
+    std::string_view path(size_t index) const;
+    md5 hash(size_t index) const;
+
+    static source_file_list from_files(std::vector<std::pair<std::string_view, md5>> const& files);
+
+    // returns an empty list (operator bool is false) if the data is not
+    // a valid list
+    static source_file_list map(file_descriptor const& fd);
+
+    explicit operator bool() const;
+
+private:
+    friend struct source_file_cache;
+
+    struct header;
+    struct entry;
+
+    static bool is_valid(char const* data, size_t size);
+
+    header const* get_header() const;
+
+private:
+    memory_mapping mapping;
+    std::vector<char> owned;
+    char const* data;
+};
+
+// Results of dwarf::get_source_files and line indices keyed by the build
+// id of the binary, stored in the dwarf-cache/ directory of the
+// repository. Binaries without a build id are always parsed. Storing
+// entries is best-effort: if dwarf-cache/ can't be created or written,
+// results are returned without being cached.
+struct source_file_cache
+{
+    explicit source_file_cache(int repository_root_fd);
+
+    // cache of the default repository, null if there is no repository
+    static std::unique_ptr<source_file_cache> open_default_if_exists();
+
+    source_file_list get(char const* filename);
+    line_index get_line_index(char const* filename);
+
+private:
+    file_descriptor open_entry_if_exists(std::string const& name);
+    void store_entry(std::string const& name, void const* data, size_t size);
+
+private:
+    file_descriptor cache_dir;
+};
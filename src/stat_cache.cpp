@@ -0,0 +1,132 @@
+#include "stat_cache.h"
+#include <atomic>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    char const CACHE_MAGIC[8] = {'S', 'S', 'S', 'T', 'A', 'T', '0', '1'};
+
+    // path size, device, inode, size, mtime, ctime, mode, md5
+    constexpr size_t RECORD_SIZE = 4 + 8 * 5 + 4 + 16;
+
+    template <typename T>
+    void put(std::vector<char>& out, T value)
+    {
+        char const* p = reinterpret_cast<char const*>(&value);
+        out.insert(out.end(), p, p + sizeof value);
+    }
+
+    template <typename T>
+    T get(char const*& p)
+    {
+        T value;
+        memcpy(&value, p, sizeof value);
+        p += sizeof value;
+        return value;
+    }
+
+    int64_t to_ns(struct timespec const& ts)
+    {
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+}
+
+stat_cache::entry stat_cache::make_entry(struct stat64 const& st, md5 const& hash)
+{
+    entry result;
+    result.device = st.st_dev;
+    result.inode = st.st_ino;
+    result.size = static_cast<uint64_t>(st.st_size);
+    result.mtime_ns = to_ns(st.st_mtim);
+    result.ctime_ns = to_ns(st.st_ctim);
+    result.mode = st.st_mode;
+    result.hash = hash;
+    return result;
+}
+
+bool stat_cache::matches(entry const& e, struct stat64 const& st)
+{
+    return e.device == st.st_dev && e.inode == st.st_ino && e.size == static_cast<uint64_t>(st.st_size)
+        && e.mtime_ns == to_ns(st.st_mtim) && e.ctime_ns == to_ns(st.st_ctim) && e.mode == st.st_mode;
+}
+
+stat_cache stat_cache::load(file_location location)
+{
+    stat_cache result;
+
+    std::unique_ptr<std::vector<char>> data = read_whole_file_if_exists(location);
+    if (!data || data->size() < sizeof CACHE_MAGIC + 8 || memcmp(data->data(), CACHE_MAGIC, sizeof CACHE_MAGIC) != 0)
+        return result;
+
+    char const* p = data->data() + sizeof CACHE_MAGIC;
+    char const* end = data->data() + data->size();
+    uint64_t count = get<uint64_t>(p);
+    if (count > static_cast<uint64_t>(end - p) / RECORD_SIZE)
+        return result;
+
+    result.entries.reserve(count);
+    for (uint64_t i = 0; i != count; ++i)
+    {
+        if (static_cast<size_t>(end - p) < RECORD_SIZE)
+            return stat_cache();
+
+        uint32_t path_size = get<uint32_t>(p);
+        entry e;
+        e.device = get<uint64_t>(p);
+        e.inode = get<uint64_t>(p);
+        e.size = get<uint64_t>(p);
+        e.mtime_ns = get<int64_t>(p);
+        e.ctime_ns = get<int64_t>(p);
+        e.mode = get<uint32_t>(p);
+        memcpy(e.hash.data, p, sizeof e.hash.data);
+        p += sizeof e.hash.data;
+
+        if (static_cast<size_t>(end - p) < path_size)
+            return stat_cache();
+        result.entries.emplace(std::string(p, path_size), e);
+        p += path_size;
+    }
+
+    return result;
+}
+
+void stat_cache::save(int dir_fd, std::string const& name) const
+{
+    std::vector<char> data(CACHE_MAGIC, CACHE_MAGIC + sizeof CACHE_MAGIC);
+    put<uint64_t>(data, entries.size());
+    for (auto const& [path, e] : entries)
+    {
+        put<uint32_t>(data, static_cast<uint32_t>(path.size()));
+        put(data, e.device);
+        put(data, e.inode);
+        put(data, e.size);
+        put(data, e.mtime_ns);
+        put(data, e.ctime_ns);
+        put(data, e.mode);
+        data.insert(data.end(), e.hash.data, e.hash.data + sizeof e.hash.data);
+        data.insert(data.end(), path.begin(), path.end());
+    }
+
+    static std::atomic<unsigned> counter;
+    std::string tmp_name = name + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    write_whole_file({dir_fd, tmp_name}, data);
+    rename({dir_fd, tmp_name}, {dir_fd, name});
+}
+
+stat_cache::entry const* stat_cache::find(std::string const& path) const
+{
+    auto i = entries.find(path);
+    return i == entries.end() ? nullptr : &i->second;
+}
+
+void stat_cache::insert(std::string const& path, entry const& e)
+{
+    entries.insert_or_assign(path, e);
+}
+
+size_t stat_cache::size() const
+{
+    return entries.size();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "file_descriptor.h"
+#include "md5.h"
+
+// What a snapshot of a directory found last time: stat data and hash of
+// every file and directory, keyed by the path relative to the snapshot
+// root. An entry whose stat data still matches lets the next snapshot
+// reuse the hash instead of reading the file (or serializing the tree).
+struct stat_cache
+{
+    struct entry
+    {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint32_t mode;
+        md5 hash;
+    };
+
+    static entry make_entry(struct stat64 const& st, md5 const& hash);
+
+    // the stat data of a file that was changed after the hash was taken
+    // differs from the cached one in at least one of these fields
+    static bool matches(entry const& e, struct stat64 const& st);
+
+    // returns an empty cache if the file is missing or damaged
+    static stat_cache load(file_location location);
+
+    // written to a temporary file in the same directory and renamed
+    void save(int dir_fd, std::string const& name) const;
+
+    entry const* find(std::string const& path) const;
+    void insert(std::string const& path, entry const& e);
+
+    size_t size() const;
+
+private:
+    std::unordered_map<std::string, entry> entries;
+};
@@ -0,0 +1,144 @@
+#include "stats.h"
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+
+namespace stats
+{
+namespace
+{
+    char const* const COUNTER_NAMES[COUNTER_COUNT] = {
+        "syscalls",
+        "files_opened",
+        "bytes_read",
+        "bytes_written",
+        "bytes_hashed",
+        "objects_written",
+        "objects_deduplicated",
+        "objects_evicted",
+        "objects_promoted",
+        "objects_uploaded",
+        "cus_parsed",
+        "source_files_found",
+        "dwarf_cache_hits",
+        "dwarf_cache_misses",
+        "stat_cache_hits",
+        "trees_written",
+        "objects_packed",
+        "deltas_written",
+    };
+
+    char const* const PHASE_NAMES[PHASE_COUNT] = {
+        "open",
+        "stat",
+        "read",
+        "write",
+        "link",
+        "hash",
+        "dwarf",
+    };
+
+    // blocks are never freed, so counts of threads that already exited
+    // are still included in the report
+    struct registry
+    {
+        std::mutex mutex;
+        std::deque<thread_block> blocks;
+    };
+
+    registry& get_registry()
+    {
+        static registry* instance = new registry();
+        return *instance;
+    }
+}
+
+namespace detail
+{
+    thread_block* register_thread()
+    {
+        registry& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+
+        thread_block& b = r.blocks.emplace_back();
+        for (auto& c : b.counters)
+            c.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i != PHASE_COUNT; ++i)
+        {
+            b.phase_ns[i].store(0, std::memory_order_relaxed);
+            b.phase_calls[i].store(0, std::memory_order_relaxed);
+        }
+
+        current = &b;
+        return &b;
+    }
+}
+
+totals collect()
+{
+    totals result = {};
+
+    registry& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    for (thread_block const& b : r.blocks)
+    {
+        for (size_t i = 0; i != COUNTER_COUNT; ++i)
+            result.counters[i] += b.counters[i].load(std::memory_order_relaxed);
+        for (size_t i = 0; i != PHASE_COUNT; ++i)
+        {
+            result.phase_ns[i] += b.phase_ns[i].load(std::memory_order_relaxed);
+            result.phase_calls[i] += b.phase_calls[i].load(std::memory_order_relaxed);
+        }
+    }
+    result.thread_count = r.blocks.size();
+
+    return result;
+}
+
+void print_summary(std::ostream& os, uint64_t wall_ns)
+{
+    totals t = collect();
+
+    os << "wall time: " << std::fixed << std::setprecision(3) << static_cast<double>(wall_ns) / 1e6 << " ms"
+       << ", threads: " << t.thread_count << '\n';
+
+    os << "phases (time summed over threads):\n";
+    for (size_t i = 0; i != PHASE_COUNT; ++i)
+    {
+        if (t.phase_calls[i] == 0)
+            continue;
+
+        os << "  " << std::left << std::setw(8) << PHASE_NAMES[i] << std::right
+           << std::setw(12) << std::setprecision(3) << static_cast<double>(t.phase_ns[i]) / 1e6 << " ms"
+           << std::setw(12) << t.phase_calls[i] << " calls\n";
+    }
+
+    os << "counters:\n";
+    for (size_t i = 0; i != COUNTER_COUNT; ++i)
+    {
+        if (t.counters[i] == 0)
+            continue;
+
+        os << "  " << std::left << std::setw(22) << COUNTER_NAMES[i] << std::right
+           << std::setw(14) << t.counters[i] << '\n';
+    }
+}
+
+void print_json(std::ostream& os, uint64_t wall_ns)
+{
+    totals t = collect();
+
+    os << "{\"wall_ns\": " << wall_ns << ", \"threads\": " << t.thread_count << ", \"phases\": {";
+    for (size_t i = 0; i != PHASE_COUNT; ++i)
+    {
+        os << (i == 0 ? "" : ", ")
+           << "\"" << PHASE_NAMES[i] << "\": {\"ns\": " << t.phase_ns[i] << ", \"calls\": " << t.phase_calls[i] << "}";
+    }
+    os << "}, \"counters\": {";
+    for (size_t i = 0; i != COUNTER_COUNT; ++i)
+        os << (i == 0 ? "" : ", ") << "\"" << COUNTER_NAMES[i] << "\": " << t.counters[i];
+    os << "}}\n";
+}
+}
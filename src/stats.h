@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <time.h>
+
+// Always-on counters and phase timers for the hot paths. Every thread
+// updates its own block of counters (relaxed load + store, no locked
+// instructions), blocks are summed only when the report is printed.
+namespace stats
+{
+enum class counter : size_t
+{
+    syscalls,
+    files_opened,
+    bytes_read,
+    bytes_written,
+    bytes_hashed,
+    objects_written,
+    objects_deduplicated,
+    objects_evicted,
+    objects_promoted,
+    objects_uploaded,
+    cus_parsed,
+    source_files_found,
+    dwarf_cache_hits,
+    dwarf_cache_misses,
+    stat_cache_hits,
+    trees_written,
+    objects_packed,
+    deltas_written,
+
+    count_
+};
+
+// phases are measured at the leaf operations, so they don't overlap
+enum class phase : size_t
+{
+    open,
+    stat,
+    read,
+    write,
+    link,
+    hash,
+    dwarf,
+
+    count_
+};
+
+constexpr size_t COUNTER_COUNT = static_cast<size_t>(counter::count_);
+constexpr size_t PHASE_COUNT = static_cast<size_t>(phase::count_);
+
+struct thread_block
+{
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> phase_ns[PHASE_COUNT];
+    std::atomic<uint64_t> phase_calls[PHASE_COUNT];
+};
+
+namespace detail
+{
+    inline thread_local thread_block* current = nullptr;
+
+    thread_block* register_thread();
+
+    inline thread_block& block()
+    {
+        thread_block* b = current;
+        if (__builtin_expect(b == nullptr, 0))
+            b = register_thread();
+        return *b;
+    }
+
+    // only the owning thread writes, the reporting thread only reads
+    inline void bump(std::atomic<uint64_t>& value, uint64_t delta)
+    {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    inline uint64_t now_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+    }
+}
+
+inline void add(counter c, uint64_t value = 1)
+{
+    detail::bump(detail::block().counters[static_cast<size_t>(c)], value);
+}
+
+struct scoped_timer
+{
+    explicit scoped_timer(phase p)
+        : p(static_cast<size_t>(p))
+        , start(detail::now_ns())
+    {}
+
+    scoped_timer(scoped_timer const&) = delete;
+    scoped_timer& operator=(scoped_timer const&) = delete;
+
+    ~scoped_timer()
+    {
+        thread_block& b = detail::block();
+        detail::bump(b.phase_ns[p], detail::now_ns() - start);
+        detail::bump(b.phase_calls[p], 1);
+    }
+
+private:
+    size_t p;
+    uint64_t start;
+};
+
+struct totals
+{
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t phase_ns[PHASE_COUNT];
+    uint64_t phase_calls[PHASE_COUNT];
+    uint64_t thread_count;
+};
+
+totals collect();
+
+void print_summary(std::ostream& os, uint64_t wall_ns);
+void print_json(std::ostream& os, uint64_t wall_ns);
+}
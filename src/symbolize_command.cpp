@@ -0,0 +1,131 @@
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#include "command_line.h"
+#include "dwarf_md5.h"
+#include "file_descriptor.h"
+#include "line_index.h"
+#include "source_file_cache.h"
+
+namespace
+{
+    // hex, with or without 0x
+    bool parse_address(char const* text, size_t size, uint64_t& result)
+    {
+        if (size > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+        {
+            text += 2;
+            size -= 2;
+        }
+        if (size == 0 || size > 16)
+            return false;
+
+        result = 0;
+        for (size_t i = 0; i != size; ++i)
+        {
+            char c = text[i];
+            unsigned digit;
+            if (c >= '0' && c <= '9')
+                digit = c - '0';
+            else if (c >= 'a' && c <= 'f')
+                digit = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                digit = c - 'A' + 10;
+            else
+                return false;
+            result = (result << 4) | digit;
+        }
+
+        return true;
+    }
+
+    void symbolize(line_index const& index, std::string const& text, std::ostream& out)
+    {
+        uint64_t address;
+        if (!parse_address(text.data(), text.size(), address))
+            throw std::runtime_error("invalid address: " + text);
+
+        line_index::location loc;
+        out << text;
+        if (index.lookup(address, loc))
+            out << ' ' << loc.hash << ' ' << loc.path << ':' << loc.line << '\n';
+        else
+            out << " ??\n";
+    }
+
+    void symbolize_line(line_index const& index, std::string line, std::ostream& out)
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (!line.empty())
+            symbolize(index, line, out);
+    }
+}
+
+// symbolize [--no-cache] <binary> [address...]
+//
+// maps addresses of the binary (hex, from the arguments or one per line on
+// stdin) to "<md5> <path>:<line>" of the source line. The line index is
+// built from the DWARF once per build id and kept in the repository.
+void symbolize_command(size_t argc, char* argv[])
+{
+    bool use_cache = true;
+    if (argc != 0 && match_flag(*argv, "no-cache"))
+    {
+        use_cache = false;
+        --argc;
+        ++argv;
+    }
+
+    if (argc == 0)
+        throw std::runtime_error("binary expected");
+
+    char const* binary = *argv;
+    --argc;
+    ++argv;
+
+    std::unique_ptr<source_file_cache> cache;
+    if (use_cache)
+        cache = source_file_cache::open_default_if_exists();
+
+    line_index index = cache ? cache->get_line_index(binary) : line_index::build(dwarf::get_line_table(binary));
+
+    if (argc != 0)
+    {
+        for (size_t i = 0; i != argc; ++i)
+            symbolize(index, argv[i], std::cout);
+        return;
+    }
+
+    // stdin is usually a pipe, lines are answered as they arrive
+    file_descriptor in = file_descriptor::attach(STDIN_FILENO);
+    try
+    {
+        std::string pending;
+        char buf[65536];
+        for (;;)
+        {
+            size_t n = in.read_some(buf, sizeof buf);
+            if (n == 0)
+                break;
+            pending.append(buf, n);
+
+            size_t pos = 0;
+            for (size_t eol; (eol = pending.find('\n', pos)) != std::string::npos; pos = eol + 1)
+                symbolize_line(index, pending.substr(pos, eol - pos), std::cout);
+            pending.erase(0, pos);
+            std::cout.flush();
+        }
+        symbolize_line(index, pending, std::cout);
+    }
+    catch (...)
+    {
+        in.release();
+        throw;
+    }
+    in.release();
+}
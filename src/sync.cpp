@@ -0,0 +1,675 @@
+#include "sync.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "md5.h"
+
+namespace
+{
+    char const SEND_MAGIC[8] = {'S', 'S', 'S', 'E', 'N', 'D', '0', '1'};
+    char const RECEIVE_MAGIC[8] = {'S', 'S', 'R', 'E', 'C', 'V', '0', '1'};
+
+    constexpr char MESSAGE_ROUND = 'R';
+    constexpr char MESSAGE_PACK = 'P';
+
+    // a differing range is split into this many parts for the next round,
+    // so negotiation takes about log_16(n) round trips
+    constexpr size_t SPLIT_FACTOR = 16;
+
+    // differing ranges with at most this many keys on the sending side
+    // are resolved by sending the keys themselves
+    constexpr size_t LEAF_SIZE = 16;
+
+    constexpr size_t IO_BUFFER_SIZE = 64 * 1024;
+    constexpr size_t PACK_CHUNK_SIZE = 64 * 1024;
+
+    enum class range_status : uint8_t
+    {
+        same = 0,
+        // the receiver has no keys in the range, all of them are wanted
+        empty = 1,
+        differ = 2,
+    };
+
+    bool key_less(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) < 0;
+    }
+
+    bool key_equal(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }
+
+    struct message_writer
+    {
+        explicit message_writer(file_descriptor& fd)
+            : fd(fd)
+        {}
+
+        void put(void const* data, size_t size)
+        {
+            char const* p = static_cast<char const*>(data);
+            buf.insert(buf.end(), p, p + size);
+            if (buf.size() >= IO_BUFFER_SIZE)
+                flush();
+        }
+
+        void put_u8(uint8_t value)
+        {
+            put(&value, 1);
+        }
+
+        void put_u32(uint32_t value)
+        {
+            unsigned char bytes[4];
+            for (size_t i = 0; i != 4; ++i)
+                bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+            put(bytes, sizeof bytes);
+        }
+
+        void put_u64(uint64_t value)
+        {
+            unsigned char bytes[8];
+            for (size_t i = 0; i != 8; ++i)
+                bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+            put(bytes, sizeof bytes);
+        }
+
+        void put_key(md5 const& key)
+        {
+            put(key.data, sizeof key.data);
+        }
+
+        void flush()
+        {
+            fd.write(buf.data(), buf.size());
+            buf.clear();
+        }
+
+    private:
+        file_descriptor& fd;
+        std::vector<char> buf;
+    };
+
+    struct message_reader
+    {
+        explicit message_reader(file_descriptor& fd)
+            : fd(fd)
+            , buf(new char[IO_BUFFER_SIZE])
+            , current(0)
+            , end(0)
+        {}
+
+        void get(void* data, size_t size)
+        {
+            char* p = static_cast<char*>(data);
+            while (size != 0)
+            {
+                if (current == end)
+                {
+                    end = fd.read_some(buf.get(), IO_BUFFER_SIZE);
+                    current = 0;
+                    if (end == 0)
+                        throw std::runtime_error("sync stream ended unexpectedly");
+                }
+
+                size_t n = std::min(size, end - current);
+                memcpy(p, buf.get() + current, n);
+                current += n;
+                p += n;
+                size -= n;
+            }
+        }
+
+        uint8_t get_u8()
+        {
+            uint8_t value;
+            get(&value, 1);
+            return value;
+        }
+
+        uint32_t get_u32()
+        {
+            unsigned char bytes[4];
+            get(bytes, sizeof bytes);
+            uint32_t value = 0;
+            for (size_t i = 0; i != 4; ++i)
+                value |= uint32_t(bytes[i]) << (8 * i);
+            return value;
+        }
+
+        uint64_t get_u64()
+        {
+            unsigned char bytes[8];
+            get(bytes, sizeof bytes);
+            uint64_t value = 0;
+            for (size_t i = 0; i != 8; ++i)
+                value |= uint64_t(bytes[i]) << (8 * i);
+            return value;
+        }
+
+        md5 get_key()
+        {
+            md5 key;
+            get(key.data, sizeof key.data);
+            return key;
+        }
+
+    private:
+        file_descriptor& fd;
+        std::unique_ptr<char[]> buf;
+        size_t current;
+        size_t end;
+    };
+
+    // Sorted keys with prefix xors, fingerprint of any index range is O(1).
+    // xor is enough here: keys are hashes and a set has no duplicates, the
+    // count is compared as well.
+    struct key_set
+    {
+        explicit key_set(std::vector<md5> keys)
+            : keys(std::move(keys))
+        {
+            std::sort(this->keys.begin(), this->keys.end(), key_less);
+
+            prefix.resize(this->keys.size() + 1);
+            prefix[0] = md5{};
+            for (size_t i = 0; i != this->keys.size(); ++i)
+                prefix[i + 1] = combine(prefix[i], this->keys[i]);
+        }
+
+        size_t size() const
+        {
+            return keys.size();
+        }
+
+        md5 const& operator[](size_t index) const
+        {
+            return keys[index];
+        }
+
+        size_t lower_bound(md5 const& key) const
+        {
+            return std::lower_bound(keys.begin(), keys.end(), key, key_less) - keys.begin();
+        }
+
+        md5 fingerprint(size_t begin, size_t end) const
+        {
+            return combine(prefix[begin], prefix[end]);
+        }
+
+    private:
+        static md5 combine(md5 const& a, md5 const& b)
+        {
+            md5 result;
+            result.a = a.a ^ b.a;
+            result.b = a.b ^ b.b;
+            result.c = a.c ^ b.c;
+            result.d = a.d ^ b.d;
+            return result;
+        }
+
+    private:
+        std::vector<md5> keys;
+        std::vector<md5> prefix;
+    };
+
+    // key range [low, high), unbounded ranges extend to the end of the key
+    // space; begin and end index the sender's keys in the range
+    struct key_range
+    {
+        md5 low;
+        md5 high;
+        bool bounded;
+        size_t begin;
+        size_t end;
+    };
+
+    // compressed data is framed as (u32 length, bytes) chunks ending with an
+    // empty one, so the receiver never reads past the end of the pack
+    struct deflate_writer
+    {
+        explicit deflate_writer(message_writer& out)
+            : out(out)
+            , buf(new char[PACK_CHUNK_SIZE])
+            , total_out(0)
+        {
+            memset(&stream, 0, sizeof stream);
+            if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)
+                throw std::runtime_error("deflateInit failed");
+        }
+
+        ~deflate_writer()
+        {
+            deflateEnd(&stream);
+        }
+
+        void write(void const* data, size_t size)
+        {
+            stream.next_in = static_cast<Bytef*>(const_cast<void*>(data));
+            stream.avail_in = static_cast<uInt>(size);
+            while (stream.avail_in != 0)
+                run(Z_NO_FLUSH);
+        }
+
+        void finish()
+        {
+            while (run(Z_FINISH) != Z_STREAM_END)
+                ;
+            out.put_u32(0);
+        }
+
+        uint64_t compressed_size() const
+        {
+            return total_out;
+        }
+
+    private:
+        int run(int flush)
+        {
+            stream.next_out = reinterpret_cast<Bytef*>(buf.get());
+            stream.avail_out = PACK_CHUNK_SIZE;
+
+            int r = deflate(&stream, flush);
+            if (r == Z_STREAM_ERROR)
+                throw std::runtime_error("deflate failed");
+
+            size_t n = PACK_CHUNK_SIZE - stream.avail_out;
+            if (n != 0)
+            {
+                out.put_u32(static_cast<uint32_t>(n));
+                out.put(buf.get(), n);
+                total_out += n;
+            }
+
+            return r;
+        }
+
+    private:
+        message_writer& out;
+        z_stream stream;
+        std::unique_ptr<char[]> buf;
+        uint64_t total_out;
+    };
+
+    struct inflate_reader
+    {
+        explicit inflate_reader(message_reader& in)
+            : in(in)
+            , buf(new char[PACK_CHUNK_SIZE])
+            , chunk_left(0)
+            , input_done(false)
+        {
+            memset(&stream, 0, sizeof stream);
+            if (inflateInit(&stream) != Z_OK)
+                throw std::runtime_error("inflateInit failed");
+        }
+
+        ~inflate_reader()
+        {
+            inflateEnd(&stream);
+        }
+
+        void read(void* data, size_t size)
+        {
+            stream.next_out = static_cast<Bytef*>(data);
+            stream.avail_out = static_cast<uInt>(size);
+
+            while (stream.avail_out != 0)
+            {
+                if (stream.avail_in == 0)
+                    refill();
+
+                int r = inflate(&stream, Z_NO_FLUSH);
+                if (r == Z_STREAM_END && stream.avail_out != 0)
+                    throw std::runtime_error("sync pack is truncated");
+                if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+                    throw std::runtime_error("sync pack is corrupted");
+            }
+        }
+
+        // consumes the remaining chunks up to the terminating empty one
+        void finish()
+        {
+            while (!input_done)
+            {
+                if (chunk_left == 0)
+                {
+                    chunk_left = in.get_u32();
+                    if (chunk_left == 0)
+                    {
+                        input_done = true;
+                        break;
+                    }
+                }
+
+                size_t n = std::min(chunk_left, PACK_CHUNK_SIZE);
+                in.get(buf.get(), n);
+                chunk_left -= n;
+            }
+        }
+
+    private:
+        void refill()
+        {
+            if (chunk_left == 0)
+            {
+                if (!input_done)
+                    chunk_left = in.get_u32();
+                if (chunk_left == 0)
+                {
+                    input_done = true;
+                    throw std::runtime_error("sync pack is truncated");
+                }
+            }
+
+            size_t n = std::min(chunk_left, PACK_CHUNK_SIZE);
+            in.get(buf.get(), n);
+            chunk_left -= n;
+
+            stream.next_in = reinterpret_cast<Bytef*>(buf.get());
+            stream.avail_in = static_cast<uInt>(n);
+        }
+
+    private:
+        message_reader& in;
+        z_stream stream;
+        std::unique_ptr<char[]> buf;
+        size_t chunk_left;
+        bool input_done;
+    };
+
+    void put_range(message_writer& out, key_set const& keys, key_range const& range)
+    {
+        out.put_key(range.low);
+        out.put_u8(range.bounded);
+        out.put_key(range.high);
+        out.put_u64(range.end - range.begin);
+        out.put_key(keys.fingerprint(range.begin, range.end));
+    }
+
+    // splits the sender's keys of the range into SPLIT_FACTOR parts of
+    // about the same size, boundaries are keys the sender has
+    void split_range(key_set const& keys, key_range const& range, std::vector<key_range>& result)
+    {
+        size_t count = range.end - range.begin;
+        for (size_t i = 0; i != SPLIT_FACTOR; ++i)
+        {
+            size_t begin = range.begin + count * i / SPLIT_FACTOR;
+            size_t end = range.begin + count * (i + 1) / SPLIT_FACTOR;
+            if (begin == end)
+                continue;
+
+            key_range part;
+            part.low = begin == range.begin ? range.low : keys[begin];
+            part.bounded = end == range.end ? range.bounded : true;
+            part.high = end == range.end ? range.high : keys[end];
+            part.begin = begin;
+            part.end = end;
+            result.push_back(part);
+        }
+    }
+
+    // returns indices of the sender's keys that the receiver lacks, sorted
+    std::vector<size_t> negotiate(key_set const& keys, message_reader& in, message_writer& out, size_t& rounds)
+    {
+        std::vector<size_t> wanted;
+
+        std::vector<key_range> ranges;
+        if (keys.size() != 0)
+            ranges.push_back({md5{}, md5{}, false, 0, keys.size()});
+
+        std::vector<size_t> leaf_keys;
+        while (!ranges.empty() || !leaf_keys.empty())
+        {
+            ++rounds;
+
+            out.put_u8(MESSAGE_ROUND);
+            out.put_u32(static_cast<uint32_t>(ranges.size()));
+            for (key_range const& range : ranges)
+                put_range(out, keys, range);
+            out.put_u32(static_cast<uint32_t>(leaf_keys.size()));
+            for (size_t index : leaf_keys)
+                out.put_key(keys[index]);
+            out.flush();
+
+            std::vector<key_range> next_ranges;
+            std::vector<size_t> next_leaf_keys;
+            for (key_range const& range : ranges)
+            {
+                auto status = static_cast<range_status>(in.get_u8());
+                if (status == range_status::same)
+                    continue;
+
+                if (status == range_status::empty)
+                {
+                    for (size_t i = range.begin; i != range.end; ++i)
+                        wanted.push_back(i);
+                }
+                else if (status == range_status::differ)
+                {
+                    if (range.end - range.begin <= LEAF_SIZE)
+                        for (size_t i = range.begin; i != range.end; ++i)
+                            next_leaf_keys.push_back(i);
+                    else
+                        split_range(keys, range, next_ranges);
+                }
+                else
+                    throw std::runtime_error("invalid range status in sync stream");
+            }
+
+            std::vector<unsigned char> bitmap((leaf_keys.size() + 7) / 8);
+            in.get(bitmap.data(), bitmap.size());
+            for (size_t i = 0; i != leaf_keys.size(); ++i)
+                if (bitmap[i / 8] & (1u << (i % 8)))
+                    wanted.push_back(leaf_keys[i]);
+
+            ranges = std::move(next_ranges);
+            leaf_keys = std::move(next_leaf_keys);
+        }
+
+        std::sort(wanted.begin(), wanted.end());
+        return wanted;
+    }
+
+    // The sender writes a whole round before it reads the answer, so
+    // nothing is written back until the round has been read: a status
+    // flushed early would fill the pipe back to a sender that is still
+    // writing, and both sides would wait for each other.
+    void answer_round(repository& repo, key_set const& keys, message_reader& in, message_writer& out)
+    {
+        std::vector<uint8_t> statuses;
+        uint32_t range_count = in.get_u32();
+        for (uint32_t i = 0; i != range_count; ++i)
+        {
+            md5 low = in.get_key();
+            bool bounded = in.get_u8() != 0;
+            md5 high = in.get_key();
+            uint64_t count = in.get_u64();
+            md5 fingerprint = in.get_key();
+
+            size_t begin = keys.lower_bound(low);
+            size_t end = bounded ? keys.lower_bound(high) : keys.size();
+            if (end < begin)
+                throw std::runtime_error("invalid key range in sync stream");
+
+            range_status status;
+            if (begin == end)
+                status = range_status::empty;
+            else if (end - begin == count && key_equal(keys.fingerprint(begin, end), fingerprint))
+                status = range_status::same;
+            else
+                status = range_status::differ;
+
+            statuses.push_back(static_cast<uint8_t>(status));
+        }
+
+        // objects added after the key list was taken are also not wanted
+        uint32_t key_count = in.get_u32();
+        std::vector<unsigned char> bitmap((key_count + 7) / 8);
+        for (uint32_t i = 0; i != key_count; ++i)
+        {
+            md5 key = in.get_key();
+            size_t index = keys.lower_bound(key);
+            bool present = (index != keys.size() && key_equal(keys[index], key)) || repo.has_object(key);
+            if (!present)
+                bitmap[i / 8] |= static_cast<unsigned char>(1u << (i % 8));
+        }
+        out.put(statuses.data(), statuses.size());
+        out.put(bitmap.data(), bitmap.size());
+        out.flush();
+    }
+
+    uint64_t send_pack(repository& repo, key_set const& keys, std::vector<size_t> const& wanted, message_writer& out)
+    {
+        out.put_u8(MESSAGE_PACK);
+        out.put_u64(wanted.size());
+
+        deflate_writer pack(out);
+        std::unique_ptr<char[]> buf(new char[PACK_CHUNK_SIZE]);
+        for (size_t index : wanted)
+        {
+            md5 const& key = keys[index];
+
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(key, name);
+
+            // packed objects have no file of their own, open_object
+            // reconstructs them
+            file_descriptor fd = repo.open_object(key);
+            if (!fd)
+                throw std::runtime_error(std::string("object disappeared while sending: ") + name);
+
+            uint64_t size = static_cast<uint64_t>(fd.stat().st_size);
+            unsigned char header[sizeof key.data + 8];
+            memcpy(header, key.data, sizeof key.data);
+            for (size_t i = 0; i != 8; ++i)
+                header[sizeof key.data + i] = static_cast<unsigned char>(size >> (8 * i));
+            pack.write(header, sizeof header);
+
+            // objects are immutable, a size mismatch means the store is damaged
+            for (uint64_t left = size; left != 0;)
+            {
+                size_t bytes_read = fd.read_some(buf.get(), std::min<uint64_t>(left, PACK_CHUNK_SIZE));
+                if (bytes_read == 0)
+                    throw std::runtime_error(std::string("object changed while sending: ") + name);
+                pack.write(buf.get(), bytes_read);
+                left -= bytes_read;
+            }
+        }
+        pack.finish();
+        out.flush();
+
+        return pack.compressed_size();
+    }
+
+    size_t receive_pack(repository& repo, message_reader& in)
+    {
+        uint64_t object_count = in.get_u64();
+
+        size_t stored = 0;
+        inflate_reader pack(in);
+        std::unique_ptr<char[]> buf(new char[PACK_CHUNK_SIZE]);
+        for (uint64_t i = 0; i != object_count; ++i)
+        {
+            unsigned char header[16 + 8];
+            pack.read(header, sizeof header);
+
+            md5 key;
+            memcpy(key.data, header, sizeof key.data);
+            uint64_t size = 0;
+            for (size_t j = 0; j != 8; ++j)
+                size |= uint64_t(header[sizeof key.data + j]) << (8 * j);
+
+            // objects are streamed into the store, the size from the other
+            // side never decides how much memory is allocated; it is not
+            // trusted to name objects correctly either, add_object checks
+            if (!repo.has_object(key))
+            {
+                repo.add_object(key, size, [&](char* data, size_t n)
+                {
+                    pack.read(data, n);
+                });
+                ++stored;
+                continue;
+            }
+
+            for (uint64_t left = size; left != 0;)
+            {
+                size_t n = std::min<uint64_t>(left, PACK_CHUNK_SIZE);
+                pack.read(buf.get(), n);
+                left -= n;
+            }
+        }
+        pack.finish();
+
+        return stored;
+    }
+}
+
+sync_summary sync_send(repository& repo, file_descriptor& input, file_descriptor& output)
+{
+    message_reader in(input);
+    message_writer out(output);
+
+    out.put(SEND_MAGIC, sizeof SEND_MAGIC);
+    out.flush();
+
+    char magic[sizeof RECEIVE_MAGIC];
+    in.get(magic, sizeof magic);
+    if (memcmp(magic, RECEIVE_MAGIC, sizeof magic) != 0)
+        throw std::runtime_error("the other side is not a compatible source-store receive");
+
+    key_set keys(repo.list_objects());
+
+    sync_summary result;
+    result.objects_offered = keys.size();
+
+    std::vector<size_t> wanted = negotiate(keys, in, out, result.rounds);
+    result.objects_sent = wanted.size();
+    result.pack_bytes = send_pack(repo, keys, wanted, out);
+
+    uint64_t stored = in.get_u64();
+    if (stored > wanted.size())
+        throw std::runtime_error("invalid acknowledgement in sync stream");
+
+    return result;
+}
+
+size_t sync_receive(repository& repo, file_descriptor& input, file_descriptor& output)
+{
+    message_reader in(input);
+    message_writer out(output);
+
+    char magic[sizeof SEND_MAGIC];
+    in.get(magic, sizeof magic);
+    if (memcmp(magic, SEND_MAGIC, sizeof magic) != 0)
+        throw std::runtime_error("the other side is not a compatible source-store send");
+
+    out.put(RECEIVE_MAGIC, sizeof RECEIVE_MAGIC);
+    out.flush();
+
+    key_set keys(repo.list_objects());
+
+    for (;;)
+    {
+        char message = static_cast<char>(in.get_u8());
+        if (message == MESSAGE_ROUND)
+            answer_round(repo, keys, in, out);
+        else if (message == MESSAGE_PACK)
+        {
+            size_t stored = receive_pack(repo, in);
+            out.put_u64(stored);
+            out.flush();
+            return stored;
+        }
+        else
+            throw std::runtime_error("unknown message in sync stream");
+    }
+}
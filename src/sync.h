@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "file_descriptor.h"
+#include "repository.h"
+
+// Replication of objects between two repositories over a pair of byte
+// streams (pipes, an ssh connection, ...).
+//
+// The sides first find the objects the receiver lacks by comparing
+// fingerprints of key ranges, recursively splitting only the ranges that
+// differ, so negotiation costs O(d log n) for d differing keys. Missing
+// objects are then sent as a single zlib-compressed pack.
+
+struct sync_summary
+{
+    size_t objects_offered = 0;
+    size_t objects_sent = 0;
+    size_t rounds = 0;
+    uint64_t pack_bytes = 0;
+};
+
+sync_summary sync_send(repository& repo, file_descriptor& input, file_descriptor& output);
+
+// returns the number of objects stored
+size_t sync_receive(repository& repo, file_descriptor& input, file_descriptor& output);
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Lazily started coroutine returning T. Awaiting a task starts it and
+// resumes the awaiter when it finishes (symmetric transfer, so long
+// chains of co_await don't grow the stack); exceptions propagate to the
+// awaiter.
+template <typename T = void>
+struct task;
+
+namespace detail
+{
+    struct task_promise_base
+    {
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+        std::exception_ptr error;
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        struct final_awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+            {
+                return h.promise().continuation;
+            }
+
+            void await_resume() noexcept
+            {}
+        };
+
+        final_awaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception() noexcept
+        {
+            error = std::current_exception();
+        }
+    };
+
+    template <typename T>
+    struct task_promise : task_promise_base
+    {
+        std::optional<T> value;
+
+        task<T> get_return_object() noexcept;
+
+        template <typename U>
+        void return_value(U&& v)
+        {
+            value.emplace(std::forward<U>(v));
+        }
+
+        T take_result()
+        {
+            if (error)
+                std::rethrow_exception(error);
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct task_promise<void> : task_promise_base
+    {
+        task<void> get_return_object() noexcept;
+
+        void return_void() noexcept
+        {}
+
+        void take_result()
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+}
+
+template <typename T>
+struct task
+{
+    using promise_type = detail::task_promise<T>;
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    task() noexcept
+        : handle(nullptr)
+    {}
+
+    explicit task(handle_type handle) noexcept
+        : handle(handle)
+    {}
+
+    task(task&& other) noexcept
+        : handle(std::exchange(other.handle, nullptr))
+    {}
+
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return static_cast<bool>(handle);
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        return handle.promise().take_result();
+    }
+
+    // hands the coroutine frame over, used by io_context::spawn
+    handle_type release() noexcept
+    {
+        return std::exchange(handle, nullptr);
+    }
+
+private:
+    handle_type handle;
+};
+
+namespace detail
+{
+    template <typename T>
+    task<T> task_promise<T>::get_return_object() noexcept
+    {
+        return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+    }
+
+    inline task<void> task_promise<void>::get_return_object() noexcept
+    {
+        return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+    }
+}
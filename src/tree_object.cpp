@@ -0,0 +1,109 @@
+#include "tree_object.h"
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "repository.h"
+
+namespace
+{
+    char const TREE_MAGIC[] = "SSTREE1\n";
+    constexpr size_t TREE_MAGIC_SIZE = sizeof TREE_MAGIC - 1;
+
+    bool is_valid_mode(uint32_t mode)
+    {
+        switch (static_cast<tree_entry_mode>(mode))
+        {
+        case tree_entry_mode::file:
+        case tree_entry_mode::executable:
+        case tree_entry_mode::symlink:
+        case tree_entry_mode::directory:
+            return true;
+        }
+        return false;
+    }
+
+    std::runtime_error malformed_tree()
+    {
+        return std::runtime_error("object is not a valid tree");
+    }
+}
+
+std::vector<char> serialize_tree(std::vector<tree_entry> const& entries)
+{
+    std::vector<char> result(TREE_MAGIC, TREE_MAGIC + TREE_MAGIC_SIZE);
+
+    for (tree_entry const& entry : entries)
+    {
+        char mode[16];
+        int mode_size = snprintf(mode, sizeof mode, "%o ", static_cast<unsigned>(entry.mode));
+        result.insert(result.end(), mode, mode + mode_size);
+        result.insert(result.end(), entry.name.begin(), entry.name.end());
+        result.push_back('\0');
+        result.insert(result.end(), entry.hash.data, entry.hash.data + sizeof entry.hash.data);
+    }
+
+    return result;
+}
+
+bool looks_like_tree(char const* data, size_t size)
+{
+    return size >= TREE_MAGIC_SIZE && memcmp(data, TREE_MAGIC, TREE_MAGIC_SIZE) == 0;
+}
+
+std::vector<tree_entry> parse_tree(std::vector<char> const& data)
+{
+    if (data.size() < TREE_MAGIC_SIZE || memcmp(data.data(), TREE_MAGIC, TREE_MAGIC_SIZE) != 0)
+        throw malformed_tree();
+
+    std::vector<tree_entry> result;
+    char const* p = data.data() + TREE_MAGIC_SIZE;
+    char const* end = data.data() + data.size();
+    while (p != end)
+    {
+        uint32_t mode = 0;
+        for (; p != end && *p >= '0' && *p <= '7'; ++p)
+            mode = mode * 8 + static_cast<uint32_t>(*p - '0');
+        if (p == end || *p != ' ' || !is_valid_mode(mode))
+            throw malformed_tree();
+        ++p;
+
+        char const* name_end = static_cast<char const*>(memchr(p, '\0', static_cast<size_t>(end - p)));
+        if (name_end == nullptr || name_end == p || static_cast<size_t>(end - name_end) < 1 + sizeof(md5::data))
+            throw malformed_tree();
+
+        tree_entry entry;
+        entry.name.assign(p, name_end);
+        entry.mode = static_cast<tree_entry_mode>(mode);
+        memcpy(entry.hash.data, name_end + 1, sizeof entry.hash.data);
+        if (!result.empty() && !(result.back().name < entry.name))
+            throw malformed_tree();
+
+        result.push_back(std::move(entry));
+        p = name_end + 1 + sizeof(md5::data);
+    }
+
+    return result;
+}
+
+md5 store_tree(repository& repo, std::vector<tree_entry> const& entries)
+{
+    std::vector<char> data = serialize_tree(entries);
+    md5 hash = md5_hash(data.data(), data.size());
+    if (!repo.has_object(hash))
+        repo.add_object(hash, data);
+    return hash;
+}
+
+std::vector<tree_entry> load_tree(repository& repo, md5 const& hash)
+{
+    file_descriptor fd = repo.open_object(hash);
+    if (!fd)
+    {
+        std::stringstream ss;
+        ss << "tree " << hash << " is missing from the repository";
+        throw std::runtime_error(ss.str());
+    }
+
+    return parse_tree(read_whole_file(fd));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "md5.h"
+
+struct repository;
+
+// Content-addressed directory listings. A tree object is stored like any
+// other object and named by the md5 of its serialized form, so equal
+// subtrees have equal names and a snapshot is identified by the name of
+// its root tree.
+//
+// Serialized form: "SSTREE1\n", then per entry (sorted by name)
+// "<octal mode> <name>\0" followed by the 16 bytes of the md5.
+enum class tree_entry_mode : uint32_t
+{
+    file       = 0100644,
+    executable = 0100755,
+    symlink    = 0120000,
+    directory  = 0040000,
+};
+
+struct tree_entry
+{
+    std::string name;
+    tree_entry_mode mode;
+    md5 hash;
+};
+
+// entries must be sorted by name, names must be unique
+std::vector<char> serialize_tree(std::vector<tree_entry> const& entries);
+
+// checks the magic only, enough to tell trees from other objects
+bool looks_like_tree(char const* data, size_t size);
+
+// throws if data is not a tree object
+std::vector<tree_entry> parse_tree(std::vector<char> const& data);
+
+// stores the tree unless an identical one is already stored
+md5 store_tree(repository& repo, std::vector<tree_entry> const& entries);
+
+// throws if the object is missing or is not a tree
+std::vector<tree_entry> load_tree(repository& repo, md5 const& hash);
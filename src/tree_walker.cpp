@@ -0,0 +1,165 @@
+#include "tree_walker.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "file_descriptor.h"
+
+namespace
+{
+    struct work_item
+    {
+        // null for roots, name is relative to the current directory then
+        std::shared_ptr<file_descriptor> parent;
+        std::string name;
+        std::string path;
+    };
+
+    struct walk_state
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        // LIFO keeps the walk close to depth-first, which bounds the number
+        // of directories that are kept open as parents of pending items
+        std::vector<work_item> stack;
+        size_t busy = 0;
+        std::atomic<bool> stop{false};
+        std::exception_ptr error;
+    };
+
+    void process_directory(walk_state& state, work_item const& item, tree_walker::file_callback const& on_file)
+    {
+        file_flags flags = file_flags::read_only | file_flags::directory | file_flags::close_on_exec;
+        if (item.parent)
+            flags |= file_flags::nofollow;
+
+        directory_stream dir(file_descriptor::open({item.parent ? item.parent->get_fd() : AT_FDCWD, item.name}, flags));
+
+        // one path buffer for the whole directory, files don't allocate
+        std::string path = item.path;
+        if (path.empty() || path.back() != '/')
+            path += '/';
+        size_t prefix_size = path.size();
+
+        std::vector<work_item> subdirs;
+        while (directory_stream::dirent const* ent = dir.next())
+        {
+            char const* name = ent->d_name;
+            if (!strcmp(name, ".") || !strcmp(name, ".."))
+                continue;
+
+            unsigned char type = ent->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                // some filesystems (e.g. older XFS, some FUSE) don't fill d_type
+                struct stat64 st = stat({dir.get_fd(), name}, stat_flags::symlink_nofollow);
+                if (S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+                else if (S_ISREG(st.st_mode))
+                    type = DT_REG;
+            }
+
+            path.resize(prefix_size);
+            path += name;
+
+            if (type == DT_DIR)
+                subdirs.push_back({nullptr, name, path});
+            else if (type == DT_REG)
+                on_file(dir.get_fd(), name, path);
+
+            if (state.stop)
+                return;
+        }
+
+        if (subdirs.empty())
+            return;
+
+        auto parent = std::make_shared<file_descriptor>(dir.release_fd());
+        for (work_item& subdir : subdirs)
+            subdir.parent = parent;
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+        std::move(subdirs.rbegin(), subdirs.rend(), std::back_inserter(state.stack));
+        state.cv.notify_all();
+    }
+
+    void worker(walk_state& state, tree_walker::file_callback const& on_file)
+    {
+        for (;;)
+        {
+            work_item item;
+            {
+                std::unique_lock<std::mutex> lock(state.mutex);
+                state.cv.wait(lock, [&] { return state.stop || !state.stack.empty() || state.busy == 0; });
+                if (state.stop || state.stack.empty())
+                    return;
+
+                item = std::move(state.stack.back());
+                state.stack.pop_back();
+                ++state.busy;
+            }
+
+            try
+            {
+                process_directory(state, item, on_file);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(state.mutex);
+                if (!state.error)
+                    state.error = std::current_exception();
+                state.stop = true;
+            }
+
+            std::lock_guard<std::mutex> lock(state.mutex);
+            --state.busy;
+            if (state.stop || (state.busy == 0 && state.stack.empty()))
+                state.cv.notify_all();
+        }
+    }
+}
+
+tree_walker::tree_walker(size_t thread_count)
+    : thread_count(std::max(thread_count, size_t(1)))
+{}
+
+void tree_walker::walk(std::vector<std::string> const& roots, file_callback const& on_file)
+{
+    walk_state state;
+
+    for (std::string const& root : roots)
+    {
+        // roots that are not directories are reported as files directly
+        if (!S_ISDIR(stat(root, stat_flags::none).st_mode))
+            on_file(AT_FDCWD, root.c_str(), root);
+        else
+            state.stack.push_back({nullptr, root, root});
+    }
+    std::reverse(state.stack.begin(), state.stack.end());
+
+    std::vector<std::thread> threads;
+    try
+    {
+        for (size_t i = 1; i < thread_count; ++i)
+            threads.emplace_back([&] { worker(state, on_file); });
+    }
+    catch (...)
+    {
+        // failed to start some threads, the remaining ones finish the walk
+    }
+
+    worker(state, on_file);
+
+    for (std::thread& t : threads)
+        t.join();
+
+    if (state.error)
+        std::rethrow_exception(state.error);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Walks directory trees with a pool of worker threads. Directories are
+// opened relative to their parent (openat) and entries are classified by
+// d_type, so in the common case no stat is needed. Symbolic links are
+// not followed.
+//
+// on_file is called concurrently from the worker threads with the
+// descriptor of the containing directory, the entry name and the full
+// path for reporting.
+struct tree_walker
+{
+    using file_callback = std::function<void(int dir_fd, char const* name, std::string const& path)>;
+
+    explicit tree_walker(size_t thread_count);
+
+    // rethrows the first exception raised by on_file or by traversal,
+    // the walk is stopped as soon as possible in that case
+    void walk(std::vector<std::string> const& roots, file_callback const& on_file);
+
+private:
+    size_t thread_count;
+};
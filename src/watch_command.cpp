@@ -0,0 +1,527 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/statfs.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "command_line.h"
+#include "file_descriptor.h"
+#include "parallel.h"
+#include "repository.h"
+
+namespace
+{
+    using clock_type = std::chrono::steady_clock;
+
+    // a file is stored once no event arrived for it for the debounce
+    // interval, but never later than this after its first event
+    constexpr auto MAX_DELAY = std::chrono::seconds(2);
+
+    // larger batches are stored right away
+    constexpr size_t MAX_BATCH_SIZE = 16384;
+
+    constexpr uint32_t INOTIFY_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+    constexpr uint64_t FANOTIFY_MASK = FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE | FAN_ONDIR;
+
+    std::runtime_error system_error(char const* what)
+    {
+        return std::runtime_error(std::string(what) + " failed: " + strerror(errno));
+    }
+
+    std::string resolve_path(char const* path)
+    {
+        char resolved[PATH_MAX];
+        if (!realpath(path, resolved))
+            throw std::runtime_error(std::string("can not resolve ") + path + ": " + strerror(errno));
+        return resolved;
+    }
+
+    bool is_under(std::string const& path, std::string const& dir)
+    {
+        return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 && (dir.back() == '/' || path[dir.size()] == '/');
+    }
+
+    // changed files waiting for their events to settle
+    struct pending_changes
+    {
+        void add(std::string path)
+        {
+            clock_type::time_point now = clock_type::now();
+            if (paths.empty())
+                first_event = now;
+            last_event = now;
+            paths.insert(std::move(path));
+        }
+
+        // poll timeout in milliseconds, -1 if there is nothing to wait for
+        int timeout(std::chrono::milliseconds debounce) const
+        {
+            if (paths.empty())
+                return -1;
+            if (paths.size() >= MAX_BATCH_SIZE)
+                return 0;
+
+            clock_type::time_point deadline = std::min(last_event + debounce, first_event + MAX_DELAY);
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now());
+            return static_cast<int>(std::max<int64_t>(left.count(), 0));
+        }
+
+        std::vector<std::string> take()
+        {
+            std::vector<std::string> result(paths.begin(), paths.end());
+            paths.clear();
+            return result;
+        }
+
+        bool empty() const
+        {
+            return paths.empty();
+        }
+
+    private:
+        std::set<std::string> paths;
+        clock_type::time_point first_event;
+        clock_type::time_point last_event;
+    };
+
+    // Change events for the watched roots. fanotify with a filesystem
+    // mark needs CAP_SYS_ADMIN but costs nothing per directory; inotify
+    // needs a watch on every directory, added as directories appear.
+    // Either way, moving a directory in reports only the directory, so
+    // its contents are scanned.
+    struct change_monitor
+    {
+        change_monitor(std::vector<std::string> const& roots, std::string const& excluded)
+            : roots(roots)
+            , excluded(excluded)
+        {
+            use_fanotify = init_fanotify();
+            if (!use_fanotify)
+            {
+                int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+                if (fd < 0)
+                    throw system_error("inotify_init1");
+                events = file_descriptor::attach(fd);
+            }
+        }
+
+        char const* backend() const
+        {
+            return use_fanotify ? "fanotify" : "inotify";
+        }
+
+        int get_fd() const
+        {
+            return events.get_fd();
+        }
+
+        // every file under the roots, watching the directories on the way
+        void scan_all(pending_changes& pending)
+        {
+            for (std::string const& root : roots)
+                scan(root, pending);
+        }
+
+        void read_events(pending_changes& pending)
+        {
+            alignas(8) char buf[64 * 1024];
+            for (;;)
+            {
+                ssize_t n = ::read(events.get_fd(), buf, sizeof buf);
+                if (n < 0)
+                {
+                    if (errno == EAGAIN)
+                        return;
+                    if (errno == EINTR)
+                        continue;
+                    throw system_error("read of change events");
+                }
+
+                if (use_fanotify)
+                    parse_fanotify(buf, static_cast<size_t>(n), pending);
+                else
+                    parse_inotify(buf, static_cast<size_t>(n), pending);
+            }
+        }
+
+    private:
+        bool init_fanotify()
+        {
+            int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+            if (fd < 0)
+            {
+                // not privileged, or a kernel without name reporting
+                if (errno == EPERM || errno == EINVAL || errno == ENOSYS)
+                    return false;
+                throw system_error("fanotify_init");
+            }
+            events = file_descriptor::attach(fd);
+
+            for (std::string const& root : roots)
+            {
+                if (fanotify_mark(events.get_fd(), FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, root.c_str()) != 0)
+                {
+                    if (errno == EPERM || errno == EINVAL || errno == EXDEV || errno == ENODEV || errno == EOPNOTSUPP)
+                    {
+                        events.close();
+                        mount_fds.clear();
+                        return false;
+                    }
+                    throw system_error("fanotify_mark");
+                }
+
+                // directory handles are resolved through any descriptor
+                // on the same filesystem
+                struct statfs st;
+                file_descriptor root_fd = file_descriptor::open(root, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+                if (fstatfs(root_fd.get_fd(), &st) != 0)
+                    throw system_error("fstatfs");
+
+                __kernel_fsid_t fsid;
+                memcpy(&fsid, &st.f_fsid, sizeof fsid);
+                mount_fds.emplace_back(fsid, std::move(root_fd));
+            }
+
+            return true;
+        }
+
+        void scan(std::string const& dir_path, pending_changes& pending)
+        {
+            if (is_excluded(dir_path))
+                return;
+
+            if (!use_fanotify)
+            {
+                int wd = inotify_add_watch(events.get_fd(), dir_path.c_str(), INOTIFY_MASK);
+                if (wd < 0)
+                {
+                    // gone or replaced by a file in the meantime
+                    if (errno == ENOENT || errno == ENOTDIR || errno == EACCES)
+                        return;
+                    if (errno == ENOSPC)
+                        throw std::runtime_error("inotify watch limit reached, raise fs.inotify.max_user_watches");
+                    throw system_error("inotify_add_watch");
+                }
+                watches[wd] = dir_path;
+            }
+
+            std::error_code ec;
+            file_descriptor fd = file_descriptor::try_open(dir_path, file_flags::read_only | file_flags::directory | file_flags::nofollow | file_flags::close_on_exec, ec);
+            if (!fd)
+                return;
+
+            directory_stream dir(std::move(fd));
+            std::vector<std::string> subdirs;
+            while (directory_stream::dirent const* ent = dir.next())
+            {
+                char const* name = ent->d_name;
+                if (!strcmp(name, ".") || !strcmp(name, ".."))
+                    continue;
+
+                unsigned char type = ent->d_type;
+                if (type == DT_UNKNOWN)
+                {
+                    struct stat64 st;
+                    if (!try_stat({dir.get_fd(), name}, stat_flags::symlink_nofollow, st, ec))
+                        continue;
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+
+                if (type == DT_DIR)
+                    subdirs.push_back(join(dir_path, name));
+                else if (type == DT_REG)
+                    pending.add(join(dir_path, name));
+            }
+
+            for (std::string const& subdir : subdirs)
+                scan(subdir, pending);
+        }
+
+        void parse_inotify(char const* buf, size_t size, pending_changes& pending)
+        {
+            for (size_t offset = 0; offset < size;)
+            {
+                inotify_event const* ev = reinterpret_cast<inotify_event const*>(buf + offset);
+                offset += sizeof(inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // events were lost, only a full scan is safe
+                    scan_all(pending);
+                    continue;
+                }
+
+                if (ev->mask & IN_IGNORED)
+                {
+                    watches.erase(ev->wd);
+                    continue;
+                }
+
+                auto i = watches.find(ev->wd);
+                if (i == watches.end() || ev->len == 0)
+                    continue;
+
+                std::string path = join(i->second, ev->name);
+                if (ev->mask & IN_ISDIR)
+                {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        scan(path, pending);
+                    else if (ev->mask & IN_MOVED_FROM)
+                        forget_directory(path);
+                }
+                else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                {
+                    if (!is_excluded(path))
+                        pending.add(std::move(path));
+                }
+            }
+        }
+
+        // the watches of a moved directory would report its old path
+        void forget_directory(std::string const& path)
+        {
+            for (auto i = watches.begin(); i != watches.end();)
+            {
+                if (i->second == path || is_under(i->second, path))
+                {
+                    inotify_rm_watch(events.get_fd(), i->first);
+                    i = watches.erase(i);
+                }
+                else
+                    ++i;
+            }
+        }
+
+        void parse_fanotify(char const* buf, size_t size, pending_changes& pending)
+        {
+            auto ev = reinterpret_cast<fanotify_event_metadata const*>(buf);
+            for (ssize_t left = static_cast<ssize_t>(size); FAN_EVENT_OK(ev, left); ev = FAN_EVENT_NEXT(ev, left))
+            {
+                if (ev->vers != FANOTIFY_METADATA_VERSION)
+                    throw std::runtime_error("unsupported fanotify metadata version");
+
+                if (ev->mask & FAN_Q_OVERFLOW)
+                {
+                    scan_all(pending);
+                    continue;
+                }
+
+                auto info = reinterpret_cast<fanotify_event_info_fid const*>(ev + 1);
+                if (ev->event_len < sizeof *ev + sizeof *info || info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+                    continue;
+
+                auto handle = reinterpret_cast<file_handle const*>(info->handle);
+                char const* name = reinterpret_cast<char const*>(handle->f_handle + handle->handle_bytes);
+
+                std::string dir_path;
+                if (!resolve_handle(info->fsid, handle, dir_path))
+                    continue;
+
+                std::string path = join(dir_path, name);
+                if (is_excluded(path) || !is_watched(path))
+                    continue;
+
+                if (ev->mask & FAN_ONDIR)
+                {
+                    if (ev->mask & (FAN_CREATE | FAN_MOVED_TO))
+                        scan(path, pending);
+                }
+                else if (ev->mask & (FAN_CLOSE_WRITE | FAN_MOVED_TO))
+                    pending.add(std::move(path));
+            }
+        }
+
+        // false if the directory is gone
+        bool resolve_handle(__kernel_fsid_t const& fsid, file_handle const* handle, std::string& result)
+        {
+            for (auto const& mount : mount_fds)
+            {
+                if (memcmp(&mount.first, &fsid, sizeof fsid) != 0)
+                    continue;
+
+                int fd = open_by_handle_at(mount.second.get_fd(), const_cast<file_handle*>(handle), O_PATH | O_CLOEXEC);
+                if (fd < 0)
+                    return false;
+
+                file_descriptor dir = file_descriptor::attach(fd);
+                char link[64];
+                snprintf(link, sizeof link, "/proc/self/fd/%d", dir.get_fd());
+                char target[PATH_MAX];
+                ssize_t n = readlink(link, target, sizeof target);
+                if (n <= 0 || static_cast<size_t>(n) == sizeof target)
+                    return false;
+
+                result.assign(target, static_cast<size_t>(n));
+                return true;
+            }
+
+            return false;
+        }
+
+        // a filesystem mark also reports everything outside the roots
+        bool is_watched(std::string const& path) const
+        {
+            for (std::string const& root : roots)
+                if (is_under(path, root))
+                    return true;
+            return false;
+        }
+
+        // the repository itself, storing objects must not trigger events
+        bool is_excluded(std::string const& path) const
+        {
+            return path == excluded || is_under(path, excluded);
+        }
+
+        static std::string join(std::string const& dir, char const* name)
+        {
+            std::string result = dir;
+            if (result.empty() || result.back() != '/')
+                result += '/';
+            result += name;
+            return result;
+        }
+
+    private:
+        std::vector<std::string> roots;
+        std::string excluded;
+
+        bool use_fanotify;
+        file_descriptor events;
+
+        std::unordered_map<int, std::string> watches;
+        std::vector<std::pair<__kernel_fsid_t, file_descriptor>> mount_fds;
+    };
+
+    // hashes and stores a batch in parallel, files that vanished or can't
+    // be read are skipped
+    void store_batch(repository& repo, std::vector<std::string> const& paths, size_t jobs)
+    {
+        std::vector<md5> hashes(paths.size());
+        std::vector<char> stored(paths.size());
+
+        std::atomic<size_t> next{0};
+        run_parallel(std::min(jobs, paths.size()), [&](std::atomic<bool> const& stop)
+        {
+            while (!stop)
+            {
+                size_t index = next++;
+                if (index >= paths.size())
+                    return;
+
+                std::error_code ec;
+                file_descriptor fd = file_descriptor::try_open(paths[index], file_flags::read_only | file_flags::nofollow | file_flags::close_on_exec, ec);
+                if (!fd || !S_ISREG(fd.stat().st_mode))
+                    continue;
+
+                hashes[index] = repo.add_object(fd);
+                stored[index] = true;
+            }
+        });
+
+        for (size_t i = 0; i != paths.size(); ++i)
+            if (stored[i])
+                std::cout << hashes[i] << "  " << paths[i] << '\n';
+        std::cout.flush();
+
+        repo.flush_shared_tier();
+        repo.enforce_capacity();
+    }
+}
+
+// watch [--jobs=N] [--debounce=MS] <directory>...
+//
+// stores every file under the directories, then keeps storing files as
+// they are written or moved in, until interrupted. Events for a file are
+// coalesced until none arrived for the debounce interval (200 ms by
+// default), then the batch is stored in parallel. Prints "<md5>  <path>"
+// for every file stored.
+void watch_command(size_t argc, char* argv[])
+{
+    size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    std::chrono::milliseconds debounce(200);
+
+    for (; argc != 0; --argc, ++argv)
+    {
+        char const* value;
+        if (match_option(*argv, "jobs", value))
+            jobs = std::max(parse_count("jobs", value), size_t(1));
+        else if (match_option(*argv, "debounce", value))
+            debounce = std::chrono::milliseconds(parse_count("debounce", value));
+        else if (**argv == '-' && (*argv)[1] == '-')
+            throw std::runtime_error(std::string("unknown option: ") + *argv);
+        else
+            break;
+    }
+
+    if (argc == 0)
+        throw std::runtime_error("directory expected");
+
+    std::vector<std::string> roots;
+    for (size_t i = 0; i != argc; ++i)
+        roots.push_back(resolve_path(argv[i]));
+
+    std::string repository_root = default_repository_root();
+    repository repo(repository_root);
+
+    // pending changes are stored before exiting on these
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) != 0)
+        throw system_error("sigprocmask");
+    int sfd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (sfd < 0)
+        throw system_error("signalfd");
+    file_descriptor signal_fd = file_descriptor::attach(sfd);
+
+    // watches go first, so nothing written during the scan is missed
+    change_monitor monitor(roots, resolve_path(repository_root.c_str()));
+    std::cerr << "watching with " << monitor.backend() << '\n';
+
+    pending_changes pending;
+    monitor.scan_all(pending);
+    store_batch(repo, pending.take(), jobs);
+
+    pollfd fds[2] = {};
+    fds[0].fd = monitor.get_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd.get_fd();
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        fds[0].revents = fds[1].revents = 0;
+        poll_fds(fds, 2, pending.timeout(debounce));
+
+        if (fds[1].revents)
+            break;
+
+        if (fds[0].revents)
+            monitor.read_events(pending);
+
+        if (pending.timeout(debounce) == 0)
+            store_batch(repo, pending.take(), jobs);
+    }
+
+    if (!pending.empty())
+        store_batch(repo, pending.take(), jobs);
+}
@@ -0,0 +1,197 @@
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "md5.h"
+#include "repository.h"
+#include "repository_manifest.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    std::vector<char> object_data(size_t index)
+    {
+        std::string text = "shared object " + std::to_string(index) + "\n";
+        return std::vector<char>(text.begin(), text.end());
+    }
+
+    md5 object_hash_of(size_t index)
+    {
+        std::vector<char> data = object_data(index);
+        return md5_hash(data.data(), data.size());
+    }
+
+    // runs body(0) ... body(count - 1) in child processes at the same time
+    void run_in_processes(size_t count, std::function<void(size_t)> const& body)
+    {
+        std::cout.flush();
+        std::cerr.flush();
+
+        std::vector<pid_t> children;
+        for (size_t i = 0; i != count; ++i)
+        {
+            pid_t pid = ::fork();
+            if (pid == -1)
+                throw_error(errno, "fork");
+            if (pid == 0)
+            {
+                int status = 0;
+                try
+                {
+                    body(i);
+                }
+                catch (std::exception const& e)
+                {
+                    std::cerr << "child " << i << ": " << e.what() << std::endl;
+                    status = 1;
+                }
+                ::_exit(status);
+            }
+            children.push_back(pid);
+        }
+
+        for (pid_t pid : children)
+        {
+            int status;
+            CHECK(::waitpid(pid, &status, 0) == pid);
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+
+    size_t count_files(std::string const& dir, std::string const& suffix)
+    {
+        size_t result = 0;
+        directory_stream stream(file_descriptor::open(dir, file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+        while (directory_stream::dirent const* entry = stream.next())
+        {
+            std::string name = entry->d_name;
+            if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+                ++result;
+        }
+        return result;
+    }
+
+    void check_objects(repository& repo, size_t count, size_t step = 1)
+    {
+        for (size_t i = 0; i < count; i += step)
+        {
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(object_hash_of(i), name);
+
+            md5 found;
+            CHECK(repo.resolve_prefix(name, MD5_HEX_LENGTH, found) == prefix_match::unique);
+            CHECK(memcmp(found.data, object_hash_of(i).data, sizeof found.data) == 0);
+
+            file_descriptor fd = repo.open_object(object_hash_of(i));
+            CHECK(fd);
+            CHECK(read_whole_file(fd) == object_data(i));
+        }
+    }
+}
+
+void run_concurrent_writers_tests(runner& r)
+{
+    // overlapping ranges, so some objects are stored by several writers
+    r.run("concurrent_writers", "processes_share_a_repository", []
+    {
+        temp_dir dir;
+        std::string root = dir.path() + "/repo";
+        init_new_repository(root);
+
+        run_in_processes(4, [&](size_t k)
+        {
+            repository repo(root);
+            for (size_t i = k * 400; i != k * 400 + 500; ++i)
+                repo.add_object(object_hash_of(i), object_data(i));
+        });
+
+        repository repo(root);
+        check_objects(repo, 1700);
+        CHECK(count_files(root + "/index", ".journal") <= 4);
+
+        // the journals of the first writers are continued, not multiplied
+        run_in_processes(4, [&](size_t k)
+        {
+            repository repo(root);
+            for (size_t i = 1700 + k * 100; i != 1700 + (k + 1) * 100; ++i)
+                repo.add_object(object_hash_of(i), object_data(i));
+        });
+        check_objects(repo, 2100);
+        CHECK(count_files(root + "/index", ".journal") <= 4);
+
+        repo.rebuild_index();
+        CHECK(count_files(root + "/index", ".journal") == 0);
+        check_objects(repo, 2100);
+    });
+
+    // a writer that loses the race to a generation applies its change on
+    // top of the winner's
+    r.run("concurrent_writers", "manifest_updates", []
+    {
+        temp_dir dir;
+        mkdir(dir.path() + "/manifests");
+        std::string manifests = dir.path() + "/manifests";
+
+        run_in_processes(4, [&](size_t k)
+        {
+            file_descriptor dir_fd = file_descriptor::open(manifests, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+            for (size_t i = 0; i != 25; ++i)
+            {
+                repository_manifest::update(dir_fd.get_fd(), [&](repository_manifest& m)
+                {
+                    m.packs.push_back("pack-" + std::to_string(k) + "-" + std::to_string(i));
+                });
+            }
+        });
+
+        file_descriptor dir_fd = file_descriptor::open(manifests, file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+        repository_manifest latest = repository_manifest::load_latest(dir_fd.get_fd());
+        CHECK(latest.generation == 100);
+        CHECK(latest.packs.size() == 100);
+        CHECK(std::set<std::string>(latest.packs.begin(), latest.packs.end()).size() == 100);
+    });
+
+    r.run("concurrent_writers", "manifest_round_trip", []
+    {
+        repository_manifest m;
+        m.generation = 7;
+        m.index = "full.idx";
+        m.segments = {"a.idx", "b.idx"};
+        m.packs = {"p.pack"};
+
+        std::vector<char> text = m.serialize();
+        repository_manifest parsed = repository_manifest::parse(7, text.data(), text.size());
+        CHECK(parsed.generation == 7);
+        CHECK(parsed.index == m.index);
+        CHECK(parsed.segments == m.segments);
+        CHECK(parsed.packs == m.packs);
+    });
+
+    // a journal long enough is sealed into an index segment
+    r.run("concurrent_writers", "journal_becomes_segment", []
+    {
+        temp_dir dir;
+        std::string root = dir.path() + "/repo";
+        init_new_repository(root);
+
+        size_t const count = 64 * 1024 + 10;
+        {
+            repository repo(root);
+            for (size_t i = 0; i != count; ++i)
+                repo.add_object(object_hash_of(i), object_data(i));
+        }
+        CHECK(count_files(root + "/index", ".idx") == 1);
+
+        // without a full index every lookup lists objects/
+        repository repo(root);
+        check_objects(repo, count, 997);
+    });
+}
+}
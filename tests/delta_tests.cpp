@@ -0,0 +1,193 @@
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "delta.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    std::vector<char> random_bytes(size_t size, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<char> result(size);
+        for (char& c : result)
+            c = static_cast<char>(rng());
+        return result;
+    }
+
+    std::vector<char> text(std::string const& s)
+    {
+        return std::vector<char>(s.begin(), s.end());
+    }
+
+    std::vector<char> round_trip(std::vector<char> const& base, std::vector<char> const& target)
+    {
+        std::vector<char> delta = create_delta(base.data(), base.size(), target.data(), target.size());
+        std::vector<char> result = apply_delta(base.data(), base.size(), delta.data(), delta.size());
+        CHECK(result == target);
+        return delta;
+    }
+
+    // a version of data with a few insertions, deletions and changes
+    std::vector<char> edit(std::vector<char> data, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        for (size_t i = 0; i != 8 && !data.empty(); ++i)
+        {
+            size_t pos = rng() % data.size();
+            switch (rng() % 3)
+            {
+            case 0:
+            {
+                std::vector<char> inserted = random_bytes(rng() % 200, rng());
+                data.insert(data.begin() + pos, inserted.begin(), inserted.end());
+                break;
+            }
+            case 1:
+                data.erase(data.begin() + pos, data.begin() + std::min(data.size(), pos + rng() % 200));
+                break;
+            default:
+                data[pos] = static_cast<char>(data[pos] + 1);
+                break;
+            }
+        }
+        return data;
+    }
+
+    // the delta format: varint sizes, then copy (0x80, varint offset,
+    // varint length) and literal (length, bytes) operations
+    std::vector<char> delta_bytes(std::vector<unsigned char> const& bytes)
+    {
+        return std::vector<char>(bytes.begin(), bytes.end());
+    }
+
+    void check_damaged(std::vector<char> const& base, std::vector<char> const& delta)
+    {
+        CHECK_THROWS(apply_delta(base.data(), base.size(), delta.data(), delta.size()));
+    }
+}
+
+void run_delta_tests(runner& r)
+{
+    r.run("delta", "empty_and_short_inputs", []
+    {
+        std::vector<char> empty;
+        round_trip(empty, empty);
+        round_trip(empty, text("a"));
+        round_trip(text("a"), empty);
+        round_trip(text("a"), text("a"));
+        round_trip(text("short base"), text("short target"));
+        round_trip(text("0123456789abcdef"), text("0123456789abcdef"));
+        round_trip(text("0123456789abcdef"), text("x0123456789abcdefx"));
+        round_trip(text("0123456789abcdefx"), text("0123456789abcde"));
+    });
+
+    r.run("delta", "identical_inputs_are_copies", []
+    {
+        std::vector<char> data = random_bytes(100000, 1);
+        std::vector<char> delta = round_trip(data, data);
+        CHECK(delta.size() < 32);
+    });
+
+    r.run("delta", "edited_versions", []
+    {
+        for (uint64_t seed = 0; seed != 50; ++seed)
+        {
+            std::vector<char> base = random_bytes(1000 + seed * 997, seed);
+            std::vector<char> target = edit(base, seed + 1000);
+            std::vector<char> delta = round_trip(base, target);
+            CHECK(delta.size() < target.size() / 2);
+
+            // the other direction deletes what was inserted
+            round_trip(target, base);
+        }
+    });
+
+    r.run("delta", "unrelated_inputs", []
+    {
+        round_trip(random_bytes(5000, 1), random_bytes(7000, 2));
+        round_trip(random_bytes(7000, 3), random_bytes(5000, 4));
+    });
+
+    r.run("delta", "repetitive_inputs", []
+    {
+        // runs longer than a literal and matches overlapping themselves
+        round_trip(std::vector<char>(1000, 'a'), std::vector<char>(5000, 'a'));
+        round_trip(std::vector<char>(5000, 'a'), std::vector<char>(1000, 'a'));
+        round_trip(std::vector<char>(17, 'x'), std::vector<char>(300, 'y'));
+    });
+
+    r.run("delta", "wrong_base_throws", []
+    {
+        std::vector<char> base = random_bytes(1000, 1);
+        std::vector<char> target = edit(base, 2);
+        std::vector<char> delta = create_delta(base.data(), base.size(), target.data(), target.size());
+
+        std::vector<char> other = random_bytes(999, 3);
+        check_damaged(other, delta);
+    });
+
+    r.run("delta", "truncated_delta_throws", []
+    {
+        std::vector<char> base = random_bytes(3000, 1);
+        std::vector<char> target = edit(base, 2);
+        std::vector<char> delta = create_delta(base.data(), base.size(), target.data(), target.size());
+
+        for (size_t size = 0; size != delta.size(); ++size)
+            check_damaged(base, std::vector<char>(delta.begin(), delta.begin() + size));
+    });
+
+    r.run("delta", "damaged_delta_never_reads_out_of_bounds", []
+    {
+        std::vector<char> base = random_bytes(3000, 1);
+        std::vector<char> target = edit(base, 2);
+        std::vector<char> delta = create_delta(base.data(), base.size(), target.data(), target.size());
+
+        // damage either makes it throw or still yields a result of the
+        // announced size, reading only the base and the delta
+        std::mt19937_64 rng(3);
+        for (size_t i = 0; i != 2000; ++i)
+        {
+            std::vector<char> damaged = delta;
+            damaged[rng() % damaged.size()] ^= static_cast<char>(1 + rng() % 255);
+            try
+            {
+                std::vector<char> result = apply_delta(base.data(), base.size(), damaged.data(), damaged.size());
+                CHECK(result.size() == target.size());
+            }
+            catch (failure const&)
+            {
+                throw;
+            }
+            catch (std::exception const&)
+            {}
+        }
+    });
+
+    r.run("delta", "crafted_damage_throws", []
+    {
+        std::vector<char> base = text("0123456789abcdef");
+
+        // copy past the end of the base
+        check_damaged(base, delta_bytes({16, 8, 0x80, 12, 8}));
+        // copy longer than the announced target
+        check_damaged(base, delta_bytes({16, 4, 0x80, 0, 8}));
+        // empty literal
+        check_damaged(base, delta_bytes({16, 1, 0, 1, 'x'}));
+        // literal past the end of the delta
+        check_damaged(base, delta_bytes({16, 4, 4, 'x'}));
+        // result shorter than announced
+        check_damaged(base, delta_bytes({16, 9, 0x80, 0, 8}));
+        // varint that doesn't end
+        check_damaged(base, delta_bytes({16, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}));
+
+        // a huge announced target doesn't allocate it, it just doesn't
+        // match
+        check_damaged(base, delta_bytes({16, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f, 0x80, 0, 16}));
+    });
+}
+}
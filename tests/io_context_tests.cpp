@@ -0,0 +1,192 @@
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "io_context.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    task<void> count_on_executor(io_context& ctx, std::atomic<size_t>& counter)
+    {
+        co_await ctx.schedule();
+        ++counter;
+    }
+
+    task<void> spawn_children(io_context& ctx, std::atomic<size_t>& counter, size_t children)
+    {
+        co_await ctx.schedule();
+        for (size_t i = 0; i != children; ++i)
+            ctx.spawn(count_on_executor(ctx, counter));
+        ++counter;
+    }
+
+    task<void> fail_after_schedule(io_context& ctx)
+    {
+        co_await ctx.schedule();
+        throw std::runtime_error("task failed");
+    }
+
+    task<void> hold(std::shared_ptr<int> value)
+    {
+        (void)value;
+        co_return;
+    }
+
+    task<void> write_all(io_context& ctx, file_descriptor& fd, std::vector<char> const& data)
+    {
+        // more than the pipe holds, the writer waits for writable()
+        co_await async_write(ctx, fd, data.data(), data.size());
+        fd.close();
+    }
+
+    task<void> read_all(io_context& ctx, file_descriptor& fd, std::vector<char>& result)
+    {
+        char buf[4096];
+        for (;;)
+        {
+            size_t bytes_read = co_await async_read_some(ctx, fd, buf, sizeof buf);
+            if (bytes_read == 0)
+                break;
+            result.insert(result.end(), buf, buf + bytes_read);
+        }
+    }
+
+    task<void> read_exactly(io_context& ctx, file_descriptor& fd, size_t size)
+    {
+        std::vector<char> buf(size);
+        co_await async_read(ctx, fd, buf.data(), buf.size());
+    }
+
+    task<void> open_and_read(task<file_descriptor> open, std::vector<char>& result)
+    {
+        file_descriptor fd = co_await open;
+        result = read_whole_file(fd);
+    }
+
+    void pipe_transfer(size_t thread_count)
+    {
+        std::vector<char> data(1024 * 1024);
+        for (size_t i = 0; i != data.size(); ++i)
+            data[i] = static_cast<char>(i * 7 + i / 251);
+
+        pipe_fds p = make_pipe(pipe_flags::close_on_exec | pipe_flags::nonblock);
+        std::vector<char> received;
+
+        io_context ctx;
+        ctx.spawn(read_all(ctx, p.read_end, received));
+        ctx.spawn(write_all(ctx, p.write_end, data));
+        ctx.run(thread_count);
+
+        CHECK(received == data);
+    }
+}
+
+void run_io_context_tests(runner& r)
+{
+    r.run("io_context", "run_without_tasks", []
+    {
+        io_context ctx;
+        ctx.run(4);
+    });
+
+    r.run("io_context", "spawn_and_run", []
+    {
+        io_context ctx;
+        std::atomic<size_t> counter(0);
+        for (size_t i = 0; i != 1000; ++i)
+            ctx.spawn(count_on_executor(ctx, counter));
+        ctx.run(4);
+        CHECK(counter == 1000);
+    });
+
+    r.run("io_context", "spawn_from_running_task", []
+    {
+        io_context ctx;
+        std::atomic<size_t> counter(0);
+        for (size_t i = 0; i != 10; ++i)
+            ctx.spawn(spawn_children(ctx, counter, 10));
+        ctx.run(3);
+        CHECK(counter == 110);
+    });
+
+    r.run("io_context", "run_again", []
+    {
+        io_context ctx;
+        std::atomic<size_t> counter(0);
+        ctx.spawn(count_on_executor(ctx, counter));
+        ctx.run(2);
+        ctx.spawn(count_on_executor(ctx, counter));
+        ctx.run(2);
+        CHECK(counter == 2);
+    });
+
+    r.run("io_context", "exception_reaches_run", []
+    {
+        io_context ctx;
+        std::atomic<size_t> counter(0);
+        ctx.spawn(fail_after_schedule(ctx));
+        for (size_t i = 0; i != 100; ++i)
+            ctx.spawn(count_on_executor(ctx, counter));
+        CHECK_THROWS(ctx.run(4));
+
+        // the other tasks still ran to completion
+        CHECK(counter == 100);
+    });
+
+    r.run("io_context", "destroy_without_run", []
+    {
+        auto value = std::make_shared<int>(1);
+        {
+            io_context ctx;
+            ctx.spawn(hold(value));
+            CHECK(value.use_count() == 2);
+        }
+        CHECK(value.use_count() == 1);
+    });
+
+    r.run("io_context", "readable_and_writable_one_thread", []
+    {
+        pipe_transfer(1);
+    });
+
+    r.run("io_context", "readable_and_writable_many_threads", []
+    {
+        pipe_transfer(4);
+    });
+
+    // the path is a temporary that is gone before the task starts
+    r.run("io_context", "open_from_temporary_path", []
+    {
+        temp_dir dir;
+        write_whole_file(dir.path() + "/some file with a long name", {'a', 'b', 'c'});
+        file_descriptor basedir = file_descriptor::open(dir.path(), file_flags::read_only | file_flags::directory | file_flags::close_on_exec);
+
+        std::vector<char> by_path;
+        std::vector<char> by_basedir;
+        io_context ctx;
+        ctx.spawn(open_and_read(async_open(ctx, dir.path() + "/some file with a long name", file_flags::read_only | file_flags::close_on_exec), by_path));
+        ctx.spawn(open_and_read(async_open(ctx, basedir.get_fd(), std::string("some file ") + "with a long name", file_flags::read_only | file_flags::close_on_exec), by_basedir));
+        ctx.run(2);
+
+        CHECK(by_path == std::vector<char>({'a', 'b', 'c'}));
+        CHECK(by_basedir == std::vector<char>({'a', 'b', 'c'}));
+    });
+
+    r.run("io_context", "read_past_end_throws", []
+    {
+        pipe_fds p = make_pipe(pipe_flags::close_on_exec | pipe_flags::nonblock);
+        p.write_end.write("abc", 3);
+        p.write_end.close();
+
+        io_context ctx;
+        ctx.spawn(read_exactly(ctx, p.read_end, 4));
+        CHECK_THROWS(ctx.run(2));
+    });
+}
+}
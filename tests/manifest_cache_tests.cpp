@@ -0,0 +1,175 @@
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "manifest_cache.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    // every name says which generation it belongs to, so a reader can
+    // tell a torn copy; long, so that copying takes a while
+    repository_manifest make_manifest(uint64_t generation)
+    {
+        repository_manifest result;
+        result.generation = generation;
+        result.index = "index-" + std::to_string(generation);
+        for (uint64_t i = 0; i != generation % 17 + 1; ++i)
+            result.packs.push_back("pack-" + std::to_string(generation) + "-" + std::to_string(i) + std::string(500, 'x'));
+        return result;
+    }
+
+    bool is_consistent(repository_manifest const& m)
+    {
+        std::string prefix = "pack-" + std::to_string(m.generation) + "-";
+        if (m.index != "index-" + std::to_string(m.generation) || m.packs.size() != m.generation % 17 + 1)
+            return false;
+        for (std::string const& pack : m.packs)
+            if (pack.compare(0, prefix.size(), prefix) != 0)
+                return false;
+        return true;
+    }
+}
+
+void run_manifest_cache_tests(runner& r)
+{
+    r.run("manifest_cache", "store_and_load", []
+    {
+        temp_dir dir;
+        manifest_cache cache = manifest_cache::open(dir.path() + "/cache");
+        CHECK(cache);
+
+        repository_manifest m;
+        CHECK(cache.generation() == 0);
+        CHECK(!cache.load(m));
+
+        cache.store(make_manifest(3));
+        CHECK(cache.generation() == 3);
+        CHECK(cache.load(m));
+        CHECK(m.generation == 3);
+        CHECK(is_consistent(m));
+
+        // an older one doesn't replace it
+        cache.store(make_manifest(2));
+        CHECK(cache.load(m));
+        CHECK(m.generation == 3);
+    });
+
+    r.run("manifest_cache", "shared_between_processes", []
+    {
+        temp_dir dir;
+        manifest_cache cache = manifest_cache::open(dir.path() + "/cache");
+
+        pid_t pid = ::fork();
+        if (pid == -1)
+            throw_error(errno, "fork");
+        if (pid == 0)
+        {
+            int status = 0;
+            try
+            {
+                manifest_cache::open(dir.path() + "/cache").store(make_manifest(5));
+            }
+            catch (...)
+            {
+                status = 1;
+            }
+            ::_exit(status);
+        }
+
+        int status;
+        CHECK(::waitpid(pid, &status, 0) == pid);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        repository_manifest m;
+        CHECK(cache.generation() == 5);
+        CHECK(cache.load(m));
+        CHECK(is_consistent(m));
+    });
+
+    // readers never see a mix of two generations, nor an older one after
+    // a newer one
+    r.run("manifest_cache", "concurrent_readers", []
+    {
+        temp_dir dir;
+        manifest_cache cache = manifest_cache::open(dir.path() + "/cache");
+        uint64_t const last = 20000;
+
+        std::atomic<size_t> torn(0);
+        std::atomic<size_t> backwards(0);
+        std::vector<std::thread> readers;
+        for (size_t i = 0; i != 3; ++i)
+        {
+            readers.emplace_back([&]
+            {
+                manifest_cache own = manifest_cache::open(dir.path() + "/cache");
+                uint64_t seen = 0;
+                while (seen != last)
+                {
+                    repository_manifest m;
+                    if (!own.load(m))
+                        continue;
+                    if (!is_consistent(m))
+                        ++torn;
+                    if (m.generation < seen)
+                        ++backwards;
+                    seen = m.generation;
+                }
+            });
+        }
+
+        for (uint64_t generation = 1; generation <= last; ++generation)
+            cache.store(make_manifest(generation));
+        for (std::thread& t : readers)
+            t.join();
+
+        CHECK(torn == 0);
+        CHECK(backwards == 0);
+    });
+
+    // the sequence stays odd when a writer dies while storing
+    r.run("manifest_cache", "dead_writer", []
+    {
+        temp_dir dir;
+        manifest_cache cache = manifest_cache::open(dir.path() + "/cache");
+        cache.store(make_manifest(1));
+
+        {
+            file_descriptor fd = file_descriptor::open(dir.path() + "/cache", file_flags::read_write | file_flags::close_on_exec);
+            uint64_t odd = 3;
+            fd.seek(8);
+            fd.write(&odd, sizeof odd);
+        }
+
+        repository_manifest m;
+        CHECK(!cache.load(m));
+
+        cache.store(make_manifest(2));
+        CHECK(cache.load(m));
+        CHECK(m.generation == 2);
+        CHECK(is_consistent(m));
+    });
+
+    r.run("manifest_cache", "too_large", []
+    {
+        temp_dir dir;
+        manifest_cache cache = manifest_cache::open(dir.path() + "/cache");
+
+        repository_manifest large;
+        large.generation = 4;
+        for (size_t i = 0; i != 10000; ++i)
+            large.packs.push_back(std::string(40, 'a') + std::to_string(i) + ".pack");
+        cache.store(large);
+
+        repository_manifest m;
+        CHECK(cache.generation() == 4);
+        CHECK(!cache.load(m));
+    });
+}
+}
@@ -0,0 +1,139 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "file_descriptor.h"
+#include "md5.h"
+#include "repository.h"
+#include "test.h"
+
+void add_source_file_command(size_t argc, char* argv[]);
+void md5sum_command(size_t argc, char* argv[]);
+void materialize_command(size_t argc, char* argv[]);
+
+namespace tests
+{
+namespace
+{
+    // sends what a command prints to a file
+    struct redirect_stdout
+    {
+        explicit redirect_stdout(std::string const& path)
+            : saved(file_descriptor::attach(::dup(STDOUT_FILENO)))
+        {
+            std::cout.flush();
+            file_descriptor out = file_descriptor::open(path, file_flags::write_only | file_flags::create | file_flags::truncate | file_flags::close_on_exec);
+            dup(out.get_fd(), STDOUT_FILENO, dup_flags::none);
+        }
+
+        ~redirect_stdout()
+        {
+            std::cout.flush();
+            dup(saved.get_fd(), STDOUT_FILENO, dup_flags::none);
+        }
+
+    private:
+        file_descriptor saved;
+    };
+
+    void run_command(void (*command)(size_t, char**), std::vector<std::string> args)
+    {
+        redirect_stdout quiet("/dev/null");
+
+        std::vector<char*> argv;
+        for (std::string& arg : args)
+            argv.push_back(&arg[0]);
+        command(argv.size(), argv.data());
+    }
+
+    std::vector<char> text(std::string const& s)
+    {
+        return std::vector<char>(s.begin(), s.end());
+    }
+
+    std::string hex(std::string const& s)
+    {
+        char result[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(md5_hash(s.data(), s.size()), result);
+        return result;
+    }
+
+    // a repository found through XDG_CACHE_HOME, like the commands do
+    struct fixture
+    {
+        fixture()
+        {
+            std::string cache_home = dir.path() + "/cache";
+            mkdir(cache_home);
+            setenv("XDG_CACHE_HOME", cache_home.c_str(), 1);
+            init_new_repository(default_repository_root());
+
+            mkdir(dir.path() + "/tree");
+            mkdir(dir.path() + "/tree/sub");
+            files = {dir.path() + "/tree/a.c", dir.path() + "/tree/sub/b.h", dir.path() + "/tree/with space.c"};
+            for (size_t i = 0; i != files.size(); ++i)
+                write_whole_file(files[i], text("contents " + std::to_string(i) + "\n"));
+            run_command(add_source_file_command, files);
+        }
+
+        // absolute paths are laid out without the leading slash
+        void check_materialized(std::string const& out)
+        {
+            for (size_t i = 0; i != files.size(); ++i)
+                CHECK(read_whole_file(out + files[i]) == text("contents " + std::to_string(i) + "\n"));
+        }
+
+        temp_dir dir;
+        std::vector<std::string> files;
+    };
+}
+
+void run_materialize_tests(runner& r)
+{
+    r.run("materialize", "manifest_from_md5sum", []
+    {
+        fixture f;
+        std::string manifest = f.dir.path() + "/manifest";
+        {
+            std::vector<std::string> args = f.files;
+            std::vector<char*> argv;
+            for (std::string& arg : args)
+                argv.push_back(&arg[0]);
+
+            redirect_stdout redirect(manifest);
+            md5sum_command(argv.size(), argv.data());
+        }
+
+        std::string out = f.dir.path() + "/out";
+        run_command(materialize_command, {"--manifest=" + manifest, out});
+        f.check_materialized(out);
+    });
+
+    r.run("materialize", "manifest_in_coreutils_format", []
+    {
+        fixture f;
+        std::string manifest = f.dir.path() + "/manifest";
+        write_whole_file(manifest, text(hex("contents 0\n") + "  " + f.files[0] + "\n"
+                                        + hex("contents 1\n") + " *" + f.files[1] + "\n"
+                                        + hex("contents 2\n") + " " + f.files[2] + "\n"));
+
+        std::string out = f.dir.path() + "/out";
+        run_command(materialize_command, {"--manifest=" + manifest, out});
+        f.check_materialized(out);
+    });
+
+    r.run("materialize", "malformed_manifest_throws", []
+    {
+        fixture f;
+        std::string manifest = f.dir.path() + "/manifest";
+        std::string out = f.dir.path() + "/out";
+        for (std::string line : {hex("x") + "\t" + f.files[0], hex("x") + " ", hex("x").substr(1) + "  a.c", std::string("a.c")})
+        {
+            write_whole_file(manifest, text(line + "\n"));
+            CHECK_THROWS(run_command(materialize_command, {"--manifest=" + manifest, out}));
+        }
+    });
+}
+}
@@ -0,0 +1,221 @@
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "md5.h"
+#include "object_clock.h"
+#include "repository.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    md5 key(size_t index)
+    {
+        std::string text = "key " + std::to_string(index);
+        return md5_hash(text.data(), text.size());
+    }
+
+    struct md5_less
+    {
+        bool operator()(md5 const& a, md5 const& b) const
+        {
+            return memcmp(a.data, b.data, sizeof a.data) < 0;
+        }
+    };
+
+    using key_set = std::set<md5, md5_less>;
+
+    // a locked table in a temporary directory
+    struct fixture
+    {
+        fixture()
+        {
+            object_clock::create(dir.path() + "/clock", false);
+            clock = object_clock::open_if_exists(dir.path() + "/clock");
+            clock.lock();
+        }
+
+        ~fixture()
+        {
+            clock.unlock();
+        }
+
+        // evicts down to target, returns what was evicted
+        key_set evict(uint64_t target)
+        {
+            key_set result;
+            clock.evict(target, [&](md5 const& hash, sha256 const&)
+            {
+                result.insert(hash);
+            });
+            return result;
+        }
+
+        temp_dir dir;
+        object_clock clock;
+    };
+
+    std::vector<char> object_data(size_t index)
+    {
+        std::string text = "object " + std::to_string(index) + "\n";
+        text.resize(1024, '.');
+        return std::vector<char>(text.begin(), text.end());
+    }
+
+    md5 object_hash_of(size_t index)
+    {
+        std::vector<char> data = object_data(index);
+        return md5_hash(data.data(), data.size());
+    }
+}
+
+void run_object_clock_tests(runner& r)
+{
+    r.run("object_clock", "evict_to_target", []
+    {
+        fixture f;
+        for (size_t i = 0; i != 100; ++i)
+            CHECK(f.clock.insert(key(i), {}, 100, false));
+        CHECK(!f.clock.insert(key(0), {}, 100, false));
+        CHECK(f.clock.total_bytes() == 10000);
+        CHECK(f.clock.object_count() == 100);
+
+        key_set evicted = f.evict(5000);
+        CHECK(evicted.size() == 50);
+        CHECK(f.clock.total_bytes() == 5000);
+        CHECK(f.clock.object_count() == 50);
+
+        // already under the target
+        CHECK(f.evict(5000).empty());
+    });
+
+    // an object touched since the hand last passed it gets a second chance
+    r.run("object_clock", "touched_objects_survive", []
+    {
+        fixture f;
+        for (size_t i = 0; i != 100; ++i)
+            f.clock.insert(key(i), {}, 100, false);
+
+        // clears the bits new objects start with
+        key_set gone = f.evict(9000);
+        CHECK(gone.size() == 10);
+
+        std::vector<md5> hot;
+        for (size_t i = 0; i != 100 && hot.size() != 20; ++i)
+            if (!gone.count(key(i)))
+                hot.push_back(key(i));
+        for (md5 const& hash : hot)
+            f.clock.touch(hash);
+
+        key_set evicted = f.evict(5000);
+        CHECK(evicted.size() == 40);
+        for (md5 const& hash : hot)
+            CHECK(!evicted.count(hash));
+        for (md5 const& hash : gone)
+            CHECK(!evicted.count(hash));
+    });
+
+    // two rounds of the hand at most, even when nothing can go
+    r.run("object_clock", "pinned_objects_stay", []
+    {
+        fixture f;
+        for (size_t i = 0; i != 100; ++i)
+            f.clock.insert(key(i), {}, 100, true);
+
+        CHECK(f.evict(0).empty());
+        CHECK(f.clock.total_bytes() == 10000);
+
+        for (size_t i = 0; i != 30; ++i)
+            f.clock.unpin(key(i));
+        key_set evicted = f.evict(0);
+        CHECK(evicted.size() == 30);
+        for (size_t i = 0; i != 30; ++i)
+            CHECK(evicted.count(key(i)));
+        CHECK(f.clock.total_bytes() == 7000);
+    });
+
+    r.run("object_clock", "rebuild_keeps_entries", []
+    {
+        fixture f;
+        size_t count = 0;
+        for (; !f.clock.is_full(); ++count)
+            f.clock.insert(key(count), {}, 10, false);
+        uint64_t total = f.clock.total_bytes();
+        f.evict(total - 100);
+
+        object_clock bigger = f.clock.rebuild(f.dir.path() + "/bigger");
+        CHECK(bigger.total_bytes() == total - 100);
+        CHECK(bigger.object_count() == count - 10);
+        CHECK(!bigger.is_full());
+
+        // the evicted ones are not carried over, the others are
+        key_set evicted;
+        bigger.evict(0, [&](md5 const& hash, sha256 const&)
+        {
+            evicted.insert(hash);
+        });
+        CHECK(evicted.size() == count - 10);
+        CHECK(bigger.total_bytes() == 0);
+        bigger.unlock();
+    });
+
+    r.run("object_clock", "repository_capacity", []
+    {
+        temp_dir dir;
+        repository_config config;
+        config.capacity = 50 * 1024;
+        config.low_water = 80;
+        init_new_repository(dir.path() + "/repo", config);
+        repository repo(dir.path() + "/repo");
+
+        // has_local_object() would count as a use, look at the files
+        auto is_stored = [&](size_t index)
+        {
+            char name[MD5_HEX_LENGTH + 1] = {};
+            md5_to_hex(object_hash_of(index), name);
+            return file_exists({repo.get_objects_fd(), name});
+        };
+
+        auto local_objects = [&]
+        {
+            std::vector<size_t> result;
+            for (size_t i = 0; i != 100; ++i)
+                if (is_stored(i))
+                    result.push_back(i);
+            return result;
+        };
+
+        for (size_t i = 0; i != 40; ++i)
+            repo.add_object(object_hash_of(i), object_data(i));
+        repo.enforce_capacity();
+        CHECK(local_objects().size() == 40);
+
+        for (size_t i = 40; i != 60; ++i)
+            repo.add_object(object_hash_of(i), object_data(i));
+        repo.enforce_capacity();
+        std::vector<size_t> kept = local_objects();
+        CHECK(kept.size() == 40);
+
+        // reading an object keeps it, the others go first
+        std::vector<size_t> hot(kept.begin(), kept.begin() + 10);
+        for (size_t i : hot)
+        {
+            file_descriptor fd = repo.open_object(object_hash_of(i));
+            CHECK(read_whole_file(fd) == object_data(i));
+        }
+
+        for (size_t i = 60; i != 75; ++i)
+            repo.add_object(object_hash_of(i), object_data(i));
+        repo.enforce_capacity();
+        kept = local_objects();
+        CHECK(kept.size() == 40);
+        for (size_t i : hot)
+            CHECK(is_stored(i));
+        for (size_t i = 60; i != 75; ++i)
+            CHECK(is_stored(i));
+    });
+}
+}
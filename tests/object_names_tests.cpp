@@ -0,0 +1,109 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "md5.h"
+#include "repository.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    std::vector<char> object_data(size_t index)
+    {
+        std::string text = "named object " + std::to_string(index) + "\n";
+        return std::vector<char>(text.begin(), text.end());
+    }
+
+    md5 object_hash_of(size_t index)
+    {
+        std::vector<char> data = object_data(index);
+        return md5_hash(data.data(), data.size());
+    }
+
+    std::string hex(md5 const& hash)
+    {
+        char result[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(hash, result);
+        return result;
+    }
+
+    bool equal(md5 const& a, md5 const& b)
+    {
+        return memcmp(a.data, b.data, sizeof a.data) == 0;
+    }
+
+    // the shortest abbreviation resolves to the object, one digit less
+    // doesn't unless it is the minimum
+    void check_names(repository& repo, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i != end; ++i)
+        {
+            md5 hash = object_hash_of(i);
+            std::string name = hex(hash);
+            size_t length = repo.abbreviation_length(hash);
+
+            md5 found;
+            CHECK(repo.resolve_prefix(name.data(), length, found) == prefix_match::unique);
+            CHECK(equal(found, hash));
+            if (length > MIN_ABBREVIATION_LENGTH)
+                CHECK(repo.resolve_prefix(name.data(), length - 1, found) == prefix_match::ambiguous);
+        }
+    }
+}
+
+void run_object_names_tests(runner& r)
+{
+    // no index yet: everything is found through the journals, which grow
+    // between lookups and belong to more than one writer
+    r.run("object_names", "growing_journals", []
+    {
+        temp_dir dir;
+        init_new_repository(dir.path() + "/repo");
+        repository repo(dir.path() + "/repo");
+        repository other(dir.path() + "/repo");
+
+        for (size_t i = 0; i != 300; ++i)
+            repo.add_object(object_hash_of(i), object_data(i));
+        check_names(repo, 0, 300);
+
+        for (size_t i = 300; i != 600; ++i)
+            repo.add_object(object_hash_of(i), object_data(i));
+        check_names(repo, 0, 600);
+
+        for (size_t i = 600; i != 900; ++i)
+            other.add_object(object_hash_of(i), object_data(i));
+        check_names(repo, 0, 900);
+        check_names(other, 0, 900);
+
+        repo.rebuild_index();
+        check_names(repo, 0, 900);
+    });
+
+    r.run("object_names", "evicted_objects_are_ignored", []
+    {
+        temp_dir dir;
+        init_new_repository(dir.path() + "/repo");
+        repository repo(dir.path() + "/repo");
+
+        // an object sharing the first 5 digits with object 0
+        std::string name = hex(object_hash_of(0));
+        size_t twin = 1;
+        while (hex(object_hash_of(twin)).compare(0, 5, name, 0, 5) != 0)
+            ++twin;
+
+        repo.add_object(object_hash_of(0), object_data(0));
+        repo.add_object(object_hash_of(twin), object_data(twin));
+        CHECK(repo.abbreviation_length(object_hash_of(0)) > 5);
+
+        // gone from objects/, still named by the journal
+        unlink({repo.get_objects_fd(), hex(object_hash_of(twin))});
+        CHECK(repo.abbreviation_length(object_hash_of(0)) == MIN_ABBREVIATION_LENGTH);
+
+        md5 found;
+        CHECK(repo.resolve_prefix(name.data(), MIN_ABBREVIATION_LENGTH, found) == prefix_match::unique);
+        CHECK(equal(found, object_hash_of(0)));
+    });
+}
+}
@@ -0,0 +1,355 @@
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <vector>
+
+#include "md5.h"
+#include "object_pack.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    // the on-disk layout from object_pack.cpp: the test reads it
+    // independently, so an accidental format change shows up here
+    constexpr size_t HEADER_SIZE = 24;
+    constexpr size_t ENTRY_SIZE = 56;
+    constexpr size_t ENTRY_SIZE_OFFSET = 24;
+    constexpr size_t ENTRY_STORED_SIZE_OFFSET = 32;
+    constexpr size_t ENTRY_PAYLOAD_SIZE_OFFSET = 40;
+    constexpr size_t ENTRY_BASE_OFFSET = 48;
+    constexpr uint32_t NO_BASE = UINT32_MAX;
+
+    struct object
+    {
+        md5 hash;
+        std::vector<char> data;
+        std::string name;
+    };
+
+    file_descriptor anonymous_file()
+    {
+        int fd = memfd_create("object_pack_tests", MFD_CLOEXEC);
+        if (fd < 0)
+            throw_error(errno, "memfd_create");
+        return file_descriptor::attach(fd);
+    }
+
+    file_descriptor file_with(std::vector<char> const& data)
+    {
+        file_descriptor fd = anonymous_file();
+        fd.write(data.data(), data.size());
+        return fd;
+    }
+
+    object make_object(std::vector<char> data, std::string name = std::string())
+    {
+        object result;
+        result.hash = md5_hash(data.data(), data.size());
+        result.data = std::move(data);
+        result.name = std::move(name);
+        return result;
+    }
+
+    std::vector<char> random_bytes(size_t size, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<char> result(size);
+        for (char& c : result)
+            c = static_cast<char>(rng());
+        return result;
+    }
+
+    // versions of one file, each a small edit of the previous one
+    void add_versions(std::vector<object>& objects, size_t count, size_t size, uint64_t seed, std::string const& name)
+    {
+        std::mt19937_64 rng(seed);
+        std::vector<char> data = random_bytes(size, seed);
+        for (size_t i = 0; i != count; ++i)
+        {
+            std::vector<char> inserted = random_bytes(1 + rng() % 100, rng());
+            data.insert(data.begin() + rng() % data.size(), inserted.begin(), inserted.end());
+            objects.push_back(make_object(data, name));
+        }
+    }
+
+    std::vector<object> mixed_objects()
+    {
+        std::vector<object> objects;
+        objects.push_back(make_object({}));
+        objects.push_back(make_object({'x'}));
+        objects.push_back(make_object(random_bytes(63, 1)));
+        objects.push_back(make_object(random_bytes(64, 2)));
+        add_versions(objects, 30, 20000, 3, "a.c");
+        add_versions(objects, 30, 5000, 4, "");
+        add_versions(objects, 10, 100000, 5, "b.h");
+        return objects;
+    }
+
+    std::vector<char> write_pack_of(std::vector<object> const& objects, pack_options const& options)
+    {
+        std::vector<pack_input> inputs;
+        for (object const& o : objects)
+            inputs.push_back({o.hash, o.data.size(), o.name});
+
+        file_descriptor fd = anonymous_file();
+        write_pack(fd, inputs, options, [&](md5 const& hash)
+        {
+            for (object const& o : objects)
+                if (memcmp(o.hash.data, hash.data, sizeof hash.data) == 0)
+                    return o.data;
+            throw std::runtime_error("unknown object");
+        });
+
+        fd.seek(0);
+        return read_whole_file(fd);
+    }
+
+    template <typename T>
+    T get(std::vector<char> const& pack, size_t offset)
+    {
+        T result;
+        memcpy(&result, pack.data() + offset, sizeof result);
+        return result;
+    }
+
+    // length of the longest delta chain
+    size_t max_chain_length(std::vector<char> const& pack)
+    {
+        uint32_t count = get<uint32_t>(pack, 8);
+        uint64_t entries_offset = get<uint64_t>(pack, 16);
+
+        size_t result = 0;
+        for (uint32_t i = 0; i != count; ++i)
+        {
+            size_t length = 0;
+            for (uint32_t j = i; get<uint32_t>(pack, entries_offset + j * ENTRY_SIZE + ENTRY_BASE_OFFSET) != NO_BASE; ++length)
+                j = get<uint32_t>(pack, entries_offset + j * ENTRY_SIZE + ENTRY_BASE_OFFSET);
+            result = std::max(result, length);
+        }
+        return result;
+    }
+
+    void check_contents(object_pack const& pack, std::vector<object> const& objects)
+    {
+        CHECK(pack.size() == objects.size());
+        for (object const& o : objects)
+        {
+            size_t index;
+            CHECK(pack.find(o.hash, index));
+            CHECK(pack.object_size(index) == o.data.size());
+            CHECK(pack.read(index) == o.data);
+        }
+    }
+
+    void round_trip(pack_options const& options)
+    {
+        std::vector<object> objects = mixed_objects();
+        std::vector<char> data = write_pack_of(objects, options);
+
+        object_pack pack = object_pack::map(file_with(data));
+        CHECK(pack);
+        check_contents(pack, objects);
+        CHECK(max_chain_length(data) <= options.max_depth);
+    }
+}
+
+void run_object_pack_tests(runner& r)
+{
+    r.run("object_pack", "empty_pack", []
+    {
+        object_pack pack = object_pack::map(file_with(write_pack_of({}, pack_options())));
+        CHECK(pack);
+        CHECK(pack.size() == 0);
+
+        size_t index;
+        md5 missing = {};
+        CHECK(!pack.find(missing, index));
+    });
+
+    r.run("object_pack", "round_trip", []
+    {
+        round_trip(pack_options());
+    });
+
+    r.run("object_pack", "round_trip_without_deltas", []
+    {
+        pack_options options;
+        options.window = 0;
+        round_trip(options);
+    });
+
+    r.run("object_pack", "chains_stop_at_max_depth", []
+    {
+        for (size_t depth : {size_t(0), size_t(1), size_t(2), size_t(5)})
+        {
+            pack_options options;
+            options.max_depth = depth;
+            round_trip(options);
+        }
+    });
+
+    r.run("object_pack", "deltas_are_used", []
+    {
+        std::vector<object> objects;
+        add_versions(objects, 20, 50000, 1, "");
+        uint64_t total = 0;
+        for (object const& o : objects)
+            total += o.data.size();
+
+        std::vector<char> data = write_pack_of(objects, pack_options());
+        CHECK(data.size() < total / 5);
+        CHECK(max_chain_length(data) != 0);
+    });
+
+    r.run("object_pack", "duplicate_inputs", []
+    {
+        std::vector<object> objects = mixed_objects();
+        std::vector<object> twice = objects;
+        twice.insert(twice.end(), objects.begin(), objects.end());
+
+        object_pack pack = object_pack::map(file_with(write_pack_of(twice, pack_options())));
+        check_contents(pack, objects);
+    });
+
+    r.run("object_pack", "truncated_pack_is_invalid", []
+    {
+        std::vector<object> objects;
+        add_versions(objects, 5, 2000, 1, "a");
+        std::vector<char> data = write_pack_of(objects, pack_options());
+
+        for (size_t size = 0; size != data.size(); ++size)
+            CHECK(!object_pack::map(file_with(std::vector<char>(data.begin(), data.begin() + size))));
+    });
+
+    r.run("object_pack", "damaged_header_is_invalid", []
+    {
+        std::vector<char> data = write_pack_of(mixed_objects(), pack_options());
+
+        std::vector<char> bad_magic = data;
+        bad_magic[0] ^= 1;
+        CHECK(!object_pack::map(file_with(bad_magic)));
+
+        std::vector<char> bad_count = data;
+        bad_count[8] ^= 1;
+        CHECK(!object_pack::map(file_with(bad_count)));
+
+        // an entry that is its own base
+        std::vector<char> self_base = data;
+        uint64_t entries_offset = get<uint64_t>(data, 16);
+        uint32_t zero = 0;
+        memcpy(self_base.data() + entries_offset + ENTRY_BASE_OFFSET, &zero, sizeof zero);
+        CHECK(!object_pack::map(file_with(self_base)));
+    });
+
+    // the payload size decides an allocation before anything is
+    // decompressed, it is checked when the pack is mapped
+    r.run("object_pack", "implausible_payload_size_is_invalid", []
+    {
+        std::vector<object> objects = mixed_objects();
+        std::vector<char> data = write_pack_of(objects, pack_options());
+        uint32_t count = get<uint32_t>(data, 8);
+        uint64_t entries_offset = get<uint64_t>(data, 16);
+
+        auto field_of = [&](size_t index, size_t field)
+        {
+            return get<uint64_t>(data, entries_offset + index * ENTRY_SIZE + field);
+        };
+
+        // the largest whole object and any delta
+        size_t whole = count;
+        size_t delta = count;
+        for (size_t i = 0; i != count; ++i)
+        {
+            if (get<uint32_t>(data, entries_offset + i * ENTRY_SIZE + ENTRY_BASE_OFFSET) != NO_BASE)
+                delta = i;
+            else if (whole == count || field_of(i, ENTRY_SIZE_OFFSET) > field_of(whole, ENTRY_SIZE_OFFSET))
+                whole = i;
+        }
+        CHECK(whole != count);
+        CHECK(delta != count);
+
+        auto with = [&](size_t index, size_t field, uint64_t value)
+        {
+            std::vector<char> result = data;
+            memcpy(result.data() + entries_offset + index * ENTRY_SIZE + field, &value, sizeof value);
+            return result;
+        };
+
+        uint64_t huge = UINT64_C(1) << 50;
+        uint64_t whole_size = field_of(whole, ENTRY_SIZE_OFFSET);
+        uint64_t delta_size = field_of(delta, ENTRY_SIZE_OFFSET);
+
+        // a whole object is its own payload
+        CHECK(!object_pack::map(file_with(with(whole, ENTRY_PAYLOAD_SIZE_OFFSET, whole_size + 1))));
+        // a delta is smaller than its object
+        CHECK(!object_pack::map(file_with(with(delta, ENTRY_PAYLOAD_SIZE_OFFSET, delta_size))));
+
+        // neither inflates beyond what deflate can produce
+        std::vector<char> inflated = with(whole, ENTRY_SIZE_OFFSET, huge);
+        memcpy(inflated.data() + entries_offset + whole * ENTRY_SIZE + ENTRY_PAYLOAD_SIZE_OFFSET, &huge, sizeof huge);
+        CHECK(!object_pack::map(file_with(inflated)));
+        CHECK(!object_pack::map(file_with(with(whole, ENTRY_STORED_SIZE_OFFSET, 0))));
+
+        // the object size of a delta only bounds the result, reading
+        // fails without allocating it
+        object_pack pack = object_pack::map(file_with(with(delta, ENTRY_SIZE_OFFSET, huge)));
+        CHECK(pack);
+        CHECK_THROWS(pack.read(delta));
+    });
+
+    r.run("object_pack", "damaged_data_throws", []
+    {
+        std::vector<object> objects = mixed_objects();
+        std::vector<char> data = write_pack_of(objects, pack_options());
+        uint64_t entries_offset = get<uint64_t>(data, 16);
+
+        // zlib checksums the payloads: reading gives the object or throws
+        std::mt19937_64 rng(1);
+        for (size_t i = 0; i != 200; ++i)
+        {
+            std::vector<char> damaged = data;
+            damaged[HEADER_SIZE + rng() % (entries_offset - HEADER_SIZE)] ^= static_cast<char>(1 + rng() % 255);
+
+            object_pack pack = object_pack::map(file_with(damaged));
+            CHECK(pack);
+            for (object const& o : objects)
+            {
+                size_t index;
+                CHECK(pack.find(o.hash, index));
+                try
+                {
+                    CHECK(pack.read(index) == o.data);
+                }
+                catch (failure const&)
+                {
+                    throw;
+                }
+                catch (std::exception const&)
+                {}
+            }
+        }
+    });
+
+    r.run("object_pack", "delta_cycle_throws", []
+    {
+        std::vector<object> objects = mixed_objects();
+        std::vector<char> data = write_pack_of(objects, pack_options());
+        uint64_t entries_offset = get<uint64_t>(data, 16);
+
+        // entries 0 and 1 as each other's base
+        std::vector<char> cycle = data;
+        uint32_t zero = 0;
+        uint32_t one = 1;
+        memcpy(cycle.data() + entries_offset + ENTRY_BASE_OFFSET, &one, sizeof one);
+        memcpy(cycle.data() + entries_offset + ENTRY_SIZE + ENTRY_BASE_OFFSET, &zero, sizeof zero);
+
+        object_pack pack = object_pack::map(file_with(cycle));
+        CHECK(pack);
+        CHECK_THROWS(pack.read(0));
+    });
+}
+}
@@ -0,0 +1,70 @@
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <vector>
+
+#include "file_descriptor.h"
+#include "output_writer.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    std::string ndjson_of(std::string_view path)
+    {
+        int raw = memfd_create("output_writer_tests", MFD_CLOEXEC);
+        if (raw < 0)
+            throw_error(errno, "memfd_create");
+        file_descriptor fd = file_descriptor::attach(raw);
+
+        md5 hash = {};
+        {
+            output_writer out(fd.get_fd(), output_format::ndjson);
+            out.write_entry(path, hash);
+            out.flush();
+        }
+
+        fd.seek(0);
+        std::vector<char> data = read_whole_file(fd);
+        return std::string(data.begin(), data.end());
+    }
+
+    std::string entry(std::string const& field, std::string const& value)
+    {
+        return "{\"" + field + "\":\"" + value + "\",\"md5\":\"00000000000000000000000000000000\"}\n";
+    }
+}
+
+void run_output_writer_tests(runner& r)
+{
+    r.run("output_writer", "ndjson_escapes", []
+    {
+        CHECK(ndjson_of("a/b.c") == entry("path", "a/b.c"));
+        CHECK(ndjson_of("") == entry("path", ""));
+        CHECK(ndjson_of("a\"b\\c\td\n") == entry("path", "a\\\"b\\\\c\\td\\n"));
+        CHECK(ndjson_of(std::string_view("\x01\x1f", 2)) == entry("path", "\\u0001\\u001f"));
+    });
+
+    r.run("output_writer", "ndjson_utf8_passes_through", []
+    {
+        // 2, 3 and 4 byte sequences at the edges of the valid ranges
+        for (char const* path : {"\xc2\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xed\x9f\xbf", "\xef\xbf\xbf",
+                                 "\xf0\x90\x80\x80", "\xf4\x8f\xbf\xbf", "caf\xc3\xa9.c"})
+            CHECK(ndjson_of(path) == entry("path", path));
+    });
+
+    r.run("output_writer", "ndjson_invalid_utf8_is_base64", []
+    {
+        CHECK(ndjson_of("\xff") == entry("path_base64", "/w=="));
+        CHECK(ndjson_of("a\xff") == entry("path_base64", "Yf8="));
+        CHECK(ndjson_of("ab\xff") == entry("path_base64", "YWL/"));
+        CHECK(ndjson_of("a\"\xff") == entry("path_base64", "YSL/"));
+
+        // overlong, surrogate, past U+10FFFF, truncated, lone continuation
+        for (char const* path : {"\xc0\xaf", "\xc1\xbf", "\xe0\x9f\xbf", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+                                 "\xf5\x80\x80\x80", "\xe2\x82", "\x80", "x\xc3"})
+            CHECK(ndjson_of(path).starts_with("{\"path_base64\":\""));
+    });
+}
+}
@@ -0,0 +1,165 @@
+#include <string>
+#include <vector>
+
+#include "md5.h"
+#include "repository.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    // 1 KiB objects, so capacities are easy to reason about
+    std::vector<char> object_data(size_t index)
+    {
+        std::string text = "object " + std::to_string(index) + "\n";
+        text.resize(1024, '.');
+        return std::vector<char>(text.begin(), text.end());
+    }
+
+    md5 object_hash_of(size_t index)
+    {
+        std::vector<char> data = object_data(index);
+        return md5_hash(data.data(), data.size());
+    }
+
+    // a local repository in front of an unlimited shared one
+    struct tiers
+    {
+        explicit tiers(write_policy policy, uint64_t capacity = 0)
+        {
+            shared_root = dir.path() + "/shared";
+            local_root = dir.path() + "/local";
+            init_new_repository(shared_root);
+
+            repository_config config;
+            config.shared = shared_root;
+            config.shared_writes = policy;
+            config.capacity = capacity;
+            init_new_repository(local_root, config);
+        }
+
+        temp_dir dir;
+        std::string shared_root;
+        std::string local_root;
+    };
+
+    size_t count_local(repository& repo, size_t count)
+    {
+        size_t result = 0;
+        for (size_t i = 0; i != count; ++i)
+            if (repo.has_local_object(object_hash_of(i)))
+                ++result;
+        return result;
+    }
+
+    void check_readable(repository& repo, size_t count)
+    {
+        for (size_t i = 0; i != count; ++i)
+        {
+            file_descriptor fd = repo.open_object(object_hash_of(i));
+            CHECK(fd);
+            CHECK(read_whole_file(fd) == object_data(i));
+        }
+    }
+}
+
+void run_shared_tier_tests(runner& r)
+{
+    r.run("shared_tier", "write_through", []
+    {
+        tiers t(write_policy::through);
+        repository local(t.local_root);
+        for (size_t i = 0; i != 20; ++i)
+            local.add_object(object_hash_of(i), object_data(i));
+
+        repository shared(t.shared_root);
+        check_readable(shared, 20);
+    });
+
+    r.run("shared_tier", "write_back_on_flush", []
+    {
+        tiers t(write_policy::back);
+        repository local(t.local_root);
+        for (size_t i = 0; i != 300; ++i)
+            local.add_object(object_hash_of(i), object_data(i));
+        local.flush_shared_tier();
+
+        repository shared(t.shared_root);
+        check_readable(shared, 300);
+    });
+
+    r.run("shared_tier", "promotion", []
+    {
+        tiers t(write_policy::back);
+        {
+            repository shared(t.shared_root);
+            shared.add_object(object_hash_of(0), object_data(0));
+        }
+
+        repository local(t.local_root);
+        CHECK(!local.has_local_object(object_hash_of(0)));
+        CHECK(local.has_object(object_hash_of(0)));
+        local.flush_shared_tier();
+        CHECK(local.has_local_object(object_hash_of(0)));
+        check_readable(local, 1);
+    });
+
+    // objects that are only local can't be evicted, the repository stays
+    // over its capacity until they are written back
+    r.run("shared_tier", "pending_write_backs_are_not_evicted", []
+    {
+        tiers t(write_policy::back, 20 * 1024);
+        repository local(t.local_root);
+        for (size_t i = 0; i != 100; ++i)
+            local.add_object(object_hash_of(i), object_data(i));
+
+        local.enforce_capacity();
+        CHECK(count_local(local, 100) == 100);
+
+        local.flush_shared_tier();
+        local.enforce_capacity();
+        CHECK(count_local(local, 100) <= 20);
+
+        repository shared(t.shared_root);
+        check_readable(shared, 100);
+        check_readable(local, 100);
+    });
+
+    // a process that exits without flushing loses its queue, another one
+    // evicting in the meantime must not lose the objects
+    r.run("shared_tier", "dropped_write_backs_are_not_evicted", []
+    {
+        tiers t(write_policy::back, 20 * 1024);
+        {
+            repository writer(t.local_root);
+            for (size_t i = 0; i != 100; ++i)
+                writer.add_object(object_hash_of(i), object_data(i));
+        }
+
+        repository other(t.local_root);
+        other.enforce_capacity();
+        CHECK(count_local(other, 100) == 100);
+
+        other.upload_missing_to_shared_tier();
+        other.enforce_capacity();
+        CHECK(count_local(other, 100) <= 20);
+
+        repository shared(t.shared_root);
+        check_readable(shared, 100);
+    });
+
+    r.run("shared_tier", "missing_write_back_is_an_error", []
+    {
+        tiers t(write_policy::back);
+        repository local(t.local_root);
+        local.add_object(object_hash_of(0), object_data(0));
+
+        char name[MD5_HEX_LENGTH + 1] = {};
+        md5_to_hex(object_hash_of(0), name);
+        unlink({local.get_objects_fd(), name});
+
+        CHECK_THROWS(local.flush_shared_tier());
+    });
+}
+}
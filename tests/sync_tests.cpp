@@ -0,0 +1,231 @@
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <poll.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "md5.h"
+#include "repository.h"
+#include "sync.h"
+#include "test.h"
+
+namespace tests
+{
+namespace
+{
+    std::vector<char> object_data(size_t index)
+    {
+        std::string text = "object " + std::to_string(index) + "\n";
+        return std::vector<char>(text.begin(), text.end());
+    }
+
+    md5 object_hash_of(size_t index)
+    {
+        std::vector<char> data = object_data(index);
+        return md5_hash(data.data(), data.size());
+    }
+
+    // runs sync_receive on its own thread, the caller is the sender
+    struct receiver
+    {
+        explicit receiver(repository& repo)
+            : to_receiver(make_pipe(pipe_flags::close_on_exec))
+            , to_sender(make_pipe(pipe_flags::close_on_exec))
+            , stored(0)
+            , thread([this, &repo]
+            {
+                try
+                {
+                    stored = sync_receive(repo, to_receiver.read_end, to_sender.write_end);
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+                }
+                // the sender sees the end of the stream instead of waiting
+                to_sender.write_end.close();
+            })
+        {}
+
+        // a failed test leaves the receiver waiting: closing our ends
+        // makes it fail, SIGPIPE is ignored by the test runner
+        ~receiver()
+        {
+            if (!thread.joinable())
+                return;
+            to_receiver.write_end.close();
+            to_sender.read_end.close();
+            thread.join();
+        }
+
+        // rethrows the error of sync_receive
+        size_t join()
+        {
+            to_receiver.write_end.close();
+            thread.join();
+            if (error)
+                std::rethrow_exception(error);
+            return stored;
+        }
+
+        pipe_fds to_receiver;
+        pipe_fds to_sender;
+        size_t stored;
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    // a sender that stops waiting after a minute instead of hanging the
+    // test when the other side doesn't read
+    void write_with_deadline(file_descriptor& fd, std::vector<char> const& data)
+    {
+        fd.set_nonblock(true);
+        for (size_t written = 0; written != data.size();)
+        {
+            nonblock_result r = fd.write_nonblock(data.data() + written, data.size() - written);
+            if (r.is_success())
+            {
+                written += r.bytes();
+                continue;
+            }
+
+            pollfd p = {fd.get_fd(), POLLOUT, 0};
+            if (::poll(&p, 1, 60 * 1000) == 0)
+                throw failure("the receiver stopped reading, sync is deadlocked");
+        }
+    }
+
+    void read_exactly(file_descriptor& fd, char* data, size_t size)
+    {
+        while (size != 0)
+        {
+            size_t bytes_read = fd.read_some(data, size);
+            if (bytes_read == 0)
+                throw failure("the receiver closed the stream early");
+            data += bytes_read;
+            size -= bytes_read;
+        }
+    }
+
+    template <typename T>
+    void append(std::vector<char>& out, T value)
+    {
+        for (size_t i = 0; i != sizeof value; ++i)
+            out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+
+    void append_key(std::vector<char>& out, md5 const& key)
+    {
+        out.insert(out.end(), key.data, key.data + sizeof key.data);
+    }
+}
+
+void run_sync_tests(runner& r)
+{
+    r.run("sync", "send_missing_objects", []
+    {
+        temp_dir dir;
+        init_new_repository(dir.path() + "/from");
+        init_new_repository(dir.path() + "/to");
+        repository from(dir.path() + "/from");
+        repository to(dir.path() + "/to");
+
+        // every 7th object is missing on the receiving side, which has a
+        // few of its own
+        size_t const count = 5000;
+        size_t missing = 0;
+        for (size_t i = 0; i != count; ++i)
+        {
+            from.add_object(object_hash_of(i), object_data(i));
+            if (i % 7 == 0)
+                ++missing;
+            else
+                to.add_object(object_hash_of(i), object_data(i));
+        }
+        for (size_t i = count; i != count + 10; ++i)
+            to.add_object(object_hash_of(i), object_data(i));
+
+        receiver recv(to);
+        sync_summary summary = sync_send(from, recv.to_sender.read_end, recv.to_receiver.write_end);
+        CHECK(recv.join() == missing);
+
+        CHECK(summary.objects_offered == count);
+        CHECK(summary.objects_sent == missing);
+        for (size_t i = 0; i != count; ++i)
+        {
+            file_descriptor fd = to.open_object(object_hash_of(i));
+            CHECK(fd);
+            CHECK(read_whole_file(fd) == object_data(i));
+        }
+    });
+
+    r.run("sync", "nothing_to_send", []
+    {
+        temp_dir dir;
+        init_new_repository(dir.path() + "/from");
+        init_new_repository(dir.path() + "/to");
+        repository from(dir.path() + "/from");
+        repository to(dir.path() + "/to");
+        for (size_t i = 0; i != 100; ++i)
+        {
+            from.add_object(object_hash_of(i), object_data(i));
+            to.add_object(object_hash_of(i), object_data(i));
+        }
+
+        receiver recv(to);
+        sync_summary summary = sync_send(from, recv.to_sender.read_end, recv.to_receiver.write_end);
+        CHECK(recv.join() == 0);
+        CHECK(summary.objects_sent == 0);
+        CHECK(summary.rounds == 1);
+    });
+
+    // A large key set reaches rounds with hundreds of thousands of
+    // ranges. Building one takes a million objects, so the round is
+    // written directly, the way sync_send writes it: all of it before
+    // reading any of the answer.
+    r.run("sync", "large_round_through_pipe", []
+    {
+        temp_dir dir;
+        init_new_repository(dir.path() + "/to");
+        repository to(dir.path() + "/to");
+
+        receiver recv(to);
+
+        write_with_deadline(recv.to_receiver.write_end, {'S', 'S', 'S', 'E', 'N', 'D', '0', '1'});
+        char magic[8];
+        read_exactly(recv.to_sender.read_end, magic, sizeof magic);
+
+        size_t const range_count = 300000;
+        std::vector<char> round = {'R'};
+        append(round, static_cast<uint32_t>(range_count));
+        for (size_t i = 0; i != range_count; ++i)
+        {
+            append_key(round, object_hash_of(2 * i));
+            append(round, static_cast<uint8_t>(0));
+            append_key(round, md5{});
+            append(round, static_cast<uint64_t>(1));
+            append_key(round, object_hash_of(2 * i));
+        }
+        append(round, static_cast<uint32_t>(0));
+        write_with_deadline(recv.to_receiver.write_end, round);
+
+        // the receiver has nothing, every range is empty
+        std::vector<char> statuses(range_count);
+        read_exactly(recv.to_sender.read_end, statuses.data(), statuses.size());
+        for (char status : statuses)
+            CHECK(status == 1);
+
+        // an empty pack
+        std::vector<char> pack = {'P'};
+        append(pack, static_cast<uint64_t>(0));
+        append(pack, static_cast<uint32_t>(0));
+        write_with_deadline(recv.to_receiver.write_end, pack);
+
+        char stored[8];
+        read_exactly(recv.to_sender.read_end, stored, sizeof stored);
+        CHECK(recv.join() == 0);
+    });
+}
+}
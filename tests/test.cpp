@@ -0,0 +1,111 @@
+#include "test.h"
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+#include "file_descriptor.h"
+
+namespace tests
+{
+void check(bool condition, char const* expression, char const* file, int line)
+{
+    if (!condition)
+        throw failure(std::string(file) + ":" + std::to_string(line) + ": CHECK(" + expression + ") failed");
+}
+
+void check_throws(std::function<void()> const& body, char const* expression, char const* file, int line)
+{
+    try
+    {
+        body();
+    }
+    catch (failure const&)
+    {
+        throw;
+    }
+    catch (std::exception const&)
+    {
+        return;
+    }
+
+    throw failure(std::string(file) + ":" + std::to_string(line) + ": CHECK_THROWS(" + expression + ") did not throw");
+}
+
+temp_dir::temp_dir()
+{
+    char const* tmp = getenv("TMPDIR");
+    std::string tmpl = std::string(tmp ? tmp : "/tmp") + "/source-store-tests.XXXXXX";
+    if (!mkdtemp(&tmpl[0]))
+        throw std::runtime_error("mkdtemp failed: " + tmpl);
+
+    dir = tmpl;
+}
+
+temp_dir::~temp_dir()
+{
+    try
+    {
+        remove_recursively(dir);
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "failed to remove " << dir << ": " << e.what() << '\n';
+    }
+}
+
+std::string const& temp_dir::path() const
+{
+    return dir;
+}
+
+void remove_recursively(std::string const& path)
+{
+    {
+        directory_stream dir(file_descriptor::open(path, file_flags::read_only | file_flags::directory | file_flags::close_on_exec));
+        while (directory_stream::dirent const* ent = dir.next())
+        {
+            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                continue;
+
+            std::string child = path + "/" + ent->d_name;
+            if (ent->d_type == DT_DIR)
+                remove_recursively(child);
+            else
+                unlink(child);
+        }
+    }
+
+    unlink(path, unlink_flags::directory);
+}
+
+runner::runner(std::string filter)
+    : filter(std::move(filter))
+    , passed(0)
+    , failed(0)
+{}
+
+void runner::run(std::string const& group, std::string const& name, std::function<void()> const& body)
+{
+    std::string full_name = group + "/" + name;
+    if (!filter.empty() && full_name.find(filter) == std::string::npos)
+        return;
+
+    try
+    {
+        body();
+        ++passed;
+        std::cerr << "ok " << full_name << '\n';
+    }
+    catch (std::exception const& e)
+    {
+        ++failed;
+        std::cerr << "FAIL " << full_name << ": " << e.what() << '\n';
+    }
+}
+
+size_t runner::failed_count() const
+{
+    return failed;
+}
+}
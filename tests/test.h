@@ -0,0 +1,69 @@
+#pragma once
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+namespace tests
+{
+struct failure : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// throws failure naming the condition and where it was checked
+void check(bool condition, char const* expression, char const* file, int line);
+
+#define CHECK(condition) ::tests::check(static_cast<bool>(condition), #condition, __FILE__, __LINE__)
+
+// CHECK that body throws std::exception
+void check_throws(std::function<void()> const& body, char const* expression, char const* file, int line);
+
+#define CHECK_THROWS(statement) ::tests::check_throws([&] { statement; }, #statement, __FILE__, __LINE__)
+
+// directory under $TMPDIR removed with its contents on destruction
+class temp_dir
+{
+public:
+    temp_dir();
+    temp_dir(temp_dir const&) = delete;
+    temp_dir& operator=(temp_dir const&) = delete;
+    ~temp_dir();
+
+    std::string const& path() const;
+
+private:
+    std::string dir;
+};
+
+void remove_recursively(std::string const& path);
+
+class runner
+{
+public:
+    explicit runner(std::string filter);
+
+    // runs body unless the filter excludes "group/name", a test fails if
+    // it throws
+    void run(std::string const& group, std::string const& name, std::function<void()> const& body);
+
+    size_t failed_count() const;
+
+private:
+    std::string filter;
+    size_t passed;
+    size_t failed;
+};
+
+void run_concurrent_writers_tests(runner& r);
+void run_delta_tests(runner& r);
+void run_io_context_tests(runner& r);
+void run_manifest_cache_tests(runner& r);
+void run_materialize_tests(runner& r);
+void run_object_clock_tests(runner& r);
+void run_object_names_tests(runner& r);
+void run_object_pack_tests(runner& r);
+void run_output_writer_tests(runner& r);
+void run_shared_tier_tests(runner& r);
+void run_sync_tests(runner& r);
+}
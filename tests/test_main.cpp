@@ -0,0 +1,50 @@
+#include <csignal>
+#include <iostream>
+
+#include "command_line.h"
+#include "test.h"
+
+// Usage: source-store-tests [--filter=<substring>]
+//
+// Runs the self-checks of components whose bugs wouldn't show up in
+// ordinary use right away (binary formats, concurrency), progress and
+// failures go to stderr.
+int main(int argc, char* argv[])
+{
+    std::string filter;
+    for (int i = 1; i != argc; ++i)
+    {
+        char const* value;
+        if (match_option(argv[i], "filter", value))
+            filter = value;
+        else
+        {
+            std::cerr << "unknown option: " << argv[i] << '\n';
+            return 1;
+        }
+    }
+
+    // a test whose other side is gone gets a write error instead
+    signal(SIGPIPE, SIG_IGN);
+
+    tests::runner runner(filter);
+    tests::run_concurrent_writers_tests(runner);
+    tests::run_delta_tests(runner);
+    tests::run_io_context_tests(runner);
+    tests::run_manifest_cache_tests(runner);
+    tests::run_materialize_tests(runner);
+    tests::run_object_clock_tests(runner);
+    tests::run_object_names_tests(runner);
+    tests::run_object_pack_tests(runner);
+    tests::run_output_writer_tests(runner);
+    tests::run_shared_tier_tests(runner);
+    tests::run_sync_tests(runner);
+
+    if (runner.failed_count() != 0)
+    {
+        std::cerr << runner.failed_count() << " tests failed\n";
+        return 1;
+    }
+
+    return 0;
+}